@@ -10,6 +10,8 @@ targets['common.a'] = Target(
     Input('snprintf.o'),
     Input('file_ids.o'),
     Input('unicode.o'),
+    Input('lz4.o'),
+    Input('nbd.o'),
     ],
 )
 
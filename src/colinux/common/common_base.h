@@ -18,7 +18,7 @@ typedef int bool_t;
 #define PACKED_STRUCT __attribute__((packed))
 
 #define CO_MAX_MONITORS                   64
-#define CO_LINUX_PERIPHERY_API_VERSION    22
+#define CO_LINUX_PERIPHERY_API_VERSION    35
 
 #define CO_ERRORS_X_MACRO			\
 	X(ERROR)				\
@@ -44,6 +44,8 @@ typedef int bool_t;
 	X(INVALID_PARAMETER)			\
 	X(HOSTMEM_USE_LIMIT_REACHED)		\
 	X(INSTANCE_TERMINATED)			\
+	X(BUSY)					\
+	X(NOT_SUPPORTED)			\
 
 #define X(name) CO_RC_ERROR_##name,
 typedef enum {
@@ -37,6 +37,28 @@ typedef enum co_color_t
 /*
  * Per block device configuration
  */
+typedef enum {
+	CO_BLOCK_DEV_FORMAT_RAW = 0,
+	CO_BLOCK_DEV_FORMAT_COMPRESSED,		/* read-only, see common/zblock.h */
+	CO_BLOCK_DEV_FORMAT_NBD,		/* network export, see common/nbd.h */
+} co_block_dev_format_t;
+
+typedef enum {
+	CO_BLOCK_DEV_CACHE_WRITEBACK = 0,	/* host page cache, synced on flush */
+	CO_BLOCK_DEV_CACHE_WRITETHROUGH,	/* every write reaches the disk */
+	CO_BLOCK_DEV_CACHE_UNSAFE,		/* flushes are ignored */
+} co_block_dev_cache_mode_t;
+
+/* I/O limits of a device, 0 for none */
+#define CO_BLOCK_QOS_BURST_DEFAULT	1000	/* ms */
+#define CO_BLOCK_QOS_BURST_MAX		10000
+
+typedef struct {
+	unsigned long iops;	/* requests per second */
+	unsigned long kbps;	/* KB per second */
+	unsigned long burst;	/* ms worth of the limits an idle device saves up */
+} co_block_qos_t;
+
 typedef struct co_block_dev_desc {
 	/*
 	 * This bool var determines whether Linux would be given
@@ -57,6 +79,55 @@ typedef struct co_block_dev_desc {
 	 */
 	bool_t alias_used;
 	char   alias[20];
+
+	/*
+	 * Size of the host side read cache in KB, 0 disables it.
+	 */
+	unsigned long cache_size;
+
+	/*
+	 * Read-only base image of a copy-on-write overlay. If set,
+	 * 'pathname' is the overlay that receives the writes.
+	 */
+	co_pathname_t base_pathname;
+
+	/*
+	 * Layout of the image file, detected by the daemon.
+	 */
+	co_block_dev_format_t format;
+
+	/*
+	 * Writes of whole zero pages free the storage instead, so that
+	 * a sparse image stays sparse.
+	 */
+	bool_t sparse;
+
+	/*
+	 * When writes of Linux become durable on the host.
+	 */
+	co_block_dev_cache_mode_t cache_mode;
+
+	/*
+	 * Bypass the host's file cache, Linux caches the data already.
+	 */
+	bool_t direct;
+
+	/*
+	 * Largest read ahead on sequential reads in KB, 0 disables it.
+	 */
+	unsigned long readahead;
+
+	/*
+	 * Copy between the host's cached pages of the image and Linux,
+	 * instead of reading and writing the file.
+	 */
+	bool_t mapped;
+
+	/*
+	 * Requests over these limits wait in the monitor. Changed at run
+	 * time by CO_MONITOR_IOCTL_BLOCK_QOS.
+	 */
+	co_block_qos_t qos;
 } co_block_dev_desc_t;
 
 typedef struct co_video_dev_desc {
@@ -135,10 +206,11 @@ typedef enum {
 
 	/*
 	 * Unix Meta-data - we maintain the UNIX metadata of the guest
-	 * mount in a parallel host FS directory structure. This means
-	 * that the guest file meta data is disconnected from the host
-	 * OS file meta data entirely, allowing to provide a 'true' UNIX
-	 * file system on Windows, for example.
+	 * mount in a store file at the root of the host directory. This
+	 * means that the guest file meta data is disconnected from the
+	 * host OS file meta data entirely, allowing to provide a 'true'
+	 * UNIX file system on Windows, for example. The 'unix' mount
+	 * option selects it as well.
 	 */
 	CO_COFS_TYPE_UNIX_METADATA = 2,
 } co_cofs_type_t;
@@ -310,6 +382,11 @@ typedef struct co_config {
 	 */
 	int cobd_async_enable;
 
+	/*
+	 * Enable asynchronious cofs operations.
+	 */
+	int cofs_async_enable;
+
 	/* User console configuration */
 	co_console_config_t console;
 
@@ -0,0 +1,42 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __CO_COMMON_COW_H__
+#define __CO_COMMON_COW_H__
+
+/*
+ * Copy-on-write overlay of a read-only base image.
+ *
+ * The overlay file is made of clusters. Cluster 0 holds the header,
+ * the L1 table follows from cluster 1. Each L1 entry points to the
+ * cluster of an L2 table, one page of cluster numbers. An L2 entry
+ * points to the overlay cluster that holds the data, 0 means that it
+ * is still read from the base image.
+ *
+ * Since version 2 the header names the base image, which may be an
+ * overlay itself: a snapshot frozen by CO_MONITOR_IOCTL_BLOCK_SNAPSHOT.
+ * The name is the host driver's pathname of the base.
+ */
+
+#include "common.h"
+
+#define CO_COW_MAGIC		0x776f436f	/* "oCow" */
+#define CO_COW_VERSION		2
+#define CO_COW_CLUSTER_SHIFT	16
+#define CO_COW_MAX_DEPTH	16		/* overlays stacked on a base image */
+
+typedef struct {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long cluster_shift;
+	unsigned long l1_entries;
+	unsigned long long size;	/* of the base image */
+	unsigned long long l1_offset;
+	co_pathname_t base_pathname;	/* version 2 */
+} co_cow_header_t;
+
+#endif
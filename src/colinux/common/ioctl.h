@@ -65,7 +65,11 @@ typedef enum {
 	CO_MONITOR_IOCTL_VIDEO_ATTACH, /* incomplete */
 	CO_MONITOR_IOCTL_VIDEO_DETACH, /* incomplete */
 	CO_MONITOR_IOCTL_CONET_BIND_ADAPTER,
-	CO_MONITOR_IOCTL_CONET_UNBIND_ADAPTER
+	CO_MONITOR_IOCTL_CONET_UNBIND_ADAPTER,
+	CO_MONITOR_IOCTL_GET_BLOCK_STATS,
+	CO_MONITOR_IOCTL_BLOCK_TRACE,
+	CO_MONITOR_IOCTL_BLOCK_QOS,
+	CO_MONITOR_IOCTL_BLOCK_SNAPSHOT,
 } co_monitor_ioctl_op_t;
 
 /* interface for CO_MANAGER_IOCTL_MONITOR: */
@@ -200,6 +204,95 @@ typedef struct {
 } co_monitor_ioctl_video_t;
 #endif
 
+/* Host read cache counters of a cobd device, requests are counted as a whole */
+typedef struct {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long invalidations;
+	unsigned long	   pages;	/* currently cached */
+	unsigned long	   max_pages;	/* 0 if the cache is disabled */
+} co_block_cache_stats_t;
+
+/* interface for CO_MONITOR_IOCTL_GET_BLOCK_STATS: */
+typedef struct {
+	co_manager_ioctl_monitor_t pc;
+	unsigned int		   unit;
+	co_block_cache_stats_t	   cache;
+} co_monitor_ioctl_get_block_stats_t;
+
+/* One cobd request recorded by the block trace, times in host timestamp ticks */
+typedef struct {
+	unsigned long long submit;
+	unsigned long long complete;	/* 0 while the request is in flight */
+	unsigned long long offset;
+	unsigned long	   size;
+	unsigned char	   unit;
+	unsigned char	   type;	/* co_block_request_type_t */
+	unsigned char	   error;
+	unsigned char	   reserved;
+} PACKED_STRUCT co_block_trace_event_t;
+
+typedef enum {
+	CO_BLOCK_TRACE_START,
+	CO_BLOCK_TRACE_STOP,
+	CO_BLOCK_TRACE_READ,
+} co_block_trace_op_t;
+
+#define CO_BLOCK_TRACE_EVENTS		4096	/* size of the ring in the monitor */
+#define CO_BLOCK_TRACE_READ_MAX		1024	/* events per CO_BLOCK_TRACE_READ */
+
+/*
+ * interface for CO_MONITOR_IOCTL_BLOCK_TRACE: START returns the cursor to
+ * read from. READ returns up to 'count' completed events from 'cursor' on
+ * and moves 'cursor' to the oldest event it did not return, one still in
+ * flight. Each event is returned once.
+ */
+typedef struct {
+	co_manager_ioctl_monitor_t pc;
+	co_block_trace_op_t	   op;
+	unsigned long		   cursor;
+	unsigned long		   count;
+	unsigned long		   lost;	/* overwritten before they were read */
+	unsigned long long	   freq;	/* timestamp ticks per second */
+	co_block_trace_event_t	   events[0];
+} co_monitor_ioctl_block_trace_t;
+
+/*
+ * interface for CO_MONITOR_IOCTL_BLOCK_QOS: returns the limits of a unit,
+ * after replacing them if 'set'.
+ */
+typedef struct {
+	co_manager_ioctl_monitor_t pc;
+	unsigned int		   unit;
+	bool_t			   set;
+	co_block_qos_t		   qos;
+	unsigned long		   queued;	/* requests waiting for budget */
+	unsigned long long	   delayed;	/* requests that had to wait so far */
+} co_monitor_ioctl_block_qos_t;
+
+typedef enum {
+	CO_BLOCK_SNAPSHOT_NONE,
+	CO_BLOCK_SNAPSHOT_PENDING,	/* taken by the monitor between two requests */
+	CO_BLOCK_SNAPSHOT_DONE,
+	CO_BLOCK_SNAPSHOT_FAILED,
+} co_block_snapshot_state_t;
+
+/*
+ * interface for CO_MONITOR_IOCTL_BLOCK_SNAPSHOT: unless 'query', freezes
+ * the current image of a unit and sends the writes to the empty overlay
+ * 'delta' from then on. Returns the state of the last snapshot and the
+ * file it froze, see common/cow.h.
+ */
+typedef struct {
+	co_manager_ioctl_monitor_t pc;
+	unsigned int		   unit;
+	bool_t			   query;
+	co_pathname_t		   delta;
+	co_block_snapshot_state_t  state;
+	co_pathname_t		   snapshot;
+} co_monitor_ioctl_block_snapshot_t;
+
 /***************** support kernel mode conet ***********************/
 typedef enum {
 	CO_CONET_BRIDGE,	/* bridge conet adapter to external */
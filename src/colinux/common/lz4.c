@@ -0,0 +1,183 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include "libc.h"
+#include "lz4.h"
+
+#define MINMATCH	4
+#define LASTLITERALS	5	/* the last bytes of a block are always literals */
+#define MFLIMIT		12	/* and no match starts within this many of the end */
+#define MAX_DISTANCE	65535
+
+static unsigned long read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static unsigned long hash32(unsigned long value)
+{
+	return ((value * 2654435761UL) & 0xffffffffUL) >> (32 - CO_LZ4_HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned long length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)length;
+	return op;
+}
+
+/* One sequence, a match_length of 0 ends the block */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+				   const unsigned char *literals, unsigned long literal_length,
+				   unsigned long offset, unsigned long match_length)
+{
+	unsigned char *token = op++;
+
+	if ((unsigned long)(oend - op) < literal_length + literal_length / 255 + 1 +
+					 2 + match_length / 255 + 1)
+		return NULL;
+
+	if (literal_length >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, literal_length - 15);
+	} else
+		*token = (unsigned char)(literal_length << 4);
+
+	co_memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	if (match_length == 0)
+		return op;
+
+	*op++ = (unsigned char)offset;
+	*op++ = (unsigned char)(offset >> 8);
+
+	match_length -= MINMATCH;
+	if (match_length >= 15) {
+		*token |= 15;
+		op = put_length(op, match_length - 15);
+	} else
+		*token |= (unsigned char)match_length;
+
+	return op;
+}
+
+unsigned long co_lz4_compress(const unsigned char *src, unsigned long src_size,
+			      unsigned char *dst, unsigned long dst_size,
+			      void *work)
+{
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *iend = src + src_size;
+	unsigned long *table = work;
+	unsigned char *op = dst, *oend = dst + dst_size;
+	unsigned long h, length;
+
+	co_memset(table, 0, CO_LZ4_WORK_SIZE);
+
+	if (src_size > MFLIMIT) {
+		const unsigned char *mflimit = iend - MFLIMIT;
+		const unsigned char *matchlimit = iend - LASTLITERALS;
+
+		while (ip < mflimit) {
+			h = hash32(read32(ip));
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			length = MINMATCH;
+			while (ip + length < matchlimit && ref[length] == ip[length])
+				length++;
+
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, length);
+			if (!op)
+				return 0;
+
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - dst;
+}
+
+static co_rc_t get_length(const unsigned char **ip, const unsigned char *iend,
+			  unsigned long *length)
+{
+	unsigned char byte;
+
+	do {
+		if (*ip >= iend)
+			return CO_RC(ERROR);
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_lz4_decompress(const unsigned char *src, unsigned long src_size,
+			  unsigned char *dst, unsigned long dst_size)
+{
+	const unsigned char *ip = src, *iend = src + src_size;
+	unsigned char *op = dst, *oend = dst + dst_size;
+	const unsigned char *match;
+	unsigned long token, length, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15 && !CO_OK(get_length(&ip, iend, &length)))
+			return CO_RC(ERROR);
+
+		if (length > (unsigned long)(iend - ip) || length > (unsigned long)(oend - op))
+			return CO_RC(ERROR);
+
+		co_memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		/* The last sequence has literals only */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return CO_RC(ERROR);
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > (unsigned long)(op - dst))
+			return CO_RC(ERROR);
+
+		length = token & 15;
+		if (length == 15 && !CO_OK(get_length(&ip, iend, &length)))
+			return CO_RC(ERROR);
+		length += MINMATCH;
+
+		if (length > (unsigned long)(oend - op))
+			return CO_RC(ERROR);
+
+		/* Byte by byte, the match may overlap what it produces */
+		match = op - offset;
+		while (length--)
+			*op++ = *match++;
+	}
+
+	if (op != oend)
+		return CO_RC(ERROR);
+
+	return CO_RC(OK);
+}
@@ -0,0 +1,37 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __CO_COMMON_LZ4_H__
+#define __CO_COMMON_LZ4_H__
+
+#include "common.h"
+
+/*
+ * LZ4 block format, without the frame around it. Small enough to be
+ * carried by the host driver, which has no compression library.
+ */
+
+#define CO_LZ4_HASH_BITS	12
+#define CO_LZ4_WORK_SIZE	((1 << CO_LZ4_HASH_BITS) * sizeof(unsigned long))
+
+/**
+ * Compress 'src' into 'dst', using 'work' (CO_LZ4_WORK_SIZE bytes) for
+ * the match finder. Returns the compressed size, or 0 if it doesn't
+ * fit in 'dst_size'.
+ */
+extern unsigned long co_lz4_compress(const unsigned char *src, unsigned long src_size,
+				     unsigned char *dst, unsigned long dst_size,
+				     void *work);
+
+/**
+ * Decompress a block that must expand to exactly 'dst_size' bytes.
+ * Malformed input is detected and never makes it write out of 'dst'.
+ */
+extern co_rc_t co_lz4_decompress(const unsigned char *src, unsigned long src_size,
+				 unsigned char *dst, unsigned long dst_size);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include "libc.h"
+#include "debug.h"
+#include "nbd.h"
+
+#define NBD_PREFIX_TCP		"nbd://"
+#define NBD_PREFIX_UNIX		"nbd+unix://"
+#define NBD_SOCKET_QUERY	"?socket="
+#define NBD_ZEROES		124	/* padding after the export flags */
+
+static void put_be(unsigned char *p, unsigned long long value, int size)
+{
+	while (size--) {
+		p[size] = (unsigned char)value;
+		value >>= 8;
+	}
+}
+
+static unsigned long long get_be(const unsigned char *p, int size)
+{
+	unsigned long long value = 0;
+
+	while (size--)
+		value = (value << 8) | *p++;
+
+	return value;
+}
+
+static bool_t has_prefix(const char *s, const char *prefix)
+{
+	return co_strncmp(s, prefix, co_strlen(prefix)) == 0;
+}
+
+/* Decimal number of up to 'max', returns the end or NULL */
+static const char *parse_number(const char *s, unsigned long max, unsigned long *value)
+{
+	const char *start = s;
+
+	*value = 0;
+	while (*s >= '0' && *s <= '9') {
+		*value = *value * 10 + (*s++ - '0');
+		if (*value > max)
+			return NULL;
+	}
+
+	return s == start ? NULL : s;
+}
+
+static co_rc_t copy_string(char *dest, unsigned long size, const char *src, unsigned long length)
+{
+	if (length >= size)
+		return CO_RC(INVALID_PARAMETER);
+
+	co_memcpy(dest, src, length);
+	dest[length] = '\0';
+	return CO_RC(OK);
+}
+
+static co_rc_t parse_tcp(const char *s, co_nbd_uri_t *uri)
+{
+	unsigned long value;
+	int i;
+
+	if (has_prefix(s, "localhost") && (s[9] == '\0' || s[9] == ':' || s[9] == '/')) {
+		uri->addr[0] = 127;
+		uri->addr[3] = 1;
+		s += 9;
+	} else {
+		for (i = 0; i < 4; i++) {
+			if (i && *s++ != '.')
+				return CO_RC(INVALID_PARAMETER);
+			s = parse_number(s, 255, &value);
+			if (!s)
+				return CO_RC(INVALID_PARAMETER);
+			uri->addr[i] = (unsigned char)value;
+		}
+	}
+
+	uri->port = CO_NBD_DEFAULT_PORT;
+	if (*s == ':') {
+		s = parse_number(s + 1, 65535, &value);
+		if (!s || value == 0)
+			return CO_RC(INVALID_PARAMETER);
+		uri->port = (unsigned short)value;
+	}
+
+	if (*s == '\0')
+		return CO_RC(OK);
+	if (*s != '/')
+		return CO_RC(INVALID_PARAMETER);
+
+	s++;
+	return copy_string(uri->name, sizeof(uri->name), s, co_strlen(s));
+}
+
+static co_rc_t parse_unix(const char *s, co_nbd_uri_t *uri)
+{
+	const char *query;
+	co_rc_t rc;
+
+	/* No host part, the path starts right away */
+	if (*s++ != '/')
+		return CO_RC(INVALID_PARAMETER);
+
+	query = co_strstr(s, NBD_SOCKET_QUERY);
+	if (!query)
+		return CO_RC(INVALID_PARAMETER);
+
+	rc = copy_string(uri->name, sizeof(uri->name), s, query - s);
+	if (!CO_OK(rc))
+		return rc;
+
+	query += co_strlen(NBD_SOCKET_QUERY);
+	if (*query == '\0')
+		return CO_RC(INVALID_PARAMETER);
+
+	uri->unix_socket = PTRUE;
+	return copy_string(uri->socket_path, sizeof(uri->socket_path), query, co_strlen(query));
+}
+
+bool_t co_nbd_is_uri(const char *pathname)
+{
+	return has_prefix(pathname, NBD_PREFIX_TCP) || has_prefix(pathname, NBD_PREFIX_UNIX);
+}
+
+co_rc_t co_nbd_parse_uri(const char *pathname, co_nbd_uri_t *uri)
+{
+	co_memset(uri, 0, sizeof(*uri));
+
+	if (has_prefix(pathname, NBD_PREFIX_TCP))
+		return parse_tcp(pathname + co_strlen(NBD_PREFIX_TCP), uri);
+	if (has_prefix(pathname, NBD_PREFIX_UNIX))
+		return parse_unix(pathname + co_strlen(NBD_PREFIX_UNIX), uri);
+
+	return CO_RC(INVALID_PARAMETER);
+}
+
+static co_rc_t handshake_oldstyle(void *conn, co_nbd_io_func_t recv, co_nbd_export_t *export)
+{
+	unsigned char buf[8 + 4 + NBD_ZEROES];
+	co_rc_t rc;
+
+	rc = recv(conn, buf, sizeof(buf));
+	if (!CO_OK(rc))
+		return rc;
+
+	export->size = get_be(buf, 8);
+	export->flags = (unsigned long)get_be(buf + 8, 4) & 0xffff;
+	return CO_RC(OK);
+}
+
+static co_rc_t handshake_newstyle(void *conn, co_nbd_io_func_t send, co_nbd_io_func_t recv,
+				  const char *name, co_nbd_export_t *export)
+{
+	unsigned char buf[8 + 4 + 4];
+	unsigned char zeroes[NBD_ZEROES];
+	unsigned long server_flags, client_flags, length;
+	co_rc_t rc;
+
+	rc = recv(conn, buf, 2);
+	if (!CO_OK(rc))
+		return rc;
+
+	server_flags = (unsigned long)get_be(buf, 2);
+	client_flags = server_flags & (CO_NBD_FLAG_FIXED_NEWSTYLE | CO_NBD_FLAG_NO_ZEROES);
+	put_be(buf, client_flags, 4);
+	rc = send(conn, buf, 4);
+	if (!CO_OK(rc))
+		return rc;
+
+	/* The server closes the connection if it doesn't know the name */
+	length = co_strlen(name);
+	put_be(buf, CO_NBD_OPTS_MAGIC, 8);
+	put_be(buf + 8, CO_NBD_OPT_EXPORT_NAME, 4);
+	put_be(buf + 12, length, 4);
+	rc = send(conn, buf, sizeof(buf));
+	if (CO_OK(rc) && length)
+		rc = send(conn, (void *)name, length);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = recv(conn, buf, 8 + 2);
+	if (!CO_OK(rc)) {
+		co_debug_error("nbd: no export named '%s'", name);
+		return rc;
+	}
+
+	export->size = get_be(buf, 8);
+	export->flags = (unsigned long)get_be(buf + 8, 2);
+
+	if (!(client_flags & CO_NBD_FLAG_NO_ZEROES))
+		rc = recv(conn, zeroes, sizeof(zeroes));
+
+	return rc;
+}
+
+co_rc_t co_nbd_handshake(void *conn, co_nbd_io_func_t send, co_nbd_io_func_t recv,
+			 const char *name, co_nbd_export_t *export)
+{
+	unsigned char buf[16];
+	unsigned long long magic;
+	co_rc_t rc;
+
+	rc = recv(conn, buf, sizeof(buf));
+	if (!CO_OK(rc))
+		return rc;
+
+	if (get_be(buf, 8) != CO_NBD_MAGIC) {
+		co_debug_error("nbd: not an NBD server");
+		return CO_RC(ERROR);
+	}
+
+	magic = get_be(buf + 8, 8);
+	if (magic == CO_NBD_OPTS_MAGIC)
+		rc = handshake_newstyle(conn, send, recv, name, export);
+	else if (magic == CO_NBD_OLDSTYLE_MAGIC) {
+		/* A single export per port, there is no name to ask for */
+		if (*name)
+			co_debug("nbd: oldstyle server, export name '%s' ignored", name);
+		rc = handshake_oldstyle(conn, recv, export);
+	} else {
+		co_debug_error("nbd: unknown handshake %llx", magic);
+		rc = CO_RC(ERROR);
+	}
+
+	if (!CO_OK(rc))
+		return rc;
+
+	if (!(export->flags & CO_NBD_FLAG_HAS_FLAGS))
+		export->flags = 0;
+
+	co_debug("nbd: export of %llu bytes, flags %lx", export->size, export->flags);
+	return CO_RC(OK);
+}
+
+void co_nbd_request_init(co_nbd_request_t *request, unsigned long type,
+			 unsigned long flags, unsigned long long handle,
+			 unsigned long long offset, unsigned long length)
+{
+	put_be(request->magic, CO_NBD_REQUEST_MAGIC, 4);
+	put_be(request->flags, flags, 2);
+	put_be(request->type, type, 2);
+	put_be(request->handle, handle, 8);
+	put_be(request->offset, offset, 8);
+	put_be(request->length, length, 4);
+}
+
+co_rc_t co_nbd_reply_parse(co_nbd_reply_t *reply, unsigned long long *handle,
+			   unsigned long *error)
+{
+	if (get_be(reply->magic, 4) != CO_NBD_REPLY_MAGIC) {
+		co_debug_error("nbd: bad reply magic");
+		return CO_RC(ERROR);
+	}
+
+	*error = (unsigned long)get_be(reply->error, 4);
+	*handle = get_be(reply->handle, 8);
+	return CO_RC(OK);
+}
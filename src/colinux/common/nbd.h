@@ -0,0 +1,108 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __CO_COMMON_NBD_H__
+#define __CO_COMMON_NBD_H__
+
+#include "common.h"
+
+/*
+ * Client side of the network block device protocol, as spoken by
+ * nbd-server and qemu-nbd. All numbers on the wire are big endian.
+ * Only the parts a cobd device needs are here: the fixed newstyle and
+ * the oldstyle handshake, simple replies and the READ, WRITE, FLUSH,
+ * TRIM and DISC commands.
+ */
+
+#define CO_NBD_DEFAULT_PORT		10809
+
+#define CO_NBD_MAGIC			0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define CO_NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define CO_NBD_OLDSTYLE_MAGIC		0x0000420281861253ULL
+#define CO_NBD_REQUEST_MAGIC		0x25609513
+#define CO_NBD_REPLY_MAGIC		0x67446698
+
+/* Handshake flags of the server and the client */
+#define CO_NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define CO_NBD_FLAG_NO_ZEROES		(1 << 1)
+
+#define CO_NBD_OPT_EXPORT_NAME		1
+
+/* Transmission flags of an export */
+#define CO_NBD_FLAG_HAS_FLAGS		(1 << 0)
+#define CO_NBD_FLAG_READ_ONLY		(1 << 1)
+#define CO_NBD_FLAG_SEND_FLUSH		(1 << 2)
+#define CO_NBD_FLAG_SEND_FUA		(1 << 3)
+#define CO_NBD_FLAG_SEND_TRIM		(1 << 5)
+
+#define CO_NBD_CMD_READ			0
+#define CO_NBD_CMD_WRITE		1
+#define CO_NBD_CMD_DISC			2
+#define CO_NBD_CMD_FLUSH		3
+#define CO_NBD_CMD_TRIM			4
+
+#define CO_NBD_CMD_FLAG_FUA		(1 << 0)
+
+#define CO_NBD_MAX_NAME			256
+#define CO_NBD_MAX_SOCKET_PATH		108	/* sun_path */
+
+typedef struct {
+	unsigned char magic[4];
+	unsigned char flags[2];
+	unsigned char type[2];
+	unsigned char handle[8];
+	unsigned char offset[8];
+	unsigned char length[4];
+} PACKED_STRUCT co_nbd_request_t;
+
+typedef struct {
+	unsigned char magic[4];
+	unsigned char error[4];
+	unsigned char handle[8];
+} PACKED_STRUCT co_nbd_reply_t;
+
+/*
+ * Where the export is, from the pathname of the cobd device:
+ *
+ *   nbd://<a.b.c.d>[:<port>][/<name>]
+ *   nbd+unix:///[<name>]?socket=<path>
+ *
+ * The host driver can't resolve names, except for "localhost".
+ */
+typedef struct {
+	bool_t unix_socket;
+	unsigned char addr[4];			/* TCP, IPv4 */
+	unsigned short port;
+	char socket_path[CO_NBD_MAX_SOCKET_PATH];	/* UNIX */
+	char name[CO_NBD_MAX_NAME];		/* empty for the default export */
+} co_nbd_uri_t;
+
+/* What a successful handshake tells about the export */
+typedef struct {
+	unsigned long long size;
+	unsigned long flags;			/* CO_NBD_FLAG_* transmission flags */
+} co_nbd_export_t;
+
+/*
+ * Blocking transfer of exactly 'size' bytes over the connection, the
+ * handshake is driven through these.
+ */
+typedef co_rc_t (*co_nbd_io_func_t)(void *conn, void *buffer, unsigned long size);
+
+extern bool_t co_nbd_is_uri(const char *pathname);
+extern co_rc_t co_nbd_parse_uri(const char *pathname, co_nbd_uri_t *uri);
+
+extern co_rc_t co_nbd_handshake(void *conn, co_nbd_io_func_t send, co_nbd_io_func_t recv,
+				const char *name, co_nbd_export_t *export);
+
+extern void co_nbd_request_init(co_nbd_request_t *request, unsigned long type,
+				unsigned long flags, unsigned long long handle,
+				unsigned long long offset, unsigned long length);
+extern co_rc_t co_nbd_reply_parse(co_nbd_reply_t *reply, unsigned long long *handle,
+				  unsigned long *error);
+
+#endif
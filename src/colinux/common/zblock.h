@@ -0,0 +1,40 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __CO_COMMON_ZBLOCK_H__
+#define __CO_COMMON_ZBLOCK_H__
+
+/*
+ * Compressed read-only block device image.
+ *
+ * The image is cut into chunks of (1 << chunk_shift) bytes which are
+ * compressed one by one. After the header and the compressed chunks
+ * comes an index of (chunks + 1) file offsets; chunk i is stored in
+ * [index[i], index[i + 1]). A chunk stored with its full uncompressed
+ * length is not compressed at all.
+ */
+
+#define CO_ZBLOCK_MAGIC			0x7a426f43	/* "CoBz" */
+#define CO_ZBLOCK_VERSION		1
+#define CO_ZBLOCK_METHOD_LZ4		1
+
+#define CO_ZBLOCK_MIN_CHUNK_SHIFT	12
+#define CO_ZBLOCK_MAX_CHUNK_SHIFT	20
+#define CO_ZBLOCK_DEFAULT_CHUNK_SHIFT	16
+
+typedef struct {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long method;
+	unsigned long chunk_shift;
+	unsigned long chunks;
+	unsigned long reserved;
+	unsigned long long size;	/* uncompressed */
+	unsigned long long index_offset;
+} co_zblock_header_t;
+
+#endif
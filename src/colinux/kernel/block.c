@@ -10,6 +10,8 @@
 #include <colinux/common/libc.h>
 
 #include "block.h"
+#include "blockqos.h"
+#include "blocktrace.h"
 #include "monitor.h"
 
 void co_monitor_block_register_device(co_monitor_t *cmon, unsigned int index, co_block_dev_t *dev)
@@ -45,11 +47,30 @@ static co_block_dev_t* co_monitor_block_dev_from_index(co_monitor_t *cmon, unsig
 	return cmon->block_devs[index];
 }
 
+/* Pass a tagged request to the backend, the tag is marked in flight */
+co_rc_t co_monitor_block_issue(co_monitor_t *cmon, co_block_dev_t *dev,
+			       co_block_request_t *request, co_timestamp_t *submit)
+{
+	co_rc_t rc;
+
+	/* Traced first, the backend may complete it before it returns */
+	dev->trace_seq[request->tag] = co_block_trace_request(cmon, dev, request, submit);
+	rc = (dev->service)(cmon, dev, request);
+	if (!CO_OK(rc) || !request->async) {
+		co_block_trace_complete(cmon, dev->trace_seq[request->tag], CO_OK(rc));
+		dev->inflight[request->tag] = PFALSE;
+	}
+
+	return rc;
+}
+
 static co_rc_t intern_monitor_block_request(co_monitor_t*	cmon,
 					    unsigned int	index,
 					    co_block_request_t*	request)
 {
 	co_block_dev_t *dev;
+	co_timestamp_t submit;
+	unsigned long seq = CO_BLOCK_TRACE_NO_EVENT;
 	co_rc_t rc;
 
 	dev = co_monitor_block_dev_from_index(cmon, index);
@@ -85,13 +106,43 @@ static co_rc_t intern_monitor_block_request(co_monitor_t*	cmon,
 		co_snprintf(request->alias, sizeof(request->alias), "%s", dev->conf->alias);
 		return CO_RC_OK;
 	}
+	case CO_BLOCK_READ:
+	case CO_BLOCK_WRITE:
+	case CO_BLOCK_READV:
+	case CO_BLOCK_WRITEV:
+	case CO_BLOCK_DISCARD: {
+		if (request->tag >= CO_BLOCK_MAX_INFLIGHT) {
+			co_debug_error("cobd%d: bad tag %ld", index, request->tag);
+			return CO_RC(INVALID_PARAMETER);
+		}
+		if (dev->inflight[request->tag])
+			return CO_RC(BUSY);
+
+		dev->inflight[request->tag] = PTRUE;
+		request->async = 0;
+		co_os_get_timestamp(&submit);
+		if (co_block_qos_defer(cmon, dev, request, &submit)) {
+			/* Completed later, once the device is within its limits */
+			request->async = PTRUE;
+			return CO_RC_OK;
+		}
+		return co_monitor_block_issue(cmon, dev, request, &submit);
+	}
 	default:
 		break;
 	}
 
+	co_os_get_timestamp(&submit);
+	if (request->type == CO_BLOCK_FLUSH)
+		seq = co_block_trace_request(cmon, dev, request, &submit);
 	rc = (dev->service)(cmon, dev, request);
 
 	switch (request->type) {
+	case CO_BLOCK_FLUSH: {
+		request->async = 0;
+		co_block_trace_complete(cmon, seq, CO_OK(rc));
+		break;
+	}
 	case CO_BLOCK_OPEN: {
 		if (CO_OK(rc)) {
 			co_debug("cobd%d: open success (count=%d)", index, dev->use_count);
@@ -127,6 +178,28 @@ void co_monitor_block_request(co_monitor_t*       cmon,
 	rc = intern_monitor_block_request(cmon, index, request);
 	if (CO_OK(rc))
 		request->rc = CO_BLOCK_REQUEST_RETCODE_OK;
+	else if (CO_RC_GET_CODE(rc) == CO_RC_BUSY)
+		request->rc = CO_BLOCK_REQUEST_RETCODE_BUSY;
 	else
 		request->rc = CO_BLOCK_REQUEST_RETCODE_ERROR;
 }
+
+/*
+ * Called by the backends when an asynchronous request is done. 'message'
+ * carries the request's co_block_intr_t. The tag is released before
+ * Linux sees the completion, so it can be reused right away.
+ */
+void co_monitor_block_complete(co_monitor_t *cmon, co_block_dev_t *dev, co_message_t *message)
+{
+	co_block_intr_t *intr;
+
+	intr = (co_block_intr_t *)((co_linux_message_t *)message->data)->data;
+	if (intr->tag < CO_BLOCK_MAX_INFLIGHT) {
+		if (dev->complete)
+			dev->complete(cmon, dev, intr->tag, intr->uptodate);
+		co_block_trace_complete(cmon, dev->trace_seq[intr->tag], intr->uptodate);
+		dev->inflight[intr->tag] = PFALSE;
+	}
+
+	co_monitor_message_from_user_free(cmon, message);
+}
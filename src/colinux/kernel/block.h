@@ -11,20 +11,48 @@
 #define __COLINUX_KERNEL_BLOCK_H__
 
 #include <colinux/common/config.h>
+#include <colinux/os/timer.h>
 
 struct co_block_dev;
 struct co_monitor;
 
 typedef struct co_block_dev co_block_dev_t;
 
+/*
+ * Token buckets of the limits in conf->qos, and the requests waiting
+ * for them. Only touched by the monitor thread, see blockqos.c.
+ */
+typedef struct {
+	long long ops;		/* budgets, in microseconds worth of the limit */
+	long long bytes;
+	co_timestamp_t last;	/* of the last refill */
+	unsigned int head;
+	unsigned int count;
+	unsigned char queue[CO_BLOCK_MAX_INFLIGHT];	/* tags in order of arrival */
+	co_block_request_t requests[CO_BLOCK_MAX_INFLIGHT];
+	co_timestamp_t submit[CO_BLOCK_MAX_INFLIGHT];
+	unsigned long long delayed;
+} co_block_qos_state_t;
+
 struct co_block_dev {
 	unsigned long long size;
 	co_block_dev_desc_t *conf;
 	co_rc_t (*service)(struct co_monitor *cmon, co_block_dev_t *dev,
 			   co_block_request_t *request);
 	void (*free)(struct co_monitor *cmon, co_block_dev_t *dev);
+	/* Optional, called when an asynchronous request is done */
+	void (*complete)(struct co_monitor *cmon, co_block_dev_t *dev,
+			 unsigned long tag, bool_t uptodate);
 	unsigned int use_count;
 	int unit;
+
+	/*
+	 * Tags of asynchronous requests in flight. Set by the monitor when
+	 * a request is accepted, cleared by the backend on completion.
+	 */
+	volatile bool_t inflight[CO_BLOCK_MAX_INFLIGHT];
+	unsigned long trace_seq[CO_BLOCK_MAX_INFLIGHT]; /* trace event of each tag */
+	co_block_qos_state_t qos;
 } PACKED_STRUCT;
 
 extern void co_monitor_block_register_device(struct co_monitor *cmon, unsigned int unit,
@@ -32,6 +60,10 @@ extern void co_monitor_block_register_device(struct co_monitor *cmon, unsigned i
 extern void co_monitor_block_request(struct co_monitor *cmon, unsigned int unit,
 					co_block_request_t *request);
 extern void co_monitor_block_unregister_device(struct co_monitor *cmon, unsigned int unit);
+extern void co_monitor_block_complete(struct co_monitor *cmon, co_block_dev_t *dev,
+				      co_message_t *message);
+extern co_rc_t co_monitor_block_issue(struct co_monitor *cmon, co_block_dev_t *dev,
+				      co_block_request_t *request, co_timestamp_t *submit);
 extern void co_monitor_unregister_and_free_block_devices(struct co_monitor *cmon);
 
 #endif
@@ -0,0 +1,334 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/alloc.h>
+#include <colinux/arch/mmu.h>
+
+#include "monitor.h"
+#include "transfer.h"
+#include "blockcache.h"
+
+#define CO_BLOCK_CACHE_HASH_MAX		8192
+
+struct co_block_cache_page {
+	co_list_t lru;
+	co_block_cache_page_t *hash_next;
+	unsigned long long index;	/* offset >> CO_ARCH_PAGE_SHIFT */
+	unsigned char *data;
+};
+
+static unsigned long hash_index(co_block_cache_t *cache, unsigned long long index)
+{
+	return (unsigned long)(index ^ (index >> 16)) & (cache->hash_size - 1);
+}
+
+static co_block_cache_page_t *lookup(co_block_cache_t *cache, unsigned long long index)
+{
+	co_block_cache_page_t *page;
+
+	page = cache->hash[hash_index(cache, index)];
+	while (page && page->index != index)
+		page = page->hash_next;
+
+	return page;
+}
+
+static void unhash(co_block_cache_t *cache, co_block_cache_page_t *page)
+{
+	co_block_cache_page_t **pprev;
+
+	pprev = &cache->hash[hash_index(cache, page->index)];
+	while (*pprev != page)
+		pprev = &(*pprev)->hash_next;
+	*pprev = page->hash_next;
+}
+
+static void drop(co_block_cache_t *cache, co_block_cache_page_t *page)
+{
+	unhash(cache, page);
+	co_list_del(&page->lru);
+	co_os_free_pages(page->data, 1);
+	co_os_free(page);
+	cache->nr_pages--;
+}
+
+co_rc_t co_block_cache_create(unsigned long size_kb, co_block_cache_t **out_cache)
+{
+	co_block_cache_t *cache;
+	co_rc_t rc;
+
+	cache = co_os_malloc(sizeof(*cache));
+	if (!cache)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(cache, 0, sizeof(*cache));
+
+	cache->max_pages = size_kb >> (CO_ARCH_PAGE_SHIFT - 10);
+	if (cache->max_pages == 0) {
+		co_os_free(cache);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	/* About four pages per bucket */
+	cache->hash_size = 1;
+	while (cache->hash_size < cache->max_pages / 4 &&
+	       cache->hash_size < CO_BLOCK_CACHE_HASH_MAX)
+		cache->hash_size <<= 1;
+
+	cache->hash = co_os_malloc(cache->hash_size * sizeof(co_block_cache_page_t *));
+	if (!cache->hash) {
+		co_os_free(cache);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+	co_memset(cache->hash, 0, cache->hash_size * sizeof(co_block_cache_page_t *));
+
+	rc = co_os_mutex_create(&cache->mutex);
+	if (!CO_OK(rc)) {
+		co_os_free(cache->hash);
+		co_os_free(cache);
+		return rc;
+	}
+
+	co_list_init(&cache->lru);
+	cache->stats.max_pages = cache->max_pages;
+
+	*out_cache = cache;
+	return CO_RC(OK);
+}
+
+void co_block_cache_flush(co_block_cache_t *cache)
+{
+	co_os_mutex_acquire(cache->mutex);
+	while (!co_list_empty(&cache->lru))
+		drop(cache, co_list_entry(cache->lru.next, co_block_cache_page_t, lru));
+	cache->generation++;
+	cache->stats.pages = 0;
+	co_os_mutex_release(cache->mutex);
+}
+
+void co_block_cache_destroy(co_block_cache_t *cache)
+{
+	co_block_cache_flush(cache);
+	co_os_mutex_destroy(cache->mutex);
+	co_os_free(cache->hash);
+	co_os_free(cache);
+}
+
+/*
+ * Copy the part [pos, pos + size) of a request between a host buffer and
+ * the request's Linux segments. 'offset' is the disk offset of the first
+ * segment.
+ */
+static co_rc_t transfer_range(co_monitor_t *cmon, co_block_segment_t *segments,
+			      unsigned long nr_segments, unsigned long long offset,
+			      unsigned long long pos, unsigned char *buffer, unsigned long size,
+			      co_monitor_transfer_dir_t dir)
+{
+	unsigned long i;
+	co_rc_t rc;
+
+	for (i = 0; i < nr_segments && size > 0; i++) {
+		unsigned long long end = offset + segments[i].size;
+
+		if (pos < end) {
+			unsigned long skip = (unsigned long)(pos - offset);
+			unsigned long one_copy = segments[i].size - skip;
+
+			if (one_copy > size)
+				one_copy = size;
+
+			if (dir == CO_MONITOR_TRANSFER_FROM_HOST)
+				rc = co_monitor_host_to_linuxvm(cmon, buffer,
+								segments[i].address + skip, one_copy);
+			else
+				rc = co_monitor_linuxvm_to_host(cmon, segments[i].address + skip,
+								buffer, one_copy);
+			if (!CO_OK(rc))
+				return rc;
+
+			buffer += one_copy;
+			pos += one_copy;
+			size -= one_copy;
+		}
+
+		offset = end;
+	}
+
+	return CO_RC(OK);
+}
+
+static unsigned long long segments_size(co_block_segment_t *segments, unsigned long nr_segments)
+{
+	unsigned long long size = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr_segments; i++)
+		size += segments[i].size;
+
+	return size;
+}
+
+bool_t co_block_cache_read(co_monitor_t *cmon, co_block_cache_t *cache,
+			   unsigned long long offset,
+			   co_block_segment_t *segments, unsigned long nr_segments)
+{
+	unsigned long long end = offset + segments_size(segments, nr_segments);
+	unsigned long long index;
+	co_block_cache_page_t *page;
+	bool_t hit = PFALSE;
+
+	if (end == offset)
+		return PFALSE;
+
+	co_os_mutex_acquire(cache->mutex);
+
+	for (index = offset >> CO_ARCH_PAGE_SHIFT; index <= (end - 1) >> CO_ARCH_PAGE_SHIFT; index++)
+		if (!lookup(cache, index))
+			goto out;
+
+	for (index = offset >> CO_ARCH_PAGE_SHIFT; index <= (end - 1) >> CO_ARCH_PAGE_SHIFT; index++) {
+		unsigned long long start = index << CO_ARCH_PAGE_SHIFT;
+		unsigned long long stop = start + CO_ARCH_PAGE_SIZE;
+
+		if (start < offset)
+			start = offset;
+		if (stop > end)
+			stop = end;
+
+		page = lookup(cache, index);
+		if (!CO_OK(transfer_range(cmon, segments, nr_segments, offset, start,
+					  page->data + (start & ~CO_ARCH_PAGE_MASK),
+					  (unsigned long)(stop - start),
+					  CO_MONITOR_TRANSFER_FROM_HOST)))
+			goto out;
+
+		co_list_del(&page->lru);
+		co_list_add_head(&page->lru, &cache->lru);
+	}
+
+	hit = PTRUE;
+out:
+	if (hit)
+		cache->stats.hits++;
+	else
+		cache->stats.misses++;
+	co_os_mutex_release(cache->mutex);
+
+	return hit;
+}
+
+static co_block_cache_page_t *get_free_page(co_block_cache_t *cache)
+{
+	co_block_cache_page_t *page;
+
+	if (cache->nr_pages >= cache->max_pages) {
+		/* Recycle the least recently used page */
+		page = co_list_entry(cache->lru.prev, co_block_cache_page_t, lru);
+		unhash(cache, page);
+		co_list_del(&page->lru);
+		cache->stats.evictions++;
+		return page;
+	}
+
+	page = co_os_malloc(sizeof(*page));
+	if (!page)
+		return NULL;
+
+	page->data = co_os_alloc_pages(1);
+	if (!page->data) {
+		co_os_free(page);
+		return NULL;
+	}
+
+	cache->nr_pages++;
+	return page;
+}
+
+void co_block_cache_fill(co_monitor_t *cmon, co_block_cache_t *cache,
+			 unsigned long generation, unsigned long long offset,
+			 co_block_segment_t *segments, unsigned long nr_segments)
+{
+	unsigned long long end = offset + segments_size(segments, nr_segments);
+	unsigned long long index;
+	co_block_cache_page_t *page;
+
+	co_os_mutex_acquire(cache->mutex);
+
+	if (generation != cache->generation)
+		goto out;
+
+	/* Only whole pages go in */
+	index = (offset + CO_ARCH_PAGE_SIZE - 1) >> CO_ARCH_PAGE_SHIFT;
+	for (; (index + 1) << CO_ARCH_PAGE_SHIFT <= end; index++) {
+		if (lookup(cache, index))
+			continue;
+
+		page = get_free_page(cache);
+		if (!page)
+			break;
+
+		page->index = index;
+		if (!CO_OK(transfer_range(cmon, segments, nr_segments, offset,
+					  index << CO_ARCH_PAGE_SHIFT, page->data,
+					  CO_ARCH_PAGE_SIZE, CO_MONITOR_TRANSFER_FROM_LINUX))) {
+			co_os_free_pages(page->data, 1);
+			co_os_free(page);
+			cache->nr_pages--;
+			break;
+		}
+
+		page->hash_next = cache->hash[hash_index(cache, index)];
+		cache->hash[hash_index(cache, index)] = page;
+		co_list_add_head(&page->lru, &cache->lru);
+	}
+
+	cache->stats.pages = cache->nr_pages;
+out:
+	co_os_mutex_release(cache->mutex);
+}
+
+void co_block_cache_invalidate(co_block_cache_t *cache,
+			       unsigned long long offset, unsigned long long size)
+{
+	unsigned long long index, first, last;
+	co_block_cache_page_t *page;
+
+	if (size == 0)
+		return;
+
+	co_os_mutex_acquire(cache->mutex);
+
+	cache->generation++;
+
+	first = offset >> CO_ARCH_PAGE_SHIFT;
+	last = (offset + size - 1) >> CO_ARCH_PAGE_SHIFT;
+	if (last - first >= cache->nr_pages) {
+		/* Large range, cheaper to walk what is cached */
+		co_list_t *item = cache->lru.next;
+
+		while (item != &cache->lru) {
+			page = co_list_entry(item, co_block_cache_page_t, lru);
+			item = item->next;
+			if (page->index >= first && page->index <= last) {
+				drop(cache, page);
+				cache->stats.invalidations++;
+			}
+		}
+	} else {
+		for (index = first; index <= last; index++) {
+			page = lookup(cache, index);
+			if (page) {
+				drop(cache, page);
+				cache->stats.invalidations++;
+			}
+		}
+	}
+
+	cache->stats.pages = cache->nr_pages;
+	co_os_mutex_release(cache->mutex);
+}
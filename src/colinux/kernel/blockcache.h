@@ -0,0 +1,58 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __COLINUX_KERNEL_BLOCK_CACHE_H__
+#define __COLINUX_KERNEL_BLOCK_CACHE_H__
+
+/*
+ * Page granular read cache of a block device, kept in host memory.
+ */
+
+#include <colinux/common/list.h>
+#include <colinux/common/ioctl.h>
+#include <colinux/os/kernel/mutex.h>
+
+struct co_monitor;
+
+typedef struct co_block_cache_page co_block_cache_page_t;
+
+typedef struct co_block_cache {
+	co_os_mutex_t mutex;
+	unsigned long max_pages;
+	unsigned long nr_pages;
+	unsigned long hash_size;
+	co_block_cache_page_t **hash;
+	co_list_t lru;			/* most recently used first */
+	unsigned long generation;	/* bumped by every invalidation */
+	co_block_cache_stats_t stats;
+} co_block_cache_t;
+
+extern co_rc_t co_block_cache_create(unsigned long size_kb, co_block_cache_t **out_cache);
+extern void co_block_cache_destroy(co_block_cache_t *cache);
+extern void co_block_cache_flush(co_block_cache_t *cache);
+
+/*
+ * Serve a read from the cache. Returns PTRUE if all of it was cached and
+ * copied to Linux, PFALSE on a miss.
+ */
+extern bool_t co_block_cache_read(struct co_monitor *cmon, co_block_cache_t *cache,
+				  unsigned long long offset,
+				  co_block_segment_t *segments, unsigned long nr_segments);
+
+/*
+ * Insert the pages fully covered by a completed read. 'generation' is the
+ * value sampled when the read was issued, the data is dropped if a write
+ * went in meanwhile.
+ */
+extern void co_block_cache_fill(struct co_monitor *cmon, co_block_cache_t *cache,
+				unsigned long generation, unsigned long long offset,
+				co_block_segment_t *segments, unsigned long nr_segments);
+
+extern void co_block_cache_invalidate(co_block_cache_t *cache,
+				      unsigned long long offset, unsigned long long size);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+
+#include "monitor.h"
+#include "blockqos.h"
+
+/*
+ * The budgets are kept in microseconds worth of each limit: a second of
+ * waiting adds 1000000 * iops to 'ops', a request takes 1000000 away.
+ * They fill up to 'burst' milliseconds worth. A request larger than a
+ * full bucket still goes once the bucket is full, leaving it in debt.
+ */
+
+#define USECS_PER_SEC	1000000ULL
+
+static unsigned long long burst_usecs(co_block_qos_t *limits)
+{
+	unsigned long burst = limits->burst;
+
+	if (burst == 0)
+		burst = CO_BLOCK_QOS_BURST_DEFAULT;
+	else if (burst > CO_BLOCK_QOS_BURST_MAX)
+		burst = CO_BLOCK_QOS_BURST_MAX;
+
+	return (unsigned long long)burst * 1000;
+}
+
+static void qos_refill(co_monitor_t *cmon, co_block_qos_state_t *qos, co_block_qos_t *limits)
+{
+	unsigned long long elapsed, burst;
+	co_timestamp_t now;
+
+	co_os_get_timestamp(&now);
+	if (now.quad <= qos->last.quad)
+		return;
+
+	burst = burst_usecs(limits);
+
+	/* Long idle times only fill the buckets, keep the products small */
+	elapsed = now.quad - qos->last.quad;
+	if (elapsed > cmon->timestamp_freq.quad * (2 * CO_BLOCK_QOS_BURST_MAX / 1000))
+		elapsed = cmon->timestamp_freq.quad * (2 * CO_BLOCK_QOS_BURST_MAX / 1000);
+	elapsed *= USECS_PER_SEC;
+	co_div64_32(&elapsed, cmon->timestamp_freq.quad);
+	qos->last = now;
+
+	qos->ops += elapsed * limits->iops;
+	if (qos->ops > (long long)(burst * limits->iops))
+		qos->ops = burst * limits->iops;
+
+	qos->bytes += elapsed * limits->kbps;
+	if (qos->bytes > (long long)(burst * limits->kbps))
+		qos->bytes = burst * limits->kbps;
+}
+
+static bool_t qos_take(co_block_qos_state_t *qos, co_block_qos_t *limits,
+		       co_block_request_t *request)
+{
+	unsigned long long burst = burst_usecs(limits);
+	long long ops = USECS_PER_SEC;
+	long long bytes = 0;
+
+	/* Discards move no data */
+	if (request->type != CO_BLOCK_DISCARD)
+		bytes = (request->size * USECS_PER_SEC) >> 10;
+
+	if (limits->iops) {
+		if (ops > (long long)(burst * limits->iops))
+			ops = burst * limits->iops;
+		if (qos->ops < ops)
+			return PFALSE;
+	}
+
+	if (limits->kbps) {
+		if (bytes > (long long)(burst * limits->kbps))
+			bytes = burst * limits->kbps;
+		if (qos->bytes < bytes)
+			return PFALSE;
+	}
+
+	if (limits->iops)
+		qos->ops -= USECS_PER_SEC;
+	if (limits->kbps && request->type != CO_BLOCK_DISCARD)
+		qos->bytes -= (request->size * USECS_PER_SEC) >> 10;
+
+	return PTRUE;
+}
+
+/*
+ * Called with the tag of the request already in flight. Returns PTRUE
+ * if the request was queued, Linux then waits for its completion.
+ */
+bool_t co_block_qos_defer(co_monitor_t *cmon, co_block_dev_t *dev,
+			  co_block_request_t *request, co_timestamp_t *submit)
+{
+	co_block_qos_state_t *qos = &dev->qos;
+	co_block_qos_t *limits;
+	unsigned int slot;
+
+	if (!dev->conf)
+		return PFALSE;
+
+	limits = &dev->conf->qos;
+	if (!limits->iops && !limits->kbps && qos->count == 0)
+		return PFALSE;
+
+	qos_refill(cmon, qos, limits);
+
+	/* Requests don't overtake the ones already waiting */
+	if (qos->count == 0 && qos_take(qos, limits, request))
+		return PFALSE;
+
+	co_memcpy(&qos->requests[request->tag], request, sizeof(*request));
+	qos->submit[request->tag] = *submit;
+
+	slot = (qos->head + qos->count) % CO_BLOCK_MAX_INFLIGHT;
+	qos->queue[slot] = request->tag;
+	qos->count++;
+	qos->delayed++;
+	cmon->block_qos_queued++;
+
+	return PTRUE;
+}
+
+/* The backend finished a queued request right away, tell Linux */
+static void qos_post_completion(co_monitor_t *cmon, co_block_dev_t *dev,
+				co_block_request_t *request, bool_t uptodate)
+{
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		co_block_intr_t intr;
+	} *msg;
+
+	msg = co_os_malloc(sizeof(*msg));
+	if (!msg) {
+		co_debug_error("cobd%d: no memory to complete tag %ld", dev->unit, request->tag);
+		return;
+	}
+
+	co_memset(msg, 0, sizeof(*msg));
+	msg->message.from = CO_MODULE_COBD0 + dev->unit;
+	msg->message.to = CO_MODULE_LINUX;
+	msg->message.priority = CO_PRIORITY_DISCARDABLE;
+	msg->message.type = CO_MESSAGE_TYPE_OTHER;
+	msg->message.size = sizeof(*msg) - sizeof(msg->message);
+	msg->linux_message.device = CO_DEVICE_BLOCK;
+	msg->linux_message.unit = dev->unit;
+	msg->linux_message.size = sizeof(msg->intr);
+	msg->intr.irq_request = request->irq_request;
+	msg->intr.tag = request->tag;
+	msg->intr.uptodate = uptodate;
+
+	co_monitor_message_from_user_free(cmon, &msg->message);
+}
+
+static void qos_dispatch_device(co_monitor_t *cmon, co_block_dev_t *dev)
+{
+	co_block_qos_state_t *qos = &dev->qos;
+	co_block_request_t *request;
+	unsigned char tag;
+	co_rc_t rc;
+
+	qos_refill(cmon, qos, &dev->conf->qos);
+
+	while (qos->count > 0) {
+		tag = qos->queue[qos->head];
+		request = &qos->requests[tag];
+
+		if (!qos_take(qos, &dev->conf->qos, request))
+			break;
+
+		qos->head = (qos->head + 1) % CO_BLOCK_MAX_INFLIGHT;
+		qos->count--;
+		cmon->block_qos_queued--;
+
+		request->async = 0;
+		rc = co_monitor_block_issue(cmon, dev, request, &qos->submit[tag]);
+		if (!CO_OK(rc) || !request->async)
+			qos_post_completion(cmon, dev, request, CO_OK(rc));
+	}
+}
+
+/* Called by the monitor on its way back to Linux */
+void co_block_qos_dispatch(co_monitor_t *cmon)
+{
+	co_block_dev_t *dev;
+	int i;
+
+	for (i = 0; i < CO_MODULE_MAX_COBD && cmon->block_qos_queued; i++) {
+		dev = cmon->block_devs[i];
+		if (dev && dev->qos.count)
+			qos_dispatch_device(cmon, dev);
+	}
+}
+
+co_rc_t co_block_qos_ioctl(co_monitor_t *cmon, co_monitor_ioctl_block_qos_t *params)
+{
+	co_block_dev_t *dev;
+
+	if (params->unit >= CO_MODULE_MAX_COBD)
+		return CO_RC(INVALID_PARAMETER);
+
+	dev = cmon->block_devs[params->unit];
+	if (!dev || !dev->conf)
+		return CO_RC(NOT_FOUND);
+
+	if (params->set) {
+		if (params->qos.burst > CO_BLOCK_QOS_BURST_MAX)
+			return CO_RC(INVALID_PARAMETER);
+
+		/* Words are stored whole, the monitor thread reads them as it goes */
+		dev->conf->qos.burst = params->qos.burst;
+		dev->conf->qos.iops = params->qos.iops;
+		dev->conf->qos.kbps = params->qos.kbps;
+	}
+
+	params->qos = dev->conf->qos;
+	params->queued = dev->qos.count;
+	params->delayed = dev->qos.delayed;
+
+	return CO_RC(OK);
+}
@@ -0,0 +1,30 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __COLINUX_KERNEL_BLOCK_QOS_H__
+#define __COLINUX_KERNEL_BLOCK_QOS_H__
+
+/*
+ * IOPS and bandwidth limits of cobd devices. A request over the budget
+ * is answered as asynchronous and waits in its device; the monitor
+ * passes it to the backend from co_block_qos_dispatch() once the budget
+ * refilled, and completes it like any asynchronous request.
+ */
+
+#include <colinux/common/ioctl.h>
+
+#include "block.h"
+
+struct co_monitor;
+
+extern bool_t co_block_qos_defer(struct co_monitor *cmon, co_block_dev_t *dev,
+				 co_block_request_t *request, co_timestamp_t *submit);
+extern void co_block_qos_dispatch(struct co_monitor *cmon);
+extern co_rc_t co_block_qos_ioctl(struct co_monitor *cmon,
+				  co_monitor_ioctl_block_qos_t *params);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+
+#include "monitor.h"
+#include "manager.h"
+#include "blocktrace.h"
+
+#define EVENT_MASK	(CO_BLOCK_TRACE_EVENTS - 1)
+
+/* x86 keeps stores in order, only the compiler must not reorder them */
+#define trace_barrier()	__asm__ __volatile__("" : : : "memory")
+
+/*
+ * Add the event of a request about to go to the backend. Returns its
+ * sequence, for co_block_trace_complete().
+ */
+unsigned long co_block_trace_request(co_monitor_t *cmon, co_block_dev_t *dev,
+				     co_block_request_t *request, co_timestamp_t *submit)
+{
+	co_block_trace_t *trace = cmon->block_trace;
+	co_block_trace_event_t *event;
+	unsigned long seq;
+
+	if (!trace || !trace->enabled)
+		return CO_BLOCK_TRACE_NO_EVENT;
+
+	co_os_mutex_acquire(trace->lock);
+
+	seq = trace->head++;
+	if (!trace->read[seq & EVENT_MASK])
+		trace->lost++;
+	trace->read[seq & EVENT_MASK] = 0;
+
+	event = &trace->events[seq & EVENT_MASK];
+	event->submit = submit->quad;
+	event->complete = 0;
+	event->offset = request->offset;
+	event->size = (unsigned long)request->size;
+	event->unit = dev->unit;
+	event->type = request->type;
+	event->error = 0;
+
+	co_os_mutex_release(trace->lock);
+
+	return seq;
+}
+
+void co_block_trace_complete(co_monitor_t *cmon, unsigned long seq, bool_t uptodate)
+{
+	co_block_trace_t *trace = cmon->block_trace;
+	co_block_trace_event_t *event;
+	co_timestamp_t now;
+
+	if (!trace || seq == CO_BLOCK_TRACE_NO_EVENT)
+		return;
+
+	co_os_get_timestamp(&now);
+	co_os_mutex_acquire(trace->lock);
+
+	/* Unless a newer one took its place already */
+	if (trace->head - seq <= CO_BLOCK_TRACE_EVENTS) {
+		event = &trace->events[seq & EVENT_MASK];
+		event->error = !uptodate;
+		event->complete = now.quad;
+	}
+
+	co_os_mutex_release(trace->lock);
+}
+
+static co_rc_t trace_start(co_monitor_t *cmon, co_monitor_ioctl_block_trace_t *params)
+{
+	co_block_trace_t *trace;
+	co_rc_t rc = CO_RC(OK);
+
+	co_os_mutex_acquire(cmon->manager->lock);
+
+	trace = cmon->block_trace;
+	if (!trace) {
+		trace = co_os_malloc(sizeof(*trace));
+		if (!trace) {
+			rc = CO_RC(OUT_OF_MEMORY);
+			goto out;
+		}
+		co_memset(trace, 0, sizeof(*trace));
+
+		rc = co_os_mutex_create(&trace->lock);
+		if (!CO_OK(rc)) {
+			co_os_free(trace);
+			goto out;
+		}
+
+		trace->events = co_os_malloc(CO_BLOCK_TRACE_EVENTS * sizeof(co_block_trace_event_t));
+		if (!trace->events) {
+			co_os_mutex_destroy(trace->lock);
+			co_os_free(trace);
+			rc = CO_RC(OUT_OF_MEMORY);
+			goto out;
+		}
+		co_memset(trace->events, 0, CO_BLOCK_TRACE_EVENTS * sizeof(co_block_trace_event_t));
+
+		trace->read = co_os_malloc(CO_BLOCK_TRACE_EVENTS);
+		if (!trace->read) {
+			co_os_free(trace->events);
+			co_os_mutex_destroy(trace->lock);
+			co_os_free(trace);
+			rc = CO_RC(OUT_OF_MEMORY);
+			goto out;
+		}
+
+		trace_barrier();
+		cmon->block_trace = trace;
+	}
+
+	co_os_mutex_acquire(trace->lock);
+	trace->enabled = PTRUE;
+	/* Nothing from before the start is returned, or counted as lost */
+	co_memset(trace->read, 1, CO_BLOCK_TRACE_EVENTS);
+	trace->lost = 0;
+	params->cursor = trace->head;
+	co_os_mutex_release(trace->lock);
+
+out:
+	co_os_mutex_release(cmon->manager->lock);
+	return rc;
+}
+
+static co_rc_t trace_read(co_monitor_t *cmon, co_monitor_ioctl_block_trace_t *params,
+			  unsigned long max_count)
+{
+	co_block_trace_t *trace = cmon->block_trace;
+	co_block_trace_event_t *event;
+	unsigned long cursor = params->cursor;
+	unsigned long head;
+	unsigned long seq;
+
+	params->count = 0;
+	params->lost = 0;
+
+	if (!trace)
+		return CO_RC(NOT_FOUND);
+
+	co_os_mutex_acquire(trace->lock);
+
+	params->lost = trace->lost;
+	trace->lost = 0;
+
+	head = trace->head;
+	if (head - cursor > CO_BLOCK_TRACE_EVENTS)
+		cursor = head - CO_BLOCK_TRACE_EVENTS;
+
+	for (seq = cursor; seq != head && params->count < max_count; seq++) {
+		event = &trace->events[seq & EVENT_MASK];
+
+		if (trace->read[seq & EVENT_MASK])
+			continue;
+
+		/* Still in flight, a later read returns it */
+		if (event->complete == 0)
+			continue;
+
+		params->events[params->count++] = *event;
+		trace->read[seq & EVENT_MASK] = 1;
+	}
+
+	/* The cursor stays at the oldest event not returned yet */
+	while (cursor != head && trace->read[cursor & EVENT_MASK])
+		cursor++;
+
+	co_os_mutex_release(trace->lock);
+
+	params->cursor = cursor;
+	return CO_RC(OK);
+}
+
+co_rc_t co_block_trace_ioctl(co_monitor_t *cmon, co_monitor_ioctl_block_trace_t *params,
+			     unsigned long out_size, unsigned long *return_size)
+{
+	unsigned long max_count = 0;
+	co_rc_t rc;
+
+	*return_size = sizeof(*params);
+	params->freq = cmon->timestamp_freq.quad;
+
+	switch (params->op) {
+	case CO_BLOCK_TRACE_START:
+		return trace_start(cmon, params);
+
+	case CO_BLOCK_TRACE_STOP:
+		if (cmon->block_trace)
+			cmon->block_trace->enabled = PFALSE;
+		return CO_RC(OK);
+
+	case CO_BLOCK_TRACE_READ:
+		if (out_size > sizeof(*params))
+			max_count = (out_size - sizeof(*params)) / sizeof(co_block_trace_event_t);
+		if (max_count > CO_BLOCK_TRACE_READ_MAX)
+			max_count = CO_BLOCK_TRACE_READ_MAX;
+
+		rc = trace_read(cmon, params, max_count);
+		*return_size += params->count * sizeof(co_block_trace_event_t);
+		return rc;
+
+	default:
+		break;
+	}
+
+	return CO_RC(INVALID_PARAMETER);
+}
+
+void co_block_trace_free(co_monitor_t *cmon)
+{
+	co_block_trace_t *trace = cmon->block_trace;
+
+	if (!trace)
+		return;
+
+	cmon->block_trace = NULL;
+	co_os_mutex_destroy(trace->lock);
+	co_os_free(trace->read);
+	co_os_free(trace->events);
+	co_os_free(trace);
+}
@@ -0,0 +1,54 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#ifndef __COLINUX_KERNEL_BLOCK_TRACE_H__
+#define __COLINUX_KERNEL_BLOCK_TRACE_H__
+
+/*
+ * Ring of the cobd requests of a monitor, read by the user through
+ * CO_MONITOR_IOCTL_BLOCK_TRACE.
+ *
+ * The monitor thread adds an event before it passes a request to the
+ * backend, and the completion stamps it, from whichever thread or APC
+ * the backend completes on. 'lock' covers the events and the head, so
+ * the reader never sees half of an event.
+ *
+ * Requests complete out of order, so the reader returns the completed
+ * events and leaves those still in flight for a later READ. 'read'
+ * remembers which ones it returned already.
+ */
+
+#include <colinux/common/ioctl.h>
+#include <colinux/os/timer.h>
+#include <colinux/os/kernel/mutex.h>
+
+#include "block.h"
+
+struct co_monitor;
+
+/* Sequence of a request that was not traced */
+#define CO_BLOCK_TRACE_NO_EVENT	(~0UL)
+
+typedef struct co_block_trace {
+	bool_t enabled;
+	co_os_mutex_t lock;
+	unsigned long head;		/* sequence of the next event */
+	unsigned long lost;		/* overwritten before they were read */
+	co_block_trace_event_t *events;	/* CO_BLOCK_TRACE_EVENTS */
+	unsigned char *read;		/* per event, returned by a READ already */
+} co_block_trace_t;
+
+extern unsigned long co_block_trace_request(struct co_monitor *cmon, co_block_dev_t *dev,
+					    co_block_request_t *request, co_timestamp_t *submit);
+extern void co_block_trace_complete(struct co_monitor *cmon, unsigned long seq,
+				    bool_t uptodate);
+extern co_rc_t co_block_trace_ioctl(struct co_monitor *cmon,
+				    co_monitor_ioctl_block_trace_t *params,
+				    unsigned long out_size, unsigned long *return_size);
+extern void co_block_trace_free(struct co_monitor *cmon);
+
+#endif
@@ -0,0 +1,668 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/common/cow.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/alloc.h>
+#include <colinux/arch/mmu.h>
+
+#include "monitor.h"
+#include "transfer.h"
+#include "fileblock.h"
+
+/*
+ * The base image and the overlay are opened as two plain file devices
+ * with the synchronous operations of the host, so the requests of a
+ * copy-on-write device always complete right away. A base that is an
+ * overlay itself is opened as a read-only copy-on-write device in turn.
+ */
+
+#define CO_COW_CLUSTER_SIZE	(1UL << CO_COW_CLUSTER_SHIFT)
+#define CO_COW_CLUSTER_PAGES	(CO_COW_CLUSTER_SIZE >> CO_ARCH_PAGE_SHIFT)
+#define CO_COW_L2_SHIFT		10
+#define CO_COW_L2_ENTRIES	(1UL << CO_COW_L2_SHIFT)
+#define CO_COW_L2_SIZE		(CO_COW_L2_ENTRIES * sizeof(unsigned long))
+
+typedef struct {
+	co_monitor_file_block_dev_t *base;	/* NULL until it is open */
+	co_monitor_file_block_dev_t overlay;
+	co_block_dev_desc_t base_conf;		/* of a base that is an overlay */
+	co_cow_header_t header;
+	unsigned long *l1;
+	unsigned long **l2;		/* L2 tables read so far, indexed like l1 */
+	unsigned long next_cluster;	/* first free cluster of the overlay */
+	unsigned char *bounce;		/* one cluster, for partial writes */
+} co_cow_block_t;
+
+static unsigned long long cluster_offset(unsigned long cluster)
+{
+	return (unsigned long long)cluster << CO_COW_CLUSTER_SHIFT;
+}
+
+static void init_child(co_monitor_file_block_dev_t *child, co_monitor_file_block_dev_t *fdev,
+		       char *pathname, bool_t read_only)
+{
+	co_memset(child, 0, sizeof(*child));
+	co_memcpy(child->pathname, pathname, sizeof(co_pathname_t));
+	child->dev.unit = fdev->dev.unit;
+	child->dev.conf = fdev->dev.conf;
+	child->op = &co_os_file_block_default_operations;
+	child->read_only = read_only;
+	child->write_through = fdev->write_through && !read_only;
+}
+
+static co_rc_t child_read_write(co_monitor_t *cmon, co_monitor_file_block_dev_t *child,
+				unsigned long long offset, vm_ptr_t address,
+				unsigned long size, bool_t read)
+{
+	co_block_request_t request;
+
+	co_memset(&request, 0, sizeof(request));
+	request.type = read ? CO_BLOCK_READ : CO_BLOCK_WRITE;
+	request.offset = offset;
+	request.size = size;
+	request.address = address;
+
+	if (read)
+		return child->op->read(cmon, &child->dev, child, &request);
+
+	return child->op->write(cmon, &child->dev, child, &request);
+}
+
+static co_rc_t overlay_io(co_cow_block_t *cow, unsigned long long offset,
+			  void *buffer, unsigned long size, bool_t read)
+{
+	return cow->overlay.op->host_read_write(&cow->overlay, offset, buffer, size, read);
+}
+
+static co_rc_t load_l2(co_cow_block_t *cow, unsigned long l1_index, unsigned long **out_l2)
+{
+	unsigned long *l2 = cow->l2[l1_index];
+	co_rc_t rc;
+
+	if (!l2) {
+		l2 = co_os_malloc(CO_COW_L2_SIZE);
+		if (!l2)
+			return CO_RC(OUT_OF_MEMORY);
+
+		if (cow->l1[l1_index]) {
+			rc = overlay_io(cow, cluster_offset(cow->l1[l1_index]), l2,
+					CO_COW_L2_SIZE, PTRUE);
+			if (!CO_OK(rc)) {
+				co_os_free(l2);
+				return rc;
+			}
+		} else
+			co_memset(l2, 0, CO_COW_L2_SIZE);
+
+		cow->l2[l1_index] = l2;
+	}
+
+	*out_l2 = l2;
+	return CO_RC(OK);
+}
+
+/* Overlay cluster holding 'cluster' of the disk, 0 if it is in the base image */
+static co_rc_t lookup(co_cow_block_t *cow, unsigned long cluster, unsigned long *out_cluster)
+{
+	unsigned long l1_index = cluster >> CO_COW_L2_SHIFT;
+	unsigned long *l2;
+	co_rc_t rc;
+
+	if (!cow->l1[l1_index]) {
+		*out_cluster = 0;
+		return CO_RC(OK);
+	}
+
+	rc = load_l2(cow, l1_index, &l2);
+	if (!CO_OK(rc))
+		return rc;
+
+	*out_cluster = l2[cluster & (CO_COW_L2_ENTRIES - 1)];
+	return CO_RC(OK);
+}
+
+/*
+ * Point 'cluster' to 'data_cluster', whose data is already written.
+ * A new L2 table is written whole before the L1 entry refers to it, so
+ * a crash in between only leaks clusters of the overlay.
+ */
+static co_rc_t set_mapping(co_cow_block_t *cow, unsigned long cluster, unsigned long data_cluster)
+{
+	unsigned long l1_index = cluster >> CO_COW_L2_SHIFT;
+	unsigned long l2_index = cluster & (CO_COW_L2_ENTRIES - 1);
+	unsigned long l2_cluster;
+	unsigned long *l2;
+	co_rc_t rc;
+
+	rc = load_l2(cow, l1_index, &l2);
+	if (!CO_OK(rc))
+		return rc;
+
+	l2[l2_index] = data_cluster;
+
+	if (cow->l1[l1_index]) {
+		rc = overlay_io(cow, cluster_offset(cow->l1[l1_index]) + l2_index * sizeof(unsigned long),
+				&l2[l2_index], sizeof(unsigned long), PFALSE);
+		if (!CO_OK(rc))
+			l2[l2_index] = 0;
+		return rc;
+	}
+
+	l2_cluster = cow->next_cluster++;
+	rc = overlay_io(cow, cluster_offset(l2_cluster), l2, CO_COW_L2_SIZE, PFALSE);
+	if (CO_OK(rc)) {
+		cow->l1[l1_index] = l2_cluster;
+		rc = overlay_io(cow, cow->header.l1_offset + l1_index * sizeof(unsigned long),
+				&cow->l1[l1_index], sizeof(unsigned long), PFALSE);
+		if (!CO_OK(rc))
+			cow->l1[l1_index] = 0;
+	}
+
+	if (!CO_OK(rc))
+		l2[l2_index] = 0;
+
+	return rc;
+}
+
+/* Write to a cluster that is still in the base image */
+static co_rc_t copy_on_write(co_monitor_t *cmon, co_cow_block_t *cow, unsigned long cluster,
+			     unsigned long skip, vm_ptr_t address, unsigned long size)
+{
+	unsigned long data_cluster = cow->next_cluster;
+	unsigned long long start = cluster_offset(cluster);
+	unsigned long base_size;
+	co_rc_t rc;
+
+	if (skip == 0 && size == CO_COW_CLUSTER_SIZE) {
+		rc = child_read_write(cmon, &cow->overlay, cluster_offset(data_cluster),
+				      address, size, PFALSE);
+	} else {
+		/* Partial write, merge it with the data of the base image */
+		base_size = CO_COW_CLUSTER_SIZE;
+		if (start + base_size > cow->header.size)
+			base_size = (unsigned long)(cow->header.size - start);
+
+		co_memset(cow->bounce + base_size, 0, CO_COW_CLUSTER_SIZE - base_size);
+		rc = cow->base->op->host_read_write(cow->base, start, cow->bounce, base_size, PTRUE);
+		if (!CO_OK(rc))
+			return rc;
+
+		rc = co_monitor_linuxvm_to_host(cmon, address, cow->bounce + skip, size);
+		if (!CO_OK(rc))
+			return rc;
+
+		rc = overlay_io(cow, cluster_offset(data_cluster), cow->bounce,
+				CO_COW_CLUSTER_SIZE, PFALSE);
+	}
+
+	if (!CO_OK(rc))
+		return rc;
+
+	cow->next_cluster++;
+	return set_mapping(cow, cluster, data_cluster);
+}
+
+static co_rc_t cow_transfer(co_monitor_t *cmon, co_cow_block_t *cow,
+			    unsigned long long offset, vm_ptr_t address,
+			    unsigned long long size, bool_t read)
+{
+	unsigned long cluster, data_cluster, next, skip, length, i;
+	co_rc_t rc;
+
+	if (offset + size > cow->header.size)
+		return CO_RC(INVALID_PARAMETER);
+
+	while (size > 0) {
+		cluster = (unsigned long)(offset >> CO_COW_CLUSTER_SHIFT);
+		skip = (unsigned long)offset & (CO_COW_CLUSTER_SIZE - 1);
+
+		rc = lookup(cow, cluster, &data_cluster);
+		if (!CO_OK(rc))
+			return rc;
+
+		length = CO_COW_CLUSTER_SIZE - skip;
+		if (length > size)
+			length = (unsigned long)size;
+
+		if (!read && !data_cluster) {
+			rc = copy_on_write(cmon, cow, cluster, skip, address, length);
+		} else {
+			/* Carry on over clusters that are contiguous in the same file */
+			for (i = 1; length < size; i++) {
+				rc = lookup(cow, cluster + i, &next);
+				if (!CO_OK(rc))
+					return rc;
+
+				if (next != (data_cluster ? data_cluster + i : 0))
+					break;
+
+				length += CO_COW_CLUSTER_SIZE;
+				if (length > size)
+					length = (unsigned long)size;
+			}
+
+			if (data_cluster)
+				rc = child_read_write(cmon, &cow->overlay,
+						      cluster_offset(data_cluster) + skip,
+						      address, length, read);
+			else
+				rc = child_read_write(cmon, cow->base, offset, address, length, PTRUE);
+		}
+
+		if (!CO_OK(rc))
+			return rc;
+
+		offset += length;
+		address += length;
+		size -= length;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t format_overlay(co_cow_block_t *cow)
+{
+	co_rc_t rc;
+
+	co_debug("cobd%d: formatting overlay %s", cow->overlay.dev.unit, cow->overlay.pathname);
+
+	/* The L1 table goes first, the header makes the overlay valid */
+	rc = overlay_io(cow, cow->header.l1_offset, cow->l1,
+			cow->header.l1_entries * sizeof(unsigned long), PFALSE);
+	if (!CO_OK(rc))
+		return rc;
+
+	return overlay_io(cow, 0, &cow->header, sizeof(cow->header), PFALSE);
+}
+
+static co_rc_t load_overlay(co_cow_block_t *cow, unsigned long long overlay_size)
+{
+	co_cow_header_t header;
+	co_rc_t rc;
+
+	rc = overlay_io(cow, 0, &header, sizeof(header), PTRUE);
+	if (!CO_OK(rc))
+		return rc;
+
+	if (header.magic != CO_COW_MAGIC ||
+	    header.version < 1 || header.version > CO_COW_VERSION ||
+	    header.cluster_shift != CO_COW_CLUSTER_SHIFT) {
+		co_debug_error("cobd%d: %s is not a coLinux overlay",
+			       cow->overlay.dev.unit, cow->overlay.pathname);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	if (header.size != cow->header.size ||
+	    header.l1_entries != cow->header.l1_entries) {
+		co_debug_error("cobd%d: base image %s changed size (%llu != %llu)",
+			       cow->overlay.dev.unit, cow->base->pathname,
+			       cow->header.size, header.size);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	/* Name the base in the header, a snapshot may stack on this overlay */
+	if (!cow->overlay.read_only &&
+	    (header.version < CO_COW_VERSION ||
+	     co_strcmp(header.base_pathname, cow->header.base_pathname) != 0)) {
+		header.version = CO_COW_VERSION;
+		co_memcpy(header.base_pathname, cow->header.base_pathname, sizeof(co_pathname_t));
+		rc = overlay_io(cow, 0, &header, sizeof(header), PFALSE);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	cow->header = header;
+	cow->next_cluster = (unsigned long)((overlay_size + CO_COW_CLUSTER_SIZE - 1)
+					    >> CO_COW_CLUSTER_SHIFT);
+
+	return overlay_io(cow, cow->header.l1_offset, cow->l1,
+			  cow->header.l1_entries * sizeof(unsigned long), PTRUE);
+}
+
+/*
+ * Open a plain image and tell whether it is an overlay. 'size' is the
+ * size of the file, 'header' is valid for overlays only.
+ */
+static co_rc_t probe_image(co_monitor_t *cmon, co_monitor_file_block_dev_t *child,
+			   co_cow_header_t *header, bool_t *overlay, unsigned long long *size)
+{
+	co_rc_t rc;
+
+	*overlay = PFALSE;
+
+	/* Sizes first, the Windows host only tells them for closed files */
+	rc = child->op->get_size(child, size);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = child->op->open(cmon, child);
+	if (!CO_OK(rc))
+		return rc;
+
+	if (*size < sizeof(*header))
+		return CO_RC(OK);
+
+	rc = child->op->host_read_write(child, 0, header, sizeof(*header), PTRUE);
+	if (!CO_OK(rc)) {
+		child->op->close(child);
+		return rc;
+	}
+
+	*overlay = (header->magic == CO_COW_MAGIC);
+	return CO_RC(OK);
+}
+
+static co_rc_t cow_open_chain(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			      unsigned long depth);
+
+static co_rc_t open_base(co_monitor_t *cmon, co_cow_block_t *cow,
+			 co_monitor_file_block_dev_t *fdev, unsigned long depth,
+			 unsigned long long *base_size)
+{
+	co_monitor_file_block_dev_t *base;
+	co_cow_header_t header;
+	bool_t overlay;
+	co_rc_t rc;
+
+	base = co_os_malloc(sizeof(*base));
+	if (!base)
+		return CO_RC(OUT_OF_MEMORY);
+
+	init_child(base, fdev, fdev->dev.conf->base_pathname, PTRUE);
+	rc = probe_image(cmon, base, &header, &overlay, base_size);
+	if (!CO_OK(rc))
+		goto out;
+
+	if (overlay) {
+		base->op->close(base);
+
+		if (header.version < 2 || depth + 1 >= CO_COW_MAX_DEPTH) {
+			co_debug_error("cobd%d: can't stack on overlay %s",
+				       fdev->dev.unit, base->pathname);
+			rc = CO_RC(INVALID_PARAMETER);
+			goto out;
+		}
+
+		co_memcpy(&cow->base_conf, fdev->dev.conf, sizeof(cow->base_conf));
+		co_memcpy(cow->base_conf.base_pathname, header.base_pathname, sizeof(co_pathname_t));
+		base->dev.conf = &cow->base_conf;
+		base->op = &co_monitor_cow_block_operations;
+
+		rc = cow_open_chain(cmon, base, depth + 1);
+		if (!CO_OK(rc))
+			goto out;
+
+		*base_size = header.size;
+	}
+
+	cow->base = base;
+	return CO_RC(OK);
+
+out:
+	co_os_free(base);
+	return rc;
+}
+
+static void free_cow(co_cow_block_t *cow)
+{
+	unsigned long i;
+
+	if (cow->l2) {
+		for (i = 0; i < cow->header.l1_entries; i++)
+			if (cow->l2[i])
+				co_os_free(cow->l2[i]);
+		co_os_free(cow->l2);
+	}
+
+	if (cow->l1)
+		co_os_free(cow->l1);
+
+	if (cow->bounce)
+		co_os_free_pages(cow->bounce, CO_COW_CLUSTER_PAGES);
+
+	if (cow->overlay.sysdep)
+		cow->overlay.op->close(&cow->overlay);
+
+	if (cow->base) {
+		cow->base->op->close(cow->base);
+		co_os_free(cow->base);
+	}
+
+	co_os_free(cow);
+}
+
+static co_rc_t cow_open_chain(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			      unsigned long depth)
+{
+	unsigned long long base_size, overlay_size;
+	unsigned long l1_size;
+	co_cow_block_t *cow;
+	co_rc_t rc;
+
+	cow = co_os_malloc(sizeof(*cow));
+	if (!cow)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(cow, 0, sizeof(*cow));
+
+	init_child(&cow->overlay, fdev, fdev->pathname, fdev->read_only);
+
+	/* Sizes first, the Windows host only tells them for closed files */
+	rc = cow->overlay.op->get_size(&cow->overlay, &overlay_size);
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = open_base(cmon, cow, fdev, depth, &base_size);
+	if (!CO_OK(rc))
+		goto out;
+
+	if (base_size == 0) {
+		rc = CO_RC(INVALID_PARAMETER);
+		goto out;
+	}
+
+	cow->header.magic = CO_COW_MAGIC;
+	cow->header.version = CO_COW_VERSION;
+	cow->header.cluster_shift = CO_COW_CLUSTER_SHIFT;
+	cow->header.size = base_size;
+	cow->header.l1_entries = (unsigned long)((base_size + cluster_offset(CO_COW_L2_ENTRIES) - 1)
+						 >> (CO_COW_CLUSTER_SHIFT + CO_COW_L2_SHIFT));
+	cow->header.l1_offset = CO_COW_CLUSTER_SIZE;
+	co_memcpy(cow->header.base_pathname, fdev->dev.conf->base_pathname, sizeof(co_pathname_t));
+
+	l1_size = cow->header.l1_entries * sizeof(unsigned long);
+	cow->l1 = co_os_malloc(l1_size);
+	cow->l2 = co_os_malloc(cow->header.l1_entries * sizeof(unsigned long *));
+	cow->bounce = co_os_alloc_pages(CO_COW_CLUSTER_PAGES);
+	if (!cow->l1 || !cow->l2 || !cow->bounce) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+	co_memset(cow->l1, 0, l1_size);
+	co_memset(cow->l2, 0, cow->header.l1_entries * sizeof(unsigned long *));
+
+	rc = cow->overlay.op->open(cmon, &cow->overlay);
+	if (!CO_OK(rc))
+		goto out;
+
+	if (overlay_size == 0 && fdev->read_only) {
+		rc = CO_RC(INVALID_PARAMETER);
+		goto out;
+	} else if (overlay_size == 0) {
+		cow->next_cluster = 1 + (unsigned long)((l1_size + CO_COW_CLUSTER_SIZE - 1)
+							>> CO_COW_CLUSTER_SHIFT);
+		rc = format_overlay(cow);
+	} else
+		rc = load_overlay(cow, overlay_size);
+
+	if (!CO_OK(rc))
+		goto out;
+
+	fdev->backend = cow;
+	return CO_RC(OK);
+
+out:
+	free_cow(cow);
+	return rc;
+}
+
+static co_rc_t cow_open(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev)
+{
+	return cow_open_chain(cmon, fdev, 0);
+}
+
+static co_rc_t cow_close(co_monitor_file_block_dev_t *fdev)
+{
+	free_cow((co_cow_block_t *)fdev->backend);
+	fdev->backend = NULL;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t cow_flush(co_monitor_file_block_dev_t *fdev)
+{
+	co_cow_block_t *cow = fdev->backend;
+
+	/* The base image is never written */
+	return cow->overlay.op->flush(&cow->overlay);
+}
+
+/* Size of the disk in an image or an overlay, 0 for an empty file */
+static co_rc_t disk_size(co_monitor_file_block_dev_t *fdev, char *pathname,
+			 unsigned long long *size)
+{
+	co_monitor_file_block_dev_t *child;
+	co_cow_header_t header;
+	bool_t overlay;
+	co_rc_t rc;
+
+	child = co_os_malloc(sizeof(*child));
+	if (!child)
+		return CO_RC(OUT_OF_MEMORY);
+
+	init_child(child, fdev, pathname, PTRUE);
+	rc = probe_image(NULL, child, &header, &overlay, size);
+	if (CO_OK(rc)) {
+		child->op->close(child);
+		if (overlay)
+			*size = header.size;
+	}
+	co_os_free(child);
+
+	return rc;
+}
+
+static co_rc_t cow_get_size(co_monitor_file_block_dev_t *fdev, unsigned long long *size)
+{
+	co_rc_t rc;
+
+	/* The overlay is formatted on the first open, until then the base tells */
+	rc = disk_size(fdev, fdev->pathname, size);
+	if (CO_OK(rc) && *size == 0)
+		rc = disk_size(fdev, fdev->dev.conf->base_pathname, size);
+
+	return rc;
+}
+
+/* Reads into a host buffer, for the overlays stacked on this one */
+static co_rc_t cow_host_read_write(co_monitor_file_block_dev_t *fdev, unsigned long long offset,
+				   void *buffer, unsigned long size, bool_t read)
+{
+	co_cow_block_t *cow = fdev->backend;
+	unsigned long cluster, data_cluster, skip, length;
+	co_rc_t rc;
+
+	if (!read || offset + size > cow->header.size)
+		return CO_RC(INVALID_PARAMETER);
+
+	while (size > 0) {
+		cluster = (unsigned long)(offset >> CO_COW_CLUSTER_SHIFT);
+		skip = (unsigned long)offset & (CO_COW_CLUSTER_SIZE - 1);
+
+		rc = lookup(cow, cluster, &data_cluster);
+		if (!CO_OK(rc))
+			return rc;
+
+		length = CO_COW_CLUSTER_SIZE - skip;
+		if (length > size)
+			length = size;
+
+		if (data_cluster)
+			rc = overlay_io(cow, cluster_offset(data_cluster) + skip, buffer, length, PTRUE);
+		else
+			rc = cow->base->op->host_read_write(cow->base, offset, buffer, length, PTRUE);
+		if (!CO_OK(rc))
+			return rc;
+
+		offset += length;
+		buffer = (unsigned char *)buffer + length;
+		size -= length;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t cow_read(co_monitor_t *cmon, co_block_dev_t *dev,
+			co_monitor_file_block_dev_t *fdev, co_block_request_t *request)
+{
+	return cow_transfer(cmon, fdev->backend, request->offset, request->address,
+			    request->size, PTRUE);
+}
+
+static co_rc_t cow_write(co_monitor_t *cmon, co_block_dev_t *dev,
+			 co_monitor_file_block_dev_t *fdev, co_block_request_t *request)
+{
+	return cow_transfer(cmon, fdev->backend, request->offset, request->address,
+			    request->size, PFALSE);
+}
+
+static co_rc_t cow_vector(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			  co_block_request_t *request, co_block_segment_t *segments,
+			  bool_t read)
+{
+	unsigned long long offset = request->offset;
+	unsigned long i;
+	co_rc_t rc;
+
+	for (i = 0; i < request->nr_segments; i++) {
+		rc = cow_transfer(cmon, fdev->backend, offset, segments[i].address,
+				  segments[i].size, read);
+		if (!CO_OK(rc))
+			return rc;
+
+		offset += segments[i].size;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t cow_readv(co_monitor_t *cmon, co_block_dev_t *dev,
+			 co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			 co_block_segment_t *segments)
+{
+	return cow_vector(cmon, fdev, request, segments, PTRUE);
+}
+
+static co_rc_t cow_writev(co_monitor_t *cmon, co_block_dev_t *dev,
+			  co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			  co_block_segment_t *segments)
+{
+	return cow_vector(cmon, fdev, request, segments, PFALSE);
+}
+
+co_monitor_file_block_operations_t co_monitor_cow_block_operations = {
+	.open = cow_open,
+	.close = cow_close,
+	.read = cow_read,
+	.write = cow_write,
+	.get_size = cow_get_size,
+	.readv = cow_readv,
+	.writev = cow_writev,
+	.host_read_write = cow_host_read_write,
+	.flush = cow_flush,
+};
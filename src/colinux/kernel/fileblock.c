@@ -9,14 +9,291 @@
 
 #include <colinux/os/current/memory.h>
 
+#include <colinux/arch/mmu.h>
+
 #include "fileblock.h"
 #include "monitor.h"
+#include "transfer.h"
+
+static co_rc_t get_segments(co_monitor_t *cmon,
+			    co_monitor_file_block_dev_t *fdev,
+			    co_block_request_t *request)
+{
+	unsigned long long size = 0;
+	unsigned long i;
+	co_rc_t rc;
+
+	if (request->nr_segments == 0 || request->nr_segments > CO_BLOCK_MAX_SEGMENTS) {
+		co_debug_error("monitor: cobd bad segment count %ld", request->nr_segments);
+		return CO_RC(ERROR);
+	}
+
+	rc = co_monitor_linuxvm_to_host(cmon, request->address, fdev->segments,
+					request->nr_segments * sizeof(co_block_segment_t));
+	if (!CO_OK(rc))
+		return rc;
+
+	for (i = 0; i < request->nr_segments; i++)
+		size += fdev->segments[i].size;
+
+	if (size != request->size) {
+		co_debug_error("monitor: cobd segments size mismatch (%llu != %llu)",
+			       size, request->size);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static void readahead_drop(co_monitor_file_block_dev_t *fdev,
+			   unsigned long long offset, unsigned long long size)
+{
+	co_monitor_file_block_readahead_t *ra = &fdev->readahead;
+
+	if (ra->size && offset < ra->start + ra->size && offset + size > ra->start)
+		ra->size = 0;
+}
+
+static co_rc_t copy_to_segments(co_monitor_t *cmon, unsigned char *data,
+				co_block_segment_t *segments, unsigned long nr_segments)
+{
+	unsigned long i;
+	co_rc_t rc;
+
+	for (i = 0; i < nr_segments; i++) {
+		rc = co_monitor_host_to_linuxvm(cmon, data, segments[i].address, segments[i].size);
+		if (!CO_OK(rc))
+			return rc;
+		data += segments[i].size;
+	}
+
+	return CO_RC(OK);
+}
+
+/*
+ * Serve a read from the read ahead buffer. A read that continues the
+ * stream beyond the buffer refills it with one larger read first.
+ * Returns PFALSE if the backend has to do the read.
+ */
+static bool_t readahead_read(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			     unsigned long long offset, unsigned long long size,
+			     co_block_segment_t *segments, unsigned long nr_segments)
+{
+	co_monitor_file_block_readahead_t *ra = &fdev->readahead;
+	unsigned long long end = offset + size;
+	unsigned long length;
+	bool_t sequential;
+
+	sequential = (offset == ra->next);
+	ra->next = end;
+
+	if (ra->size && offset >= ra->start && end <= ra->start + ra->size) {
+		if (!CO_OK(copy_to_segments(cmon, ra->buffer + (unsigned long)(offset - ra->start),
+					    segments, nr_segments)))
+			return PFALSE;
+		ra->hits++;
+		return PTRUE;
+	}
+
+	if (!sequential) {
+		ra->window = CO_MONITOR_FILE_BLOCK_READAHEAD_MIN;
+		if (ra->window > ra->max_size)
+			ra->window = ra->max_size;
+		return PFALSE;
+	}
+
+	if (size > ra->max_size || end > fdev->dev.size)
+		return PFALSE;
+
+	length = ra->window;
+	if (length < size)
+		length = (unsigned long)size;
+	if (offset + length > fdev->dev.size)
+		length = (unsigned long)(fdev->dev.size - offset);
+
+	ra->size = 0;
+	if (!CO_OK(fdev->op->host_read_write(fdev, offset, ra->buffer, length, PTRUE)))
+		return PFALSE;
+
+	ra->start = offset;
+	ra->size = length;
+	ra->reads++;
+
+	ra->window <<= 1;
+	if (ra->window > ra->max_size)
+		ra->window = ra->max_size;
+
+	return CO_OK(copy_to_segments(cmon, ra->buffer, segments, nr_segments));
+}
+
+static co_rc_t read_single(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			   co_block_request_t *request)
+{
+	co_block_segment_t segment;
+
+	if (fdev->readahead.buffer) {
+		segment.address = request->address;
+		segment.size = (unsigned long)request->size;
+		if (readahead_read(cmon, fdev, request->offset, request->size, &segment, 1))
+			return CO_RC(OK);
+	}
+
+	return fdev->op->read(cmon, &fdev->dev, fdev, request);
+}
+
+static co_rc_t read_vector(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			   co_block_request_t *request)
+{
+	if (fdev->readahead.buffer &&
+	    readahead_read(cmon, fdev, request->offset, request->size,
+			   fdev->segments, request->nr_segments))
+		return CO_RC(OK);
+
+	return fdev->op->readv(cmon, &fdev->dev, fdev, request, fdev->segments);
+}
+
+/*
+ * Reads consult the cache first. On a miss the data is inserted once the
+ * backend has delivered it, right away for synchronous requests or from
+ * co_monitor_file_block_complete() for asynchronous ones. Writes
+ * invalidate what they cover before they are issued.
+ */
+static co_rc_t cached_read(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			   co_block_request_t *request)
+{
+	co_monitor_file_block_pending_t *pending = &fdev->pending[request->tag];
+	co_rc_t rc;
+
+	pending->segments[0].address = request->address;
+	pending->segments[0].size = (unsigned long)request->size;
+	pending->nr_segments = 1;
+
+	if (co_block_cache_read(cmon, fdev->cache, request->offset, pending->segments, 1))
+		return CO_RC(OK);
+
+	/* Armed before the I/O is issued, the completion may come first */
+	pending->offset = request->offset;
+	pending->generation = fdev->cache->generation;
+	pending->valid = PTRUE;
+
+	rc = read_single(cmon, fdev, request);
+	if (CO_OK(rc) && request->async)
+		return rc;
+
+	pending->valid = PFALSE;
+	if (CO_OK(rc))
+		co_block_cache_fill(cmon, fdev->cache, pending->generation,
+				    request->offset, pending->segments, 1);
+
+	return rc;
+}
+
+static co_rc_t cached_readv(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+			    co_block_request_t *request)
+{
+	co_monitor_file_block_pending_t *pending = &fdev->pending[request->tag];
+	co_rc_t rc;
+
+	if (co_block_cache_read(cmon, fdev->cache, request->offset,
+				fdev->segments, request->nr_segments))
+		return CO_RC(OK);
+
+	memcpy(pending->segments, fdev->segments,
+		  request->nr_segments * sizeof(co_block_segment_t));
+	pending->nr_segments = request->nr_segments;
+	pending->offset = request->offset;
+	pending->generation = fdev->cache->generation;
+	pending->valid = PTRUE;
+
+	rc = read_vector(cmon, fdev, request);
+	if (CO_OK(rc) && request->async)
+		return rc;
+
+	pending->valid = PFALSE;
+	if (CO_OK(rc))
+		co_block_cache_fill(cmon, fdev->cache, pending->generation, request->offset,
+				    pending->segments, pending->nr_segments);
+
+	return rc;
+}
+
+static void co_monitor_file_block_complete(co_monitor_t *cmon, co_block_dev_t *dev,
+					   unsigned long tag, bool_t uptodate)
+{
+	co_monitor_file_block_dev_t *fdev = (co_monitor_file_block_dev_t *)dev;
+	co_monitor_file_block_pending_t *pending = &fdev->pending[tag];
+
+	if (!pending->valid)
+		return;
+
+	pending->valid = PFALSE;
+	if (!uptodate)
+		return;
+
+	co_block_cache_fill(cmon, fdev->cache, pending->generation, pending->offset,
+			    pending->segments, pending->nr_segments);
+}
+
+static bool_t is_zero(co_monitor_t *cmon, vm_ptr_t address, unsigned long size)
+{
+	unsigned char *start, *page;
+	unsigned long one_copy, i;
+	co_pfn_t pfn;
+	bool_t zero = PTRUE;
+
+	while (size > 0 && zero) {
+		one_copy = ((address + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - address;
+		if (one_copy > size)
+			one_copy = size;
+
+		if (!CO_OK(co_monitor_host_linuxvm_transfer_map(cmon, address, one_copy,
+								&start, &page, &pfn)))
+			return PFALSE;
+
+		for (i = 0; i < one_copy; i++)
+			if (start[i]) {
+				zero = PFALSE;
+				break;
+			}
+
+		co_monitor_host_linuxvm_transfer_unmap(cmon, page, pfn);
+
+		address += one_copy;
+		size -= one_copy;
+	}
+
+	return zero;
+}
+
+/*
+ * Writes of whole zero pages to sparse devices free the storage instead.
+ * Returns PFALSE if the write still has to be done.
+ */
+static bool_t discard_zero_write(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev,
+				 co_block_request_t *request, co_block_segment_t *segments,
+				 unsigned long nr_segments)
+{
+	unsigned long i;
+
+	if (!fdev->dev.conf->sparse || !fdev->op->discard || fdev->read_only)
+		return PFALSE;
+
+	if ((request->offset | request->size) & ~CO_ARCH_PAGE_MASK)
+		return PFALSE;
+
+	for (i = 0; i < nr_segments; i++)
+		if (!is_zero(cmon, segments[i].address, segments[i].size))
+			return PFALSE;
+
+	return CO_OK(fdev->op->discard(fdev, request->offset, request->size));
+}
 
 static co_rc_t co_monitor_file_block_service(co_monitor_t *cmon,
 				      co_block_dev_t *dev,
 				      co_block_request_t *request)
 {
 	co_monitor_file_block_dev_t *fdev = (co_monitor_file_block_dev_t *)dev;
+	co_block_segment_t segment;
 	co_rc_t rc = CO_RC_ERROR;
 
 	switch (request->type) {
@@ -28,6 +305,11 @@ static co_rc_t co_monitor_file_block_service(co_monitor_t *cmon,
 
 		co_debug("monitor: cobd opened (%s)", fdev->pathname);
 
+		/* The image may have changed while nobody had it open */
+		if (fdev->cache)
+			co_block_cache_flush(fdev->cache);
+		fdev->readahead.size = 0;
+
 		rc = fdev->op->open(cmon, fdev);
 		if (CO_OK(rc))
 			fdev->state = CO_MONITOR_FILE_BLOCK_OPENED;
@@ -41,7 +323,10 @@ static co_rc_t co_monitor_file_block_service(co_monitor_t *cmon,
 			break;
 		}
 
-		rc = fdev->op->read(cmon, dev, fdev, request);
+		if (fdev->cache)
+			rc = cached_read(cmon, fdev, request);
+		else
+			rc = read_single(cmon, fdev, request);
 		break;
 	}
 
@@ -51,10 +336,81 @@ static co_rc_t co_monitor_file_block_service(co_monitor_t *cmon,
 			break;
 		}
 
+		if (fdev->cache)
+			co_block_cache_invalidate(fdev->cache, request->offset, request->size);
+		readahead_drop(fdev, request->offset, request->size);
+
+		segment.address = request->address;
+		segment.size = (unsigned long)request->size;
+		if (discard_zero_write(cmon, fdev, request, &segment, 1)) {
+			rc = CO_RC(OK);
+			break;
+		}
+
 		rc = fdev->op->write(cmon, dev, fdev, request);
 		break;
 	}
 
+	case CO_BLOCK_READV:
+	case CO_BLOCK_WRITEV: {
+		if (fdev->state != CO_MONITOR_FILE_BLOCK_OPENED) {
+			co_debug_error("monitor: readv/writev: cobd not open!");
+			break;
+		}
+
+		rc = get_segments(cmon, fdev, request);
+		if (!CO_OK(rc))
+			break;
+
+		if (request->type == CO_BLOCK_READV) {
+			if (fdev->cache)
+				rc = cached_readv(cmon, fdev, request);
+			else
+				rc = read_vector(cmon, fdev, request);
+		} else {
+			if (fdev->cache)
+				co_block_cache_invalidate(fdev->cache, request->offset, request->size);
+			readahead_drop(fdev, request->offset, request->size);
+			if (discard_zero_write(cmon, fdev, request, fdev->segments, request->nr_segments))
+				rc = CO_RC(OK);
+			else
+				rc = fdev->op->writev(cmon, dev, fdev, request, fdev->segments);
+		}
+		break;
+	}
+
+	case CO_BLOCK_DISCARD: {
+		if (fdev->state != CO_MONITOR_FILE_BLOCK_OPENED) {
+			co_debug_error("monitor: discard: cobd not open!");
+			break;
+		}
+
+		if (fdev->cache)
+			co_block_cache_invalidate(fdev->cache, request->offset, request->size);
+		readahead_drop(fdev, request->offset, request->size);
+
+		/* Only a hint, Linux does not rely on the storage being freed */
+		rc = CO_RC(OK);
+		if (fdev->op->discard && !fdev->read_only &&
+		    !CO_OK(fdev->op->discard(fdev, request->offset, request->size)))
+			co_debug("monitor: cobd%d discard of %llu bytes at %llu ignored",
+				 dev->unit, request->size, request->offset);
+		break;
+	}
+
+	case CO_BLOCK_FLUSH: {
+		if (fdev->state != CO_MONITOR_FILE_BLOCK_OPENED) {
+			co_debug_error("monitor: flush: cobd not open!");
+			break;
+		}
+
+		rc = CO_RC(OK);
+		if (fdev->op->flush && !fdev->read_only &&
+		    fdev->dev.conf->cache_mode == CO_BLOCK_DEV_CACHE_WRITEBACK)
+			rc = fdev->op->flush(fdev);
+		break;
+	}
+
 	case CO_BLOCK_CLOSE: {
 		if (fdev->state != CO_MONITOR_FILE_BLOCK_OPENED) {
 			co_debug_error("monitor: close: cobd not open!");
@@ -94,18 +450,61 @@ static co_rc_t co_monitor_file_block_service(co_monitor_t *cmon,
 
 co_rc_t co_monitor_file_block_init(struct co_monitor *cmon,
 				   co_monitor_file_block_dev_t *dev,
-				   co_pathname_t *pathname)
+				   co_block_dev_desc_t *conf)
 {
+	co_rc_t rc;
+
 	memset(dev, 0, sizeof(*dev));
-	memcpy(dev->pathname, pathname, sizeof(*pathname));
+	memcpy(dev->pathname, conf->pathname, sizeof(conf->pathname));
+	dev->dev.conf = conf;
+	dev->write_through = (conf->cache_mode == CO_BLOCK_DEV_CACHE_WRITETHROUGH);
+	dev->direct = conf->direct;
+
+	if (conf->cache_size) {
+		rc = co_block_cache_create(conf->cache_size, &dev->cache);
+		if (!CO_OK(rc))
+			return rc;
+
+		dev->pending = co_os_malloc(sizeof(*dev->pending) * CO_BLOCK_MAX_INFLIGHT);
+		if (!dev->pending) {
+			co_block_cache_destroy(dev->cache);
+			dev->cache = NULL;
+			return CO_RC(OUT_OF_MEMORY);
+		}
+		memset(dev->pending, 0, sizeof(*dev->pending) * CO_BLOCK_MAX_INFLIGHT);
+		dev->dev.complete = co_monitor_file_block_complete;
+	}
 
-	if (cmon->config.cobd_async_enable)
+	if (conf->format == CO_BLOCK_DEV_FORMAT_NBD)
+		dev->op = &co_monitor_nbd_block_operations;
+	else if (conf->base_pathname[0])
+		dev->op = &co_monitor_cow_block_operations;
+	else if (conf->format == CO_BLOCK_DEV_FORMAT_COMPRESSED)
+		dev->op = &co_monitor_zblock_operations;
+	else if (conf->mapped && !conf->direct)
+		dev->op = &co_os_file_block_mapped_operations;
+	else if (cmon->config.cobd_async_enable)
 		dev->op = &co_os_file_block_async_operations;
 	else
 		dev->op = &co_os_file_block_default_operations;
 	dev->state = CO_MONITOR_FILE_BLOCK_CLOSED;
 	dev->dev.service = co_monitor_file_block_service;
 
+	/* Only the synchronous backend reads into host buffers */
+	if (conf->readahead && dev->op->host_read_write) {
+		co_monitor_file_block_readahead_t *ra = &dev->readahead;
+
+		ra->max_size = conf->readahead << 10;
+		if (ra->max_size > CO_MONITOR_FILE_BLOCK_READAHEAD_MAX)
+			ra->max_size = CO_MONITOR_FILE_BLOCK_READAHEAD_MAX;
+		ra->max_size &= CO_ARCH_PAGE_MASK;
+
+		if (ra->max_size)
+			ra->buffer = co_os_alloc_pages(ra->max_size >> CO_ARCH_PAGE_SHIFT);
+		if (!ra->buffer)
+			co_debug("monitor: cobd%d readahead disabled", dev->dev.unit);
+	}
+
 	return CO_RC(OK);
 }
 
@@ -115,4 +514,170 @@ void co_monitor_file_block_shutdown(co_monitor_file_block_dev_t *dev)
 		dev->op->close(dev);
 		dev->state = CO_MONITOR_FILE_BLOCK_CLOSED;
 	}
+
+	if (dev->cache) {
+		co_debug("monitor: cobd%d cache: %llu hits, %llu misses, %llu evictions",
+			 dev->dev.unit, dev->cache->stats.hits, dev->cache->stats.misses,
+			 dev->cache->stats.evictions);
+		co_block_cache_destroy(dev->cache);
+		dev->cache = NULL;
+		co_os_free(dev->pending);
+		dev->pending = NULL;
+	}
+
+	if (dev->readahead.buffer) {
+		co_debug("monitor: cobd%d readahead: %llu reads, %llu hits",
+			 dev->dev.unit, dev->readahead.reads, dev->readahead.hits);
+		co_os_free_pages(dev->readahead.buffer, dev->readahead.max_size >> CO_ARCH_PAGE_SHIFT);
+		dev->readahead.buffer = NULL;
+	}
+}
+
+co_rc_t co_monitor_file_block_get_stats(co_monitor_file_block_dev_t *dev,
+					co_monitor_ioctl_get_block_stats_t *params)
+{
+	memset(&params->cache, 0, sizeof(params->cache));
+
+	if (dev->cache) {
+		co_os_mutex_acquire(dev->cache->mutex);
+		params->cache = dev->cache->stats;
+		co_os_mutex_release(dev->cache->mutex);
+	}
+
+	return CO_RC(OK);
+}
+
+/*
+ * Snapshots hand the device to the copy-on-write backend, which works
+ * synchronously through host buffers. It can't take over the requests
+ * of the asynchronous or mapped backends, nor NBD and compressed images.
+ */
+static co_rc_t can_snapshot(co_monitor_file_block_dev_t *fdev)
+{
+	co_block_dev_desc_t *conf = fdev->dev.conf;
+
+	if (fdev->op == &co_os_file_block_async_operations ||
+	    fdev->op == &co_os_file_block_mapped_operations) {
+		co_debug_error("monitor: cobd%d is served asynchronously or mapped, no snapshot",
+			       fdev->dev.unit);
+		return CO_RC(NOT_SUPPORTED);
+	}
+
+	if (conf->format != CO_BLOCK_DEV_FORMAT_RAW || fdev->read_only) {
+		co_debug_error("monitor: cobd%d can't be snapshotted", fdev->dev.unit);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_monitor_file_block_snapshot_ioctl(struct co_monitor *cmon,
+					     co_monitor_ioctl_block_snapshot_t *params)
+{
+	co_monitor_file_block_dev_t *fdev;
+	co_block_dev_t *dev;
+	co_rc_t rc;
+
+	if (params->unit >= CO_MODULE_MAX_COBD)
+		return CO_RC(INVALID_PARAMETER);
+
+	dev = cmon->block_devs[params->unit];
+	if (!dev || !dev->conf || dev->service != co_monitor_file_block_service)
+		return CO_RC(NOT_FOUND);
+
+	fdev = (co_monitor_file_block_dev_t *)dev;
+
+	if (!params->query) {
+		if (fdev->snapshot.state == CO_BLOCK_SNAPSHOT_PENDING)
+			return CO_RC(BUSY);
+
+		rc = can_snapshot(fdev);
+		if (!CO_OK(rc))
+			return rc;
+
+		params->delta[sizeof(params->delta) - 1] = '\0';
+		memcpy(fdev->snapshot.delta, params->delta, sizeof(params->delta));
+		fdev->snapshot.state = CO_BLOCK_SNAPSHOT_PENDING;
+		cmon->block_snapshot_pending = PTRUE;
+	}
+
+	params->state = fdev->snapshot.state;
+	memcpy(params->snapshot, fdev->snapshot.frozen, sizeof(params->snapshot));
+
+	return CO_RC(OK);
+}
+
+/*
+ * Freeze the current image and stack the delta on it. Only the names
+ * change hands, the data stays where it is. The copy-on-write backend
+ * serves the device from then on, with the frozen image as its base.
+ */
+static co_rc_t take_snapshot(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev)
+{
+	co_block_dev_desc_t *conf = fdev->dev.conf;
+	co_monitor_file_block_operations_t *op = fdev->op;
+	co_pathname_t base_pathname;
+	bool_t opened;
+	co_rc_t rc;
+
+	rc = can_snapshot(fdev);
+	if (!CO_OK(rc))
+		return rc;
+
+	opened = (fdev->state == CO_MONITOR_FILE_BLOCK_OPENED);
+	if (opened)
+		fdev->op->close(fdev);
+
+	memcpy(base_pathname, conf->base_pathname, sizeof(base_pathname));
+	memcpy(conf->base_pathname, fdev->pathname, sizeof(fdev->pathname));
+	memcpy(fdev->pathname, fdev->snapshot.delta, sizeof(fdev->pathname));
+	fdev->op = &co_monitor_cow_block_operations;
+
+	rc = CO_RC(OK);
+	if (opened)
+		rc = fdev->op->open(cmon, fdev);
+
+	if (!CO_OK(rc)) {
+		memcpy(fdev->pathname, conf->base_pathname, sizeof(fdev->pathname));
+		memcpy(conf->base_pathname, base_pathname, sizeof(base_pathname));
+		fdev->op = op;
+		if (opened && !CO_OK(fdev->op->open(cmon, fdev))) {
+			co_debug_error("monitor: cobd%d lost after a failed snapshot", fdev->dev.unit);
+			fdev->state = CO_MONITOR_FILE_BLOCK_CLOSED;
+		}
+		return rc;
+	}
+
+	memcpy(conf->pathname, fdev->pathname, sizeof(conf->pathname));
+	memcpy(fdev->snapshot.frozen, conf->base_pathname, sizeof(fdev->snapshot.frozen));
+	fdev->readahead.size = 0;
+
+	co_debug("monitor: cobd%d snapshot %s, writes go to %s",
+		 fdev->dev.unit, fdev->snapshot.frozen, fdev->pathname);
+
+	return CO_RC(OK);
+}
+
+void co_monitor_file_block_snapshot_run(struct co_monitor *cmon)
+{
+	co_monitor_file_block_dev_t *fdev;
+	co_block_dev_t *dev;
+	unsigned int unit;
+
+	cmon->block_snapshot_pending = PFALSE;
+
+	for (unit = 0; unit < CO_MODULE_MAX_COBD; unit++) {
+		dev = cmon->block_devs[unit];
+		if (!dev || dev->service != co_monitor_file_block_service)
+			continue;
+
+		fdev = (co_monitor_file_block_dev_t *)dev;
+		if (fdev->snapshot.state != CO_BLOCK_SNAPSHOT_PENDING)
+			continue;
+
+		if (CO_OK(take_snapshot(cmon, fdev)))
+			fdev->snapshot.state = CO_BLOCK_SNAPSHOT_DONE;
+		else
+			fdev->snapshot.state = CO_BLOCK_SNAPSHOT_FAILED;
+	}
 }
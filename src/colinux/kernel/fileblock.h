@@ -11,6 +11,7 @@
 #define __COLINUX_KERNEL_FILE_BLOCK_H__
 
 #include "block.h"
+#include "blockcache.h"
 
 typedef enum {
 	CO_MONITOR_FILE_BLOCK_CLOSED,
@@ -30,22 +31,100 @@ typedef struct {
 	co_rc_t (*write)(struct co_monitor *cmon, co_block_dev_t *dev,
 			 co_monitor_file_block_dev_t *fdev, co_block_request_t *request);
 	co_rc_t (*close)(co_monitor_file_block_dev_t *fdev);
+	co_rc_t (*readv)(struct co_monitor *cmon, co_block_dev_t *dev,
+			 co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			 co_block_segment_t *segments);
+	co_rc_t (*writev)(struct co_monitor *cmon, co_block_dev_t *dev,
+			  co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			  co_block_segment_t *segments);
+	/* Synchronous I/O to a host buffer, for the metadata of stacked backends */
+	co_rc_t (*host_read_write)(co_monitor_file_block_dev_t *fdev, unsigned long long offset,
+				   void *buffer, unsigned long size, bool_t read);
+	/* Free the storage of a range, it reads back as zeros. NULL if not possible */
+	co_rc_t (*discard)(co_monitor_file_block_dev_t *fdev, unsigned long long offset,
+			   unsigned long long size);
+	/* Write what the host caches to stable storage. NULL if nothing is cached */
+	co_rc_t (*flush)(co_monitor_file_block_dev_t *fdev);
 } co_monitor_file_block_operations_t;
 
+/*
+ * An asynchronous read, to be inserted into the cache once it completes.
+ * The segment list is a copy, the device's is reused by the next request.
+ */
+typedef struct {
+	bool_t valid;
+	unsigned long long offset;
+	unsigned long generation;
+	unsigned long nr_segments;
+	co_block_segment_t segments[CO_BLOCK_MAX_SEGMENTS];
+} co_monitor_file_block_pending_t;
+
+/*
+ * Read ahead of sequential streams. The window grows from
+ * CO_MONITOR_FILE_BLOCK_READAHEAD_MIN up to the configured size while
+ * the stream goes on, and shrinks back on a random read.
+ */
+#define CO_MONITOR_FILE_BLOCK_READAHEAD_MIN	(16*1024)
+#define CO_MONITOR_FILE_BLOCK_READAHEAD_MAX	(256*1024)
+
+typedef struct {
+	unsigned char *buffer;		/* NULL if disabled */
+	unsigned long max_size;
+	unsigned long window;		/* size of the next read ahead */
+	unsigned long long next;	/* where the stream continues */
+	unsigned long long start;	/* disk offset of the buffer */
+	unsigned long size;		/* valid bytes in the buffer */
+	unsigned long long hits;
+	unsigned long long reads;
+} co_monitor_file_block_readahead_t;
+
+/*
+ * Snapshot asked for by CO_MONITOR_IOCTL_BLOCK_SNAPSHOT. The ioctl only
+ * records it, the monitor takes it between two requests from
+ * co_monitor_file_block_snapshot_run().
+ */
+typedef struct {
+	volatile co_block_snapshot_state_t state;
+	co_pathname_t delta;		/* overlay for the writes from now on */
+	co_pathname_t frozen;		/* image that was current until then */
+} co_monitor_file_block_snapshot_t;
+
 struct co_monitor_file_block_dev {
 	co_block_dev_t dev; /* Must stay as the first field */
 
 	co_monitor_file_block_state_t state;
 	co_pathname_t pathname;
 	co_monitor_file_block_operations_t *op;
+	bool_t read_only; /* open without write access, shared with others */
+	bool_t write_through; /* open so that writes bypass the host's write cache */
+	bool_t direct; /* keep the image out of the host's file cache */
+
+	/* Segment list of the current READV/WRITEV, fetched from Linux */
+	co_block_segment_t segments[CO_BLOCK_MAX_SEGMENTS];
+
+	co_block_cache_t *cache; /* NULL if disabled */
+	co_monitor_file_block_pending_t *pending; /* per tag, with the cache */
+	co_monitor_file_block_readahead_t readahead;
+	co_monitor_file_block_snapshot_t snapshot;
 
 	struct co_os_file_block_sysdep *sysdep;
+	void *backend; /* state of other backends, such as cowblock.c or the NBD client */
 };
 
-co_rc_t co_monitor_file_block_init(struct co_monitor *cmon, co_monitor_file_block_dev_t *dev, co_pathname_t *pathname);
+co_rc_t co_monitor_file_block_init(struct co_monitor *cmon, co_monitor_file_block_dev_t *dev,
+				   co_block_dev_desc_t *conf);
 void co_monitor_file_block_shutdown(co_monitor_file_block_dev_t *dev);
+co_rc_t co_monitor_file_block_get_stats(co_monitor_file_block_dev_t *dev,
+					co_monitor_ioctl_get_block_stats_t *params);
+co_rc_t co_monitor_file_block_snapshot_ioctl(struct co_monitor *cmon,
+					     co_monitor_ioctl_block_snapshot_t *params);
+void co_monitor_file_block_snapshot_run(struct co_monitor *cmon);
 
 extern co_monitor_file_block_operations_t co_os_file_block_async_operations;
 extern co_monitor_file_block_operations_t co_os_file_block_default_operations;
+extern co_monitor_file_block_operations_t co_os_file_block_mapped_operations;
+extern co_monitor_file_block_operations_t co_monitor_cow_block_operations;
+extern co_monitor_file_block_operations_t co_monitor_nbd_block_operations;
+extern co_monitor_file_block_operations_t co_monitor_zblock_operations;
 
 #endif
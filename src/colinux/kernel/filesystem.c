@@ -9,7 +9,101 @@
 #include "transfer.h"
 
 static struct co_filesystem_ops flat_mode; /* like UML's hostfs */
-/* static struct co_filesystem_ops unix_attr_mode; like UML's humfs (TODO) */
+static struct co_filesystem_ops unix_mode; /* like UML's humfs, with one store */
+
+static co_rc_t meta_open(co_filesystem_t *filesystem, const char *pathname);
+static void meta_close(co_filesystem_t *filesystem);
+
+/* FNV-1a */
+static unsigned long name_hash(const char *name)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+static unsigned long inode_number_key(co_list_t *node)
+{
+	return co_list_entry(node, co_inode_t, hash_node)->number;
+}
+
+static unsigned long inode_name_key(co_list_t *node)
+{
+	return co_list_entry(node, co_inode_t, name_node)->name_hash;
+}
+
+static co_list_t *fs_hash_bucket(co_fs_hash_t *hash, unsigned long key)
+{
+	return &hash->buckets[key & (hash->size - 1)];
+}
+
+/* Moves everything into 'size' buckets, the old table stays on failure */
+static co_rc_t fs_hash_resize(co_fs_hash_t *hash, unsigned long size,
+			      unsigned long (*key)(co_list_t *node))
+{
+	co_list_t *buckets, *node;
+	unsigned long i;
+
+	buckets = co_os_malloc(size * sizeof(co_list_t));
+	if (!buckets)
+		return CO_RC(OUT_OF_MEMORY);
+
+	for (i = 0; i < size; i++)
+		co_list_init(&buckets[i]);
+
+	for (i = 0; i < hash->size; i++) {
+		while (!co_list_empty(&hash->buckets[i])) {
+			node = hash->buckets[i].next;
+			co_list_del(node);
+			co_list_add_tail(node, &buckets[key(node) & (size - 1)]);
+		}
+	}
+
+	if (hash->buckets)
+		co_os_free(hash->buckets);
+	hash->buckets = buckets;
+	hash->size = size;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t fs_hash_add(co_fs_hash_t *hash, co_list_t *node, unsigned long initial_size,
+			   unsigned long (*key)(co_list_t *node))
+{
+	co_rc_t rc;
+
+	if (!hash->buckets) {
+		rc = fs_hash_resize(hash, initial_size, key);
+		if (!CO_OK(rc))
+			return rc;
+	} else if (hash->count >= hash->size * 2) {
+		/* Longer chains still work, growing is best effort */
+		fs_hash_resize(hash, hash->size * 2, key);
+	}
+
+	co_list_add_head(node, fs_hash_bucket(hash, key(node)));
+	hash->count++;
+
+	return CO_RC(OK);
+}
+
+static void fs_hash_del(co_fs_hash_t *hash, co_list_t *node)
+{
+	co_list_del(node);
+	hash->count--;
+}
+
+static void fs_hash_free(co_fs_hash_t *hash)
+{
+	if (hash->buckets)
+		co_os_free(hash->buckets);
+	co_memset(hash, 0, sizeof(*hash));
+}
 
 static co_inode_t *ino_num_to_inode(int ino, co_filesystem_t *filesystem)
 {
@@ -19,7 +113,7 @@ static co_inode_t *ino_num_to_inode(int ino, co_filesystem_t *filesystem)
 		return filesystem->root;
 
         co_list_each_entry(inode,
-			   &filesystem->inode_hashes[ino % CO_FS_HASH_TABLE_SIZE],
+			   fs_hash_bucket(&filesystem->inode_hashes, ino),
 			   hash_node)
 	{
 		if (inode->number == ino)
@@ -32,41 +126,86 @@ out:
 	return inode;
 }
 
+/*
+ * Numbers are handed out in order, so live inodes only get in the way
+ * once the counter has wrapped around.
+ */
+static int next_inode_number(co_filesystem_t *filesystem)
+{
+	int number;
+
+	do {
+		number = filesystem->next_inode_num;
+		if (number == 0x7fffffff) {
+			filesystem->next_inode_num = 2;
+			filesystem->inode_num_wrapped = PTRUE;
+		} else
+			filesystem->next_inode_num++;
+	} while (filesystem->inode_num_wrapped && ino_num_to_inode(number, filesystem));
+
+	return number;
+}
+
+static co_rc_t link_child(co_inode_t *parent, co_inode_t *inode)
+{
+	co_rc_t rc;
+
+	rc = fs_hash_add(&parent->children, &inode->name_node, CO_FS_NAME_HASH_SIZE,
+			 inode_name_key);
+	if (!CO_OK(rc))
+		return rc;
+
+	co_list_add_tail(&inode->node, &parent->sub_inodes);
+	inode->parent = parent;
+
+	return CO_RC(OK);
+}
+
+static void unlink_child(co_inode_t *inode)
+{
+	fs_hash_del(&inode->parent->children, &inode->name_node);
+	co_list_del(&inode->node);
+	inode->parent = NULL;
+}
+
 static co_inode_t *alloc_inode(co_filesystem_t *filesystem, co_inode_t *parent, const char *name)
 {
 	co_inode_t *inode;
+	co_rc_t rc;
 
 	inode = co_os_malloc(sizeof(*inode));
 	if (!inode)
 		return NULL;
 
 	co_memset(inode, 0, sizeof(*inode));
-
-	do {
-		inode->number = filesystem->next_inode_num;
-		filesystem->next_inode_num++;
-	} while (ino_num_to_inode(inode->number, filesystem) != NULL);
-
-	if (parent) {
-		co_list_add_tail(&inode->node, &parent->sub_inodes);
-		inode->parent = parent;
-	}
+	co_list_init(&inode->sub_inodes);
 
 	if (name != NULL) {
 		int len = co_strlen(name);
 		char *dup = co_os_malloc(len + 1);
 		if (!dup) {
-			co_list_del(&inode->node);
 			co_os_free(inode);
 			return NULL;
 		}
 		co_memcpy(dup, name, len+1);
 		inode->name = dup;
+		inode->name_hash = name_hash(dup);
 	}
 
-	co_list_init(&inode->sub_inodes);
+	if (parent) {
+		rc = link_child(parent, inode);
+		if (!CO_OK(rc)) {
+			if (inode->name)
+				co_os_free(inode->name);
+			co_os_free(inode);
+			return NULL;
+		}
+	}
+
+	inode->number = next_inode_number(filesystem);
 	co_list_add_tail(&inode->flat_node, &filesystem->list_inodes);
-	co_list_add_tail(&inode->hash_node, &filesystem->inode_hashes[inode->number % CO_FS_HASH_TABLE_SIZE]);
+	fs_hash_add(&filesystem->inode_hashes, &inode->hash_node, CO_FS_HASH_TABLE_SIZE,
+		    inode_number_key);
 
 	filesystem->inodes_count++;
 	co_debug_lvl(filesystem, 10, "inode [%d] allocated %p child '%s' of %p",
@@ -75,31 +214,392 @@ static co_inode_t *alloc_inode(co_filesystem_t *filesystem, co_inode_t *parent,
 	return inode;
 }
 
-static void reparent_inode(co_inode_t *node, co_inode_t *new_parent)
-{
-	co_list_del(&node->node);
-	co_list_add_head(&node->node, &new_parent->sub_inodes);
-	node->parent = new_parent;
-}
-
 static co_inode_t *find_inode(co_filesystem_t *filesystem, co_inode_t *parent, const char *name)
 {
+	unsigned long hash = name_hash(name);
 	co_inode_t *inode = NULL;
 
-        co_list_each_entry(inode, &parent->sub_inodes, node) {
-		if (co_strcmp(inode->name, name) == 0)
+	if (!parent->children.buckets)
+		return NULL;
+
+        co_list_each_entry(inode, fs_hash_bucket(&parent->children, hash), name_node) {
+		if (inode->name_hash == hash && co_strcmp(inode->name, name) == 0)
 			return inode;
 	}
 
 	return NULL;
 }
 
+static void handle_put(co_fs_handle_t *handle)
+{
+	if (--handle->users > 0)
+		return;
+
+	co_os_file_handle_close(handle->file);
+	co_os_free(handle);
+}
+
+/* The host file stays open while transfers still use it */
+static void inode_handle_close(co_filesystem_t *filesystem, co_inode_t *inode)
+{
+	if (!inode->handle)
+		return;
+
+	handle_put(inode->handle);
+	inode->handle = NULL;
+	co_list_del(&inode->handle_node);
+	filesystem->handles_count--;
+}
+
+static void inode_handles_close_all(co_filesystem_t *filesystem)
+{
+	co_inode_t *inode;
+
+	while (!co_list_empty(&filesystem->handles_lru)) {
+		co_list_entry_assign(filesystem->handles_lru.next, inode, handle_node);
+		inode_handle_close(filesystem, inode);
+	}
+}
+
+/*
+ * Open host file of an inode, from the cache if possible. Files are
+ * opened for writing where the host allows it, so that reads and
+ * writes of the same file share a handle.
+ */
+static co_rc_t inode_handle_get(co_filesystem_t *filesystem, co_inode_t *inode,
+				bool_t write, co_fs_handle_t **handle_out)
+{
+	co_fs_handle_t *handle;
+	co_rc_t rc;
+
+	if (inode->handle && (inode->handle_write || !write)) {
+		co_list_del(&inode->handle_node);
+		co_list_add_head(&inode->handle_node, &filesystem->handles_lru);
+		*handle_out = inode->handle;
+		return CO_RC(OK);
+	}
+
+	inode_handle_close(filesystem, inode);
+
+	if (filesystem->handles_count >= CO_FS_OPEN_HANDLES) {
+		co_inode_t *oldest;
+
+		co_list_entry_assign(filesystem->handles_lru.prev, oldest, handle_node);
+		inode_handle_close(filesystem, oldest);
+	}
+
+	handle = co_os_malloc(sizeof(*handle));
+	if (!handle)
+		return CO_RC(OUT_OF_MEMORY);
+
+	inode->handle_write = PTRUE;
+	rc = co_os_fs_open(filesystem, inode, PTRUE, &handle->file);
+	if (!CO_OK(rc) && !write) {
+		inode->handle_write = PFALSE;
+		rc = co_os_fs_open(filesystem, inode, PFALSE, &handle->file);
+	}
+
+	if (!CO_OK(rc)) {
+		co_os_free(handle);
+		return rc;
+	}
+
+	handle->users = 1;
+	inode->handle = handle;
+	co_list_add_head(&inode->handle_node, &filesystem->handles_lru);
+	filesystem->handles_count++;
+	*handle_out = handle;
+
+	return CO_RC(OK);
+}
+
+/* Tells Linux that entries of directory 'number' changed, see struct fuse_notify_dir */
+static void watch_post(co_filesystem_t *filesystem, int number)
+{
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		struct fuse_notify_dir notify;
+	} *msg;
+
+	msg = co_os_malloc(sizeof(*msg));
+	if (!msg)
+		return;
+
+	co_memset(msg, 0, sizeof(*msg));
+	msg->message.from = CO_MODULE_COFS0 + filesystem->unit;
+	msg->message.to = CO_MODULE_LINUX;
+	msg->message.priority = CO_PRIORITY_DISCARDABLE;
+	msg->message.type = CO_MESSAGE_TYPE_OTHER;
+	msg->message.size = sizeof(*msg) - sizeof(msg->message);
+	msg->linux_message.device = CO_DEVICE_FILESYSTEM;
+	msg->linux_message.unit = filesystem->unit;
+	msg->linux_message.size = sizeof(msg->notify);
+	msg->notify.type = FUSE_NOTIFY_DIR;
+	msg->notify.ino = number;
+
+	co_monitor_message_from_user_free(filesystem->cmon, &msg->message);
+}
+
+/*
+ * Each change counts, cached attributes of the entries of the directory
+ * are stale then. Linux hears of it once, if it relies on the watch.
+ */
+void co_monitor_file_system_changed(co_filesystem_t *filesystem, co_fs_watch_t *watch,
+				    bool_t lost)
+{
+	watch->changes++;
+	if (lost)
+		watch->lost = PTRUE;
+
+	if (watch->notify) {
+		watch->notify = PFALSE;
+		watch_post(filesystem, watch->number);
+	}
+}
+
+/* With 'post', Linux is told to stop relying on the watch */
+static void watch_free(co_filesystem_t *filesystem, co_fs_watch_t *watch, bool_t post)
+{
+	co_inode_t *inode;
+
+	co_os_fs_unwatch(filesystem, watch);
+
+	/* The host is done with it */
+	if (post && watch->notify)
+		watch_post(filesystem, watch->number);
+
+	/* A new watch counts from the start */
+	co_list_each_entry(inode, &watch->dir->sub_inodes, node)
+		inode->attr_valid = PFALSE;
+
+	watch->dir->watch = NULL;
+	co_list_del(&watch->node);
+	filesystem->watches_count--;
+	co_os_free(watch);
+}
+
+static void watches_free_all(co_filesystem_t *filesystem)
+{
+	co_fs_watch_t *watch;
+
+	while (!co_list_empty(&filesystem->watches_lru)) {
+		co_list_entry_assign(filesystem->watches_lru.next, watch, node);
+		watch_free(filesystem, watch, PFALSE);
+	}
+}
+
+/* Watch of a directory, set up on first use. NULL if the host can't watch it */
+static co_fs_watch_t *watch_get(co_filesystem_t *filesystem, co_inode_t *dir)
+{
+	co_fs_watch_t *watch = dir->watch;
+	bool_t lost;
+	co_rc_t rc;
+
+	if (watch) {
+		co_os_mutex_acquire(filesystem->watch_mutex);
+		lost = watch->lost;
+		co_os_mutex_release(filesystem->watch_mutex);
+
+		if (!lost) {
+			co_list_del(&watch->node);
+			co_list_add_head(&watch->node, &filesystem->watches_lru);
+			return watch;
+		}
+
+		/* Gone on the host, it may be back under the same name */
+		watch_free(filesystem, watch, PTRUE);
+	}
+
+	if (dir->watch_failed)
+		return NULL;
+
+	if (filesystem->watches_count >= CO_FS_WATCHES) {
+		co_fs_watch_t *oldest;
+
+		co_list_entry_assign(filesystem->watches_lru.prev, oldest, node);
+		watch_free(filesystem, oldest, PTRUE);
+	}
+
+	watch = co_os_malloc(sizeof(*watch));
+	if (!watch)
+		return NULL;
+
+	co_memset(watch, 0, sizeof(*watch));
+	watch->dir = dir;
+	watch->number = dir->number;
+
+	rc = co_os_fs_watch(filesystem, watch);
+	if (!CO_OK(rc)) {
+		co_debug_lvl(filesystem, 5, "no watch on dir %d (rc %x)", dir->number, (int)rc);
+		co_os_free(watch);
+		dir->watch_failed = PTRUE;
+		return NULL;
+	}
+
+	dir->watch = watch;
+	co_list_add_head(&watch->node, &filesystem->watches_lru);
+	filesystem->watches_count++;
+
+	return watch;
+}
+
+/*
+ * Change count of the watch of 'dir', PFALSE if its entries are not
+ * watched. With 'notify' Linux may rely on the watch from now on, it
+ * hears of the next change. Call it before asking the host, so that a
+ * change in between is not missed.
+ */
+static bool_t watch_changes(co_filesystem_t *filesystem, co_inode_t *dir, bool_t notify,
+			    unsigned long *changes)
+{
+	co_fs_watch_t *watch;
+	bool_t watched;
+
+	*changes = 0;
+	if (!dir || (filesystem->flags & COFS_MOUNT_NOCACHE))
+		return PFALSE;
+
+	watch = watch_get(filesystem, dir);
+	if (!watch)
+		return PFALSE;
+
+	co_os_mutex_acquire(filesystem->watch_mutex);
+	watched = !watch->lost;
+	*changes = watch->changes;
+	if (watched && notify)
+		watch->notify = PTRUE;
+	co_os_mutex_release(filesystem->watch_mutex);
+
+	return watched;
+}
+
+/*
+ * Changes of our own count too, but some hosts report them late. What
+ * they touched is read again.
+ */
+static void attr_drop(co_filesystem_t *filesystem, co_inode_t *dir, char *name)
+{
+	co_inode_t *inode;
+
+	if (!dir)
+		return;
+
+	dir->attr_valid = PFALSE;
+	if (name) {
+		inode = find_inode(filesystem, dir, name);
+		if (inode)
+			inode->attr_valid = PFALSE;
+	}
+}
+
+/* A name Linux wants the attributes of, see entries_get_attr() */
+typedef struct {
+	char *name;
+	struct fuse_attr attr;
+	int ino;
+	co_rc_t rc;
+	bool_t read;			/* from the host */
+	unsigned long offset;		/* of the caller's reply */
+} co_fs_entry_attr_t;
+
+/*
+ * Attributes of names in 'dir' and their inodes, allocated as needed.
+ * They are read from the host only if it may have changed them since
+ * the last time, and then with the mutex let go, so that the monitor
+ * need not wait for the host. The names must stay valid without the
+ * mutex. CO_RC(NOT_FOUND) if 'dir' is forgotten meanwhile.
+ */
+static co_rc_t entries_get_attr(co_filesystem_t *filesystem, co_inode_t *dir, bool_t notify,
+				co_fs_entry_attr_t *entries, int count, bool_t *watched_out)
+{
+	co_fs_entry_attr_t *entry, *end = entries + count;
+	unsigned long changes;
+	co_inode_t *inode;
+	bool_t watched;
+	int number, reads = 0;
+	bool_t gone = PFALSE;
+	void *ref;
+	co_rc_t rc;
+
+	watched = watch_changes(filesystem, dir, notify, &changes);
+	if (watched_out)
+		*watched_out = watched;
+
+	for (entry = entries; entry < end; entry++) {
+		inode = dir ? find_inode(filesystem, dir, entry->name) : NULL;
+		entry->read = !inode || !inode->attr_valid || !watched ||
+			      inode->attr_changes != changes;
+		if (entry->read) {
+			reads++;
+			continue;
+		}
+
+		co_memcpy(&entry->attr, &inode->attr, sizeof(entry->attr));
+		entry->ino = inode->number;
+		entry->rc = CO_RC(OK);
+	}
+
+	if (!reads)
+		return CO_RC(OK);
+
+	number = dir ? dir->number : 0;
+	rc = co_os_fs_dir_hold(filesystem, dir, &ref);
+	if (CO_OK(rc)) {
+		co_os_mutex_release(filesystem->mutex);
+		for (entry = entries; entry < end; entry++)
+			if (entry->read)
+				entry->rc = co_os_fs_dir_get_attr(ref, entry->name, &entry->attr);
+		co_os_mutex_acquire(filesystem->mutex);
+		co_os_fs_dir_unhold(ref);
+
+		gone = dir && ino_num_to_inode(number, filesystem) != dir;
+	}
+
+	for (entry = entries; entry < end; entry++) {
+		if (!entry->read)
+			continue;
+
+		if (!CO_OK(rc))
+			entry->rc = rc;
+		else if (gone)
+			entry->rc = CO_RC(NOT_FOUND);
+		else if (CO_OK(entry->rc))
+			entry->rc = filesystem->ops->host_attr(filesystem, dir, entry->name,
+							       &entry->attr);
+
+		/* The root has no directory to keep it in */
+		if (!CO_OK(entry->rc) || !dir)
+			continue;
+
+		inode = find_inode(filesystem, dir, entry->name);
+		if (!inode)
+			inode = alloc_inode(filesystem, dir, entry->name);
+		if (!inode) {
+			entry->rc = CO_RC(OUT_OF_MEMORY);
+			continue;
+		}
+
+		co_memcpy(&inode->attr, &entry->attr, sizeof(entry->attr));
+		inode->attr_valid = watched;
+		inode->attr_changes = changes;
+		entry->ino = inode->number;
+	}
+
+	return gone ? CO_RC(NOT_FOUND) : CO_RC(OK);
+}
+
 static void free_inode(co_filesystem_t *filesystem, co_inode_t *inode)
 {
+	if (inode->watch)
+		watch_free(filesystem, inode->watch, PFALSE);
+	inode_handle_close(filesystem, inode);
+	co_os_fs_inode_release(filesystem, inode);
 	co_list_del(&inode->flat_node);
-	co_list_del(&inode->hash_node);
+	fs_hash_del(&filesystem->inode_hashes, &inode->hash_node);
 	if (inode->parent)
-		co_list_del(&inode->node);
+		unlink_child(inode);
+	fs_hash_free(&inode->children);
 	if (inode->names)
 		co_filesystem_getdir_free(inode->names);
 	if (inode->name)
@@ -116,9 +616,9 @@ static void free_inode_children(co_filesystem_t *filesystem, co_list_t *delete_n
 
 	if (level > 5) {
 		co_list_each_entry_safe(inode, inode_new, delete_now, node) {
-			co_list_del(&inode->node);
+			if (inode->parent)
+				unlink_child(inode);
 			co_list_add_head(&inode->node, delete_later);
-			inode->parent = NULL;
 		}
 	} else {
 		co_list_each_entry_safe(inode, inode_new, delete_now, node) {
@@ -174,6 +674,7 @@ static co_rc_t inode_dir_open(co_filesystem_t *filesystem, co_inode_t *inode)
 
 	inode->names->refcount = 1;
 	co_list_init(&inode->names->list);
+	inode->names->watched = watch_changes(filesystem, inode, PTRUE, &inode->names->changes);
 
 	rc = filesystem->ops->getdir(filesystem, inode, inode->names);
 
@@ -187,7 +688,13 @@ static co_rc_t inode_dir_open(co_filesystem_t *filesystem, co_inode_t *inode)
 
 static co_rc_t inode_open(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long flags)
 {
-	return CO_RC(OK);
+	co_fs_handle_t *handle;
+
+	if (!inode)
+		return CO_RC(ERROR);
+
+	/* Linux open flags, O_WRONLY or O_RDWR in the access mode bits */
+	return inode_handle_get(filesystem, inode, (flags & 3) != 0, &handle);
 }
 
 static co_rc_t inode_read(co_monitor_t *cmon, co_filesystem_t *filesystem, co_inode_t *inode,
@@ -201,26 +708,70 @@ static co_rc_t inode_write(co_monitor_t *cmon, co_filesystem_t *filesystem, co_i
 			   unsigned long long offset, unsigned long size,
 			   vm_ptr_t src_buffer)
 {
+	if (inode)
+		inode->attr_valid = PFALSE;
+
 	return filesystem->ops->inode_read_write(cmon, filesystem, inode, offset, size, src_buffer, PFALSE);
 }
 
+/*
+ * FUSE_READV/FUSE_WRITEV: 'size' bytes at 'offset', scattered over the
+ * guest buffers of a segment list that lives in guest memory.
+ */
+static co_rc_t inode_read_write_vector(co_monitor_t *cmon, co_filesystem_t *filesystem,
+				       co_inode_t *inode, unsigned long long offset,
+				       unsigned long size, vm_ptr_t segments_address,
+				       unsigned long nr_segments, bool_t read)
+{
+	struct fuse_segment segments[FUSE_MAX_SEGMENTS];
+	unsigned long total = 0;
+	unsigned long i;
+	co_rc_t rc;
+
+	if (!inode || nr_segments == 0 || nr_segments > FUSE_MAX_SEGMENTS)
+		return CO_RC(INVALID_PARAMETER);
+
+	rc = co_monitor_linuxvm_to_host(cmon, segments_address, segments,
+					nr_segments * sizeof(struct fuse_segment));
+	if (!CO_OK(rc))
+		return rc;
+
+	for (i = 0; i < nr_segments; i++) {
+		if (segments[i].size > FUSE_MAX_VECTOR_SIZE)
+			return CO_RC(INVALID_PARAMETER);
+		total += segments[i].size;
+	}
+
+	if (total != size || total > FUSE_MAX_VECTOR_SIZE)
+		return CO_RC(INVALID_PARAMETER);
+
+	if (!read)
+		inode->attr_valid = PFALSE;
+
+	return filesystem->ops->inode_read_write_vector(cmon, filesystem, inode, offset,
+							segments, nr_segments, read);
+}
+
+/* 'attr' comes with the caller's mode and owner, the ops keep what they support */
 static co_rc_t inode_mknod(co_filesystem_t *filesystem, co_inode_t *dir, unsigned long mode,
-			   unsigned long rdev, char *name, int *ino, struct fuse_attr *attr)
+			   unsigned long rdev, char *name, unsigned long uid, unsigned long gid,
+			   int *ino, struct fuse_attr *attr)
 {
 	co_rc_t rc;
 
 	attr->size = 0;
-	attr->mode = mode & filesystem->file_mode;
+	attr->mode = mode;
 	attr->nlink = 1;
-	attr->uid = filesystem->uid;
-	attr->gid = filesystem->gid;
-	attr->rdev = 0;
+	attr->uid = uid;
+	attr->gid = gid;
+	attr->rdev = rdev;
 	attr->_dummy = 0;
 	attr->blocks = 0;
 	attr->atime = \
 	attr->mtime = \
 	attr->ctime = co_os_get_time();
 
+	attr_drop(filesystem, dir, name);
 	rc = filesystem->ops->inode_mknod(filesystem, dir, mode, rdev, name, ino, attr);
 
 	if (CO_OK(rc)) {
@@ -236,25 +787,131 @@ static co_rc_t inode_mknod(co_filesystem_t *filesystem, co_inode_t *dir, unsigne
 }
 
 static co_rc_t inode_mkdir(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
-			   char *name)
+			   char *name, unsigned long uid, unsigned long gid)
 {
-	return filesystem->ops->inode_mkdir(filesystem, inode, mode, name);
+	attr_drop(filesystem, inode, name);
+	return filesystem->ops->inode_mkdir(filesystem, inode, mode, name, uid, gid);
 }
 
-static co_rc_t inode_unlink(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+/* The target comes from guest memory, 'size' with its terminating zero */
+static co_rc_t inode_symlink(co_monitor_t *cmon, co_filesystem_t *filesystem, co_inode_t *dir,
+			     char *name, vm_ptr_t target_address, unsigned long size,
+			     unsigned long uid, unsigned long gid)
 {
-	return filesystem->ops->inode_unlink(filesystem, inode, name);
-}
+	char *target;
+	co_rc_t rc;
 
-static co_rc_t inode_rmdir(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+	if (!dir)
+		return CO_RC(ERROR);
+
+	if (size < 2 || size > FUSE_SYMLINK_MAX)
+		return CO_RC(INVALID_PARAMETER);
+
+	target = co_os_malloc(size);
+	if (!target)
+		return CO_RC(OUT_OF_MEMORY);
+
+	rc = co_monitor_linuxvm_to_host(cmon, target_address, target, size);
+	if (CO_OK(rc)) {
+		target[size - 1] = '\0';
+		attr_drop(filesystem, dir, name);
+		rc = filesystem->ops->inode_symlink(filesystem, dir, name, target, uid, gid);
+	}
+
+	co_os_free(target);
+	return rc;
+}
+
+/* Copies the target, unterminated, to a guest buffer of 'size' */
+static co_rc_t inode_readlink(co_monitor_t *cmon, co_filesystem_t *filesystem, co_inode_t *inode,
+			      vm_ptr_t buffer, unsigned long size, unsigned long *size_out)
+{
+	char *target;
+	co_rc_t rc;
+
+	if (!inode)
+		return CO_RC(ERROR);
+
+	if (size > FUSE_SYMLINK_MAX)
+		size = FUSE_SYMLINK_MAX;
+
+	target = co_os_malloc(size + 1);
+	if (!target)
+		return CO_RC(OUT_OF_MEMORY);
+
+	rc = filesystem->ops->inode_readlink(filesystem, inode, target, &size);
+	if (CO_OK(rc))
+		rc = co_monitor_host_to_linuxvm(cmon, target, buffer, size);
+	if (CO_OK(rc))
+		*size_out = size;
+
+	co_os_free(target);
+	return rc;
+}
+
+static co_rc_t inode_unlink(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+{
+	co_inode_t *file = find_inode(filesystem, inode, name);
+
+	if (file)
+		inode_handle_close(filesystem, file);
+
+	attr_drop(filesystem, inode, name);
+	return filesystem->ops->inode_unlink(filesystem, inode, name);
+}
+
+static co_rc_t inode_rmdir(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
 {
+	attr_drop(filesystem, inode, name);
 	return filesystem->ops->inode_rmdir(filesystem, inode, name);
 }
 
+/* The name is a copy, a rename may free it while the host is asked */
+static co_rc_t inode_get_attr(co_filesystem_t *filesystem, co_inode_t *inode,
+			      struct fuse_getattr_out *attr)
+{
+	co_fs_entry_attr_t entry;
+	char *name;
+	int size;
+
+	if (!inode)
+		return CO_RC(ERROR);
+
+	name = inode->name ? inode->name : "";
+	size = co_strlen(name) + 1;
+	entry.name = co_os_malloc(size);
+	if (!entry.name)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memcpy(entry.name, name, size);
+
+	/* The root has no directory to watch it */
+	entries_get_attr(filesystem, inode->parent, PFALSE, &entry, 1, NULL);
+	if (CO_OK(entry.rc))
+		co_memcpy(&attr->attr, &entry.attr, sizeof(attr->attr));
+
+	co_os_free(entry.name);
+	return entry.rc;
+}
+
 static co_rc_t inode_set_attr(co_filesystem_t *filesystem, co_inode_t *inode,
 			      unsigned long valid, struct fuse_attr *attr)
 {
-	return filesystem->ops->inode_set_attr(filesystem, inode, valid, attr);
+	struct fuse_getattr_out out;
+	co_rc_t rc;
+
+	/* The host opens the file itself, without sharing */
+	if (inode) {
+		inode_handle_close(filesystem, inode);
+		inode->attr_valid = PFALSE;
+	}
+
+	rc = filesystem->ops->inode_set_attr(filesystem, inode, valid, attr);
+
+	/* Linux takes all of the attributes of the reply */
+	if (CO_OK(rc) && inode && CO_OK(inode_get_attr(filesystem, inode, &out)))
+		co_memcpy(attr, &out.attr, sizeof(*attr));
+
+	return rc;
 }
 
 static co_rc_t inode_rename(co_filesystem_t *filesystem, co_inode_t *dir,
@@ -266,41 +923,90 @@ static co_rc_t inode_rename(co_filesystem_t *filesystem, co_inode_t *dir,
 	new_dir_inode = ino_num_to_inode(new_dir_num, filesystem);
 	if (!new_dir_inode)
 		return CO_RC(ERROR);
+
+	/* Open files below a renamed directory would make the host refuse */
+	inode_handles_close_all(filesystem);
+	attr_drop(filesystem, dir, oldname);
+	attr_drop(filesystem, new_dir_inode, newname);
+
 	rc = filesystem->ops->inode_rename(filesystem, dir, new_dir_inode, oldname, newname);
 	if (CO_OK(rc)) {
 		co_inode_t *old_inode = find_inode(filesystem, dir, oldname);
 		if (old_inode) {
+			char *name;
 			int size;
 
-			// This moves the file from one dir to an other
-			reparent_inode(old_inode, new_dir_inode);
-
-			// This renames the file on the same inode number
-			co_os_free(old_inode->name);
+			// The new name and directory slot first, nothing can fail after that
 			size = co_strlen(newname) + 1;
-			old_inode->name = co_os_malloc(size);
-			if (!old_inode->name)
+			name = co_os_malloc(size);
+			if (!name)
 				return CO_RC(OUT_OF_MEMORY);
-			co_memcpy(old_inode->name, newname, size);
+			if (!new_dir_inode->children.buckets) {
+				rc = fs_hash_resize(&new_dir_inode->children, CO_FS_NAME_HASH_SIZE,
+						    inode_name_key);
+				if (!CO_OK(rc)) {
+					co_os_free(name);
+					return rc;
+				}
+			}
+			co_memcpy(name, newname, size);
+
+			// This moves the file from one dir to an other,
+			// and renames it on the same inode number
+			unlink_child(old_inode);
+			co_os_free(old_inode->name);
+			old_inode->name = name;
+			old_inode->name_hash = name_hash(name);
+			link_child(new_dir_inode, old_inode);
 		}
 	}
 	return rc;
 }
 
 
+/* Inode number of a name listed with its attributes, FUSE_INO_NONE without memory */
+static unsigned long dir_entry_ino(co_filesystem_t *filesystem, co_inode_t *dir,
+				   co_filesystem_name_t *name)
+{
+	co_inode_t *inode;
+
+	inode = find_inode(filesystem, dir, name->name);
+	if (!inode)
+		inode = alloc_inode(filesystem, dir, name->name);
+	if (!inode)
+		return FUSE_INO_NONE;
+
+	return inode->number;
+}
+
+/*
+ * Entries of an open directory from 'file_pos' on, as many as fit in
+ * 'size'. They are put together on the host and copied to Linux at
+ * once. With 'plus' every entry comes with its attributes and inode
+ * number, so Linux need not look the names up one by one afterwards,
+ * and 'flags' tell whether it may keep them until the host reports a
+ * change. Names listed without attributes get theirs in one go at the
+ * end, see entries_get_attr().
+ */
 static co_rc_t inode_dir_read(co_monitor_t *cmon,
+			      co_filesystem_t *filesystem,
 			      co_inode_t *inode,
 			      vm_ptr_t buff,
 			      unsigned long size,
 			      unsigned long *fill_size,
-			      unsigned long file_pos)
+			      unsigned long file_pos,
+			      bool_t plus,
+			      unsigned long *flags)
 {
 	co_filesystem_name_t *name;
 	unsigned long file_pos_seek = 0;
-	struct fuse_dirent dirent;
-	unsigned long dirent_size;
-	vm_ptr_t buff_writeptr;
-	co_rc_t rc;
+	struct fuse_direntplus *direntplus = NULL;
+	struct fuse_dirent *dirent;
+	unsigned long dirent_size, name_offset;
+	co_fs_entry_attr_t *entries = NULL;
+	int count = 0, i;
+	char *buffer, *names = NULL;
+	co_rc_t rc = CO_RC(OK);
 
 	if (!inode)
 		return CO_RC(ERROR);
@@ -308,13 +1014,51 @@ static co_rc_t inode_dir_read(co_monitor_t *cmon,
 	if (!inode->names)
 		return CO_RC(ERROR);
 
-	buff_writeptr = buff;
 	*fill_size = 0;
+	*flags = 0;
+	if (size > FUSE_DIR_BUFSIZE_MAX)
+		size = FUSE_DIR_BUFSIZE_MAX;
+
+	name_offset = plus ? FUSE_NAME_OFFSET_DIRENTPLUS : FUSE_NAME_OFFSET;
+
+	/* Nothing may have changed since the listing */
+	if (plus) {
+		unsigned long changes;
+
+		if (watch_changes(filesystem, inode, PTRUE, &changes) &&
+		    inode->names->watched && inode->names->changes == changes)
+			*flags = FUSE_ENTRY_WATCHED;
+
+		/* An entry per smallest dirent at most, their names after them */
+		i = size / FUSE_DIRENT_ALIGN(name_offset + 1);
+		entries = co_os_malloc(i * sizeof(*entries) + size);
+		if (!entries)
+			return CO_RC(OUT_OF_MEMORY);
+		names = (char *)&entries[i];
+	}
+
+	/* Zeroed, the padding of the entries must not leak host memory */
+	buffer = co_os_malloc(size);
+	if (!buffer) {
+		if (entries)
+			co_os_free(entries);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+	co_memset(buffer, 0, size);
 
         co_list_each_entry(name, &inode->names->list, node) {
 		int slen = co_strlen(name->name);
+		bool_t truncated = PFALSE;
 
-		dirent_size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + slen);
+		/* TODO: Make it dynamicly.  See NAME_MAX in linux kernel. */
+		if (slen > sizeof(dirent->name)) {
+			/* Name to long */
+			co_debug_lvl(filesystem, 5, "name to long (%d) '%s'", slen, name->name);
+			slen = sizeof(dirent->name);
+			truncated = PTRUE;
+		}
+
+		dirent_size = FUSE_DIRENT_ALIGN(name_offset + slen);
 		if (file_pos_seek < file_pos) {
 			file_pos_seek += dirent_size;
 			continue;
@@ -325,39 +1069,65 @@ static co_rc_t inode_dir_read(co_monitor_t *cmon,
 			break;
 		}
 
+		if (plus) {
+			direntplus = (struct fuse_direntplus *)(buffer + *fill_size);
+			dirent = &direntplus->dirent;
+		} else {
+			dirent = (struct fuse_dirent *)(buffer + *fill_size);
+		}
+
 		if (co_strcmp(name->name, "..") == 0) {
 			if (inode->parent)
-				dirent.ino = inode->parent->number;
+				dirent->ino = inode->parent->number;
 			else
-				dirent.ino = inode->number;
+				dirent->ino = inode->number;
 		} else if (co_strcmp(name->name, ".") == 0) {
-			dirent.ino = inode->number;
+			dirent->ino = inode->number;
+		} else if (plus && !truncated && name->has_attr) {
+			dirent->ino = dir_entry_ino(filesystem, inode, name);
+			if (dirent->ino != FUSE_INO_NONE)
+				co_memcpy(&direntplus->attr, &name->attr, sizeof(direntplus->attr));
+		} else if (plus && !truncated) {
+			/* A copy of the name, the listing may go while the host is asked */
+			entries[count].name = names;
+			entries[count].offset = *fill_size;
+			co_memcpy(names, name->name, slen + 1);
+			names += slen + 1;
+			count++;
+			dirent->ino = FUSE_INO_NONE;
 		} else {
-			dirent.ino = -1;
+			dirent->ino = FUSE_INO_NONE;
 		}
 
-		/* TODO: Make it dynamicly.  See NAME_MAX in linux kernel. */
-		if (slen > sizeof(dirent.name)) {
-			/* Name to long */
-			co_debug_lvl(filesystem, 5, "name to long (%d) '%s'", slen, name->name);
-			slen = sizeof(dirent.name);
-		}
+		dirent->namelen = slen;
+		dirent->type = name->type;
+		co_memcpy(dirent->name, name->name, slen);
 
-		dirent.namelen = slen;
-		dirent.type = name->type;
+		*fill_size += dirent_size;
+		file_pos_seek += dirent_size;
+	}
 
-		co_memcpy(dirent.name, name->name, slen);
+	if (count)
+		rc = entries_get_attr(filesystem, inode, PFALSE, entries, count, NULL);
 
-		rc = co_monitor_host_to_linuxvm(cmon, &dirent, buff_writeptr, dirent_size);
-		if (!CO_OK(rc))
-			return rc;
+	for (i = 0; CO_OK(rc) && i < count; i++) {
+		if (!CO_OK(entries[i].rc))
+			continue;
 
-		buff_writeptr += dirent_size;
-		*fill_size += dirent_size;
-		file_pos_seek += dirent_size;
+		direntplus = (struct fuse_direntplus *)(buffer + entries[i].offset);
+		direntplus->dirent.ino = entries[i].ino;
+		co_memcpy(&direntplus->attr, &entries[i].attr, sizeof(direntplus->attr));
 	}
 
-	return CO_RC(OK);
+	if (CO_OK(rc) && *fill_size)
+		rc = co_monitor_host_to_linuxvm(cmon, buffer, buff, *fill_size);
+	if (!CO_OK(rc))
+		*fill_size = 0;
+
+	if (entries)
+		co_os_free(entries);
+	co_os_free(buffer);
+	return rc;
 }
 
 static co_rc_t inode_dir_release(co_inode_t *inode)
@@ -394,7 +1164,7 @@ co_rc_t co_monitor_file_system_init(co_monitor_t *cmon, unsigned int unit,
 				    co_cofsdev_desc_t *desc)
 {
 	co_filesystem_t *filesystem;
-	int i;
+	co_rc_t rc;
 
 	filesystem = co_os_malloc(sizeof(*filesystem));
 	if (!filesystem)
@@ -402,23 +1172,56 @@ co_rc_t co_monitor_file_system_init(co_monitor_t *cmon, unsigned int unit,
 
 	co_memset(filesystem, 0, sizeof(*filesystem));
 
-	for (i=0; i < CO_FS_HASH_TABLE_SIZE; i++) {
-		co_list_init(&filesystem->inode_hashes[i]);
+	rc = fs_hash_resize(&filesystem->inode_hashes, CO_FS_HASH_TABLE_SIZE, inode_number_key);
+	if (!CO_OK(rc)) {
+		co_os_free(filesystem);
+		return rc;
+	}
+
+	rc = co_os_mutex_create(&filesystem->watch_mutex);
+	if (!CO_OK(rc)) {
+		fs_hash_free(&filesystem->inode_hashes);
+		co_os_free(filesystem);
+		return rc;
+	}
+
+	rc = co_os_mutex_create(&filesystem->mutex);
+	if (!CO_OK(rc)) {
+		co_os_mutex_destroy(filesystem->watch_mutex);
+		fs_hash_free(&filesystem->inode_hashes);
+		co_os_free(filesystem);
+		return rc;
 	}
 
 	filesystem->next_inode_num = 1;
+	co_list_init(&filesystem->handles_lru);
+	co_list_init(&filesystem->watches_lru);
+	filesystem->cmon = cmon;
+	filesystem->unit = unit;
 
 	co_list_init(&filesystem->list_inodes);
 	co_memcpy(&filesystem->base_path, &desc->pathname, sizeof(co_pathname_t));
 	filesystem->desc = desc;
-	filesystem->ops = &flat_mode; /* The only supported mode at the moment */
+	filesystem->ops = &flat_mode; /* until mounted in UNIX mode */
 	filesystem->root = alloc_inode(filesystem, NULL, NULL);
 
 	if (!filesystem->root) {
+		co_os_mutex_destroy(filesystem->mutex);
+		co_os_mutex_destroy(filesystem->watch_mutex);
+		fs_hash_free(&filesystem->inode_hashes);
 		co_os_free(filesystem);
 		return CO_RC(OUT_OF_MEMORY);
 	}
 
+	/* Without a worker the requests stay synchronous */
+	if (cmon->config.cofs_async_enable) {
+		rc = co_os_fs_async_start(filesystem);
+		if (CO_OK(rc))
+			filesystem->async = PTRUE;
+		else
+			co_debug_error("cofs%d: no worker, rc=%x", unit, (int)rc);
+	}
+
 	cmon->filesystems[unit] = filesystem;
 
 	return CO_RC(OK);
@@ -432,43 +1235,46 @@ void co_monitor_file_system_free(co_monitor_t *cmon, int unit)
 	if (!filesystem)
 		return;
 
+	if (filesystem->async)
+		co_os_fs_async_stop(filesystem);
+
+	watches_free_all(filesystem);
+	meta_close(filesystem);
+
+	/* Parents may go before their children here, don't unlink from them */
+	co_list_each_entry(inode, &filesystem->list_inodes, flat_node)
+		inode->parent = NULL;
+
 	while (!co_list_empty(&filesystem->list_inodes)) {
 		co_list_entry_assign(filesystem->list_inodes.next, inode, flat_node);
 		free_inode(filesystem, inode);
 	}
 
+	fs_hash_free(&filesystem->inode_hashes);
+	co_os_mutex_destroy(filesystem->mutex);
+	co_os_mutex_destroy(filesystem->watch_mutex);
 	co_os_free(filesystem);
 	cmon->filesystems[unit] = NULL;
 }
 
-static co_rc_t inode_get_attr(co_filesystem_t *filesystem, co_inode_t *inode,
-			      struct fuse_getattr_out *attr)
-{
-	char *name;
-
-	name = inode->name;
-	inode = inode->parent;
-
-	if (name == NULL)
-		name = "";
-
-	return filesystem->ops->getattr(filesystem, inode, name, &attr->attr);
-}
-
 static co_rc_t inode_lookup(co_filesystem_t *filesystem, co_inode_t *dir,
 			    char *name, struct fuse_lookup_out *args)
 {
-	co_rc_t rc = filesystem->ops->getattr(filesystem, dir, name, &args->attr);
+	co_fs_entry_attr_t entry;
+	bool_t watched;
 
-	if (CO_OK(rc)) {
-		co_inode_t *inode = NULL;
-		inode = find_inode(filesystem, dir, name);
-		if (!inode)
-			inode = alloc_inode(filesystem, dir, name);
-		args->ino = inode->number;
+	if (!dir)
+		return CO_RC(ERROR);
+
+	entry.name = name;
+	entries_get_attr(filesystem, dir, PTRUE, &entry, 1, &watched);
+	if (CO_OK(entry.rc)) {
+		co_memcpy(&args->attr, &entry.attr, sizeof(args->attr));
+		args->ino = entry.ino;
+		args->flags = watched ? FUSE_ENTRY_WATCHED : 0;
 	}
 
-	return rc;
+	return entry.rc;
 }
 
 static int translate_code(co_rc_t value)
@@ -493,6 +1299,7 @@ static co_rc_t fs_mount(co_filesystem_t *filesystem, const char *pathname,
 			int flags)
 {
 	co_cofsdev_desc_t *desc;
+	co_inode_t *inode;
 	co_rc_t rc;
 
 	desc = filesystem->desc;
@@ -507,6 +1314,23 @@ static co_rc_t fs_mount(co_filesystem_t *filesystem, const char *pathname,
 
 	rc = co_os_fs_dir_join_unix_path(&filesystem->base_path, pathname);
 
+	/* What the host has open is under the old path */
+	inode_handles_close_all(filesystem);
+	watches_free_all(filesystem);
+	co_list_each_entry(inode, &filesystem->list_inodes, flat_node) {
+		co_os_fs_inode_release(filesystem, inode);
+		inode->attr_valid = PFALSE;
+		inode->watch_failed = PFALSE;
+	}
+
+	meta_close(filesystem);
+	filesystem->ops = &flat_mode;
+	if (CO_OK(rc) && ((flags & COFS_MOUNT_UNIX) || desc->type == CO_COFS_TYPE_UNIX_METADATA)) {
+		rc = meta_open(filesystem, pathname);
+		if (CO_OK(rc))
+			filesystem->ops = &unix_mode;
+	}
+
 	return rc;
 }
 
@@ -515,54 +1339,50 @@ static co_rc_t fs_stat(co_filesystem_t *filesystem, struct fuse_statfs_out *stat
 	return filesystem->ops->fs_stat(filesystem, statfs);
 }
 
-void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
-			    enum fuse_opcode opcode, unsigned long *params)
+/*
+ * Handles a request, 'params' are laid out like those of the passage
+ * page. Called with the mutex held, which reads and writes of files and
+ * attributes let go of while the host is at it.
+ */
+static int file_system_request(co_monitor_t *cmon, co_filesystem_t *filesystem,
+			       enum fuse_opcode opcode, unsigned long *params)
 {
 	int ino = -1;
-	co_filesystem_t *filesystem;
 	co_inode_t *inode;
 	int result = 0;
 
-	filesystem = cmon->filesystems[unit];
-	if (!filesystem) {
-		result = -ENODEV;
-		goto out;
-	}
-
 	switch (opcode) {
 	case FUSE_MOUNT:
-		result = fs_mount(filesystem, (char*)(&co_passage_page->params[30]),
-				  co_passage_page->params[5],
-				  co_passage_page->params[6],
-				  co_passage_page->params[7],
-				  co_passage_page->params[8],
-				  co_passage_page->params[9]);
-		result = translate_code(result);
-		goto out;
+		result = fs_mount(filesystem, (char*)(&params[30]),
+				  params[5],
+				  params[6],
+				  params[7],
+				  params[8],
+				  params[9]);
+		return translate_code(result);
 	case FUSE_STATFS:
-		result = fs_stat(filesystem, (struct fuse_statfs_out *)(&co_passage_page->params[5]));
-		result = translate_code(result);
-		goto out;
+		result = fs_stat(filesystem, (struct fuse_statfs_out *)(&params[5]));
+		return translate_code(result);
 	default:
 		break;
 	}
 
-	ino = params[0];
+	ino = params[3];
 	inode = ino_num_to_inode(ino, filesystem);
 
 	switch (opcode) {
 	case FUSE_SETATTR: {
 		result = inode_set_attr(filesystem, inode,
-					co_passage_page->params[5],
-					(struct fuse_attr *)(&co_passage_page->params[6]));
+					params[5],
+					(struct fuse_attr *)(&params[6]));
 		result = translate_code(result);
 		break;
 	}
 
 	case FUSE_RENAME: {
-		char *str = (char *)&co_passage_page->params[30];
+		char *str = (char *)&params[30];
 		result = inode_rename(filesystem, inode,
-				      co_passage_page->params[5],
+				      params[5],
 				      str,
 				      str + co_strlen(str) + 1);
 		result = translate_code(result);
@@ -576,53 +1396,87 @@ void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
 
 	case FUSE_MKNOD:
 		result = inode_mknod(filesystem, inode,
-				     co_passage_page->params[5],
-				     co_passage_page->params[6],
-				     (char *)&co_passage_page->params[30],
-				     (int *)&co_passage_page->params[7],
-				     (struct fuse_attr *)(&co_passage_page->params[8]));
+				     params[5],
+				     params[6],
+				     (char *)&params[30],
+				     params[20],
+				     params[21],
+				     (int *)&params[7],
+				     (struct fuse_attr *)(&params[8]));
 		result = translate_code(result);
 		break;
 
 	case FUSE_MKDIR:
 		result = inode_mkdir(filesystem, inode,
-				      co_passage_page->params[5],
-				      (char *)&co_passage_page->params[30]);
+				      params[5],
+				      (char *)&params[30],
+				      params[6],
+				      params[7]);
+		result = translate_code(result);
+		break;
+
+	case FUSE_SYMLINK:
+		result = inode_symlink(cmon, filesystem, inode,
+				       (char *)&params[30],
+				       params[5],
+				       params[6],
+				       params[7],
+				       params[8]);
+		result = translate_code(result);
+		break;
+
+	case FUSE_READLINK:
+		result = inode_readlink(cmon, filesystem, inode,
+					params[5],
+					params[6],
+					&params[7]);
 		result = translate_code(result);
 		break;
 
 	case FUSE_UNLINK:
 		result = inode_unlink(filesystem, inode,
-				      (char *)&co_passage_page->params[30]);
+				      (char *)&params[30]);
 		result = translate_code(result);
 		break;
 
 	case FUSE_RMDIR:
 		result = inode_rmdir(filesystem, inode,
-				     (char *)&co_passage_page->params[30]);
+				     (char *)&params[30]);
 		result = translate_code(result);
 		break;
 
 	case FUSE_WRITE: {
 		result = inode_write(cmon, filesystem, inode,
-				     *((unsigned long long *)&co_passage_page->params[5]),
-				     co_passage_page->params[7],
-				     co_passage_page->params[8]);
+				     *((unsigned long long *)&params[5]),
+				     params[7],
+				     params[8]);
 		result = translate_code(result);
 		break;
 	}
 
 	case FUSE_READ: {
 		result = inode_read(cmon, filesystem, inode,
-				    *((unsigned long long *)&co_passage_page->params[5]),
-				    co_passage_page->params[7],
-				    co_passage_page->params[8]);
+				    *((unsigned long long *)&params[5]),
+				    params[7],
+				    params[8]);
+		result = translate_code(result);
+		break;
+	}
+
+	case FUSE_READV:
+	case FUSE_WRITEV: {
+		result = inode_read_write_vector(cmon, filesystem, inode,
+						 *((unsigned long long *)&params[5]),
+						 params[7],
+						 params[8],
+						 params[9],
+						 opcode == FUSE_READV);
 		result = translate_code(result);
 		break;
 	}
 
 	case FUSE_OPEN: {
-		result = inode_open(filesystem, inode, co_passage_page->params[5]);
+		result = inode_open(filesystem, inode, params[5]);
 		result = translate_code(result);
 		break;
 	}
@@ -630,14 +1484,14 @@ void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
 	case FUSE_LOOKUP: {
 		result =
 			inode_lookup(filesystem, inode,
-				     (char *)&co_passage_page->params[30],
-				     (struct fuse_lookup_out *)&co_passage_page->params[5]);
+				     (char *)&params[30],
+				     (struct fuse_lookup_out *)&params[5]);
 		result = translate_code(result);
 		break;
 	}
 	case FUSE_GETATTR: {
 		result = inode_get_attr(filesystem, inode,
-					(struct fuse_getattr_out *)&co_passage_page->params[5]);
+					(struct fuse_getattr_out *)&params[5]);
 		result = translate_code(result);
 		break;
 	}
@@ -648,11 +1502,14 @@ void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
 		break;
 
 	case FUSE_DIR_READ:
-		result = inode_dir_read(cmon, inode,
-					co_passage_page->params[6],
-					co_passage_page->params[5],
-					&co_passage_page->params[7],
-					co_passage_page->params[8]);
+	case FUSE_DIR_READPLUS:
+		result = inode_dir_read(cmon, filesystem, inode,
+					params[6],
+					params[5],
+					&params[7],
+					params[8],
+					opcode == FUSE_DIR_READPLUS,
+					&params[9]);
 		result = translate_code(result);
 		break;
 
@@ -667,7 +1524,101 @@ void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
 		break;
 	}
 
-out:
+	return result;
+}
+
+/* The slow requests, that the guest may sleep on, see FUSE_PARAM_TOKEN */
+static bool_t file_system_request_async(enum fuse_opcode opcode)
+{
+	switch (opcode) {
+	case FUSE_LOOKUP:
+	case FUSE_GETATTR:
+	case FUSE_READ:
+	case FUSE_WRITE:
+	case FUSE_READV:
+	case FUSE_WRITEV:
+	case FUSE_DIR_READ:
+	case FUSE_DIR_READPLUS:
+		return PTRUE;
+	default:
+		return PFALSE;
+	}
+}
+
+/* Copies the request off the passage page for the worker */
+static co_rc_t file_system_queue(co_monitor_t *cmon, co_filesystem_t *filesystem,
+				 enum fuse_opcode opcode)
+{
+	co_fs_job_t *job;
+	co_rc_t rc;
+
+	job = co_os_malloc(sizeof(*job));
+	if (!job)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(&job->msg, 0, sizeof(job->msg));
+	job->msg.message.from = CO_MODULE_COFS0 + filesystem->unit;
+	job->msg.message.to = CO_MODULE_LINUX;
+	job->msg.message.priority = CO_PRIORITY_DISCARDABLE;
+	job->msg.message.type = CO_MESSAGE_TYPE_OTHER;
+	job->msg.message.size = sizeof(job->msg) - sizeof(job->msg.message);
+	job->msg.linux_message.device = CO_DEVICE_FILESYSTEM;
+	job->msg.linux_message.unit = filesystem->unit;
+	job->msg.linux_message.size = sizeof(job->msg.done);
+	job->msg.done.type = FUSE_NOTIFY_DONE;
+	job->msg.done.token = co_passage_page->params[FUSE_PARAM_TOKEN];
+	job->opcode = opcode;
+	co_memcpy(job->params, co_passage_page->params, sizeof(job->params));
+
+	rc = co_os_fs_queue(filesystem, job);
+	if (!CO_OK(rc))
+		co_os_free(job);
+
+	return rc;
+}
+
+void co_monitor_file_system_job(co_filesystem_t *filesystem, co_fs_job_t *job)
+{
+	int result;
+
+	co_os_mutex_acquire(filesystem->mutex);
+	result = file_system_request(filesystem->cmon, filesystem, job->opcode, job->params);
+	co_os_mutex_release(filesystem->mutex);
+
+	job->params[4] = result;
+	co_memcpy(job->msg.done.params, &job->params[4], sizeof(job->msg.done.params));
+	co_monitor_message_from_user_free(filesystem->cmon, &job->msg.message);
+}
+
+/*
+ * Requests run on the guest's CPU, unless the device is asynchronous and
+ * the guest can sleep on a slow one. The token stays in place then. The
+ * worker holds the mutex only while it is not waiting for the host, so
+ * the others are not held up behind a queued one.
+ */
+void co_monitor_file_system(co_monitor_t *cmon, unsigned int unit,
+			    enum fuse_opcode opcode, unsigned long *params)
+{
+	co_filesystem_t *filesystem;
+	int result;
+
+	filesystem = cmon->filesystems[unit];
+	if (!filesystem) {
+		co_passage_page->params[4] = -ENODEV;
+		return;
+	}
+
+	if (filesystem->async && co_passage_page->params[FUSE_PARAM_TOKEN] &&
+	    file_system_request_async(opcode) &&
+	    CO_OK(file_system_queue(cmon, filesystem, opcode)))
+		return;
+
+	co_passage_page->params[FUSE_PARAM_TOKEN] = 0;
+
+	co_os_mutex_acquire(filesystem->mutex);
+	result = file_system_request(cmon, filesystem, opcode, co_passage_page->params);
+	co_os_mutex_release(filesystem->mutex);
+
 	co_passage_page->params[4] = result;
 }
 
@@ -684,14 +1635,15 @@ void co_monitor_unregister_filesystems(co_monitor_t *cmon)
  *  Flat mode implementation.
  */
 
-static co_rc_t co_fs_get_attr(co_filesystem_t *fs, char *filename, struct fuse_attr *attr)
+static co_rc_t flat_mode_inode_rename(co_filesystem_t *filesystem, co_inode_t *old_inode, co_inode_t *new_inode,
+			     char *oldname, char *newname)
 {
-	co_rc_t rc;
-
-	rc = co_os_file_get_attr(filename, attr);
-	if (!CO_OK(rc))
-		return rc;
+	return co_os_fs_rename(filesystem, old_inode, oldname, new_inode, newname);
+}
 
+/* Host attributes as the mount options want them */
+static void flat_mode_attr_mask(co_filesystem_t *fs, struct fuse_attr *attr)
+{
 	if (fs->flags & COFS_MOUNT_NOATTRIB)
 		if (attr->mode & FUSE_S_IFDIR)
 			attr->mode = fs->dir_mode;
@@ -705,173 +1657,1242 @@ static co_rc_t co_fs_get_attr(co_filesystem_t *fs, char *filename, struct fuse_a
 
 	attr->uid = fs->uid;
 	attr->gid = fs->gid;
-
-	return rc;
 }
 
-static co_rc_t flat_mode_inode_rename(co_filesystem_t *filesystem, co_inode_t *old_inode, co_inode_t *new_inode,
-			     char *oldname, char *newname)
+static co_rc_t flat_mode_host_attr(co_filesystem_t *fs, co_inode_t *dir,
+				   char *name, struct fuse_attr *attr)
 {
-	char *old_dirname = NULL, *new_dirname = NULL;
-	co_rc_t rc;
+	flat_mode_attr_mask(fs, attr);
 
-	rc = co_os_fs_dir_inode_to_path(filesystem, old_inode, &old_dirname, oldname);
-	if (CO_OK(rc)) {
-		rc = co_os_fs_dir_inode_to_path(filesystem, new_inode, &new_dirname, newname);
-		if (CO_OK(rc)) {
-			rc = co_os_file_rename(old_dirname, new_dirname);
-			co_os_free(new_dirname);
-		}
-		co_os_free(old_dirname);
-	}
-
-	return rc;
+	return CO_RC(OK);
 }
 
-static co_rc_t flat_mode_getattr(co_filesystem_t *fs, co_inode_t *dir,
-				 char *name, struct fuse_attr *attr)
+static co_rc_t flat_mode_getdir(co_filesystem_t *fs, co_inode_t *dir, co_filesystem_dir_names_t *names)
 {
-	char *filename;
+	co_filesystem_name_t *name;
 	co_rc_t rc;
 
-	rc = co_os_fs_dir_inode_to_path(fs, dir, &filename, name);
+	rc = co_os_fs_getdir(fs, dir, names);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_fs_get_attr(fs, filename, attr);
-	co_os_free(filename);
+	co_list_each_entry(name, &names->list, node) {
+		if (name->has_attr)
+			flat_mode_attr_mask(fs, &name->attr);
+	}
 
 	return rc;
 }
 
-static co_rc_t flat_mode_getdir(co_filesystem_t *fs, co_inode_t *dir, co_filesystem_dir_names_t *names)
+static co_rc_t flat_mode_inode_read_write(co_monitor_t *linuxvm, co_filesystem_t *filesystem, co_inode_t *inode,
+				  unsigned long long offset, unsigned long size,
+				  vm_ptr_t src_buffer, bool_t read)
 {
-	char *dirname;
-	co_rc_t rc;
+	struct fuse_segment segment;
 
-	rc = co_os_fs_inode_to_path(fs, dir, &dirname, 1);
-	if (!CO_OK(rc))
-		return rc;
+	segment.address = src_buffer;
+	segment.size = size;
 
-	rc = co_os_file_getdir(dirname, names);
-	co_os_free(dirname);
-
-	return rc;
+	return filesystem->ops->inode_read_write_vector(linuxvm, filesystem, inode, offset,
+							&segment, 1, read);
 }
 
-static co_rc_t flat_mode_inode_read_write(co_monitor_t *linuxvm, co_filesystem_t *filesystem, co_inode_t *inode,
-				  unsigned long long offset, unsigned long size,
-				  vm_ptr_t src_buffer, bool_t read)
+/*
+ * The data goes with the mutex let go, on a handle that stays open until
+ * it is done. The inode may be forgotten meanwhile.
+ */
+static co_rc_t flat_mode_inode_read_write_vector(co_monitor_t *linuxvm, co_filesystem_t *filesystem,
+					co_inode_t *inode, unsigned long long offset,
+					struct fuse_segment *segments, unsigned long nr_segments,
+					bool_t read)
 {
-	char *filename;
+	co_fs_handle_t *handle;
+	unsigned long i;
+	int number;
 	co_rc_t rc;
 
-	rc = co_os_fs_inode_to_path(filesystem, inode, &filename, 0);
+	if (!inode)
+		return CO_RC(ERROR);
+
+	rc = inode_handle_get(filesystem, inode, !read, &handle);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_os_file_read_write(linuxvm, filename, offset, size, src_buffer, read);
-	co_os_free(filename);
+	handle->users++;
+	number = inode->number;
+	co_os_mutex_release(filesystem->mutex);
+
+	for (i = 0; i < nr_segments; i++) {
+		rc = co_os_file_handle_read_write(linuxvm, handle->file, offset, segments[i].size,
+						  segments[i].address, read);
+		if (!CO_OK(rc))
+			break;
+
+		offset += segments[i].size;
+	}
+
+	co_os_mutex_acquire(filesystem->mutex);
+
+	/* Attributes read meanwhile may not have seen the write */
+	inode = ino_num_to_inode(number, filesystem);
+	if (inode) {
+		if (!read)
+			inode->attr_valid = PFALSE;
+		if (!CO_OK(rc) && inode->handle == handle)
+			inode_handle_close(filesystem, inode);
+	}
+
+	handle_put(handle);
 
 	return rc;
 }
 
+/* Regular files only, with the owner of the mount */
 static co_rc_t flat_mode_inode_mknod(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
 			     unsigned long rdev, char *name, int *ino, struct fuse_attr *attr)
 {
-	char *filename;
-	co_rc_t rc;
+	if ((mode & FUSE_S_IFMT) != FUSE_S_IFREG)
+		return CO_RC(ACCESS_DENIED);
 
-	rc = co_os_fs_dir_inode_to_path(filesystem, inode, &filename, name);
-	if (!CO_OK(rc))
-		return rc;
+	attr->mode &= filesystem->file_mode;
+	attr->uid = filesystem->uid;
+	attr->gid = filesystem->gid;
+	attr->rdev = 0;
 
-	rc = co_os_file_mknod(filesystem, filename, mode);
-	co_os_free(filename);
+	return co_os_fs_mknod(filesystem, inode, name, mode);
+}
 
-	return rc;
+static co_rc_t flat_mode_inode_symlink(co_filesystem_t *filesystem, co_inode_t *dir, char *name,
+				       char *target, unsigned long uid, unsigned long gid)
+{
+	return CO_RC(ACCESS_DENIED);
+}
+
+static co_rc_t flat_mode_inode_readlink(co_filesystem_t *filesystem, co_inode_t *inode,
+					char *target, unsigned long *size)
+{
+	return CO_RC(INVALID_PARAMETER);
 }
 
 static co_rc_t flat_mode_inode_set_attr(co_filesystem_t *filesystem, co_inode_t *inode,
 				unsigned long valid, struct fuse_attr *attr)
 {
-	char *filename;
+	if (filesystem->flags & COFS_MOUNT_NOATTRIB)
+		valid &= ~FATTR_MODE;
+
+	return co_os_fs_set_attr(filesystem, inode, valid, attr);
+}
+
+static co_rc_t flat_mode_inode_mkdir(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
+			     char *name, unsigned long uid, unsigned long gid)
+{
+	return co_os_fs_mkdir(filesystem, inode, name, mode);
+}
+
+static co_rc_t flat_mode_inode_unlink(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+{
+	return co_os_fs_unlink(filesystem, inode, name);
+}
+
+static co_rc_t flat_mode_inode_rmdir(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+{
+	return co_os_fs_rmdir(filesystem, inode, name);
+}
+
+static co_rc_t flat_mode_fs_stat(co_filesystem_t *filesystem, struct fuse_statfs_out *statfs)
+{
+	return co_os_file_fs_stat(filesystem, statfs);
+}
+
+static struct co_filesystem_ops flat_mode = {
+	.inode_rename = flat_mode_inode_rename,
+	.host_attr = flat_mode_host_attr,
+	.getdir = flat_mode_getdir,
+	.inode_read_write = flat_mode_inode_read_write,
+	.inode_read_write_vector = flat_mode_inode_read_write_vector,
+	.inode_mknod = flat_mode_inode_mknod,
+	.inode_symlink = flat_mode_inode_symlink,
+	.inode_readlink = flat_mode_inode_readlink,
+	.inode_set_attr = flat_mode_inode_set_attr,
+	.inode_mkdir = flat_mode_inode_mkdir,
+	.inode_unlink = flat_mode_inode_unlink,
+	.inode_rmdir = flat_mode_inode_rmdir,
+	.fs_stat = flat_mode_fs_stat,
+};
+
+/*
+ *  UNIX meta data mode.
+ *
+ * The mode, owner, device number and symlink target of the files live
+ * in one store per cofs device, CO_FS_META_NAME at the root of the
+ * mapped host directory, keyed by the pathname under that root. Files
+ * without a record look as in flat mode. Symlinks and special files
+ * are empty regular files on the host.
+ *
+ * The store is mapped into memory and holds a log of records, each one
+ * replacing the earlier ones of its key, and the index of the live ones
+ * is built from it at mount. Records carry a checksum and the generation
+ * of the log, and the last one of an update is marked, so whatever part
+ * of the log makes it to the disk replays to the state after a complete
+ * update. Nothing is forced out for an update. When the log reaches the
+ * end of the file, the live records are copied to a free part of it and
+ * written out, and only then is the header switched over to them.
+ */
+
+#define META_ALIGN(size)		(((size) + sizeof(unsigned long) - 1) & \
+					 ~(sizeof(unsigned long) - 1))
+#define META_LOG_START			META_ALIGN(sizeof(co_fs_meta_header_t))
+#define META_RECORD_SIZE(key_len, link_len) \
+	META_ALIGN(sizeof(co_fs_meta_record_t) + (key_len) + (link_len))
+#define META_INDEX_SIZE			0x100
+
+/* FNV-1a, as name_hash() */
+static unsigned long meta_hash(const void *data, unsigned long size)
+{
+	const unsigned char *bytes = data;
+	unsigned long hash = 2166136261UL;
+
+	while (size--) {
+		hash ^= *bytes++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+static co_fs_meta_header_t *meta_header(co_fs_meta_t *meta)
+{
+	return (co_fs_meta_header_t *)meta->map;
+}
+
+static co_fs_meta_record_t *meta_record(co_fs_meta_t *meta, unsigned long offset)
+{
+	return (co_fs_meta_record_t *)(meta->map + offset);
+}
+
+static unsigned long meta_check(co_fs_meta_record_t *record)
+{
+	return meta_hash(&record->generation, record->size - sizeof(record->check));
+}
+
+static unsigned long meta_entry_key(co_list_t *node)
+{
+	return co_list_entry(node, co_fs_meta_entry_t, node)->hash;
+}
+
+static co_fs_meta_entry_t *meta_find(co_fs_meta_t *meta, const char *key, int len,
+				     unsigned long hash)
+{
+	co_fs_meta_record_t *record;
+	co_fs_meta_entry_t *entry;
+
+	if (!meta->index.buckets)
+		return NULL;
+
+	co_list_each_entry(entry, fs_hash_bucket(&meta->index, hash), node) {
+		record = meta_record(meta, entry->offset);
+		if (entry->hash == hash && record->key_len == len &&
+		    co_memcmp(record->data, (char *)key, len) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static co_fs_meta_record_t *meta_lookup(co_fs_meta_t *meta, const char *key, int len)
+{
+	co_fs_meta_entry_t *entry;
+
+	entry = meta_find(meta, key, len, meta_hash(key, len));
+	if (!entry)
+		return NULL;
+
+	return meta_record(meta, entry->offset);
+}
+
+/* Whether a whole record of the log's generation starts at 'offset' */
+static bool_t meta_record_valid(co_fs_meta_t *meta, unsigned long offset, unsigned long limit)
+{
+	co_fs_meta_record_t *record;
+
+	if (offset + sizeof(*record) > limit)
+		return PFALSE;
+
+	record = meta_record(meta, offset);
+	if (record->generation != meta_header(meta)->generation ||
+	    record->size < META_RECORD_SIZE(record->key_len, record->link_len) ||
+	    record->size != META_ALIGN(record->size) ||
+	    offset + record->size > limit)
+		return PFALSE;
+
+	return record->check == meta_check(record);
+}
+
+/* Puts the record at 'offset' into the index, or takes its key out of it */
+static co_rc_t meta_apply(co_fs_meta_t *meta, unsigned long offset)
+{
+	co_fs_meta_record_t *record = meta_record(meta, offset);
+	unsigned long hash = meta_hash(record->data, record->key_len);
+	co_fs_meta_entry_t *entry;
 	co_rc_t rc;
 
-	rc = co_os_fs_inode_to_path(filesystem, inode, &filename, 0);
+	entry = meta_find(meta, record->data, record->key_len, hash);
+	if (entry) {
+		meta->live -= meta_record(meta, entry->offset)->size;
+		if (record->flags & CO_FS_META_DELETED) {
+			fs_hash_del(&meta->index, &entry->node);
+			co_os_free(entry);
+			return CO_RC(OK);
+		}
+	} else {
+		if (record->flags & CO_FS_META_DELETED)
+			return CO_RC(OK);
+
+		entry = co_os_malloc(sizeof(*entry));
+		if (!entry)
+			return CO_RC(OUT_OF_MEMORY);
+
+		entry->hash = hash;
+		rc = fs_hash_add(&meta->index, &entry->node, META_INDEX_SIZE, meta_entry_key);
+		if (!CO_OK(rc)) {
+			co_os_free(entry);
+			return rc;
+		}
+	}
+
+	entry->offset = offset;
+	meta->live += record->size;
+
+	return CO_RC(OK);
+}
+
+/* Indexes the complete updates of the log after its end, up to 'limit' */
+static co_rc_t meta_replay(co_fs_meta_t *meta, unsigned long limit)
+{
+	co_fs_meta_record_t *record;
+	unsigned long offset = meta->end;
+	co_rc_t rc;
+
+	while (meta_record_valid(meta, offset, limit)) {
+		record = meta_record(meta, offset);
+		offset += record->size;
+		if (!(record->flags & CO_FS_META_LAST))
+			continue;
+
+		while (meta->end < offset) {
+			rc = meta_apply(meta, meta->end);
+			if (!CO_OK(rc))
+				return rc;
+			meta->end += meta_record(meta, meta->end)->size;
+		}
+	}
+
+	return CO_RC(OK);
+}
+
+/* The store is at the root of the device, whatever path is mounted */
+static co_rc_t meta_map(co_filesystem_t *filesystem, unsigned long *size, void **map)
+{
+	co_pathname_t pathname;
+	co_rc_t rc;
+
+	co_memcpy(&pathname, &filesystem->desc->pathname, sizeof(pathname));
+	rc = co_os_fs_dir_join_unix_path(&pathname, CO_FS_META_NAME);
 	if (!CO_OK(rc))
 		return rc;
 
-	if (filesystem->flags & COFS_MOUNT_NOATTRIB)
-		valid &= ~FATTR_MODE;
+	return co_os_fs_meta_map(filesystem, pathname, size, map);
+}
 
-	rc = co_os_file_set_attr(filename, valid, attr);
-	co_os_free(filename);
+static co_rc_t meta_grow(co_filesystem_t *filesystem, unsigned long size)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	unsigned long new_size = meta->size;
+	void *map;
+	co_rc_t rc;
+
+	while (new_size < size)
+		new_size *= 2;
+
+	if (new_size > CO_FS_META_MAX_SIZE)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_os_fs_meta_unmap(filesystem);
+
+	rc = meta_map(filesystem, &new_size, &map);
+	if (!CO_OK(rc)) {
+		new_size = meta->size;
+		if (!CO_OK(meta_map(filesystem, &new_size, &map))) {
+			meta->map = NULL;
+			return rc;
+		}
+	}
+
+	meta->map = map;
+	meta->size = new_size;
 
 	return rc;
 }
 
-static co_rc_t flat_mode_inode_mkdir(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
-			     char *name)
+/*
+ * Copies the live records to a free part of the store, leaving room for
+ * 'size' bytes of records after them, and makes them the log.
+ */
+static co_rc_t meta_compact(co_filesystem_t *filesystem, unsigned long size)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_header_t *header;
+	co_fs_meta_record_t *record;
+	co_fs_meta_entry_t *entry;
+	unsigned long start, offset, last = 0, generation, i;
+	co_rc_t rc;
+
+	/* Before the log if they fit there, after it otherwise */
+	start = META_LOG_START;
+	if (start + meta->live + size > meta_header(meta)->start)
+		start = meta->end;
+
+	/* As much room again as there is live, or compactions come too often */
+	if (start + 2 * meta->live + size > meta->size) {
+		rc = meta_grow(filesystem, start + 2 * meta->live + size);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	header = meta_header(meta);
+	generation = header->generation + 1;
+	offset = start;
+
+	for (i = 0; i < meta->index.size; i++) {
+		co_list_each_entry(entry, &meta->index.buckets[i], node) {
+			record = meta_record(meta, entry->offset);
+			co_memcpy(meta->map + offset, record, record->size);
+			entry->offset = offset;
+
+			record = meta_record(meta, offset);
+			record->generation = generation;
+			record->flags = 0;
+			record->check = meta_check(record);
+
+			last = offset;
+			offset += record->size;
+		}
+	}
+
+	if (offset > start) {
+		record = meta_record(meta, last);
+		record->flags |= CO_FS_META_LAST;
+		record->check = meta_check(record);
+	}
+
+	co_os_fs_meta_dirty(filesystem, start, offset - start);
+	rc = co_os_fs_meta_flush(filesystem);
+	if (CO_OK(rc)) {
+		header->generation = generation;
+		header->start = start;
+		co_os_fs_meta_dirty(filesystem, 0, sizeof(*header));
+		rc = co_os_fs_meta_flush(filesystem);
+	}
+
+	/* The index points to the copies now */
+	if (!CO_OK(rc)) {
+		meta_close(filesystem);
+		return rc;
+	}
+
+	meta->end = offset;
+
+	return CO_RC(OK);
+}
+
+/* Makes room for an update of 'size' bytes of records after the log */
+static co_rc_t meta_begin(co_filesystem_t *filesystem, unsigned long size)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_rc_t rc;
+
+	if (!meta->map)
+		return CO_RC(ERROR);
+
+	if (meta->end + size > meta->size) {
+		rc = meta_compact(filesystem, size);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	meta->update = meta->end;
+	meta->last = 0;
+
+	return CO_RC(OK);
+}
+
+/* A record of the update, with the values and flags of 'values' */
+static void meta_add(co_fs_meta_t *meta, co_fs_meta_record_t *values,
+		     const char *key, int key_len, const char *link, int link_len)
+{
+	unsigned long size = META_RECORD_SIZE(key_len, link_len);
+	co_fs_meta_record_t *record = meta_record(meta, meta->update);
+
+	co_memset(record, 0, size);
+	record->generation = meta_header(meta)->generation;
+	record->size = size;
+	record->flags = values->flags & CO_FS_META_DELETED;
+	record->key_len = key_len;
+	record->link_len = link_len;
+	record->mode = values->mode;
+	record->uid = values->uid;
+	record->gid = values->gid;
+	record->rdev = values->rdev;
+	co_memcpy(record->data, (char *)key, key_len);
+	if (link_len)
+		co_memcpy(record->data + key_len, (char *)link, link_len);
+	record->check = meta_check(record);
+
+	meta->last = meta->update;
+	meta->update += size;
+}
+
+static void meta_add_deleted(co_fs_meta_t *meta, const char *key, int key_len)
+{
+	co_fs_meta_record_t values;
+
+	co_memset(&values, 0, sizeof(values));
+	values.flags = CO_FS_META_DELETED;
+	meta_add(meta, &values, key, key_len, NULL, 0);
+}
+
+/* Marks the end of the update, it is part of the log from now on */
+static co_rc_t meta_commit(co_filesystem_t *filesystem)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_record_t *record;
+	co_rc_t rc;
+
+	if (!meta->last)
+		return CO_RC(OK);
+
+	record = meta_record(meta, meta->last);
+	record->flags |= CO_FS_META_LAST;
+	record->check = meta_check(record);
+
+	co_os_fs_meta_dirty(filesystem, meta->end, meta->update - meta->end);
+
+	rc = meta_replay(meta, meta->update);
+	if (!CO_OK(rc)) {
+		/* The index no longer matches the log */
+		meta_close(filesystem);
+	}
+
+	return rc;
+}
+
+/* Whether 'key' is 'dir' itself or below it */
+static bool_t meta_key_under(const char *key, int len, const char *dir, int dir_len)
+{
+	if (dir_len == 0)
+		return PTRUE;
+
+	if (len < dir_len || co_memcmp((char *)key, (char *)dir, dir_len) != 0)
+		return PFALSE;
+
+	return len == dir_len || key[dir_len] == '/';
+}
+
+/* The index entries of 'key', and with 'tree' of the keys below it, in a new array */
+static co_rc_t meta_collect(co_fs_meta_t *meta, const char *key, int len, bool_t tree,
+			    co_fs_meta_entry_t ***entries_out, int *count_out)
+{
+	co_fs_meta_entry_t **entries, *entry;
+	co_fs_meta_record_t *record;
+	unsigned long i;
+	int count = 0;
+
+	*entries_out = NULL;
+	*count_out = 0;
+
+	if (!tree) {
+		entry = meta_find(meta, key, len, meta_hash(key, len));
+		if (!entry)
+			return CO_RC(OK);
+
+		entries = co_os_malloc(sizeof(*entries));
+		if (!entries)
+			return CO_RC(OUT_OF_MEMORY);
+
+		entries[0] = entry;
+		*entries_out = entries;
+		*count_out = 1;
+		return CO_RC(OK);
+	}
+
+	if (meta->index.count == 0)
+		return CO_RC(OK);
+
+	entries = co_os_malloc(meta->index.count * sizeof(*entries));
+	if (!entries)
+		return CO_RC(OUT_OF_MEMORY);
+
+	for (i = 0; i < meta->index.size; i++) {
+		co_list_each_entry(entry, &meta->index.buckets[i], node) {
+			record = meta_record(meta, entry->offset);
+			if (meta_key_under(record->data, record->key_len, key, len))
+				entries[count++] = entry;
+		}
+	}
+
+	*entries_out = entries;
+	*count_out = count;
+
+	return CO_RC(OK);
+}
+
+/* Drops the record of 'key', and with 'tree' those of the keys below it */
+static co_rc_t meta_remove(co_filesystem_t *filesystem, const char *key, int len, bool_t tree)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_entry_t **entries;
+	co_fs_meta_record_t *record;
+	unsigned long size = 0;
+	int count, i;
+	co_rc_t rc;
+
+	rc = meta_collect(meta, key, len, tree, &entries, &count);
+	if (!CO_OK(rc) || count == 0)
+		return rc;
+
+	for (i = 0; i < count; i++)
+		size += META_RECORD_SIZE(meta_record(meta, entries[i]->offset)->key_len, 0);
+
+	rc = meta_begin(filesystem, size);
+	if (CO_OK(rc)) {
+		for (i = 0; i < count; i++) {
+			record = meta_record(meta, entries[i]->offset);
+			meta_add_deleted(meta, record->data, record->key_len);
+		}
+		rc = meta_commit(filesystem);
+	}
+
+	co_os_free(entries);
+	return rc;
+}
+
+/* Moves the records of 'key' and below it to 'new_key', dropping those there */
+static co_rc_t meta_move(co_filesystem_t *filesystem, const char *key, int len,
+			 const char *new_key, int new_len)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_entry_t **entries, **replaced;
+	co_fs_meta_record_t *record;
+	int count, replaced_count, i, key_len;
+	unsigned long size = 0;
+	char *buffer = NULL;
+	co_rc_t rc;
+
+	rc = meta_collect(meta, key, len, PTRUE, &entries, &count);
+	if (!CO_OK(rc))
+		return rc;
+
+	/* What was at the new name goes, even with nothing to move there */
+	rc = meta_collect(meta, new_key, new_len, PTRUE, &replaced, &replaced_count);
+	if (!CO_OK(rc) || count + replaced_count == 0)
+		goto out;
+
+	buffer = co_os_malloc(CO_FS_META_KEY_MAX + 1);
+	if (!buffer) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+
+	for (i = 0; i < replaced_count; i++)
+		size += META_RECORD_SIZE(meta_record(meta, replaced[i]->offset)->key_len, 0);
+
+	for (i = 0; i < count; i++) {
+		record = meta_record(meta, entries[i]->offset);
+		size += META_RECORD_SIZE(record->key_len, 0);
+		size += META_RECORD_SIZE(new_len + record->key_len - len, record->link_len);
+	}
+
+	rc = meta_begin(filesystem, size);
+	if (!CO_OK(rc))
+		goto out;
+
+	for (i = 0; i < replaced_count; i++) {
+		record = meta_record(meta, replaced[i]->offset);
+		meta_add_deleted(meta, record->data, record->key_len);
+	}
+
+	for (i = 0; i < count; i++) {
+		record = meta_record(meta, entries[i]->offset);
+
+		/* Too deep below the new name, the record is lost */
+		key_len = new_len + record->key_len - len;
+		if (key_len <= CO_FS_META_KEY_MAX) {
+			co_memcpy(buffer, (char *)new_key, new_len);
+			co_memcpy(buffer + new_len, record->data + len, record->key_len - len);
+			meta_add(meta, record, buffer, key_len,
+				 record->data + record->key_len, record->link_len);
+		}
+
+		meta_add_deleted(meta, record->data, record->key_len);
+	}
+
+	rc = meta_commit(filesystem);
+
+out:
+	if (buffer)
+		co_os_free(buffer);
+	if (replaced)
+		co_os_free(replaced);
+	if (entries)
+		co_os_free(entries);
+	return rc;
+}
+
+/* The keys are pathnames under the root of the device, the mount may be below it */
+static co_rc_t meta_set_prefix(co_fs_meta_t *meta, const char *pathname)
+{
+	int len;
+
+	while (*pathname == '/')
+		pathname++;
+
+	len = co_strlen(pathname);
+	while (len > 0 && pathname[len - 1] == '/')
+		len--;
+
+	if (len > CO_FS_META_KEY_MAX)
+		return CO_RC(INVALID_PARAMETER);
+
+	meta->prefix = co_os_malloc(len + 1);
+	if (!meta->prefix)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memcpy(meta->prefix, (char *)pathname, len);
+	meta->prefix[len] = '\0';
+	meta->prefix_len = len;
+
+	return CO_RC(OK);
+}
+
+/*
+ * The key of 'name' in 'dir', or of 'dir' for an empty name, allocated
+ * with 'room' bytes to spare. The caller frees it.
+ */
+static co_rc_t meta_key(co_filesystem_t *filesystem, co_inode_t *dir, const char *name,
+			int room, char **key_out, int *len_out)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	int len = meta->prefix_len, name_len;
+	co_inode_t *scan;
+	char *key, *p;
+
+	name_len = name ? co_strlen(name) : 0;
+	if (name_len)
+		len += name_len + 1;
+	for (scan = dir; scan && scan->name; scan = scan->parent)
+		len += co_strlen(scan->name) + 1;
+
+	/* No separator before the first name */
+	if (meta->prefix_len == 0 && len > 0)
+		len--;
+
+	if (len > CO_FS_META_KEY_MAX)
+		return CO_RC(INVALID_PARAMETER);
+
+	key = co_os_malloc(len + room + 1);
+	if (!key)
+		return CO_RC(OUT_OF_MEMORY);
+
+	p = key + len;
+	*p = '\0';
+
+	if (name_len) {
+		p -= name_len;
+		co_memcpy(p, (char *)name, name_len);
+		if (p > key)
+			*--p = '/';
+	}
+
+	for (scan = dir; scan && scan->name; scan = scan->parent) {
+		name_len = co_strlen(scan->name);
+		p -= name_len;
+		co_memcpy(p, scan->name, name_len);
+		if (p > key)
+			*--p = '/';
+	}
+
+	co_memcpy(key, meta->prefix, meta->prefix_len);
+
+	*key_out = key;
+	*len_out = len;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t meta_inode_key(co_filesystem_t *filesystem, co_inode_t *inode,
+			      char **key_out, int *len_out)
+{
+	return meta_key(filesystem, inode->parent, inode->name, 0, key_out, len_out);
+}
+
+/* The store itself is not part of the file system */
+static bool_t meta_hidden(const char *key, int len)
+{
+	return len == sizeof(CO_FS_META_NAME) - 1 &&
+	       co_memcmp((char *)key, CO_FS_META_NAME, len) == 0;
+}
+
+/* Directories are real, everything else is a regular file on the host */
+static unsigned long meta_type(co_fs_meta_record_t *record, bool_t host_dir)
+{
+	unsigned long type = record->mode & FUSE_S_IFMT;
+
+	if (host_dir)
+		return FUSE_S_IFDIR;
+
+	if (type == FUSE_S_IFDIR || type == 0)
+		return FUSE_S_IFREG;
+
+	return type;
+}
+
+static void meta_attr(co_fs_meta_record_t *record, struct fuse_attr *attr)
+{
+	unsigned long type;
+
+	type = meta_type(record, (attr->mode & FUSE_S_IFMT) == FUSE_S_IFDIR);
+
+	attr->mode = type | (record->mode & 07777);
+	attr->uid = record->uid;
+	attr->gid = record->gid;
+	attr->rdev = record->rdev;
+	if (type == FUSE_S_IFLNK)
+		attr->size = record->link_len;
+}
+
+static co_rc_t meta_open(co_filesystem_t *filesystem, const char *pathname)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_header_t *header;
+	unsigned long size = CO_FS_META_INITIAL_SIZE;
+	void *map;
+	co_rc_t rc;
+
+	rc = meta_set_prefix(meta, pathname);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = meta_map(filesystem, &size, &map);
+	if (!CO_OK(rc)) {
+		meta_close(filesystem);
+		return rc;
+	}
+
+	meta->map = map;
+	meta->size = size;
+
+	header = meta_header(meta);
+	if (header->magic == 0) {
+		header->magic = CO_FS_META_MAGIC;
+		header->version = CO_FS_META_VERSION;
+		header->generation = 1;
+		header->start = META_LOG_START;
+		co_os_fs_meta_dirty(filesystem, 0, sizeof(*header));
+	} else if (header->magic != CO_FS_META_MAGIC ||
+		   header->version != CO_FS_META_VERSION ||
+		   header->start < META_LOG_START ||
+		   header->start > size ||
+		   header->start != META_ALIGN(header->start)) {
+		co_debug("cofs%d: %s is not a meta data store", filesystem->unit, CO_FS_META_NAME);
+		meta_close(filesystem);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	meta->end = header->start;
+	rc = meta_replay(meta, meta->size);
+	if (!CO_OK(rc)) {
+		meta_close(filesystem);
+		return rc;
+	}
+
+	co_debug_lvl(filesystem, 5, "cofs%d: %ld meta data records, %ld bytes of %ld",
+		     filesystem->unit, meta->index.count, meta->end - header->start, meta->size);
+
+	return CO_RC(OK);
+}
+
+static void meta_close(co_filesystem_t *filesystem)
+{
+	co_fs_meta_t *meta = &filesystem->meta;
+	co_fs_meta_entry_t *entry;
+	unsigned long i;
+
+	if (meta->map) {
+		co_os_fs_meta_flush(filesystem);
+		co_os_fs_meta_unmap(filesystem);
+	}
+
+	for (i = 0; i < meta->index.size; i++) {
+		while (!co_list_empty(&meta->index.buckets[i])) {
+			co_list_entry_assign(meta->index.buckets[i].next, entry, node);
+			co_list_del(&entry->node);
+			co_os_free(entry);
+		}
+	}
+
+	fs_hash_free(&meta->index);
+
+	if (meta->prefix)
+		co_os_free(meta->prefix);
+
+	co_memset(meta, 0, sizeof(*meta));
+}
+
+static co_rc_t unix_mode_host_attr(co_filesystem_t *fs, co_inode_t *dir,
+				   char *name, struct fuse_attr *attr)
 {
-	char *dirname;
+	co_fs_meta_record_t *record;
+	char *key;
+	int len;
 	co_rc_t rc;
 
-	rc = co_os_fs_dir_inode_to_path(filesystem, inode, &dirname, name);
+	rc = meta_key(fs, dir, name, 0, &key, &len);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_os_file_mkdir(dirname);
-	co_os_free(dirname);
+	if (meta_hidden(key, len)) {
+		rc = CO_RC(NOT_FOUND);
+	} else {
+		flat_mode_attr_mask(fs, attr);
+		record = meta_lookup(&fs->meta, key, len);
+		if (record)
+			meta_attr(record, attr);
+	}
 
+	co_os_free(key);
 	return rc;
 }
 
-static co_rc_t flat_mode_inode_unlink(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+static co_rc_t unix_mode_getattr(co_filesystem_t *fs, co_inode_t *dir,
+				 char *name, struct fuse_attr *attr)
+{
+	co_rc_t rc;
+
+	rc = co_os_fs_get_attr(fs, dir, name, attr);
+	if (!CO_OK(rc))
+		return rc;
+
+	return unix_mode_host_attr(fs, dir, name, attr);
+}
+
+static co_rc_t unix_mode_getdir(co_filesystem_t *fs, co_inode_t *dir, co_filesystem_dir_names_t *names)
+{
+	co_filesystem_name_t *name, *name_next;
+	co_fs_meta_record_t *record;
+	int dir_len, len;
+	char *key;
+	co_rc_t rc;
+
+	rc = flat_mode_getdir(fs, dir, names);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = meta_key(fs, dir, NULL, FUSE_NAME_MAX + 1, &key, &dir_len);
+	if (!CO_OK(rc)) {
+		co_filesystem_getdir_free(names);
+		return rc;
+	}
+
+	/* Nothing to hide below the root, nothing to look up without records */
+	if (dir_len != 0 && fs->meta.index.count == 0) {
+		co_os_free(key);
+		return CO_RC(OK);
+	}
+
+	if (dir_len != 0)
+		key[dir_len++] = '/';
+
+	co_list_each_entry_safe(name, name_next, &names->list, node) {
+		len = co_strlen(name->name);
+		if (len > FUSE_NAME_MAX || dir_len + len > CO_FS_META_KEY_MAX)
+			continue;
+
+		co_memcpy(key + dir_len, name->name, len);
+		len += dir_len;
+
+		if (meta_hidden(key, len)) {
+			co_list_del(&name->node);
+			co_os_free(name);
+			continue;
+		}
+
+		record = meta_lookup(&fs->meta, key, len);
+		if (!record)
+			continue;
+
+		name->type = meta_type(record, name->type == FUSE_DT_DIR) >> 12;
+		if (name->has_attr)
+			meta_attr(record, &name->attr);
+	}
+
+	co_os_free(key);
+	return CO_RC(OK);
+}
+
+/* The host file or directory of a new entry, and its record */
+static co_rc_t unix_mode_create(co_filesystem_t *filesystem, co_inode_t *dir, char *name,
+				co_fs_meta_record_t *values, const char *link)
 {
-	char *filename;
+	bool_t directory = (values->mode & FUSE_S_IFMT) == FUSE_S_IFDIR;
+	int len, link_len = link ? co_strlen(link) : 0;
+	char *key;
 	co_rc_t rc;
 
-	rc = co_os_fs_dir_inode_to_path(filesystem, inode, &filename, name);
+	rc = meta_key(filesystem, dir, name, 0, &key, &len);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_os_file_unlink(filename);
-	co_os_free(filename);
+	if (meta_hidden(key, len))
+		rc = CO_RC(ACCESS_DENIED);
+	else
+		rc = meta_begin(filesystem, META_RECORD_SIZE(len, link_len));
+
+	if (CO_OK(rc)) {
+		if (directory)
+			rc = co_os_fs_mkdir(filesystem, dir, name, FUSE_S_IFDIR | 0755);
+		else
+			rc = co_os_fs_mknod(filesystem, dir, name, FUSE_S_IFREG | 0644);
+	}
+
+	if (CO_OK(rc)) {
+		values->flags = 0;
+		meta_add(&filesystem->meta, values, key, len, link, link_len);
+		rc = meta_commit(filesystem);
+		if (!CO_OK(rc)) {
+			if (directory)
+				co_os_fs_rmdir(filesystem, dir, name);
+			else
+				co_os_fs_unlink(filesystem, dir, name);
+		}
+	}
 
+	co_os_free(key);
 	return rc;
 }
 
-static co_rc_t flat_mode_inode_rmdir(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+static co_rc_t unix_mode_inode_mknod(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
+				     unsigned long rdev, char *name, int *ino, struct fuse_attr *attr)
 {
-	char *dirname;
+	co_fs_meta_record_t values;
+
+	if ((mode & FUSE_S_IFMT) == FUSE_S_IFDIR)
+		return CO_RC(INVALID_PARAMETER);
+
+	if ((mode & FUSE_S_IFMT) == 0)
+		attr->mode |= FUSE_S_IFREG;
+	if ((attr->mode & FUSE_S_IFMT) != FUSE_S_IFCHR && (attr->mode & FUSE_S_IFMT) != FUSE_S_IFBLK)
+		attr->rdev = 0;
+
+	co_memset(&values, 0, sizeof(values));
+	values.mode = attr->mode;
+	values.uid = attr->uid;
+	values.gid = attr->gid;
+	values.rdev = attr->rdev;
+
+	return unix_mode_create(filesystem, inode, name, &values, NULL);
+}
+
+static co_rc_t unix_mode_inode_mkdir(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
+				     char *name, unsigned long uid, unsigned long gid)
+{
+	co_fs_meta_record_t values;
+
+	co_memset(&values, 0, sizeof(values));
+	values.mode = FUSE_S_IFDIR | (mode & 07777);
+	values.uid = uid;
+	values.gid = gid;
+
+	return unix_mode_create(filesystem, inode, name, &values, NULL);
+}
+
+static co_rc_t unix_mode_inode_symlink(co_filesystem_t *filesystem, co_inode_t *dir, char *name,
+				       char *target, unsigned long uid, unsigned long gid)
+{
+	co_fs_meta_record_t values;
+
+	co_memset(&values, 0, sizeof(values));
+	values.mode = FUSE_S_IFLNK | 0777;
+	values.uid = uid;
+	values.gid = gid;
+
+	return unix_mode_create(filesystem, dir, name, &values, target);
+}
+
+static co_rc_t unix_mode_inode_readlink(co_filesystem_t *filesystem, co_inode_t *inode,
+					char *target, unsigned long *size)
+{
+	co_fs_meta_record_t *record;
+	char *key;
+	int len;
 	co_rc_t rc;
 
-	rc = co_os_fs_dir_inode_to_path(filesystem, inode, &dirname, name);
+	rc = meta_inode_key(filesystem, inode, &key, &len);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_os_file_rmdir(dirname);
-	co_os_free(dirname);
+	record = meta_lookup(&filesystem->meta, key, len);
+	if (record && (record->mode & FUSE_S_IFMT) == FUSE_S_IFLNK) {
+		if (*size > record->link_len)
+			*size = record->link_len;
+		co_memcpy(target, record->data + record->key_len, *size);
+	} else {
+		rc = CO_RC(INVALID_PARAMETER);
+	}
 
+	co_os_free(key);
 	return rc;
 }
 
+/* Mode and owner go to the record, the rest to the host file */
+static co_rc_t unix_mode_inode_set_attr(co_filesystem_t *filesystem, co_inode_t *inode,
+					unsigned long valid, struct fuse_attr *attr)
+{
+	co_fs_meta_record_t *record, values;
+	struct fuse_attr current;
+	unsigned long link_len;
+	char *key;
+	int len;
+	co_rc_t rc;
 
-static co_rc_t flat_mode_fs_stat(co_filesystem_t *filesystem, struct fuse_statfs_out *statfs)
+	if (!inode)
+		return CO_RC(ERROR);
+
+	if (valid & (FATTR_MODE | FATTR_UID | FATTR_GID)) {
+		rc = meta_inode_key(filesystem, inode, &key, &len);
+		if (!CO_OK(rc))
+			return rc;
+
+		rc = unix_mode_getattr(filesystem, inode->parent, inode->name ? inode->name : "",
+				       &current);
+		if (CO_OK(rc)) {
+			record = meta_lookup(&filesystem->meta, key, len);
+			link_len = record ? record->link_len : 0;
+			rc = meta_begin(filesystem, META_RECORD_SIZE(len, link_len));
+		}
+
+		if (CO_OK(rc)) {
+			co_memset(&values, 0, sizeof(values));
+			values.mode = current.mode;
+			if (valid & FATTR_MODE)
+				values.mode = (current.mode & FUSE_S_IFMT) | (attr->mode & 07777);
+			values.uid = (valid & FATTR_UID) ? attr->uid : current.uid;
+			values.gid = (valid & FATTR_GID) ? attr->gid : current.gid;
+			values.rdev = current.rdev;
+
+			/* Found again, the log may have moved */
+			record = meta_lookup(&filesystem->meta, key, len);
+			meta_add(&filesystem->meta, &values, key, len,
+				 record ? record->data + record->key_len : NULL, link_len);
+			rc = meta_commit(filesystem);
+		}
+
+		co_os_free(key);
+		if (!CO_OK(rc))
+			return rc;
+
+		valid &= ~(FATTR_MODE | FATTR_UID | FATTR_GID);
+	}
+
+	if (!valid)
+		return CO_RC(OK);
+
+	return co_os_fs_set_attr(filesystem, inode, valid, attr);
+}
+
+static co_rc_t unix_mode_inode_unlink(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
 {
-	return co_os_file_fs_stat(filesystem, statfs);
+	char *key;
+	int len;
+	co_rc_t rc;
+
+	rc = meta_key(filesystem, inode, name, 0, &key, &len);
+	if (!CO_OK(rc))
+		return rc;
+
+	if (meta_hidden(key, len))
+		rc = CO_RC(ACCESS_DENIED);
+	else
+		rc = co_os_fs_unlink(filesystem, inode, name);
+
+	/* The file is gone, a record left behind would only go to a new one */
+	if (CO_OK(rc) && !CO_OK(meta_remove(filesystem, key, len, PFALSE)))
+		co_debug("cofs%d: stale meta data of '%s'", filesystem->unit, key);
+
+	co_os_free(key);
+	return rc;
 }
 
-static struct co_filesystem_ops flat_mode = {
-	.inode_rename = flat_mode_inode_rename,
-	.getattr = flat_mode_getattr,
-	.getdir = flat_mode_getdir,
+static co_rc_t unix_mode_inode_rmdir(co_filesystem_t *filesystem, co_inode_t *inode, char *name)
+{
+	char *key;
+	int len;
+	co_rc_t rc;
+
+	rc = meta_key(filesystem, inode, name, 0, &key, &len);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_fs_rmdir(filesystem, inode, name);
+	if (CO_OK(rc) && !CO_OK(meta_remove(filesystem, key, len, PTRUE)))
+		co_debug("cofs%d: stale meta data of '%s'", filesystem->unit, key);
+
+	co_os_free(key);
+	return rc;
+}
+
+static co_rc_t unix_mode_inode_rename(co_filesystem_t *filesystem, co_inode_t *old_inode,
+				      co_inode_t *new_inode, char *oldname, char *newname)
+{
+	char *key, *new_key;
+	int len, new_len;
+	co_rc_t rc;
+
+	rc = meta_key(filesystem, old_inode, oldname, 0, &key, &len);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = meta_key(filesystem, new_inode, newname, 0, &new_key, &new_len);
+	if (!CO_OK(rc)) {
+		co_os_free(key);
+		return rc;
+	}
+
+	if (meta_hidden(key, len) || meta_hidden(new_key, new_len))
+		rc = CO_RC(ACCESS_DENIED);
+	else
+		rc = co_os_fs_rename(filesystem, old_inode, oldname, new_inode, newname);
+
+	if (CO_OK(rc) && (len != new_len || co_memcmp(key, new_key, len) != 0) &&
+	    !CO_OK(meta_move(filesystem, key, len, new_key, new_len)))
+		co_debug("cofs%d: meta data of '%s' lost in rename", filesystem->unit, key);
+
+	co_os_free(new_key);
+	co_os_free(key);
+	return rc;
+}
+
+static struct co_filesystem_ops unix_mode = {
+	.inode_rename = unix_mode_inode_rename,
+	.host_attr = unix_mode_host_attr,
+	.getdir = unix_mode_getdir,
 	.inode_read_write = flat_mode_inode_read_write,
-	.inode_mknod = flat_mode_inode_mknod,
-	.inode_set_attr = flat_mode_inode_set_attr,
-	.inode_mkdir = flat_mode_inode_mkdir,
-	.inode_unlink = flat_mode_inode_unlink,
-	.inode_rmdir = flat_mode_inode_rmdir,
+	.inode_read_write_vector = flat_mode_inode_read_write_vector,
+	.inode_mknod = unix_mode_inode_mknod,
+	.inode_symlink = unix_mode_inode_symlink,
+	.inode_readlink = unix_mode_inode_readlink,
+	.inode_set_attr = unix_mode_inode_set_attr,
+	.inode_mkdir = unix_mode_inode_mkdir,
+	.inode_unlink = unix_mode_inode_unlink,
+	.inode_rmdir = unix_mode_inode_rmdir,
 	.fs_stat = flat_mode_fs_stat,
 };
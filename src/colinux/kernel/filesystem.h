@@ -13,20 +13,41 @@
 #include <colinux/common/list.h>
 #include <colinux/common/common.h>
 #include <colinux/common/config.h>
+#include <colinux/os/kernel/mutex.h>
 
 #include <linux/cooperative_fs.h>
 
 typedef struct  co_filesystem_name {
 	co_list_t node;
 	unsigned char type;
+	bool_t has_attr;	/* 'attr' came with the listing */
+	struct fuse_attr attr;
 	char name[1];
 } co_filesystem_name_t;
 
 typedef struct co_filesystem_dir_names {
 	co_list_t list;
 	int refcount;
+	bool_t watched;		/* the host reports changes since the listing */
+	unsigned long changes;	/* of the directory's watch, at the listing */
 } co_filesystem_dir_names_t;
 
+/* Chained hash of power of two size, grown as entries are added */
+typedef struct co_fs_hash {
+	co_list_t *buckets;
+	unsigned long size;
+	unsigned long count;
+} co_fs_hash_t;
+
+/*
+ * An open host file. Transfers use it with the filesystem's mutex let
+ * go, it is closed once they and its inode are done with it.
+ */
+typedef struct co_fs_handle {
+	void *file;
+	int users;		/* under the mutex */
+} co_fs_handle_t;
+
 typedef struct co_inode {
 	co_list_t flat_node;
 	co_list_t hash_node;
@@ -36,9 +57,112 @@ typedef struct co_inode {
 	char *name;
 	co_filesystem_dir_names_t *names;
 	int number;
+
+	/* Index of sub_inodes by name, hashed into name_hash */
+	co_fs_hash_t children;
+	co_list_t name_node;
+	unsigned long name_hash;
+
+	/* Open host file, see CO_FS_OPEN_HANDLES */
+	co_fs_handle_t *handle;
+	bool_t handle_write;
+	co_list_t handle_node;
+
+	/* Host OS reference to the file, see co_os_fs_inode_release */
+	void *sysdep;
+
+	/* Attributes, valid while the parent's watch counts 'attr_changes' */
+	struct fuse_attr attr;
+	bool_t attr_valid;
+	unsigned long attr_changes;
+
+	/* Of a directory, see co_fs_watch_t */
+	struct co_fs_watch *watch;
+	bool_t watch_failed;
 } co_inode_t;
 
+/*
+ * A directory the host reports changes of, see co_os_fs_watch(). The
+ * host calls co_monitor_file_system_changed() from a context of its
+ * own, the fields it touches are under the filesystem's watch_mutex.
+ */
+typedef struct co_fs_watch {
+	co_list_t node;
+	co_inode_t *dir;
+	int number;		/* of 'dir' */
+
+	/* Under watch_mutex */
+	unsigned long changes;
+	bool_t notify;		/* Linux trusts its caches of the directory */
+	bool_t lost;		/* no more changes are reported */
+
+	void *sysdep;
+} co_fs_watch_t;
+
+/*
+ * Store of the meta data of UNIX mode, see "UNIX meta data mode" in
+ * filesystem.c. A log of records after the header, in a host file
+ * mapped into memory.
+ */
+#define CO_FS_META_NAME           ".cofs-meta"
+#define CO_FS_META_MAGIC          0x6174656dUL	/* "meta" */
+#define CO_FS_META_VERSION        1
+#define CO_FS_META_INITIAL_SIZE   0x10000
+#define CO_FS_META_MAX_SIZE       0x4000000
+#define CO_FS_META_KEY_MAX        4095		/* of the pathname under the root */
+
+typedef struct co_fs_meta_header {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long generation;	/* of the records in the log */
+	unsigned long start;		/* of the log */
+} co_fs_meta_header_t;
+
+typedef struct co_fs_meta_record {
+	unsigned long check;		/* FNV-1a of the rest of the record */
+	unsigned long generation;
+	unsigned short size;		/* up to the next record */
+	unsigned short flags;		/* CO_FS_META_* */
+	unsigned short key_len;
+	unsigned short link_len;
+	unsigned long mode;
+	unsigned long uid;
+	unsigned long gid;
+	unsigned long rdev;
+	char data[0];			/* the key, then the symlink target */
+} co_fs_meta_record_t;
+
+#define CO_FS_META_DELETED        (1 << 0)	/* the key has no record any more */
+#define CO_FS_META_LAST           (1 << 1)	/* of an update */
+
+typedef struct co_fs_meta_entry {
+	co_list_t node;
+	unsigned long hash;		/* of the key */
+	unsigned long offset;		/* of the record in the store */
+} co_fs_meta_entry_t;
+
+typedef struct co_fs_meta {
+	unsigned char *map;		/* NULL if unusable */
+	unsigned long size;
+	unsigned long end;		/* of the log */
+	unsigned long update;		/* end of the update being written */
+	unsigned long last;		/* its last record */
+	co_fs_hash_t index;		/* of the live records, by key */
+	unsigned long live;		/* bytes of them */
+	char *prefix;			/* of the keys, the mounted path */
+	int prefix_len;
+	void *sysdep;
+} co_fs_meta_t;
+
+/* Initial sizes of the inode number and the per-directory name hashes */
 #define CO_FS_HASH_TABLE_SIZE     0x1000
+#define CO_FS_NAME_HASH_SIZE      16
+
+/* Host files kept open for reads and writes, the least recently used goes first */
+#define CO_FS_OPEN_HANDLES        64
+
+/* Directories watched for changes, the least recently used goes first */
+#define CO_FS_WATCHES             256
 
 typedef struct co_filesystem {
 	co_list_t list_inodes;
@@ -54,26 +178,76 @@ typedef struct co_filesystem {
 	struct co_filesystem_ops *ops;
 
 	/* Inode hash table */
-	co_list_t inode_hashes[CO_FS_HASH_TABLE_SIZE];
+	co_fs_hash_t inode_hashes;
 	int next_inode_num;
+	bool_t inode_num_wrapped;
+
+	/* Inodes with an open host file, most recently used first */
+	co_list_t handles_lru;
+	int handles_count;
+
+	/* Watched directories, most recently used first */
+	struct co_monitor *cmon;
+	unsigned int unit;
+	co_os_mutex_t watch_mutex;
+	co_list_t watches_lru;
+	int watches_count;
+
+	/* UNIX mode only */
+	co_fs_meta_t meta;
+
+	/*
+	 * Requests are handled one at a time, queued ones by a worker. The
+	 * host reads and writes files and attributes with it let go.
+	 */
+	co_os_mutex_t mutex;
+	bool_t async;
+	void *async_sysdep;
 } co_filesystem_t;
 
+/* Parameters of a queued request, up to the end of a name at params[30] */
+#define CO_FS_JOB_PARAMS          (30 + (FUSE_NAME_MAX + sizeof(unsigned long)) / sizeof(unsigned long))
+
+/*
+ * A request queued by the monitor, with the passage page parameters it
+ * came with. Once done, the message is posted to Linux.
+ */
+typedef struct co_fs_job {
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		struct fuse_notify_done done;
+	} msg; /* Must stay as the first field */
+	co_list_t node;
+	enum fuse_opcode opcode;
+	unsigned long params[CO_FS_JOB_PARAMS];
+} co_fs_job_t;
+
 struct co_monitor;
 
 typedef struct co_filesystem_ops {
 	co_rc_t (*inode_rename)(co_filesystem_t *filesystem, co_inode_t *dir, co_inode_t *new_dir,
 				char *oldname, char *newname);
-	co_rc_t (*getattr)(co_filesystem_t *fs, co_inode_t *dir, char *name, struct fuse_attr *attr);
+	/* Attributes of 'name' in 'dir' as Linux sees them, from those the host has */
+	co_rc_t (*host_attr)(co_filesystem_t *fs, co_inode_t *dir, char *name, struct fuse_attr *attr);
 	co_rc_t (*getdir)(co_filesystem_t *fs, co_inode_t *dir, co_filesystem_dir_names_t *names);
 	co_rc_t (*inode_read_write)(struct co_monitor *linuxvm, co_filesystem_t *filesystem,
 				    co_inode_t *inode, unsigned long long offset, unsigned long size,
 				    vm_ptr_t src_buffer, bool_t read);
+	co_rc_t (*inode_read_write_vector)(struct co_monitor *linuxvm, co_filesystem_t *filesystem,
+					   co_inode_t *inode, unsigned long long offset,
+					   struct fuse_segment *segments, unsigned long nr_segments,
+					   bool_t read);
 	co_rc_t (*inode_mknod)(co_filesystem_t *filesystem, co_inode_t *inode, unsigned long mode,
 			       unsigned long rdev, char *name, int *ino, struct fuse_attr *attr);
+	co_rc_t (*inode_symlink)(co_filesystem_t *filesystem, co_inode_t *dir, char *name,
+				 char *target, unsigned long uid, unsigned long gid);
+	co_rc_t (*inode_readlink)(co_filesystem_t *filesystem, co_inode_t *inode,
+				  char *target, unsigned long *size);
 	co_rc_t (*inode_set_attr)(co_filesystem_t *filesystem, co_inode_t *inode,
 				  unsigned long valid, struct fuse_attr *attr);
 	co_rc_t (*inode_mkdir)(co_filesystem_t *filesystem, co_inode_t *inode,
-			       unsigned long mode, char *name);
+			       unsigned long mode, char *name, unsigned long uid, unsigned long gid);
 	co_rc_t (*inode_unlink)(co_filesystem_t *filesystem, co_inode_t *inode, char *name);
 	co_rc_t (*inode_rmdir)(co_filesystem_t *filesystem, co_inode_t *inode, char *name);
 	co_rc_t (*fs_stat)(co_filesystem_t *filesystem, struct fuse_statfs_out *statfs);
@@ -85,6 +259,13 @@ extern void co_monitor_file_system(struct co_monitor *cmon, unsigned int unit,
 
 extern void co_filesystem_getdir_free(co_filesystem_dir_names_t *names);
 
+/* Called by the host's worker for each queued request, in order */
+extern void co_monitor_file_system_job(co_filesystem_t *filesystem, co_fs_job_t *job);
+
+/* Called by the host with watch_mutex held, 'lost' if the watch ends */
+extern void co_monitor_file_system_changed(co_filesystem_t *filesystem, co_fs_watch_t *watch,
+					   bool_t lost);
+
 extern co_rc_t co_monitor_file_system_init(struct co_monitor *cmon, unsigned int unit,
 					   co_cofsdev_desc_t *desc);
 
@@ -30,6 +30,8 @@
 #include "manager.h"
 #include "scsi.h"
 #include "block.h"
+#include "blockqos.h"
+#include "blocktrace.h"
 #include "fileblock.h"
 #include "transfer.h"
 #include "filesystem.h"
@@ -62,6 +64,37 @@ co_rc_t co_monitor_free(co_monitor_t* cmon, void* ptr)
 	return CO_RC(OK);
 }
 
+/*
+ * Map a host buffer into the Linux address space at 'vaddr', using
+ * the PTEs of the self map (the area must fall within its PGD).
+ */
+static co_rc_t map_host_area(co_monitor_t *cmon, vm_ptr_t vaddr, void *host_buffer, unsigned long size)
+{
+	long 		page;
+	long 		num_pages = size >> CO_ARCH_PAGE_SHIFT;
+	long 		offset;
+	unsigned long 	host_address = (unsigned long)host_buffer;
+	co_rc_t		rc = CO_RC(OK);
+
+	offset = ((vaddr & ((1 << PGDIR_SHIFT) - 1)) >> CO_ARCH_PAGE_SHIFT) * sizeof(linux_pte_t);
+
+	for (page=0; page < num_pages; page++) {
+		unsigned long pfn = co_os_virt_to_phys((void*)host_address) >> CO_ARCH_PAGE_SHIFT;
+
+		rc = co_monitor_create_ptes(cmon, CO_VPTR_SELF_MAP + offset,
+					    sizeof(linux_pte_t), &pfn);
+		if (!CO_OK(rc)) {
+			co_debug_error("error %08x mapping page %ld at %08lx", (int)rc, page, vaddr);
+			break;
+		}
+
+		offset       += sizeof(linux_pte_t);
+		host_address += CO_ARCH_PAGE_SIZE;
+	}
+
+	return rc;
+}
+
 static co_rc_t guest_address_space_init(co_monitor_t *cmon)
 {
 	co_rc_t		rc   = CO_RC(OK);
@@ -180,28 +213,16 @@ static co_rc_t guest_address_space_init(co_monitor_t *cmon)
 		goto out_error;
 	}
 
-	{
-		long 		io_buffer_page;
-		long 		io_buffer_num_pages = CO_VPTR_IO_AREA_SIZE >> CO_ARCH_PAGE_SHIFT;
-		long 		io_buffer_offset;
-		unsigned long 	io_buffer_host_address = (unsigned long)(cmon->io_buffer);
-
-		io_buffer_offset = ((CO_VPTR_IO_AREA_START & ((1 << PGDIR_SHIFT) - 1)) >>
-				    CO_ARCH_PAGE_SHIFT) * sizeof(linux_pte_t);
-
-		for (io_buffer_page=0; io_buffer_page < io_buffer_num_pages; io_buffer_page++) {
-			unsigned long io_buffer_pfn = co_os_virt_to_phys((void*)io_buffer_host_address) >> CO_ARCH_PAGE_SHIFT;
-
-			rc = co_monitor_create_ptes(cmon, CO_VPTR_SELF_MAP + io_buffer_offset,
-						    sizeof(linux_pte_t), &io_buffer_pfn);
-			if (!CO_OK(rc)) {
-				co_debug_error("error %08x initializing io buffer (%ld)", (int)rc, io_buffer_page);
-				goto out_error;
-			}
-
-			io_buffer_offset       += sizeof(linux_pte_t);
-			io_buffer_host_address += CO_ARCH_PAGE_SIZE;
-		}
+	rc = map_host_area(cmon, CO_VPTR_IO_AREA_START, cmon->io_buffer, CO_VPTR_IO_AREA_SIZE);
+	if (!CO_OK(rc)) {
+		co_debug_error("error %08x initializing io buffer", (int)rc);
+		goto out_error;
+	}
+
+	rc = map_host_area(cmon, CO_VPTR_DEVICE_RING_START, cmon->device_ring, CO_VPTR_DEVICE_RING_SIZE);
+	if (!CO_OK(rc)) {
+		co_debug_error("error %08x initializing device ring", (int)rc);
+		goto out_error;
 	}
 
 	co_debug("initialization finished");
@@ -285,6 +306,57 @@ static bool_t device_request(co_monitor_t *cmon, co_device_t device, unsigned lo
 	return PTRUE;
 }
 
+/*
+ * Complete every request Linux queued in the device ring since the last
+ * pass, in order. Results are written back into the entries themselves.
+ *
+ * This runs before the operation Linux switched for is looked at, so
+ * only devices that keep to the parameters of their entry are served.
+ * The others work on co_passage_page->params, which still belong to
+ * that operation.
+ */
+static void device_ring_drain(co_monitor_t *cmon)
+{
+	co_device_ring_t *ring = cmon->device_ring;
+	unsigned long tail = ring->tail;
+	unsigned long head = ring->head;
+
+	if (head - tail > CO_DEVICE_RING_ENTRIES) {
+		co_debug_error("device ring: bogus indexes (head %ld, tail %ld)", head, tail);
+		ring->tail = head;
+		return;
+	}
+
+	co_debug_lvl(context_switch, 14, "device ring: %ld requests", head - tail);
+
+	while (tail != head) {
+		co_device_ring_entry_t *entry = &ring->entries[tail % CO_DEVICE_RING_ENTRIES];
+
+		switch (entry->device) {
+		case CO_DEVICE_BLOCK: {
+			co_block_request_t *request;
+
+			request = (co_block_request_t *)(&entry->params[1]);
+			device_request(cmon, entry->device, entry->params);
+			entry->rc = request->rc;
+			break;
+		}
+		case CO_DEVICE_NETWORK:
+			device_request(cmon, entry->device, entry->params);
+			entry->rc = 0;
+			break;
+		default:
+			co_debug_error("device ring: device %ld not supported", entry->device);
+			entry->rc = -1;
+			break;
+		}
+
+		tail++;
+	}
+
+	ring->tail = tail;
+}
+
 static co_rc_t callback_return_messages(co_monitor_t *cmon)
 {
 	co_rc_t rc;
@@ -625,6 +697,11 @@ co_rc_t co_monitor_message_from_user_free(co_monitor_t *monitor, co_message_t *m
 
 static bool_t iteration(co_monitor_t *cmon)
 {
+	if (cmon->block_qos_queued)
+		co_block_qos_dispatch(cmon);
+	if (cmon->block_snapshot_pending)
+		co_monitor_file_block_snapshot_run(cmon);
+
 	switch (co_passage_page->operation) {
 	case CO_OPERATION_FORWARD_INTERRUPT:
 	case CO_OPERATION_IDLE:
@@ -640,6 +717,9 @@ static bool_t iteration(co_monitor_t *cmon)
 	else
 		co_monitor_arch_enable_interrupts();
 
+	if (cmon->device_ring->tail != cmon->device_ring->head)
+		device_ring_drain(cmon);
+
 	switch (co_passage_page->operation) {
 	case CO_OPERATION_FREE_PAGES: {
 		co_free_pages(cmon, co_passage_page->params[0], co_passage_page->params[1]);
@@ -696,6 +776,10 @@ static bool_t iteration(co_monitor_t *cmon)
 		co_debug_lvl(context_switch, 14, "switching from linux (CO_OPERATION_DEVICE)");
 		return device_request(cmon, device, &co_passage_page->params[1]);
 	}
+	case CO_OPERATION_DEVICE_RING:
+		/* Already drained above */
+		co_debug_lvl(context_switch, 14, "switching from linux (CO_OPERATION_DEVICE_RING)");
+		return PTRUE;
 	case CO_OPERATION_GET_TIME: {
 		co_debug_lvl(context_switch, 14, "switching from linux (CO_OPERATION_GET_TIME)");
 		co_passage_page->params[0] = co_os_get_time();
@@ -756,9 +840,8 @@ static co_rc_t load_configuration(co_monitor_t *cmon)
 		if (!CO_OK(rc))
 			goto error_1;
 
-		rc = co_monitor_file_block_init(cmon, dev, &conf_dev->pathname);
+		rc = co_monitor_file_block_init(cmon, dev, conf_dev);
 		if (CO_OK(rc)) {
-			dev->dev.conf = conf_dev;
 			co_debug("cobd%d: enabled (%p)", i, dev);
 			co_monitor_block_register_device(cmon, i, (co_block_dev_t *)dev);
 			dev->dev.free = free_file_blockdevice;
@@ -1077,9 +1160,16 @@ co_rc_t co_monitor_create(co_manager_t*		     manager,
 	}
 	co_memset(cmon->io_buffer, 0, CO_VPTR_IO_AREA_SIZE);
 
+	cmon->device_ring = co_os_malloc(CO_VPTR_DEVICE_RING_SIZE);
+	if (cmon->device_ring == NULL) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out_free_buffer;
+	}
+	co_memset(cmon->device_ring, 0, CO_VPTR_DEVICE_RING_SIZE);
+
 	rc = alloc_shared_page(cmon);
 	if (!CO_OK(rc))
-		goto out_free_buffer;
+		goto out_free_ring;
 
 	params->shared_user_address = cmon->shared_user_address;
 	rc = co_queue_init(&cmon->linux_message_queue);
@@ -1194,6 +1284,9 @@ out_free_linux_message_queue:
 out_free_shared_page:
 	free_shared_page(cmon);
 
+out_free_ring:
+	co_os_free(cmon->device_ring);
+
 out_free_buffer:
 	co_os_free(cmon->io_buffer);
 
@@ -1237,6 +1330,7 @@ static co_rc_t co_monitor_destroy(co_monitor_t *cmon, bool_t user_context)
 
 	co_monitor_unregister_and_free_scsi_devices(cmon);
 	co_monitor_unregister_and_free_block_devices(cmon);
+	co_block_trace_free(cmon);
 	co_monitor_unregister_filesystems(cmon);
 #ifdef CONFIG_COOPERATIVE_VIDEO
 	co_monitor_unregister_video_devices(cmon);
@@ -1244,6 +1338,7 @@ static co_rc_t co_monitor_destroy(co_monitor_t *cmon, bool_t user_context)
 	free_pseudo_physical_memory(cmon);
 	manager->hostmem_used -= cmon->memory_size;
 	co_os_free(cmon->io_buffer);
+	co_os_free(cmon->device_ring);
 	free_shared_page(cmon);
 	co_monitor_os_exit(cmon);
 	co_queue_flush(&cmon->linux_message_queue);
@@ -1346,6 +1441,7 @@ static co_rc_t co_monitor_user_reset(co_monitor_t *monitor)
 	co_os_mutex_release(monitor->manager->lock);
 
 	co_memset(monitor->io_buffer, 0, CO_VPTR_IO_AREA_SIZE);
+	co_memset(monitor->device_ring, 0, CO_VPTR_DEVICE_RING_SIZE);
 
 	monitor->state = CO_MONITOR_STATE_INITIALIZED;
 	monitor->termination_reason = CO_TERMINATE_END;
@@ -1354,6 +1450,21 @@ out:
 	return rc;
 }
 
+static co_rc_t co_monitor_user_get_block_stats(co_monitor_t *monitor,
+					       co_monitor_ioctl_get_block_stats_t *params)
+{
+	co_block_dev_t *dev;
+
+	if (params->unit >= CO_MODULE_MAX_COBD)
+		return CO_RC(INVALID_PARAMETER);
+
+	dev = monitor->block_devs[params->unit];
+	if (!dev)
+		return CO_RC(NOT_FOUND);
+
+	return co_monitor_file_block_get_stats((co_monitor_file_block_dev_t *)dev, params);
+}
+
 static co_rc_t co_monitor_user_get_state(co_monitor_t* monitor, co_monitor_ioctl_get_state_t* params)
 {
 	params->monitor_state	   = monitor->state;
@@ -1495,6 +1606,37 @@ co_rc_t co_monitor_ioctl(co_monitor_t* 		     cmon,
 
 		return co_conet_unbind_adapter(cmon, params->conet_unit);
 	}
+	case CO_MONITOR_IOCTL_GET_BLOCK_STATS: {
+		co_monitor_ioctl_get_block_stats_t *params;
+
+		*return_size = sizeof(*params);
+		params       = (typeof(params))(io_buffer);
+
+		return co_monitor_user_get_block_stats(cmon, params);
+	}
+	case CO_MONITOR_IOCTL_BLOCK_TRACE: {
+		co_monitor_ioctl_block_trace_t *params;
+
+		params = (typeof(params))(io_buffer);
+
+		return co_block_trace_ioctl(cmon, params, out_size, return_size);
+	}
+	case CO_MONITOR_IOCTL_BLOCK_QOS: {
+		co_monitor_ioctl_block_qos_t *params;
+
+		*return_size = sizeof(*params);
+		params       = (typeof(params))(io_buffer);
+
+		return co_block_qos_ioctl(cmon, params);
+	}
+	case CO_MONITOR_IOCTL_BLOCK_SNAPSHOT: {
+		co_monitor_ioctl_block_snapshot_t *params;
+
+		*return_size = sizeof(*params);
+		params       = (typeof(params))(io_buffer);
+
+		return co_monitor_file_block_snapshot_ioctl(cmon, params);
+	}
 	default:
 		break;
 	}
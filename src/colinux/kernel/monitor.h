@@ -145,6 +145,9 @@ typedef struct co_monitor {
 	 * Block devices
 	 */
 	struct co_block_dev* block_devs[CO_MODULE_MAX_COBD];
+	struct co_block_trace* block_trace; /* NULL until tracing is started */
+	unsigned long block_qos_queued; /* requests waiting for their I/O limits */
+	volatile bool_t block_snapshot_pending; /* see CO_MONITOR_IOCTL_BLOCK_SNAPSHOT */
 
 	/*
 	 * File Systems
@@ -163,6 +166,7 @@ typedef struct co_monitor {
 	co_os_mutex_t 	linux_message_queue_mutex;
 
 	co_io_buffer_t* 		 io_buffer;
+	co_device_ring_t*		 device_ring;
 	co_monitor_user_kernel_shared_t* shared;
 	void*			         shared_user_address;
 	void*				 shared_handle;
@@ -0,0 +1,473 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/common/nbd.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/mutex.h>
+#include <colinux/os/kernel/nbd.h>
+
+#include "monitor.h"
+#include "transfer.h"
+#include "fileblock.h"
+
+/*
+ * cobd devices backed by an NBD export. Requests are pipelined: the
+ * monitor sends them right away, with the tag as the NBD handle, and
+ * a receiver thread completes them as the replies come in, in whatever
+ * order the server answers. Read data goes straight from the socket
+ * into the pages of Linux and write data the other way.
+ *
+ * The host only provides the connection and the thread, see
+ * os/kernel/nbd.h.
+ */
+
+/* Flushes and discards are synchronous, one at a time */
+#define CO_NBD_CONTROL_HANDLE	CO_BLOCK_MAX_INFLIGHT
+#define CO_NBD_MAX_TRIM		(1UL << 30)
+
+/*
+ * A request on the wire. Like the asynchronous file requests, it carries
+ * the message that is posted to Linux once the reply is in.
+ */
+typedef struct {
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		co_block_intr_t intr;
+	} msg; /* Must stay as the first field */
+	co_monitor_t *monitor;
+	co_block_dev_t *dev;
+	vm_ptr_t address;
+	unsigned long size;
+	bool_t read;
+	co_block_segment_t *segments; /* NULL unless READV */
+	unsigned long nr_segments;
+} co_nbd_block_request_t;
+
+typedef struct {
+	co_monitor_file_block_dev_t *fdev;
+	co_os_nbd_t conn;
+	co_nbd_export_t export;
+	co_os_mutex_t lock;
+	bool_t broken; /* set by the receiver, no new requests are sent */
+	bool_t closing; /* the end of the connection is expected */
+	co_nbd_block_request_t *inflight[CO_BLOCK_MAX_INFLIGHT];
+	unsigned long control_error;
+} co_nbd_block_t;
+
+static co_rc_t nbd_transfer(struct co_monitor *cmon,
+			    void *host_data, void *linuxvm, unsigned long size,
+			    co_monitor_transfer_dir_t dir)
+{
+	if (dir == CO_MONITOR_TRANSFER_FROM_LINUX)
+		return co_os_nbd_send(host_data, linuxvm, size);
+
+	return co_os_nbd_recv(host_data, linuxvm, size);
+}
+
+/* Payload of a request, between the socket and the pages of Linux */
+static co_rc_t nbd_data(co_monitor_t *cmon, co_os_nbd_t conn,
+			vm_ptr_t address, unsigned long size,
+			co_block_segment_t *segments, unsigned long nr_segments,
+			co_monitor_transfer_dir_t dir)
+{
+	unsigned long i;
+	co_rc_t rc;
+
+	if (!segments)
+		return co_monitor_host_linuxvm_transfer(cmon, conn, nbd_transfer,
+							address, size, dir);
+
+	for (i = 0; i < nr_segments; i++) {
+		rc = co_monitor_host_linuxvm_transfer(cmon, conn, nbd_transfer,
+						      segments[i].address, segments[i].size, dir);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t nbd_attach(co_monitor_file_block_dev_t *fdev, co_os_nbd_t *conn_out,
+			  co_nbd_export_t *export)
+{
+	co_nbd_uri_t uri;
+	co_rc_t rc;
+
+	rc = co_nbd_parse_uri(fdev->pathname, &uri);
+	if (!CO_OK(rc)) {
+		co_debug_error("nbd: invalid export '%s'", fdev->pathname);
+		return rc;
+	}
+
+	rc = co_os_nbd_connect(&uri, conn_out);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_nbd_handshake(*conn_out, co_os_nbd_send, co_os_nbd_recv, uri.name, export);
+	if (!CO_OK(rc))
+		co_os_nbd_close(*conn_out);
+
+	return rc;
+}
+
+static void nbd_disconnect(co_os_nbd_t conn)
+{
+	co_nbd_request_t header;
+
+	co_nbd_request_init(&header, CO_NBD_CMD_DISC, 0, CO_NBD_CONTROL_HANDLE, 0, 0);
+	co_os_nbd_send(conn, &header, sizeof(header));
+	co_os_nbd_shutdown(conn);
+}
+
+static void nbd_done(co_nbd_block_request_t *context, bool_t uptodate)
+{
+	if (uptodate)
+		context->msg.intr.uptodate = 1;
+	else
+		co_debug("cobd%d nbd %s failed size=%ld",
+			 context->msg.linux_message.unit,
+			 context->read ? "read" : "write", context->size);
+
+	co_monitor_block_complete(context->monitor, context->dev, &context->msg.message);
+}
+
+static void nbd_receiver(void *data)
+{
+	co_nbd_block_t *nbd = data;
+	co_nbd_block_request_t *context;
+	co_nbd_reply_t reply;
+	unsigned long long handle;
+	unsigned long error;
+	co_rc_t rc;
+	int i;
+
+	for (;;) {
+		rc = co_os_nbd_recv(nbd->conn, &reply, sizeof(reply));
+		if (CO_OK(rc))
+			rc = co_nbd_reply_parse(&reply, &handle, &error);
+		if (!CO_OK(rc))
+			break;
+
+		if (handle == CO_NBD_CONTROL_HANDLE) {
+			nbd->control_error = error;
+			co_os_nbd_control_done(nbd->conn);
+			continue;
+		}
+
+		context = NULL;
+		co_os_mutex_acquire(nbd->lock);
+		if (handle < CO_BLOCK_MAX_INFLIGHT) {
+			context = nbd->inflight[handle];
+			nbd->inflight[handle] = NULL;
+		}
+		co_os_mutex_release(nbd->lock);
+
+		if (!context) {
+			co_debug_error("cobd%d: nbd reply for unknown handle %llx",
+				       nbd->fdev->dev.unit, handle);
+			break;
+		}
+
+		/* Nothing follows the reply of a failed read */
+		if (context->read && !error)
+			rc = nbd_data(context->monitor, nbd->conn, context->address,
+				      context->size, context->segments,
+				      context->nr_segments, CO_MONITOR_TRANSFER_FROM_HOST);
+
+		nbd_done(context, CO_OK(rc) && !error);
+		if (!CO_OK(rc))
+			break;
+	}
+
+	/* Nothing is sent once this is set, what is in flight now never gets a reply */
+	co_os_mutex_acquire(nbd->lock);
+	nbd->broken = PTRUE;
+	co_os_mutex_release(nbd->lock);
+
+	if (!nbd->closing)
+		co_debug_error("cobd%d: lost the connection to the NBD server", nbd->fdev->dev.unit);
+
+	for (i = 0; i < CO_BLOCK_MAX_INFLIGHT; i++) {
+		context = nbd->inflight[i];
+		if (context) {
+			nbd->inflight[i] = NULL;
+			nbd_done(context, PFALSE);
+		}
+	}
+
+	nbd->control_error = 1;
+	co_os_nbd_control_done(nbd->conn);
+}
+
+static co_rc_t nbd_submit(co_monitor_t *monitor,
+			  co_block_dev_t *dev,
+			  co_monitor_file_block_dev_t *fdev,
+			  co_block_request_t *request,
+			  co_block_segment_t *segments,
+			  bool_t read)
+{
+	co_nbd_block_t *nbd = fdev->backend;
+	co_nbd_block_request_t *context;
+	co_nbd_request_t header;
+	unsigned long segments_size = 0;
+	unsigned long flags = 0;
+	co_rc_t rc;
+
+	if (!read && fdev->read_only)
+		return CO_RC(ACCESS_DENIED);
+
+	/* The receiver needs the segments of a read, fdev->segments is reused */
+	if (segments && read)
+		segments_size = request->nr_segments * sizeof(co_block_segment_t);
+
+	context = co_os_malloc(sizeof(co_nbd_block_request_t) + segments_size);
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(context, 0, sizeof(co_nbd_block_request_t));
+
+	if (segments_size) {
+		context->segments = (co_block_segment_t *)(context + 1);
+		context->nr_segments = request->nr_segments;
+		co_memcpy(context->segments, segments, segments_size);
+	}
+
+	context->monitor = monitor;
+	context->dev = dev;
+	context->address = request->address;
+	context->size = (unsigned long)request->size;
+	context->read = read;
+	context->msg.message.from = CO_MODULE_COBD0 + dev->unit;
+	context->msg.message.to = CO_MODULE_LINUX;
+	context->msg.message.priority = CO_PRIORITY_DISCARDABLE;
+	context->msg.message.type = CO_MESSAGE_TYPE_OTHER;
+	context->msg.message.size = sizeof(context->msg) - sizeof(context->msg.message);
+	context->msg.linux_message.device = CO_DEVICE_BLOCK;
+	context->msg.linux_message.unit = dev->unit;
+	context->msg.linux_message.size = sizeof(context->msg.intr);
+	context->msg.intr.irq_request = request->irq_request;
+	context->msg.intr.tag = request->tag;
+
+	/* Set before the receiver can complete the request */
+	request->async = PTRUE;
+
+	co_os_mutex_acquire(nbd->lock);
+	if (nbd->broken) {
+		co_os_mutex_release(nbd->lock);
+		co_os_free(context);
+		request->async = PFALSE;
+		return CO_RC(BROKEN_PIPE);
+	}
+	nbd->inflight[request->tag] = context;
+	co_os_mutex_release(nbd->lock);
+
+	/* The server answers once it has it all, context is the receiver's now */
+	if (!read && fdev->write_through && (nbd->export.flags & CO_NBD_FLAG_SEND_FUA))
+		flags = CO_NBD_CMD_FLAG_FUA;
+
+	co_nbd_request_init(&header, read ? CO_NBD_CMD_READ : CO_NBD_CMD_WRITE, flags,
+			    request->tag, request->offset, (unsigned long)request->size);
+	rc = co_os_nbd_send(nbd->conn, &header, sizeof(header));
+	if (CO_OK(rc) && !read)
+		rc = nbd_data(monitor, nbd->conn, request->address,
+			      (unsigned long)request->size, segments,
+			      segments ? request->nr_segments : 0,
+			      CO_MONITOR_TRANSFER_FROM_LINUX);
+
+	/* The receiver fails everything in flight, this request too */
+	if (!CO_OK(rc))
+		co_os_nbd_shutdown(nbd->conn);
+
+	return CO_RC(OK);
+}
+
+static co_rc_t nbd_read(struct co_monitor *cmon,
+			co_block_dev_t *dev,
+			co_monitor_file_block_dev_t *fdev,
+			co_block_request_t *request)
+{
+	return nbd_submit(cmon, dev, fdev, request, NULL, PTRUE);
+}
+
+static co_rc_t nbd_write(struct co_monitor *cmon,
+			 co_block_dev_t *dev,
+			 co_monitor_file_block_dev_t *fdev,
+			 co_block_request_t *request)
+{
+	return nbd_submit(cmon, dev, fdev, request, NULL, PFALSE);
+}
+
+static co_rc_t nbd_readv(struct co_monitor *cmon,
+			 co_block_dev_t *dev,
+			 co_monitor_file_block_dev_t *fdev,
+			 co_block_request_t *request,
+			 co_block_segment_t *segments)
+{
+	return nbd_submit(cmon, dev, fdev, request, segments, PTRUE);
+}
+
+static co_rc_t nbd_writev(struct co_monitor *cmon,
+			  co_block_dev_t *dev,
+			  co_monitor_file_block_dev_t *fdev,
+			  co_block_request_t *request,
+			  co_block_segment_t *segments)
+{
+	return nbd_submit(cmon, dev, fdev, request, segments, PFALSE);
+}
+
+/* Send a request without payload and wait for its reply */
+static co_rc_t nbd_control(co_nbd_block_t *nbd, unsigned long type,
+			   unsigned long long offset, unsigned long length)
+{
+	co_nbd_request_t header;
+	co_rc_t rc;
+
+	co_os_mutex_acquire(nbd->lock);
+	if (nbd->broken) {
+		co_os_mutex_release(nbd->lock);
+		return CO_RC(BROKEN_PIPE);
+	}
+	co_os_nbd_control_reset(nbd->conn);
+	nbd->control_error = 0;
+	co_os_mutex_release(nbd->lock);
+
+	co_nbd_request_init(&header, type, 0, CO_NBD_CONTROL_HANDLE, offset, length);
+	rc = co_os_nbd_send(nbd->conn, &header, sizeof(header));
+	if (!CO_OK(rc))
+		co_os_nbd_shutdown(nbd->conn);
+
+	co_os_nbd_control_wait(nbd->conn);
+
+	if (CO_OK(rc) && nbd->control_error)
+		rc = CO_RC(ERROR);
+
+	return rc;
+}
+
+static co_rc_t nbd_discard(co_monitor_file_block_dev_t *fdev,
+			   unsigned long long offset,
+			   unsigned long long size)
+{
+	co_nbd_block_t *nbd = fdev->backend;
+	unsigned long length;
+	co_rc_t rc = CO_RC(OK);
+
+	if (!(nbd->export.flags & CO_NBD_FLAG_SEND_TRIM))
+		return CO_RC(ERROR);
+
+	while (size && CO_OK(rc)) {
+		length = size > CO_NBD_MAX_TRIM ? CO_NBD_MAX_TRIM : (unsigned long)size;
+		rc = nbd_control(nbd, CO_NBD_CMD_TRIM, offset, length);
+		offset += length;
+		size -= length;
+	}
+
+	return rc;
+}
+
+static co_rc_t nbd_flush(co_monitor_file_block_dev_t *fdev)
+{
+	co_nbd_block_t *nbd = fdev->backend;
+
+	/* The server writes through, or keeps nothing it could lose */
+	if (!(nbd->export.flags & CO_NBD_FLAG_SEND_FLUSH))
+		return CO_RC(OK);
+
+	return nbd_control(nbd, CO_NBD_CMD_FLUSH, 0, 0);
+}
+
+static co_rc_t nbd_get_size(co_monitor_file_block_dev_t *fdev, unsigned long long *size)
+{
+	co_nbd_export_t export;
+	co_os_nbd_t conn;
+	co_rc_t rc;
+
+	rc = nbd_attach(fdev, &conn, &export);
+	if (!CO_OK(rc))
+		return rc;
+
+	nbd_disconnect(conn);
+	co_os_nbd_close(conn);
+
+	*size = export.size;
+	return CO_RC(OK);
+}
+
+static co_rc_t nbd_open(struct co_monitor *cmon, co_monitor_file_block_dev_t *fdev)
+{
+	co_nbd_block_t *nbd;
+	co_rc_t rc;
+
+	co_debug("opening %s", fdev->pathname);
+
+	nbd = co_os_malloc(sizeof(co_nbd_block_t));
+	if (!nbd)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(nbd, 0, sizeof(co_nbd_block_t));
+	nbd->fdev = fdev;
+
+	rc = co_os_mutex_create(&nbd->lock);
+	if (!CO_OK(rc)) {
+		co_os_free(nbd);
+		return rc;
+	}
+
+	rc = nbd_attach(fdev, &nbd->conn, &nbd->export);
+	if (!CO_OK(rc))
+		goto out_lock;
+
+	fdev->read_only = (nbd->export.flags & CO_NBD_FLAG_READ_ONLY) != 0;
+	fdev->backend = nbd;
+
+	rc = co_os_nbd_receiver_start(nbd->conn, nbd_receiver, nbd, fdev->dev.unit);
+	if (!CO_OK(rc)) {
+		nbd_disconnect(nbd->conn);
+		co_os_nbd_close(nbd->conn);
+		fdev->backend = NULL;
+		goto out_lock;
+	}
+
+	return CO_RC(OK);
+
+out_lock:
+	co_os_mutex_destroy(nbd->lock);
+	co_os_free(nbd);
+	return rc;
+}
+
+static co_rc_t nbd_close(co_monitor_file_block_dev_t *fdev)
+{
+	co_nbd_block_t *nbd = fdev->backend;
+
+	co_debug("closing %s", fdev->pathname);
+
+	/* Linux has no requests left, the receiver just sees the end */
+	nbd->closing = PTRUE;
+	nbd_disconnect(nbd->conn);
+	co_os_nbd_receiver_stop(nbd->conn);
+
+	co_os_nbd_close(nbd->conn);
+	co_os_mutex_destroy(nbd->lock);
+	co_os_free(nbd);
+	fdev->backend = NULL;
+
+	return CO_RC(OK);
+}
+
+co_monitor_file_block_operations_t co_monitor_nbd_block_operations = {
+	.open = nbd_open,
+	.close = nbd_close,
+	.read = nbd_read,
+	.write = nbd_write,
+	.get_size = nbd_get_size,
+	.readv = nbd_readv,
+	.writev = nbd_writev,
+	.discard = nbd_discard,
+	.flush = nbd_flush,
+};
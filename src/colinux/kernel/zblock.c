@@ -0,0 +1,366 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/common/lz4.h>
+#include <colinux/common/zblock.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/alloc.h>
+#include <colinux/arch/mmu.h>
+
+#include "monitor.h"
+#include "transfer.h"
+#include "fileblock.h"
+
+/*
+ * Compressed images are read through a plain file device with the
+ * synchronous operations of the host. Decompressed chunks are kept in
+ * a small cache, so that Linux reading a chunk page by page costs one
+ * decompression.
+ */
+
+#define CO_ZBLOCK_CACHE_CHUNKS	16
+#define CO_ZBLOCK_MAX_CHUNKS	(1UL << 21)	/* keeps the index below 16 MB */
+
+typedef struct {
+	unsigned long chunk;
+	unsigned long last_used;	/* 0 if the slot is empty */
+	unsigned char *data;
+} co_zblock_chunk_t;
+
+typedef struct {
+	co_monitor_file_block_dev_t file;
+	co_zblock_header_t header;
+	unsigned long chunk_size;
+	unsigned long long *index;
+	unsigned char *input;		/* one compressed chunk */
+	unsigned long clock;
+	co_zblock_chunk_t cache[CO_ZBLOCK_CACHE_CHUNKS];
+	unsigned long long hits;
+	unsigned long long misses;
+} co_zblock_t;
+
+static unsigned long chunk_pages(co_zblock_t *zb)
+{
+	return zb->chunk_size >> CO_ARCH_PAGE_SHIFT;
+}
+
+static co_rc_t decompress_chunk(co_zblock_t *zb, unsigned long chunk, unsigned char *data)
+{
+	unsigned long long start = (unsigned long long)chunk << zb->header.chunk_shift;
+	unsigned long size = zb->chunk_size;
+	unsigned long long stored;
+	co_rc_t rc;
+
+	/* The last chunk may be short */
+	if (start + size > zb->header.size)
+		size = (unsigned long)(zb->header.size - start);
+
+	stored = zb->index[chunk + 1] - zb->index[chunk];
+	if (stored == 0 || stored > size) {
+		co_debug_error("cobd%d: bad chunk %lu in %s", zb->file.dev.unit,
+			       chunk, zb->file.pathname);
+		return CO_RC(ERROR);
+	}
+
+	/* Stored as is */
+	if (stored == size)
+		return zb->file.op->host_read_write(&zb->file, zb->index[chunk],
+						    data, size, PTRUE);
+
+	rc = zb->file.op->host_read_write(&zb->file, zb->index[chunk], zb->input,
+					  (unsigned long)stored, PTRUE);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_lz4_decompress(zb->input, (unsigned long)stored, data, size);
+	if (!CO_OK(rc))
+		co_debug_error("cobd%d: corrupt chunk %lu in %s", zb->file.dev.unit,
+			       chunk, zb->file.pathname);
+
+	return rc;
+}
+
+static co_rc_t get_chunk(co_zblock_t *zb, unsigned long chunk, unsigned char **out_data)
+{
+	co_zblock_chunk_t *slot, *victim = &zb->cache[0];
+	co_rc_t rc;
+	int i;
+
+	for (i = 0; i < CO_ZBLOCK_CACHE_CHUNKS; i++) {
+		slot = &zb->cache[i];
+		if (slot->last_used && slot->chunk == chunk) {
+			slot->last_used = ++zb->clock;
+			zb->hits++;
+			*out_data = slot->data;
+			return CO_RC(OK);
+		}
+
+		if (slot->last_used < victim->last_used)
+			victim = slot;
+	}
+
+	zb->misses++;
+
+	victim->last_used = 0;
+	rc = decompress_chunk(zb, chunk, victim->data);
+	if (!CO_OK(rc))
+		return rc;
+
+	victim->chunk = chunk;
+	victim->last_used = ++zb->clock;
+	*out_data = victim->data;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t zblock_transfer(co_monitor_t *cmon, co_zblock_t *zb,
+			       unsigned long long offset, vm_ptr_t address,
+			       unsigned long long size)
+{
+	unsigned long chunk, skip, length;
+	unsigned char *data;
+	co_rc_t rc;
+
+	if (offset + size > zb->header.size)
+		return CO_RC(INVALID_PARAMETER);
+
+	while (size > 0) {
+		chunk = (unsigned long)(offset >> zb->header.chunk_shift);
+		skip = (unsigned long)offset & (zb->chunk_size - 1);
+
+		length = zb->chunk_size - skip;
+		if (length > size)
+			length = (unsigned long)size;
+
+		rc = get_chunk(zb, chunk, &data);
+		if (!CO_OK(rc))
+			return rc;
+
+		rc = co_monitor_host_to_linuxvm(cmon, data + skip, address, length);
+		if (!CO_OK(rc))
+			return rc;
+
+		offset += length;
+		address += length;
+		size -= length;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t check_header(co_zblock_t *zb, unsigned long long file_size)
+{
+	co_zblock_header_t *header = &zb->header;
+	unsigned long long chunks;
+
+	if (header->magic != CO_ZBLOCK_MAGIC ||
+	    header->version != CO_ZBLOCK_VERSION ||
+	    header->method != CO_ZBLOCK_METHOD_LZ4 ||
+	    header->chunk_shift < CO_ZBLOCK_MIN_CHUNK_SHIFT ||
+	    header->chunk_shift > CO_ZBLOCK_MAX_CHUNK_SHIFT)
+		return CO_RC(INVALID_PARAMETER);
+
+	chunks = (header->size + (1ULL << header->chunk_shift) - 1) >> header->chunk_shift;
+	if (chunks != header->chunks || header->chunks == 0 ||
+	    header->chunks > CO_ZBLOCK_MAX_CHUNKS)
+		return CO_RC(INVALID_PARAMETER);
+
+	if (header->index_offset + (header->chunks + 1) * sizeof(unsigned long long) > file_size)
+		return CO_RC(INVALID_PARAMETER);
+
+	return CO_RC(OK);
+}
+
+static void free_zblock(co_zblock_t *zb)
+{
+	int i;
+
+	for (i = 0; i < CO_ZBLOCK_CACHE_CHUNKS; i++)
+		if (zb->cache[i].data)
+			co_os_free_pages(zb->cache[i].data, chunk_pages(zb));
+
+	if (zb->input)
+		co_os_free_pages(zb->input, chunk_pages(zb));
+
+	if (zb->index)
+		co_os_free(zb->index);
+
+	if (zb->file.sysdep)
+		zb->file.op->close(&zb->file);
+
+	co_os_free(zb);
+}
+
+static void init_file(co_monitor_file_block_dev_t *file, co_monitor_file_block_dev_t *fdev)
+{
+	co_memset(file, 0, sizeof(*file));
+	co_memcpy(file->pathname, fdev->pathname, sizeof(co_pathname_t));
+	file->dev.unit = fdev->dev.unit;
+	file->dev.conf = fdev->dev.conf;
+	file->op = &co_os_file_block_default_operations;
+	file->read_only = PTRUE;
+}
+
+static co_rc_t zblock_open(co_monitor_t *cmon, co_monitor_file_block_dev_t *fdev)
+{
+	unsigned long long file_size;
+	unsigned long index_size;
+	co_zblock_t *zb;
+	co_rc_t rc;
+	int i;
+
+	zb = co_os_malloc(sizeof(*zb));
+	if (!zb)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(zb, 0, sizeof(*zb));
+
+	init_file(&zb->file, fdev);
+
+	rc = zb->file.op->get_size(&zb->file, &file_size);
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = zb->file.op->open(cmon, &zb->file);
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = zb->file.op->host_read_write(&zb->file, 0, &zb->header, sizeof(zb->header), PTRUE);
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = check_header(zb, file_size);
+	if (!CO_OK(rc)) {
+		co_debug_error("cobd%d: %s is not a valid compressed image",
+			       fdev->dev.unit, fdev->pathname);
+		goto out;
+	}
+
+	zb->chunk_size = 1UL << zb->header.chunk_shift;
+	index_size = (zb->header.chunks + 1) * sizeof(unsigned long long);
+
+	zb->index = co_os_malloc(index_size);
+	zb->input = co_os_alloc_pages(chunk_pages(zb));
+	if (!zb->index || !zb->input) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+
+	for (i = 0; i < CO_ZBLOCK_CACHE_CHUNKS; i++) {
+		zb->cache[i].data = co_os_alloc_pages(chunk_pages(zb));
+		if (!zb->cache[i].data) {
+			rc = CO_RC(OUT_OF_MEMORY);
+			goto out;
+		}
+	}
+
+	rc = zb->file.op->host_read_write(&zb->file, zb->header.index_offset,
+					  zb->index, index_size, PTRUE);
+	if (!CO_OK(rc))
+		goto out;
+
+	fdev->backend = zb;
+	return CO_RC(OK);
+
+out:
+	free_zblock(zb);
+	return rc;
+}
+
+static co_rc_t zblock_close(co_monitor_file_block_dev_t *fdev)
+{
+	co_zblock_t *zb = fdev->backend;
+
+	co_debug("cobd%d: %llu chunk hits, %llu decompressed",
+		 fdev->dev.unit, zb->hits, zb->misses);
+
+	free_zblock(zb);
+	fdev->backend = NULL;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t zblock_get_size(co_monitor_file_block_dev_t *fdev, unsigned long long *size)
+{
+	co_monitor_file_block_dev_t *file;
+	co_zblock_header_t header;
+	co_rc_t rc;
+
+	file = co_os_malloc(sizeof(*file));
+	if (!file)
+		return CO_RC(OUT_OF_MEMORY);
+
+	init_file(file, fdev);
+
+	rc = file->op->open(NULL, file);
+	if (CO_OK(rc)) {
+		rc = file->op->host_read_write(file, 0, &header, sizeof(header), PTRUE);
+		file->op->close(file);
+	}
+
+	co_os_free(file);
+
+	if (!CO_OK(rc))
+		return rc;
+
+	if (header.magic != CO_ZBLOCK_MAGIC)
+		return CO_RC(INVALID_PARAMETER);
+
+	*size = header.size;
+	return CO_RC(OK);
+}
+
+static co_rc_t zblock_read(co_monitor_t *cmon, co_block_dev_t *dev,
+			   co_monitor_file_block_dev_t *fdev, co_block_request_t *request)
+{
+	return zblock_transfer(cmon, fdev->backend, request->offset, request->address,
+			       request->size);
+}
+
+static co_rc_t zblock_readv(co_monitor_t *cmon, co_block_dev_t *dev,
+			    co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			    co_block_segment_t *segments)
+{
+	unsigned long long offset = request->offset;
+	unsigned long i;
+	co_rc_t rc;
+
+	for (i = 0; i < request->nr_segments; i++) {
+		rc = zblock_transfer(cmon, fdev->backend, offset, segments[i].address,
+				     segments[i].size);
+		if (!CO_OK(rc))
+			return rc;
+
+		offset += segments[i].size;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t zblock_write(co_monitor_t *cmon, co_block_dev_t *dev,
+			    co_monitor_file_block_dev_t *fdev, co_block_request_t *request)
+{
+	co_debug_error("cobd%d: write to compressed image", fdev->dev.unit);
+	return CO_RC(ACCESS_DENIED);
+}
+
+static co_rc_t zblock_writev(co_monitor_t *cmon, co_block_dev_t *dev,
+			     co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			     co_block_segment_t *segments)
+{
+	return zblock_write(cmon, dev, fdev, request);
+}
+
+co_monitor_file_block_operations_t co_monitor_zblock_operations = {
+	.open = zblock_open,
+	.close = zblock_close,
+	.read = zblock_read,
+	.write = zblock_write,
+	.get_size = zblock_get_size,
+	.readv = zblock_readv,
+	.writev = zblock_writev,
+};
@@ -13,29 +13,75 @@
 #include <colinux/common/common.h>
 #include <colinux/kernel/filesystem.h>
 
+extern co_rc_t co_os_fs_dir_join_unix_path(co_pathname_t *dirname, const char *addition);
+
 /*
- * OS-specific pathname helpers.
+ * OS-specific operations on files. Files are named by their directory
+ * inode and a name in it, an empty name stands for the directory itself
+ * and a NULL directory for the root. The OS may keep its own reference
+ * to the host file in inode->sysdep, released by co_os_fs_inode_release.
  */
-extern co_rc_t co_os_fs_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
-				      char **out_name, int need_len);
-extern int co_os_fs_add_last_component(co_pathname_t *dirname);
-extern co_rc_t co_os_fs_dir_join_unix_path(co_pathname_t *dirname, const char *addition);
-extern co_rc_t co_os_fs_dir_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
-					  char **out_name, char *name);
+extern co_rc_t co_os_fs_get_attr(co_filesystem_t *fs, co_inode_t *dir, char *name,
+				 struct fuse_attr *attr);
+extern co_rc_t co_os_fs_set_attr(co_filesystem_t *fs, co_inode_t *inode, unsigned long valid,
+				 struct fuse_attr *attr);
+extern co_rc_t co_os_fs_getdir(co_filesystem_t *fs, co_inode_t *dir,
+			       co_filesystem_dir_names_t *names);
+extern co_rc_t co_os_fs_mknod(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			      unsigned long mode);
+extern co_rc_t co_os_fs_mkdir(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			      unsigned long mode);
+extern co_rc_t co_os_fs_unlink(co_filesystem_t *fs, co_inode_t *dir, char *name);
+extern co_rc_t co_os_fs_rmdir(co_filesystem_t *fs, co_inode_t *dir, char *name);
+extern co_rc_t co_os_fs_rename(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			       co_inode_t *new_dir, char *new_name);
+extern co_rc_t co_os_fs_open(co_filesystem_t *fs, co_inode_t *inode, bool_t write,
+			     void **handle);
+extern void co_os_fs_inode_release(co_filesystem_t *fs, co_inode_t *inode);
 
 /*
- * OS-specific operations on files.
+ * A reference to the host directory of 'dir' that needs no inode, so
+ * that co_os_fs_dir_get_attr() can run with the filesystem's mutex let
+ * go. Both ends are called with the mutex held.
  */
-extern co_rc_t co_os_file_read_write(struct co_monitor *linuxvm, char *filename, unsigned long long offset,
-				     unsigned long size, vm_ptr_t src_buffer, bool_t read);
-extern co_rc_t co_os_file_set_attr(char *filename, unsigned long valid, struct fuse_attr *attr);
-extern co_rc_t co_os_file_get_attr(char *filename, struct fuse_attr *attr);
-extern co_rc_t co_os_file_unlink(char *filename);
-extern co_rc_t co_os_file_rmdir(char *filename);
-extern co_rc_t co_os_file_mkdir(char *dirname);
-extern co_rc_t co_os_file_rename(char *filename, char *dest_filename);
-extern co_rc_t co_os_file_mknod(co_filesystem_t *filesystem, char *filename, unsigned long mode);
-extern co_rc_t co_os_file_getdir(char *dirname, co_filesystem_dir_names_t *names);
+extern co_rc_t co_os_fs_dir_hold(co_filesystem_t *fs, co_inode_t *dir, void **ref);
+extern co_rc_t co_os_fs_dir_get_attr(void *ref, char *name, struct fuse_attr *attr);
+extern void co_os_fs_dir_unhold(void *ref);
+
+/*
+ * Change notification of the entries of watch->dir, reported through
+ * co_monitor_file_system_changed() until co_os_fs_unwatch() returns.
+ * Neither is called with watch_mutex held.
+ */
+extern co_rc_t co_os_fs_watch(co_filesystem_t *fs, co_fs_watch_t *watch);
+extern void co_os_fs_unwatch(co_filesystem_t *fs, co_fs_watch_t *watch);
+
+/*
+ * The meta data store of UNIX mode, the host file 'pathname' mapped into
+ * memory. co_os_fs_meta_map() maps at least '*size' bytes, or the whole
+ * file if it is larger, growing the file as needed; zeros past its old
+ * end. Changes of the mapping reach the file once they are reported by
+ * co_os_fs_meta_dirty(), and the disk once co_os_fs_meta_flush() returns.
+ */
+extern co_rc_t co_os_fs_meta_map(co_filesystem_t *fs, char *pathname, unsigned long *size,
+				 void **map);
+extern void co_os_fs_meta_dirty(co_filesystem_t *fs, unsigned long offset, unsigned long size);
+extern co_rc_t co_os_fs_meta_flush(co_filesystem_t *fs);
+extern void co_os_fs_meta_unmap(co_filesystem_t *fs);
+
+/*
+ * The worker of a device with asynchronous requests, which passes each
+ * queued job to co_monitor_file_system_job() in order. Stopping it runs
+ * the jobs still queued first.
+ */
+extern co_rc_t co_os_fs_async_start(co_filesystem_t *fs);
+extern co_rc_t co_os_fs_queue(co_filesystem_t *fs, co_fs_job_t *job);
+extern void co_os_fs_async_stop(co_filesystem_t *fs);
+
+extern void co_os_file_handle_close(void *handle);
+extern co_rc_t co_os_file_handle_read_write(struct co_monitor *linuxvm, void *handle,
+					    unsigned long long offset, unsigned long size,
+					    vm_ptr_t src_buffer, bool_t read);
 extern co_rc_t co_os_file_fs_stat(co_filesystem_t *filesystem, struct fuse_statfs_out *statfs);
 
 #endif
@@ -0,0 +1,41 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#ifndef __CO_OS_KERNEL_NBD_H__
+#define __CO_OS_KERNEL_NBD_H__
+
+#include <colinux/common/nbd.h>
+
+/*
+ * Connections of the NBD client in kernel/nbdblock.c. The host provides
+ * the socket, the thread that receives the replies, and the completion
+ * a control request waits on for its reply.
+ */
+
+typedef struct co_os_nbd *co_os_nbd_t;
+
+extern co_rc_t co_os_nbd_connect(co_nbd_uri_t *uri, co_os_nbd_t *nbd_out);
+extern void co_os_nbd_close(co_os_nbd_t nbd);
+
+/* Blocking, of the type co_nbd_io_func_t, 'conn' is a co_os_nbd_t */
+extern co_rc_t co_os_nbd_send(void *conn, void *buffer, unsigned long size);
+extern co_rc_t co_os_nbd_recv(void *conn, void *buffer, unsigned long size);
+
+/* Fails what is blocked in co_os_nbd_send() or co_os_nbd_recv(), and what comes later */
+extern void co_os_nbd_shutdown(co_os_nbd_t nbd);
+
+/* co_os_nbd_receiver_stop() returns once 'func' did */
+extern co_rc_t co_os_nbd_receiver_start(co_os_nbd_t nbd, void (*func)(void *data),
+					void *data, int unit);
+extern void co_os_nbd_receiver_stop(co_os_nbd_t nbd);
+
+extern void co_os_nbd_control_reset(co_os_nbd_t nbd);
+extern void co_os_nbd_control_wait(co_os_nbd_t nbd);
+extern void co_os_nbd_control_done(co_os_nbd_t nbd);
+
+#endif
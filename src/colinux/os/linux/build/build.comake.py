@@ -7,6 +7,8 @@ targets['executables'] = Target(
     Input('colinux-console-fltk'),
     Input('colinux-debug-daemon'),
     Input('colinux-serial-daemon'),
+    Input('colinux-cobd-tool'),
+    Input('colinux-cobd-bench'),
     ],
     tool = Empty(),
 )
@@ -81,6 +83,23 @@ targets['colinux-serial-daemon'] = Target(
     mono_options = generate_options('gcc'),
 )
 
+targets['colinux-cobd-tool'] = Target(
+    inputs = [
+       Input('../user/cobd-tool/build.o'),
+       Input('../../../user/cobd-tool/build.o'),
+    ] + user_dep,
+    tool = Compiler(),
+    mono_options = generate_options('gcc'),
+)
+
+targets['colinux-cobd-bench'] = Target(
+    inputs = [
+       Input('../user/cobd-bench/build.o'),
+    ] + user_dep,
+    tool = Compiler(),
+    mono_options = generate_options('gcc', libs=['pthread']),
+)
+
 targets['colinux.ko'] = Target(
     inputs = [Input('../kernel/module/colinux.ko')],
     tool = Copy(),
@@ -10,15 +10,84 @@
  */
 
 #include "linux_inc.h"
-
+#include <linux/kthread.h>
+#include <linux/pagemap.h>
+#include <linux/swap.h>
+#include <linux/writeback.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+#include <linux/falloc.h>
+#endif
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
 #include <colinux/kernel/transfer.h>
 #include <colinux/kernel/fileblock.h>
+#include <colinux/arch/mmu.h>
+
+/*
+ * Pages mapped at once by one thread. Highmem hosts have only a few
+ * hundred kmap slots for everyone, and kmap() sleeps until one is free.
+ */
+#define CO_OS_FILE_BLOCK_IOV_MAX	16
+#define CO_OS_FILE_BLOCK_THREADS	4
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+#define read_mapping_page(mapping, index, data) \
+	read_cache_page(mapping, index, (filler_t *)(mapping)->a_ops->readpage, data)
+#endif
+
+/*
+ * Asynchronous devices get a few worker threads, so that several tagged
+ * requests can be in flight and the host I/O scheduler may reorder them.
+ */
+struct co_os_file_block_sysdep {
+	struct file *filp;
+	struct task_struct *threads[CO_OS_FILE_BLOCK_THREADS]; /* NULL for synchronous devices */
+	spinlock_t lock;
+	struct list_head queue;
+	wait_queue_head_t wait;
+};
 
 typedef struct {
 	loff_t offset;
 	co_monitor_file_block_dev_t *fdev;
 } co_os_transfer_file_block_data_t;
 
+/*
+ * Asynchronous request, carried out by one of the device's worker threads.
+ * Once the I/O is done the embedded message is posted to Linux, the
+ * same way the Windows host does it from its APC routine.
+ */
+typedef struct {
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		co_block_intr_t intr;
+	} msg; /* Must stay as the first field */
+	struct list_head node;
+	co_monitor_t *monitor;
+	co_block_dev_t *dev;
+	co_monitor_file_block_dev_t *fdev;
+	unsigned long long offset;
+	vm_ptr_t address;
+	unsigned long size;
+	bool_t read;
+	co_block_segment_t *segments; /* NULL unless READV/WRITEV */
+	unsigned long nr_segments;
+} callback_context_t;
+
+/*
+ * Page sized pieces of a segment list, mapped into the host and
+ * handed to vfs_readv/vfs_writev in one go.
+ */
+typedef struct {
+	struct iovec iov[CO_OS_FILE_BLOCK_IOV_MAX];
+	unsigned char *page[CO_OS_FILE_BLOCK_IOV_MAX];
+	co_pfn_t pfn[CO_OS_FILE_BLOCK_IOV_MAX];
+	unsigned long count;
+	size_t size;
+} co_os_file_block_iov_t;
+
 static
 co_rc_t co_os_transfer_file_block(struct co_monitor *cmon,
 				  void *host_data, void *linuxvm, unsigned long size,
@@ -29,7 +98,7 @@ co_rc_t co_os_transfer_file_block(struct co_monitor *cmon,
 	struct file *filp;
 
 	data = (co_os_transfer_file_block_data_t *)host_data;
-	filp = (struct file *)(data->fdev->sysdep);
+	filp = data->fdev->sysdep->filp;
 
 	if (CO_MONITOR_TRANSFER_FROM_HOST == dir) {
 		mm_segment_t fs;
@@ -71,6 +140,29 @@ co_rc_t co_os_transfer_file_block(struct co_monitor *cmon,
 	return rc;
 }
 
+/*
+ * O_DIRECT does not work with the kernel addresses the guest pages are
+ * mapped at, so devices that bypass the host cache drop the pages of a
+ * request once it is done, after writing them back.
+ */
+static
+void co_os_file_block_uncache(co_monitor_file_block_dev_t *fdev,
+			      unsigned long long offset,
+			      unsigned long long size,
+			      bool_t read)
+{
+	struct address_space *mapping = fdev->sysdep->filp->f_mapping;
+
+	if (!fdev->direct || size == 0)
+		return;
+
+	if (!read)
+		filemap_write_and_wait_range(mapping, offset, offset + size - 1);
+
+	invalidate_mapping_pages(mapping, offset >> PAGE_CACHE_SHIFT,
+				 (offset + size - 1) >> PAGE_CACHE_SHIFT);
+}
+
 static
 co_rc_t co_os_file_block_read(struct co_monitor *linuxvm,
 			      co_block_dev_t *dev,
@@ -89,6 +181,8 @@ co_rc_t co_os_file_block_read(struct co_monitor *linuxvm,
 					      request->address,
 					      (unsigned long)request->size,
 					      CO_MONITOR_TRANSFER_FROM_HOST);
+	if (CO_OK(rc))
+		co_os_file_block_uncache(fdev, request->offset, request->size, PTRUE);
 
 	return rc;
 }
@@ -112,6 +206,590 @@ co_rc_t co_os_file_block_write(struct co_monitor *linuxvm,
 					      request->address,
 					      (unsigned long)request->size,
 					      CO_MONITOR_TRANSFER_FROM_LINUX);
+	if (CO_OK(rc))
+		co_os_file_block_uncache(fdev, request->offset, request->size, PFALSE);
+
+	return rc;
+}
+
+static
+co_rc_t co_os_file_block_host_read_write(co_monitor_file_block_dev_t *fdev,
+					 unsigned long long offset,
+					 void *buffer,
+					 unsigned long size,
+					 bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	return co_os_transfer_file_block(NULL, &data, buffer, size,
+					 read ? CO_MONITOR_TRANSFER_FROM_HOST :
+					 CO_MONITOR_TRANSFER_FROM_LINUX);
+}
+
+static
+co_rc_t co_os_file_block_discard(co_monitor_file_block_dev_t *fdev,
+				 unsigned long long offset,
+				 unsigned long long size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	struct file *filp = fdev->sysdep->filp;
+	long ret;
+
+	if (!filp->f_op->fallocate)
+		return CO_RC(ERROR);
+
+	ret = filp->f_op->fallocate(filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				    offset, size);
+	if (ret) {
+		co_debug("co_os_file_block_discard: punch hole error: %ld", ret);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+#else
+	/* Holes can not be punched into files */
+	return CO_RC(ERROR);
+#endif
+}
+
+static
+co_rc_t co_os_file_block_flush(co_monitor_file_block_dev_t *fdev)
+{
+	struct file *filp = fdev->sysdep->filp;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	ret = vfs_fsync(filp, 1);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+	ret = vfs_fsync(filp, filp->f_dentry, 1);
+#else
+	ret = -EINVAL;
+	if (filp->f_op->fsync) {
+		struct inode *inode = filp->f_mapping->host;
+
+		ret = filemap_fdatawrite(filp->f_mapping);
+		mutex_lock(&inode->i_mutex);
+		if (!ret)
+			ret = filp->f_op->fsync(filp, filp->f_dentry, 1);
+		mutex_unlock(&inode->i_mutex);
+		if (!ret)
+			ret = filemap_fdatawait(filp->f_mapping);
+	}
+#endif
+	if (ret) {
+		co_debug("co_os_file_block_flush: fsync error: %d", ret);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static
+co_rc_t co_os_file_block_iov_submit(co_monitor_t *cmon,
+				    struct file *filp,
+				    co_os_file_block_iov_t *vec,
+				    loff_t *offset,
+				    bool_t read)
+{
+	mm_segment_t fs;
+	ssize_t ret;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	fs = get_fs();
+	set_fs(KERNEL_DS);
+	if (read)
+		ret = vfs_readv(filp, vec->iov, vec->count, offset);
+	else
+		ret = vfs_writev(filp, vec->iov, vec->count, offset);
+	set_fs(fs);
+
+	if (ret != vec->size) {
+		co_debug("co_os_file_block_iov_submit: %s error: %d != %d",
+			 read ? "read" : "write", (int)ret, (int)vec->size);
+		rc = CO_RC(ERROR);
+	}
+
+	for (i = 0; i < vec->count; i++)
+		co_monitor_host_linuxvm_transfer_unmap(cmon, vec->page[i], vec->pfn[i]);
+
+	vec->count = 0;
+	vec->size = 0;
+
+	return rc;
+}
+
+static
+co_rc_t co_os_file_block_vector(co_monitor_t *cmon,
+				co_monitor_file_block_dev_t *fdev,
+				unsigned long long offset,
+				co_block_segment_t *segments,
+				unsigned long nr_segments,
+				bool_t read)
+{
+	co_os_file_block_iov_t *vec;
+	loff_t pos = offset;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	vec = co_os_malloc(sizeof(*vec));
+	if (!vec)
+		return CO_RC(OUT_OF_MEMORY);
+	vec->count = 0;
+	vec->size = 0;
+
+	for (i = 0; i < nr_segments && CO_OK(rc); i++) {
+		vm_ptr_t vaddr = segments[i].address;
+		unsigned long size = segments[i].size;
+
+		while (size > 0) {
+			unsigned long one_copy;
+			unsigned char *start;
+
+			one_copy = ((vaddr + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - vaddr;
+			if (one_copy > size)
+				one_copy = size;
+
+			rc = co_monitor_host_linuxvm_transfer_map(cmon, vaddr, one_copy, &start,
+								  &vec->page[vec->count],
+								  &vec->pfn[vec->count]);
+			if (!CO_OK(rc))
+				break;
+
+			vec->iov[vec->count].iov_base = start;
+			vec->iov[vec->count].iov_len = one_copy;
+			vec->count++;
+			vec->size += one_copy;
+
+			if (vec->count == CO_OS_FILE_BLOCK_IOV_MAX) {
+				rc = co_os_file_block_iov_submit(cmon, fdev->sysdep->filp, vec, &pos, read);
+				if (!CO_OK(rc))
+					break;
+			}
+
+			size -= one_copy;
+			vaddr += one_copy;
+		}
+	}
+
+	if (vec->count) {
+		if (CO_OK(rc)) {
+			rc = co_os_file_block_iov_submit(cmon, fdev->sysdep->filp, vec, &pos, read);
+		} else {
+			for (i = 0; i < vec->count; i++)
+				co_monitor_host_linuxvm_transfer_unmap(cmon, vec->page[i], vec->pfn[i]);
+		}
+	}
+
+	co_os_free(vec);
+
+	if (CO_OK(rc))
+		co_os_file_block_uncache(fdev, offset, pos - offset, read);
+
+	return rc;
+}
+
+static
+co_rc_t co_os_file_block_readv(struct co_monitor *linuxvm,
+			       co_block_dev_t *dev,
+			       co_monitor_file_block_dev_t *fdev,
+			       co_block_request_t *request,
+			       co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(linuxvm, fdev, request->offset,
+				       segments, request->nr_segments, PTRUE);
+}
+
+static
+co_rc_t co_os_file_block_writev(struct co_monitor *linuxvm,
+				co_block_dev_t *dev,
+				co_monitor_file_block_dev_t *fdev,
+				co_block_request_t *request,
+				co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(linuxvm, fdev, request->offset,
+				       segments, request->nr_segments, PFALSE);
+}
+
+static void co_os_file_block_async_do(callback_context_t *context)
+{
+	co_os_transfer_file_block_data_t data;
+	co_rc_t rc;
+
+	if (context->segments) {
+		rc = co_os_file_block_vector(context->monitor, context->fdev, context->offset,
+					     context->segments, context->nr_segments,
+					     context->read);
+	} else {
+		data.offset = context->offset;
+		data.fdev = context->fdev;
+
+		rc = co_monitor_host_linuxvm_transfer(context->monitor,
+						      &data,
+						      co_os_transfer_file_block,
+						      context->address,
+						      context->size,
+						      context->read ? CO_MONITOR_TRANSFER_FROM_HOST :
+								      CO_MONITOR_TRANSFER_FROM_LINUX);
+		if (CO_OK(rc))
+			co_os_file_block_uncache(context->fdev, context->offset,
+						 context->size, context->read);
+	}
+	if (CO_OK(rc))
+		context->msg.intr.uptodate = 1;
+	else
+		co_debug("cobd%d async %s failed size=%ld rc=%x",
+			 context->msg.linux_message.unit,
+			 context->read ? "read" : "write", context->size, (int)rc);
+
+	co_monitor_block_complete(context->monitor, context->dev, &context->msg.message);
+}
+
+static int co_os_file_block_thread(void *arg)
+{
+	struct co_os_file_block_sysdep *sysdep = arg;
+	callback_context_t *context;
+
+	for (;;) {
+		wait_event_interruptible(sysdep->wait,
+					 !list_empty(&sysdep->queue) || kthread_should_stop());
+
+		spin_lock(&sysdep->lock);
+		if (list_empty(&sysdep->queue)) {
+			spin_unlock(&sysdep->lock);
+			/* Queue drained, leave if asked to */
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+		context = list_entry(sysdep->queue.next, callback_context_t, node);
+		list_del(&context->node);
+		spin_unlock(&sysdep->lock);
+
+		co_os_file_block_async_do(context);
+	}
+
+	return 0;
+}
+
+static
+co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
+					  co_block_dev_t *dev,
+					  co_monitor_file_block_dev_t *fdev,
+					  co_block_request_t *request,
+					  co_block_segment_t *segments,
+					  bool_t read)
+{
+	callback_context_t *context;
+	unsigned long segments_size = 0;
+
+	/* The segment list is copied, fdev->segments is reused by the next request */
+	if (segments)
+		segments_size = request->nr_segments * sizeof(co_block_segment_t);
+
+	context = co_os_malloc(sizeof(callback_context_t) + segments_size);
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(context, 0, sizeof(callback_context_t));
+
+	if (segments) {
+		context->segments = (co_block_segment_t *)(context + 1);
+		context->nr_segments = request->nr_segments;
+		co_memcpy(context->segments, segments, segments_size);
+	}
+
+	context->monitor = monitor;
+	context->dev = dev;
+	context->fdev = fdev;
+	context->offset = request->offset;
+	context->address = request->address;
+	context->size = (unsigned long)request->size;
+	context->read = read;
+	context->msg.message.from = CO_MODULE_COBD0 + dev->unit;
+	context->msg.message.to = CO_MODULE_LINUX;
+	context->msg.message.priority = CO_PRIORITY_DISCARDABLE;
+	context->msg.message.type = CO_MESSAGE_TYPE_OTHER;
+	context->msg.message.size = sizeof(context->msg) - sizeof(context->msg.message);
+	context->msg.linux_message.device = CO_DEVICE_BLOCK;
+	context->msg.linux_message.unit = dev->unit;
+	context->msg.linux_message.size = sizeof(context->msg.intr);
+	context->msg.intr.irq_request = request->irq_request;
+	context->msg.intr.tag = request->tag;
+
+	spin_lock(&fdev->sysdep->lock);
+	list_add_tail(&context->node, &fdev->sysdep->queue);
+	spin_unlock(&fdev->sysdep->lock);
+	wake_up(&fdev->sysdep->wait);
+
+	request->async = PTRUE;
+	return CO_RC(OK);
+}
+
+static
+co_rc_t co_os_file_block_async_read(struct co_monitor *linuxvm,
+				    co_block_dev_t *dev,
+				    co_monitor_file_block_dev_t *fdev,
+				    co_block_request_t *request)
+{
+	return co_os_file_block_async_read_write(linuxvm, dev, fdev, request, NULL, PTRUE);
+}
+
+static
+co_rc_t co_os_file_block_async_write(struct co_monitor *linuxvm,
+				     co_block_dev_t *dev,
+				     co_monitor_file_block_dev_t *fdev,
+				     co_block_request_t *request)
+{
+	return co_os_file_block_async_read_write(linuxvm, dev, fdev, request, NULL, PFALSE);
+}
+
+static
+co_rc_t co_os_file_block_async_readv(struct co_monitor *linuxvm,
+				     co_block_dev_t *dev,
+				     co_monitor_file_block_dev_t *fdev,
+				     co_block_request_t *request,
+				     co_block_segment_t *segments)
+{
+	return co_os_file_block_async_read_write(linuxvm, dev, fdev, request, segments, PTRUE);
+}
+
+static
+co_rc_t co_os_file_block_async_writev(struct co_monitor *linuxvm,
+				      co_block_dev_t *dev,
+				      co_monitor_file_block_dev_t *fdev,
+				      co_block_request_t *request,
+				      co_block_segment_t *segments)
+{
+	return co_os_file_block_async_read_write(linuxvm, dev, fdev, request, segments, PFALSE);
+}
+
+/*
+ * Mapped devices copy between the guest pages and the page cache of the
+ * image, one page at a time. This skips the f_op->read/write call chain
+ * per page of co_os_transfer_file_block. Hosts before 2.6.24 have no
+ * pagecache_write_begin and use that chain for writes.
+ */
+static
+co_rc_t co_os_file_block_mapped_copy(co_monitor_file_block_dev_t *fdev,
+				     unsigned long long offset,
+				     unsigned char *buffer,
+				     unsigned long size,
+				     bool_t read)
+{
+	struct file *filp = fdev->sysdep->filp;
+	struct address_space *mapping = filp->f_mapping;
+	unsigned long page_offset, one_copy;
+	struct page *page;
+	char *kaddr;
+
+	while (size > 0) {
+		page_offset = offset & (PAGE_CACHE_SIZE - 1);
+		one_copy = PAGE_CACHE_SIZE - page_offset;
+		if (one_copy > size)
+			one_copy = size;
+
+		if (read) {
+			page = read_mapping_page(mapping, offset >> PAGE_CACHE_SHIFT, filp);
+			if (IS_ERR(page)) {
+				co_debug("co_os_file_block_mapped_copy: read error: %ld",
+					 PTR_ERR(page));
+				return CO_RC(ERROR);
+			}
+
+			kaddr = kmap(page);
+			co_memcpy(buffer, kaddr + page_offset, one_copy);
+			kunmap(page);
+
+			mark_page_accessed(page);
+			page_cache_release(page);
+		} else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+			struct inode *inode = mapping->host;
+			void *fsdata;
+			int ret;
+
+			mutex_lock(&inode->i_mutex);
+			ret = pagecache_write_begin(filp, mapping, offset, one_copy, 0,
+						    &page, &fsdata);
+			if (ret) {
+				mutex_unlock(&inode->i_mutex);
+				co_debug("co_os_file_block_mapped_copy: write error: %d", ret);
+				return CO_RC(ERROR);
+			}
+
+			kaddr = kmap(page);
+			co_memcpy(kaddr + page_offset, buffer, one_copy);
+			kunmap(page);
+			flush_dcache_page(page);
+
+			ret = pagecache_write_end(filp, mapping, offset, one_copy, one_copy,
+						  page, fsdata);
+			mutex_unlock(&inode->i_mutex);
+			if (ret != (int)one_copy) {
+				co_debug("co_os_file_block_mapped_copy: write error: %d != %ld",
+					 ret, one_copy);
+				return CO_RC(ERROR);
+			}
+
+			balance_dirty_pages_ratelimited(mapping);
+#else
+			co_os_transfer_file_block_data_t data;
+			co_rc_t rc;
+
+			data.offset = offset;
+			data.fdev = fdev;
+
+			rc = co_os_transfer_file_block(NULL, &data, buffer, one_copy,
+						       CO_MONITOR_TRANSFER_FROM_LINUX);
+			if (!CO_OK(rc))
+				return rc;
+#endif
+		}
+
+		buffer += one_copy;
+		offset += one_copy;
+		size -= one_copy;
+	}
+
+	return CO_RC(OK);
+}
+
+static
+co_rc_t co_os_transfer_file_block_mapped(struct co_monitor *cmon,
+					 void *host_data, void *linuxvm, unsigned long size,
+					 co_monitor_transfer_dir_t dir)
+{
+	co_os_transfer_file_block_data_t *data;
+	co_rc_t rc;
+
+	data = (co_os_transfer_file_block_data_t *)host_data;
+
+	rc = co_os_file_block_mapped_copy(data->fdev, data->offset, linuxvm, size,
+					  dir == CO_MONITOR_TRANSFER_FROM_HOST);
+	data->offset += size;
+
+	return rc;
+}
+
+/* Writes to the page cache are only durable on the host after this */
+static
+co_rc_t co_os_file_block_mapped_sync(co_monitor_file_block_dev_t *fdev,
+				     unsigned long long offset,
+				     unsigned long long size)
+{
+	int ret;
+
+	if (!fdev->write_through || size == 0)
+		return CO_RC(OK);
+
+	ret = filemap_write_and_wait_range(fdev->sysdep->filp->f_mapping,
+					   offset, offset + size - 1);
+	if (ret) {
+		co_debug("co_os_file_block_mapped_sync: write back error: %d", ret);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static
+co_rc_t co_os_file_block_mapped_vector(co_monitor_t *cmon,
+				       co_monitor_file_block_dev_t *fdev,
+				       unsigned long long offset,
+				       co_block_segment_t *segments,
+				       unsigned long nr_segments,
+				       bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	for (i = 0; i < nr_segments && CO_OK(rc); i++)
+		rc = co_monitor_host_linuxvm_transfer(cmon,
+						      &data,
+						      co_os_transfer_file_block_mapped,
+						      segments[i].address,
+						      segments[i].size,
+						      read ? CO_MONITOR_TRANSFER_FROM_HOST :
+							     CO_MONITOR_TRANSFER_FROM_LINUX);
+
+	if (CO_OK(rc) && !read)
+		rc = co_os_file_block_mapped_sync(fdev, offset, data.offset - offset);
+
+	return rc;
+}
+
+static
+co_rc_t co_os_file_block_mapped_read(struct co_monitor *linuxvm,
+				     co_block_dev_t *dev,
+				     co_monitor_file_block_dev_t *fdev,
+				     co_block_request_t *request)
+{
+	co_block_segment_t segment;
+
+	segment.address = request->address;
+	segment.size = (unsigned long)request->size;
+
+	return co_os_file_block_mapped_vector(linuxvm, fdev, request->offset,
+					      &segment, 1, PTRUE);
+}
+
+static
+co_rc_t co_os_file_block_mapped_write(struct co_monitor *linuxvm,
+				      co_block_dev_t *dev,
+				      co_monitor_file_block_dev_t *fdev,
+				      co_block_request_t *request)
+{
+	co_block_segment_t segment;
+
+	segment.address = request->address;
+	segment.size = (unsigned long)request->size;
+
+	return co_os_file_block_mapped_vector(linuxvm, fdev, request->offset,
+					      &segment, 1, PFALSE);
+}
+
+static
+co_rc_t co_os_file_block_mapped_readv(struct co_monitor *linuxvm,
+				      co_block_dev_t *dev,
+				      co_monitor_file_block_dev_t *fdev,
+				      co_block_request_t *request,
+				      co_block_segment_t *segments)
+{
+	return co_os_file_block_mapped_vector(linuxvm, fdev, request->offset,
+					      segments, request->nr_segments, PTRUE);
+}
+
+static
+co_rc_t co_os_file_block_mapped_writev(struct co_monitor *linuxvm,
+				       co_block_dev_t *dev,
+				       co_monitor_file_block_dev_t *fdev,
+				       co_block_request_t *request,
+				       co_block_segment_t *segments)
+{
+	return co_os_file_block_mapped_vector(linuxvm, fdev, request->offset,
+					      segments, request->nr_segments, PFALSE);
+}
+
+static
+co_rc_t co_os_file_block_mapped_host_read_write(co_monitor_file_block_dev_t *fdev,
+						unsigned long long offset,
+						void *buffer,
+						unsigned long size,
+						bool_t read)
+{
+	co_rc_t rc;
+
+	rc = co_os_file_block_mapped_copy(fdev, offset, buffer, size, read);
+	if (CO_OK(rc) && !read)
+		rc = co_os_file_block_mapped_sync(fdev, offset, size);
+
 	return rc;
 }
 
@@ -154,7 +832,9 @@ co_rc_t co_os_file_block_open(struct co_monitor *linuxvm, co_monitor_file_block_
 
 	co_debug("opening %s", fdev->pathname);
 
-	filp = filp_open(fdev->pathname, O_RDWR | O_LARGEFILE, 0);
+	filp = filp_open(fdev->pathname,
+			 (fdev->read_only ? O_RDONLY : O_RDWR) |
+			 (fdev->write_through ? O_SYNC : 0) | O_LARGEFILE, 0);
         if (IS_ERR(filp))
 		return CO_RC(ERROR);
 
@@ -171,7 +851,17 @@ co_rc_t co_os_file_block_open(struct co_monitor *linuxvm, co_monitor_file_block_
 		goto out;
         }
 
-	fdev->sysdep = (struct co_os_file_block_sysdep *)(filp);
+	fdev->sysdep = co_os_malloc(sizeof(struct co_os_file_block_sysdep));
+	if (!fdev->sysdep) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+
+	co_memset(fdev->sysdep, 0, sizeof(struct co_os_file_block_sysdep));
+	fdev->sysdep->filp = filp;
+	spin_lock_init(&fdev->sysdep->lock);
+	INIT_LIST_HEAD(&fdev->sysdep->queue);
+	init_waitqueue_head(&fdev->sysdep->wait);
 	return rc;
 
 out:
@@ -182,22 +872,56 @@ out:
 static
 co_rc_t co_os_file_block_close(co_monitor_file_block_dev_t *fdev)
 {
-	struct file *filp;
+	int i;
 
 	co_debug("closing %s", fdev->pathname);
 
-	filp = (struct file *)(fdev->sysdep);
-	filp_close(filp, NULL);
+	/* The threads drain the queue before they exit */
+	for (i = 0; i < CO_OS_FILE_BLOCK_THREADS; i++)
+		if (fdev->sysdep->threads[i])
+			kthread_stop(fdev->sysdep->threads[i]);
+
+	filp_close(fdev->sysdep->filp, NULL);
+	co_os_free(fdev->sysdep);
+	fdev->sysdep = NULL;
 
 	return CO_RC(OK);
 }
 
+static
+co_rc_t co_os_file_block_async_open(struct co_monitor *linuxvm, co_monitor_file_block_dev_t *fdev)
+{
+	struct task_struct *thread;
+	co_rc_t rc;
+	int i;
+
+	rc = co_os_file_block_open(linuxvm, fdev);
+	if (!CO_OK(rc))
+		return rc;
+
+	for (i = 0; i < CO_OS_FILE_BLOCK_THREADS; i++) {
+		thread = kthread_run(co_os_file_block_thread, fdev->sysdep,
+				     "cobd%d/%d", fdev->dev.unit, i);
+		if (IS_ERR(thread)) {
+			co_os_file_block_close(fdev);
+			return CO_RC(OUT_OF_MEMORY);
+		}
+		fdev->sysdep->threads[i] = thread;
+	}
+
+	return rc;
+}
+
 co_monitor_file_block_operations_t co_os_file_block_async_operations = {
-	.open = co_os_file_block_open,
+	.open = co_os_file_block_async_open,
 	.close = co_os_file_block_close,
-	.read = co_os_file_block_read,
-	.write = co_os_file_block_write,
+	.read = co_os_file_block_async_read,
+	.write = co_os_file_block_async_write,
 	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_async_readv,
+	.writev = co_os_file_block_async_writev,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
 };
 
 co_monitor_file_block_operations_t co_os_file_block_default_operations = {
@@ -206,4 +930,22 @@ co_monitor_file_block_operations_t co_os_file_block_default_operations = {
 	.read = co_os_file_block_read,
 	.write = co_os_file_block_write,
 	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_readv,
+	.writev = co_os_file_block_writev,
+	.host_read_write = co_os_file_block_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
+};
+
+co_monitor_file_block_operations_t co_os_file_block_mapped_operations = {
+	.open = co_os_file_block_open,
+	.close = co_os_file_block_close,
+	.read = co_os_file_block_mapped_read,
+	.write = co_os_file_block_mapped_write,
+	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_mapped_readv,
+	.writev = co_os_file_block_mapped_writev,
+	.host_read_write = co_os_file_block_mapped_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
 };
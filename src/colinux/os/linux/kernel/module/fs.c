@@ -1,89 +1,1070 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#include "linux_inc.h"
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/statfs.h>
+#include <linux/kthread.h>
+#if defined(CONFIG_INOTIFY) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+#include <linux/inotify.h>
+#define CO_FS_INOTIFY
+#endif
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/kernel/transfer.h>
+#include <colinux/kernel/filesystem.h>
 #include <colinux/os/kernel/filesystem.h>
 
-co_rc_t co_os_fs_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
-				      char **out_name, int add)
+/*
+ * Every inode keeps a reference to its host dentry in inode->sysdep, and
+ * names are looked up in the dentry of their directory. A lookup costs
+ * the same however deep the file is, and no pathname is ever built
+ * after the mount. The dentries follow renames done on the host; the
+ * ones found unhashed, after the file went away, are looked up again.
+ */
+typedef struct {
+	struct vfsmount *mnt;
+	struct dentry *dentry;
+} co_os_fs_path_t;
+
+typedef struct {
+	struct file *filp;
+	loff_t offset;
+} co_os_fs_transfer_data_t;
+
+typedef struct {
+	co_filesystem_dir_names_t *names;
+	co_rc_t rc;
+	int count;
+} co_os_fs_getdir_data_t;
+
+static co_rc_t errno_to_rc(long err)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	switch (err) {
+	case 0:
+		return CO_RC(OK);
+	case -ENOENT:
+	case -ENOTDIR:
+		return CO_RC(NOT_FOUND);
+	case -EACCES:
+	case -EPERM:
+	case -EROFS:
+		return CO_RC(ACCESS_DENIED);
+	case -EINVAL:
+	case -ENAMETOOLONG:
+		return CO_RC(INVALID_PARAMETER);
+	case -ENOMEM:
+		return CO_RC(OUT_OF_MEMORY);
+	default:
+		return CO_RC(ERROR);
+	}
+}
+
+/* Names come from Linux, they must not lead out of their directory */
+static co_rc_t check_name(const char *name)
+{
+	if (!*name || co_strcmp(name, ".") == 0 || co_strcmp(name, "..") == 0 ||
+	    strchr(name, '/'))
+		return CO_RC(INVALID_PARAMETER);
+
+	return CO_RC(OK);
+}
+
+static bool_t path_valid(co_os_fs_path_t *path)
+{
+	struct dentry *dentry = path->dentry;
+
+	/* The root of a host filesystem is never hashed */
+	if (d_unhashed(dentry) && !IS_ROOT(dentry))
+		return PFALSE;
+
+	return dentry->d_inode != NULL;
+}
+
+void co_os_fs_inode_release(co_filesystem_t *fs, co_inode_t *inode)
+{
+	co_os_fs_path_t *path = inode->sysdep;
+
+	if (!path)
+		return;
+
+	dput(path->dentry);
+	mntput(path->mnt);
+	co_os_free(path);
+	inode->sysdep = NULL;
+}
+
+static co_rc_t lookup_base(co_filesystem_t *fs, co_os_fs_path_t *path)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	struct path base;
+	int err;
+
+	err = kern_path(fs->base_path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &base);
+	if (err)
+		goto error;
+
+	path->mnt = base.mnt;
+	path->dentry = base.dentry;
+#else
+	struct nameidata nd;
+	int err;
+
+	err = path_lookup(fs->base_path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &nd);
+	if (err)
+		goto error;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
+	path->mnt = nd.path.mnt;
+	path->dentry = nd.path.dentry;
+#else
+	path->mnt = nd.mnt;
+	path->dentry = nd.dentry;
+#endif
+#endif
+	return CO_RC(OK);
+
+error:
+	co_debug_lvl(filesystem, 5, "error %d looking up '%s'", err, fs->base_path);
+	return errno_to_rc(err);
+}
+
+/* Referenced dentry of an existing 'name' in the directory 'dir' */
+static co_rc_t lookup_child(co_os_fs_path_t *dir, const char *name,
+			    struct dentry **out_dentry)
+{
+	struct dentry *dentry;
+	co_rc_t rc;
+
+	rc = check_name(name);
+	if (!CO_OK(rc))
+		return rc;
+
+	mutex_lock(&dir->dentry->d_inode->i_mutex);
+	dentry = lookup_one_len(name, dir->dentry, co_strlen(name));
+	mutex_unlock(&dir->dentry->d_inode->i_mutex);
+
+	if (IS_ERR(dentry))
+		return errno_to_rc(PTR_ERR(dentry));
+
+	if (!dentry->d_inode) {
+		dput(dentry);
+		return CO_RC(NOT_FOUND);
+	}
+
+	*out_dentry = dentry;
+	return CO_RC(OK);
+}
+
+/* Caches the dentry of an inode whose parent is cached already */
+static co_rc_t resolve_one(co_filesystem_t *fs, co_inode_t *inode)
+{
+	co_os_fs_path_t *path;
+	co_rc_t rc;
+
+	co_os_fs_inode_release(fs, inode);
+
+	path = co_os_malloc(sizeof(*path));
+	if (!path)
+		return CO_RC(OUT_OF_MEMORY);
+
+	if (!inode->parent) {
+		rc = lookup_base(fs, path);
+	} else {
+		co_os_fs_path_t *dir = inode->parent->sysdep;
+
+		rc = lookup_child(dir, inode->name, &path->dentry);
+		if (CO_OK(rc))
+			path->mnt = mntget(dir->mnt);
+	}
+
+	if (!CO_OK(rc)) {
+		co_os_free(path);
+		return rc;
+	}
+
+	inode->sysdep = path;
+	return CO_RC(OK);
+}
+
+/*
+ * Host dentry of an inode. The uppermost inode without one is looked
+ * up first, so the walk down needs no recursion however deep the tree.
+ */
+static co_rc_t resolve(co_filesystem_t *fs, co_inode_t *inode, co_os_fs_path_t **out_path)
+{
+	co_inode_t *scan;
+	co_rc_t rc;
+
+	if (!inode)
+		inode = fs->root;
+
+	while (!inode->sysdep || !path_valid(inode->sysdep)) {
+		scan = inode;
+		while (scan->parent &&
+		       (!scan->parent->sysdep || !path_valid(scan->parent->sysdep)))
+			scan = scan->parent;
+
+		rc = resolve_one(fs, scan);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	*out_path = inode->sysdep;
+	return CO_RC(OK);
+}
+
+static void kstat_to_attr(struct kstat *stat, struct fuse_attr *attr)
+{
+	/* Flat mode has only directories and files, like the Windows host */
+	if (S_ISDIR(stat->mode))
+		attr->mode = FUSE_S_IFDIR | (stat->mode & S_IALLUGO);
+	else
+		attr->mode = FUSE_S_IFREG | (stat->mode & S_IALLUGO);
+
+	attr->size = stat->size;
+	attr->nlink = stat->nlink;
+	attr->uid = 0;
+	attr->gid = 0;
+	attr->rdev = 0;
+	attr->_dummy = 0;
+	attr->blocks = stat->blocks;
+	attr->atime = stat->atime.tv_sec;
+	attr->mtime = stat->mtime.tv_sec;
+	attr->ctime = stat->ctime.tv_sec;
+}
+
+static co_rc_t path_get_attr(co_os_fs_path_t *path, char *name, struct fuse_attr *attr)
+{
+	struct dentry *dentry;
+	struct kstat stat;
+	co_rc_t rc;
+	int err;
+
+	if (*name) {
+		rc = lookup_child(path, name, &dentry);
+		if (!CO_OK(rc))
+			return rc;
+	} else {
+		dentry = dget(path->dentry);
+	}
+
+	err = vfs_getattr(path->mnt, dentry, &stat);
+	dput(dentry);
+	if (err)
+		return errno_to_rc(err);
+
+	kstat_to_attr(&stat, attr);
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_fs_get_attr(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			  struct fuse_attr *attr)
+{
+	co_os_fs_path_t *path;
+	co_rc_t rc;
+
+	rc = resolve(fs, dir, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	return path_get_attr(path, name, attr);
+}
+
+/* A path of its own, with its own references to the dentry and the mount */
+co_rc_t co_os_fs_dir_hold(co_filesystem_t *fs, co_inode_t *dir, void **ref)
+{
+	co_os_fs_path_t *path, *held;
+	co_rc_t rc;
+
+	rc = resolve(fs, dir, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	held = co_os_malloc(sizeof(*held));
+	if (!held)
+		return CO_RC(OUT_OF_MEMORY);
+
+	held->dentry = dget(path->dentry);
+	held->mnt = mntget(path->mnt);
+	*ref = held;
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_fs_dir_get_attr(void *ref, char *name, struct fuse_attr *attr)
+{
+	return path_get_attr(ref, name, attr);
+}
+
+void co_os_fs_dir_unhold(void *ref)
+{
+	co_os_fs_path_t *held = ref;
+
+	dput(held->dentry);
+	mntput(held->mnt);
+	co_os_free(held);
+}
+
+co_rc_t co_os_fs_set_attr(co_filesystem_t *fs, co_inode_t *inode, unsigned long valid,
+			  struct fuse_attr *attr)
+{
+	co_os_fs_path_t *path;
+	struct inode *host_inode;
+	struct iattr iattr;
+	co_rc_t rc;
+	int err;
+
+	rc = resolve(fs, inode, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	host_inode = path->dentry->d_inode;
+	co_memset(&iattr, 0, sizeof(iattr));
+
+	/* Owners are those of the mount, they are not passed on */
+	if (valid & FATTR_MODE) {
+		iattr.ia_valid |= ATTR_MODE;
+		iattr.ia_mode = (attr->mode & S_IALLUGO) | (host_inode->i_mode & S_IFMT);
+	}
+
+	if (valid & FATTR_UTIME) {
+		iattr.ia_valid |= ATTR_ATIME | ATTR_MTIME | ATTR_ATIME_SET | ATTR_MTIME_SET;
+		iattr.ia_atime.tv_sec = attr->atime;
+		iattr.ia_mtime.tv_sec = attr->mtime;
+	}
+
+	if (valid & FATTR_SIZE) {
+		iattr.ia_valid |= ATTR_SIZE;
+		iattr.ia_size = attr->size;
+	}
+
+	if (!iattr.ia_valid)
+		return CO_RC(OK);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	err = mnt_want_write(path->mnt);
+	if (err)
+		return errno_to_rc(err);
+#endif
+
+	mutex_lock(&host_inode->i_mutex);
+	if (iattr.ia_valid & ATTR_SIZE)
+		down_write(&host_inode->i_alloc_sem);
+	err = notify_change(path->dentry, &iattr);
+	if (iattr.ia_valid & ATTR_SIZE)
+		up_write(&host_inode->i_alloc_sem);
+	mutex_unlock(&host_inode->i_mutex);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	mnt_drop_write(path->mnt);
+#endif
+
+	return errno_to_rc(err);
 }
 
-int co_os_fs_add_last_component(co_pathname_t *dirname)
+static struct file *open_path(co_os_fs_path_t *path, int flags)
 {
-	/* TODO */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+	return dentry_open(dget(path->dentry), mntget(path->mnt), flags, current_cred());
+#else
+	return dentry_open(dget(path->dentry), mntget(path->mnt), flags);
+#endif
+}
+
+static int getdir_fill(void *buf, const char *name, int namlen, loff_t offset,
+		       u64 ino, unsigned int d_type)
+{
+	co_os_fs_getdir_data_t *data = buf;
+	co_filesystem_name_t *new_name;
+
+	new_name = co_os_malloc(namlen + sizeof(co_filesystem_name_t) + 1);
+	if (!new_name) {
+		data->rc = CO_RC(OUT_OF_MEMORY);
+		return -ENOMEM;
+	}
+
+	/* DT_* and FUSE_DT_* are the same */
+	if (d_type == DT_DIR || d_type == DT_UNKNOWN)
+		new_name->type = d_type;
+	else
+		new_name->type = FUSE_DT_REG;
+
+	/* Stat needs the directory lock that readdir holds, so no attributes */
+	new_name->has_attr = PFALSE;
+	co_memcpy(new_name->name, name, namlen);
+	new_name->name[namlen] = '\0';
+
+	co_list_add_tail(&new_name->node, &data->names->list);
+	data->count++;
+
 	return 0;
 }
 
-co_rc_t co_os_fs_dir_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
-				   char **out_name, char *name)
+co_rc_t co_os_fs_getdir(co_filesystem_t *fs, co_inode_t *dir,
+			co_filesystem_dir_names_t *names)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	co_os_fs_getdir_data_t data;
+	co_os_fs_path_t *path;
+	struct file *filp;
+	co_rc_t rc;
+	int err;
+
+	co_list_init(&names->list);
+
+	rc = resolve(fs, dir, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	filp = open_path(path, O_RDONLY | O_DIRECTORY | O_LARGEFILE);
+	if (IS_ERR(filp))
+		return errno_to_rc(PTR_ERR(filp));
+
+	data.names = names;
+	data.rc = CO_RC(OK);
+
+	/* Some filesystems return a bufferful at a time */
+	do {
+		data.count = 0;
+		err = vfs_readdir(filp, getdir_fill, &data);
+	} while (err >= 0 && data.count > 0 && CO_OK(data.rc));
+
+	filp_close(filp, NULL);
+
+	rc = data.rc;
+	if (CO_OK(rc) && err < 0)
+		rc = errno_to_rc(err);
+
+	if (!CO_OK(rc))
+		co_filesystem_getdir_free(names);
+
+	return rc;
 }
 
-co_rc_t co_os_file_read_write(struct co_monitor *linuxvm, char *filename,
-			      unsigned long long offset, unsigned long size,
-			      vm_ptr_t src_buffer, bool_t read)
+/*
+ * Runs 'op' on the dentry of 'name', looked up with the directory
+ * locked for the change.
+ */
+static co_rc_t dir_change(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			  unsigned long mode,
+			  int (*op)(struct inode *dir, struct dentry *dentry, int mode))
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	co_os_fs_path_t *path;
+	struct inode *host_dir;
+	struct dentry *dentry;
+	co_rc_t rc;
+	int err;
+
+	rc = check_name(name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = resolve(fs, dir, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	host_dir = path->dentry->d_inode;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	err = mnt_want_write(path->mnt);
+	if (err)
+		return errno_to_rc(err);
+#endif
+
+	mutex_lock_nested(&host_dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, path->dentry, co_strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+	} else {
+		err = op(host_dir, dentry, mode);
+		dput(dentry);
+	}
+	mutex_unlock(&host_dir->i_mutex);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	mnt_drop_write(path->mnt);
+#endif
+
+	return errno_to_rc(err);
 }
 
-co_rc_t co_os_file_set_attr(char *filename, unsigned long valid, struct fuse_attr *attr)
+static int op_create(struct inode *dir, struct dentry *dentry, int mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (dentry->d_inode)
+		return -EEXIST;
+
+	return vfs_create(dir, dentry, S_IFREG | mode, NULL);
 }
 
-co_rc_t co_os_file_get_attr(char *filename, struct fuse_attr *attr)
+static int op_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (dentry->d_inode)
+		return -EEXIST;
+
+	return vfs_mkdir(dir, dentry, mode);
 }
 
-co_rc_t co_os_file_unlink(char *filename)
+static int op_unlink(struct inode *dir, struct dentry *dentry, int mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (!dentry->d_inode)
+		return -ENOENT;
+
+	return vfs_unlink(dir, dentry);
 }
 
-co_rc_t co_os_file_mkdir(char *dirname)
+static int op_rmdir(struct inode *dir, struct dentry *dentry, int mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (!dentry->d_inode)
+		return -ENOENT;
+
+	return vfs_rmdir(dir, dentry);
 }
 
-co_rc_t co_os_file_rename(char *filename, char *dest_filename)
+co_rc_t co_os_fs_mknod(co_filesystem_t *fs, co_inode_t *dir, char *name,
+		       unsigned long mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (fs->flags & COFS_MOUNT_NOATTRIB)
+		mode = S_IRUGO | S_IWUGO;
+
+	return dir_change(fs, dir, name, mode & S_IALLUGO, op_create);
 }
 
-co_rc_t co_os_file_mknod(co_filesystem_t *filesystem, char *filename, unsigned long mode)
+co_rc_t co_os_fs_mkdir(co_filesystem_t *fs, co_inode_t *dir, char *name,
+		       unsigned long mode)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	if (fs->flags & COFS_MOUNT_NOATTRIB)
+		mode = S_IRWXUGO;
+
+	return dir_change(fs, dir, name, mode & S_IALLUGO, op_mkdir);
 }
 
-co_rc_t co_os_file_getdir(char *dirname, co_filesystem_dir_names_t *names)
+co_rc_t co_os_fs_unlink(co_filesystem_t *fs, co_inode_t *dir, char *name)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	return dir_change(fs, dir, name, 0, op_unlink);
+}
+
+co_rc_t co_os_fs_rmdir(co_filesystem_t *fs, co_inode_t *dir, char *name)
+{
+	return dir_change(fs, dir, name, 0, op_rmdir);
+}
+
+co_rc_t co_os_fs_rename(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			co_inode_t *new_dir, char *new_name)
+{
+	co_os_fs_path_t *old_path, *new_path;
+	struct dentry *old_dentry, *new_dentry, *trap;
+	co_rc_t rc;
+	int err;
+
+	rc = check_name(name);
+	if (CO_OK(rc))
+		rc = check_name(new_name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = resolve(fs, dir, &old_path);
+	if (CO_OK(rc))
+		rc = resolve(fs, new_dir, &new_path);
+	if (!CO_OK(rc))
+		return rc;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	err = mnt_want_write(old_path->mnt);
+	if (err)
+		return errno_to_rc(err);
+#endif
+
+	trap = lock_rename(new_path->dentry, old_path->dentry);
+
+	old_dentry = lookup_one_len(name, old_path->dentry, co_strlen(name));
+	err = PTR_ERR(old_dentry);
+	if (IS_ERR(old_dentry))
+		goto out_unlock;
+
+	err = -ENOENT;
+	if (!old_dentry->d_inode)
+		goto out_old;
+
+	/* Neither may be an ancestor of the other */
+	err = -EINVAL;
+	if (old_dentry == trap)
+		goto out_old;
+
+	new_dentry = lookup_one_len(new_name, new_path->dentry, co_strlen(new_name));
+	err = PTR_ERR(new_dentry);
+	if (IS_ERR(new_dentry))
+		goto out_old;
+
+	err = -ENOTEMPTY;
+	if (new_dentry != trap)
+		err = vfs_rename(old_path->dentry->d_inode, old_dentry,
+				 new_path->dentry->d_inode, new_dentry);
+
+	dput(new_dentry);
+out_old:
+	dput(old_dentry);
+out_unlock:
+	unlock_rename(new_path->dentry, old_path->dentry);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	mnt_drop_write(old_path->mnt);
+#endif
+
+	return errno_to_rc(err);
+}
+
+co_rc_t co_os_fs_open(co_filesystem_t *fs, co_inode_t *inode, bool_t write, void **handle)
+{
+	co_os_fs_path_t *path;
+	struct file *filp;
+	co_rc_t rc;
+
+	rc = resolve(fs, inode, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	filp = open_path(path, (write ? O_RDWR : O_RDONLY) | O_LARGEFILE);
+	if (IS_ERR(filp)) {
+		co_debug_lvl(filesystem, 5, "error %ld opening '%s'",
+			     PTR_ERR(filp), inode->name ? inode->name : "<root>");
+		return errno_to_rc(PTR_ERR(filp));
+	}
+
+	*handle = filp;
+	return CO_RC(OK);
+}
+
+void co_os_file_handle_close(void *handle)
+{
+	filp_close((struct file *)handle, NULL);
+}
+
+static co_rc_t transfer_file(struct co_monitor *cmon, void *host_data, void *linuxvm,
+			     unsigned long size, co_monitor_transfer_dir_t dir)
+{
+	co_os_fs_transfer_data_t *data = host_data;
+	mm_segment_t fs;
+	ssize_t ret;
+
+	fs = get_fs();
+	set_fs(KERNEL_DS);
+	if (dir == CO_MONITOR_TRANSFER_FROM_HOST)
+		ret = vfs_read(data->filp, (char __user *)linuxvm, size, &data->offset);
+	else
+		ret = vfs_write(data->filp, (const char __user *)linuxvm, size, &data->offset);
+	set_fs(fs);
+
+	if (ret < 0)
+		return errno_to_rc(ret);
+
+	if (ret == size)
+		return CO_RC(OK);
+
+	/* Reading past the end is no error, as on Windows */
+	if (dir != CO_MONITOR_TRANSFER_FROM_HOST)
+		return CO_RC(ERROR);
+
+	memset((char *)linuxvm + ret, 0, size - ret);
+	data->offset += size - ret;
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_file_handle_read_write(struct co_monitor *linuxvm, void *handle,
+				     unsigned long long offset, unsigned long size,
+				     vm_ptr_t src_buffer, bool_t read)
+{
+	co_os_fs_transfer_data_t data;
+
+	data.filp = handle;
+	data.offset = offset;
+
+	return co_monitor_host_linuxvm_transfer(linuxvm, &data, transfer_file, src_buffer, size,
+						read ? CO_MONITOR_TRANSFER_FROM_HOST
+						     : CO_MONITOR_TRANSFER_FROM_LINUX);
 }
 
 co_rc_t co_os_file_fs_stat(co_filesystem_t *filesystem, struct fuse_statfs_out *statfs)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	co_os_fs_path_t *path;
+	struct kstatfs kstatfs;
+	co_rc_t rc;
+	int err;
+
+	rc = resolve(filesystem, NULL, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	{
+		struct path base = { .mnt = path->mnt, .dentry = path->dentry };
+
+		err = vfs_statfs(&base, &kstatfs);
+	}
+#else
+	err = vfs_statfs(path->dentry, &kstatfs);
+#endif
+	if (err)
+		return errno_to_rc(err);
+
+	statfs->st.block_size = kstatfs.f_bsize;
+	statfs->st.blocks = kstatfs.f_blocks;
+	statfs->st.blocks_free = kstatfs.f_bavail;
+	statfs->st.files = kstatfs.f_files;
+	statfs->st.files_free = kstatfs.f_ffree;
+	statfs->st.namelen = kstatfs.f_namelen;
+
+	return CO_RC(OK);
+}
+
+#ifdef CO_FS_INOTIFY
+/*
+ * Directories are watched through the in-kernel inotify interface, with
+ * a handle each. Events come in the context of whoever changed the
+ * directory, the handle's mutex keeps them apart from inotify_destroy.
+ */
+typedef struct {
+	struct inotify_handle *ih;
+	struct inotify_watch iw;
+	co_filesystem_t *fs;
+	co_fs_watch_t *watch;
+} co_os_fs_watch_data_t;
+
+#define WATCH_MASK	(IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_CREATE | IN_DELETE | IN_DELETE_SELF)
+
+static void watch_event(struct inotify_watch *iw, u32 wd, u32 mask, u32 cookie,
+			const char *name, struct inode *inode)
+{
+	co_os_fs_watch_data_t *data = container_of(iw, co_os_fs_watch_data_t, iw);
+
+	co_os_mutex_acquire(data->fs->watch_mutex);
+	co_monitor_file_system_changed(data->fs, data->watch,
+				       (mask & (IN_DELETE_SELF | IN_UNMOUNT | IN_IGNORED)) != 0);
+	co_os_mutex_release(data->fs->watch_mutex);
+}
+
+/* The data goes with the handle, in co_os_fs_unwatch() */
+static void watch_destroy(struct inotify_watch *iw)
+{
 }
 
-co_rc_t co_os_file_rmdir(char *filename)
+static const struct inotify_operations watch_ops = {
+	.handle_event	= watch_event,
+	.destroy_watch	= watch_destroy,
+};
+
+co_rc_t co_os_fs_watch(co_filesystem_t *fs, co_fs_watch_t *watch)
+{
+	co_os_fs_watch_data_t *data;
+	co_os_fs_path_t *path;
+	co_rc_t rc;
+	s32 wd;
+
+	rc = resolve(fs, watch->dir, &path);
+	if (!CO_OK(rc))
+		return rc;
+
+	data = co_os_malloc(sizeof(*data));
+	if (!data)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(data, 0, sizeof(*data));
+	data->fs = fs;
+	data->watch = watch;
+
+	data->ih = inotify_init(&watch_ops);
+	if (IS_ERR(data->ih)) {
+		co_os_free(data);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+
+	inotify_init_watch(&data->iw);
+	wd = inotify_add_watch(data->ih, &data->iw, path->dentry->d_inode, WATCH_MASK);
+	if (wd < 0) {
+		inotify_destroy(data->ih);
+		co_os_free(data);
+		return errno_to_rc(wd);
+	}
+
+	watch->sysdep = data;
+	return CO_RC(OK);
+}
+
+void co_os_fs_unwatch(co_filesystem_t *fs, co_fs_watch_t *watch)
+{
+	co_os_fs_watch_data_t *data = watch->sysdep;
+
+	/* Returns once no event is under way */
+	inotify_destroy(data->ih);
+	co_os_free(data);
+	watch->sysdep = NULL;
+}
+#else
+/* No interface to watch directories with, Linux revalidates on its own */
+co_rc_t co_os_fs_watch(co_filesystem_t *fs, co_fs_watch_t *watch)
 {
-	/* TODO */
 	return CO_RC(ERROR);
 }
 
+void co_os_fs_unwatch(co_filesystem_t *fs, co_fs_watch_t *watch)
+{
+}
+#endif
+
+/*
+ * The meta data store is kept in vmalloc memory, read from the file at
+ * mount, and the ranges reported dirty are written back to the page
+ * cache right away. Mapping the page cache itself would leave the pages
+ * to the file system's writeback, which differs among the versions.
+ */
+typedef struct {
+	struct file *filp;
+	void *map;
+	unsigned long size;
+} co_os_fs_meta_data_t;
+
+static co_rc_t meta_transfer(struct file *filp, void *buffer, unsigned long size,
+			     loff_t offset, bool_t read)
+{
+	mm_segment_t fs;
+	ssize_t ret;
+
+	fs = get_fs();
+	set_fs(KERNEL_DS);
+	if (read)
+		ret = vfs_read(filp, (char __user *)buffer, size, &offset);
+	else
+		ret = vfs_write(filp, (const char __user *)buffer, size, &offset);
+	set_fs(fs);
+
+	if (ret < 0)
+		return errno_to_rc(ret);
+
+	/* What is past the end of the file stays zero */
+	if (!read && ret != size)
+		return CO_RC(ERROR);
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_fs_meta_map(co_filesystem_t *fs, char *pathname, unsigned long *size, void **map)
+{
+	co_os_fs_meta_data_t *data;
+	loff_t file_size;
+	co_rc_t rc;
+
+	data = co_os_malloc(sizeof(*data));
+	if (!data)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(data, 0, sizeof(*data));
+
+	data->filp = filp_open(pathname, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(data->filp)) {
+		co_debug_lvl(filesystem, 5, "error %ld opening '%s'", PTR_ERR(data->filp), pathname);
+		rc = errno_to_rc(PTR_ERR(data->filp));
+		goto out_free;
+	}
+
+	file_size = i_size_read(data->filp->f_dentry->d_inode);
+	if (file_size > CO_FS_META_MAX_SIZE) {
+		rc = CO_RC(INVALID_PARAMETER);
+		goto out_close;
+	}
+
+	data->size = *size;
+	if (file_size > data->size)
+		data->size = file_size;
+
+	data->map = vmalloc(data->size);
+	if (!data->map) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out_close;
+	}
+
+	co_memset(data->map, 0, data->size);
+
+	rc = meta_transfer(data->filp, data->map, file_size, 0, PTRUE);
+	if (!CO_OK(rc))
+		goto out_vfree;
+
+	/* A hole up to the new end, the file has its full size from now on */
+	if (file_size < data->size) {
+		rc = meta_transfer(data->filp, (char *)data->map + data->size - 1, 1,
+				   data->size - 1, PFALSE);
+		if (!CO_OK(rc))
+			goto out_vfree;
+	}
+
+	fs->meta.sysdep = data;
+	*size = data->size;
+	*map = data->map;
+	return CO_RC(OK);
+
+out_vfree:
+	vfree(data->map);
+out_close:
+	filp_close(data->filp, NULL);
+out_free:
+	co_os_free(data);
+	return rc;
+}
+
+void co_os_fs_meta_dirty(co_filesystem_t *fs, unsigned long offset, unsigned long size)
+{
+	co_os_fs_meta_data_t *data = fs->meta.sysdep;
+	co_rc_t rc;
+
+	rc = meta_transfer(data->filp, (char *)data->map + offset, size, offset, PFALSE);
+	if (!CO_OK(rc))
+		co_debug("cofs%d: error %x writing meta data", fs->unit, (int)rc);
+}
+
+co_rc_t co_os_fs_meta_flush(co_filesystem_t *fs)
+{
+	co_os_fs_meta_data_t *data = fs->meta.sysdep;
+	struct file *filp = data->filp;
+	int err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	err = vfs_fsync(filp, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+	err = vfs_fsync(filp, filp->f_dentry, 0);
+#else
+	err = filemap_write_and_wait(filp->f_mapping);
+	if (!err && filp->f_op && filp->f_op->fsync) {
+		mutex_lock(&filp->f_mapping->host->i_mutex);
+		err = filp->f_op->fsync(filp, filp->f_dentry, 0);
+		mutex_unlock(&filp->f_mapping->host->i_mutex);
+	}
+#endif
+
+	return errno_to_rc(err);
+}
+
+void co_os_fs_meta_unmap(co_filesystem_t *fs)
+{
+	co_os_fs_meta_data_t *data = fs->meta.sysdep;
+
+	vfree(data->map);
+	filp_close(data->filp, NULL);
+	co_os_free(data);
+
+	fs->meta.sysdep = NULL;
+}
+
+/* The worker of an asynchronous device, as for the cobd devices */
+typedef struct {
+	struct task_struct *thread;
+	spinlock_t lock;
+	co_list_t queue;
+	wait_queue_head_t wait;
+} co_os_fs_async_t;
+
+static int async_thread(void *arg)
+{
+	co_filesystem_t *fs = arg;
+	co_os_fs_async_t *async = fs->async_sysdep;
+	co_fs_job_t *job;
+
+	for (;;) {
+		wait_event_interruptible(async->wait,
+					 !co_list_empty(&async->queue) || kthread_should_stop());
+
+		spin_lock(&async->lock);
+		if (co_list_empty(&async->queue)) {
+			spin_unlock(&async->lock);
+			/* Queue drained, leave if asked to */
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+		co_list_entry_assign(async->queue.next, job, node);
+		co_list_del(&job->node);
+		spin_unlock(&async->lock);
+
+		co_monitor_file_system_job(fs, job);
+	}
+
+	return 0;
+}
+
+co_rc_t co_os_fs_async_start(co_filesystem_t *fs)
+{
+	co_os_fs_async_t *async;
+	struct task_struct *thread;
+
+	async = co_os_malloc(sizeof(*async));
+	if (!async)
+		return CO_RC(OUT_OF_MEMORY);
+
+	spin_lock_init(&async->lock);
+	co_list_init(&async->queue);
+	init_waitqueue_head(&async->wait);
+	fs->async_sysdep = async;
+
+	thread = kthread_run(async_thread, fs, "cofs%d", fs->unit);
+	if (IS_ERR(thread)) {
+		co_os_free(async);
+		fs->async_sysdep = NULL;
+		return CO_RC(OUT_OF_MEMORY);
+	}
+	async->thread = thread;
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_fs_queue(co_filesystem_t *fs, co_fs_job_t *job)
+{
+	co_os_fs_async_t *async = fs->async_sysdep;
+
+	spin_lock(&async->lock);
+	co_list_add_tail(&job->node, &async->queue);
+	spin_unlock(&async->lock);
+	wake_up(&async->wait);
+
+	return CO_RC(OK);
+}
+
+void co_os_fs_async_stop(co_filesystem_t *fs)
+{
+	co_os_fs_async_t *async = fs->async_sysdep;
+
+	/* The thread drains the queue before it exits */
+	kthread_stop(async->thread);
+	co_os_free(async);
+	fs->async_sysdep = NULL;
+}
+
 co_rc_t co_os_fs_dir_join_unix_path(co_pathname_t *dirname, const char *addition)
 {
-	/* TODO */
-	return CO_RC(ERROR);
+	int len;
+
+	len = co_strlen(*dirname);
+	while (len > 1 && (*dirname)[len - 1] == '/')
+		(*dirname)[--len] = '\0';
+
+	while (*addition == '/')
+		addition++;
+
+	if (*addition) {
+		if (len > 0 && (*dirname)[len - 1] != '/')
+			co_snprintf(&(*dirname)[len], sizeof(*dirname) - len, "/%s", addition);
+		else
+			co_snprintf(&(*dirname)[len], sizeof(*dirname) - len, "%s", addition);
+	}
+
+	len = co_strlen(*dirname);
+	while (len > 1 && (*dirname)[len - 1] == '/')
+		(*dirname)[--len] = '\0';
+
+	return CO_RC(OK);
 }
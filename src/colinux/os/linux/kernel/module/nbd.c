@@ -0,0 +1,206 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/*
+ * Connections of the NBD client of kernel/nbdblock.c: kernel sockets,
+ * with a kthread as the receiver.
+ */
+
+#include "linux_inc.h"
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <linux/un.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/nbd.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
+#define kernel_connect(sock, addr, addrlen, flags) \
+	(sock)->ops->connect(sock, addr, addrlen, flags)
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+#define kernel_sock_shutdown(sock, how) (sock)->ops->shutdown(sock, how)
+#define SHUT_RDWR 2
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#define co_os_sock_create(family, type, protocol, res) \
+	sock_create_kern(&init_net, family, type, protocol, res)
+#else
+#define co_os_sock_create sock_create_kern
+#endif
+
+struct co_os_nbd {
+	struct socket *sock;
+	struct task_struct *receiver;
+	void (*func)(void *data);
+	void *data;
+	struct completion control;
+};
+
+static co_rc_t co_os_nbd_io(struct socket *sock, void *buffer, unsigned long size, bool_t send)
+{
+	struct msghdr msg;
+	struct kvec iov;
+	int ret;
+
+	while (size) {
+		co_memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buffer;
+		iov.iov_len = size;
+
+		if (send) {
+			msg.msg_flags = MSG_NOSIGNAL;
+			ret = kernel_sendmsg(sock, &msg, &iov, 1, size);
+		} else
+			ret = kernel_recvmsg(sock, &msg, &iov, 1, size, MSG_WAITALL | MSG_NOSIGNAL);
+
+		if (ret <= 0)
+			return CO_RC(BROKEN_PIPE);
+
+		buffer = (unsigned char *)buffer + ret;
+		size -= ret;
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_nbd_send(void *conn, void *buffer, unsigned long size)
+{
+	return co_os_nbd_io(((co_os_nbd_t)conn)->sock, buffer, size, PTRUE);
+}
+
+co_rc_t co_os_nbd_recv(void *conn, void *buffer, unsigned long size)
+{
+	return co_os_nbd_io(((co_os_nbd_t)conn)->sock, buffer, size, PFALSE);
+}
+
+co_rc_t co_os_nbd_connect(co_nbd_uri_t *uri, co_os_nbd_t *nbd_out)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	struct sockaddr *addr;
+	struct socket *sock;
+	co_os_nbd_t nbd;
+	int addrlen, one = 1;
+	int err;
+
+	if (uri->unix_socket) {
+		co_memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		co_memcpy(sun.sun_path, uri->socket_path, sizeof(sun.sun_path) - 1);
+		addr = (struct sockaddr *)&sun;
+		addrlen = sizeof(sun);
+		err = co_os_sock_create(PF_UNIX, SOCK_STREAM, 0, &sock);
+	} else {
+		co_memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(uri->port);
+		co_memcpy(&sin.sin_addr.s_addr, uri->addr, sizeof(uri->addr));
+		addr = (struct sockaddr *)&sin;
+		addrlen = sizeof(sin);
+		err = co_os_sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
+	}
+	if (err < 0)
+		return CO_RC(ERROR);
+
+	/* Writes of cobd may be what frees host memory */
+	sock->sk->sk_allocation = GFP_NOIO;
+
+	err = kernel_connect(sock, addr, addrlen, 0);
+	if (err < 0) {
+		co_debug_error("nbd: connect failed (errno %d)", err);
+		sock_release(sock);
+		return CO_RC(ERROR);
+	}
+
+	/* Headers go out one by one, don't let them wait for more */
+	if (!uri->unix_socket)
+		kernel_setsockopt(sock, SOL_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+
+	nbd = co_os_malloc(sizeof(*nbd));
+	if (!nbd) {
+		sock_release(sock);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+
+	co_memset(nbd, 0, sizeof(*nbd));
+	nbd->sock = sock;
+	init_completion(&nbd->control);
+
+	*nbd_out = nbd;
+	return CO_RC(OK);
+}
+
+void co_os_nbd_shutdown(co_os_nbd_t nbd)
+{
+	kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
+}
+
+void co_os_nbd_close(co_os_nbd_t nbd)
+{
+	sock_release(nbd->sock);
+	co_os_free(nbd);
+}
+
+static int co_os_nbd_receiver(void *arg)
+{
+	co_os_nbd_t nbd = arg;
+
+	nbd->func(nbd->data);
+
+	/* Keep the thread around for kthread_stop() */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+co_rc_t co_os_nbd_receiver_start(co_os_nbd_t nbd, void (*func)(void *data),
+				 void *data, int unit)
+{
+	struct task_struct *thread;
+
+	nbd->func = func;
+	nbd->data = data;
+
+	thread = kthread_run(co_os_nbd_receiver, nbd, "cobd%d/nbd", unit);
+	if (IS_ERR(thread))
+		return CO_RC(OUT_OF_MEMORY);
+
+	nbd->receiver = thread;
+	return CO_RC(OK);
+}
+
+void co_os_nbd_receiver_stop(co_os_nbd_t nbd)
+{
+	kthread_stop(nbd->receiver);
+}
+
+void co_os_nbd_control_reset(co_os_nbd_t nbd)
+{
+	init_completion(&nbd->control);
+}
+
+void co_os_nbd_control_wait(co_os_nbd_t nbd)
+{
+	wait_for_completion(&nbd->control);
+}
+
+void co_os_nbd_control_done(co_os_nbd_t nbd)
+{
+	complete(&nbd->control);
+}
@@ -0,0 +1,28 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#ifndef __COLINUX_OS_LINUX_USER_COBD_BENCH_H__
+#define __COLINUX_OS_LINUX_USER_COBD_BENCH_H__
+
+/*
+ * colinux-cobd-bench runs the block code of the host driver (block.c,
+ * fileblock.c and the backends) in a process. host.c and file.c stand
+ * in for the host kernel, guest.c for the memory of a running Linux.
+ */
+
+#include <colinux/kernel/monitor.h>
+
+/* guest.c */
+extern co_rc_t co_bench_guest_alloc(unsigned long size, vm_ptr_t *out_address);
+extern void co_bench_guest_free(void);
+extern void *co_bench_guest_to_host(vm_ptr_t address);
+
+/* main.c, called once an asynchronous request completed */
+extern void co_bench_request_done(unsigned long tag, bool_t uptodate);
+
+#endif
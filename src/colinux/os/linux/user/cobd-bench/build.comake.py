@@ -0,0 +1,20 @@
+# The portable block code of the host driver, built for user space
+kernel_sources = ['block', 'blockcache', 'blockqos', 'blocktrace', 'cowblock', 'fileblock', 'nbdblock', 'zblock']
+
+for name in kernel_sources:
+    targets['%s.o' % (name, )] = Target(
+        inputs = [Input('../../../../kernel/%s.c' % (name, ))],
+        tool = Compiler(),
+    )
+
+targets['build.o'] = Target(
+    inputs = input_list(".c", ".o") + [Input('%s.o' % (name, )) for name in kernel_sources],
+    options = Options(
+        appenders = dict(
+            compiler_defines = dict(
+                CO_KERNEL=None,
+                CO_HOST_KERNEL=None,
+            ),
+        )
+    ),
+)
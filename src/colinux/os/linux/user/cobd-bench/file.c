@@ -0,0 +1,752 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/*
+ * Linux host: the file operations of os/linux/kernel/module/file.c on
+ * top of system calls. Asynchronous devices get worker threads in
+ * place of the kernel threads of the module, mapped devices mmap()
+ * the image where the module copies from its page cache pages.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <linux/falloc.h>
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/kernel/transfer.h>
+#include <colinux/kernel/fileblock.h>
+#include <colinux/arch/mmu.h>
+
+#include "bench.h"
+
+#define CO_OS_FILE_BLOCK_IOV_MAX	256
+#define CO_OS_FILE_BLOCK_THREADS	4
+
+typedef struct callback_context callback_context_t;
+
+struct co_os_file_block_sysdep {
+	int fd;
+	unsigned char *map; /* the whole image, NULL unless mapped */
+	unsigned long long map_size;
+	pthread_t threads[CO_OS_FILE_BLOCK_THREADS];
+	int nr_threads;	/* 0 for synchronous devices */
+	bool_t stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	callback_context_t *head;
+	callback_context_t *tail;
+};
+
+typedef struct {
+	off_t offset;
+	co_monitor_file_block_dev_t *fdev;
+} co_os_transfer_file_block_data_t;
+
+struct callback_context {
+	struct {
+		co_message_t message;
+		co_linux_message_t linux_message;
+		co_block_intr_t intr;
+	} msg; /* Must stay as the first field */
+	callback_context_t *next;
+	co_monitor_t *monitor;
+	co_block_dev_t *dev;
+	co_monitor_file_block_dev_t *fdev;
+	unsigned long long offset;
+	vm_ptr_t address;
+	unsigned long size;
+	bool_t read;
+	co_block_segment_t *segments; /* NULL unless READV/WRITEV */
+	unsigned long nr_segments;
+};
+
+typedef struct {
+	struct iovec iov[CO_OS_FILE_BLOCK_IOV_MAX];
+	unsigned long count;
+	size_t size;
+} co_os_file_block_iov_t;
+
+static co_rc_t co_os_transfer_file_block(struct co_monitor *cmon,
+					 void *host_data, void *linuxvm, unsigned long size,
+					 co_monitor_transfer_dir_t dir)
+{
+	co_os_transfer_file_block_data_t *data = host_data;
+	int fd = data->fdev->sysdep->fd;
+	ssize_t ret;
+
+	if (dir == CO_MONITOR_TRANSFER_FROM_HOST)
+		ret = pread(fd, linuxvm, size, data->offset);
+	else
+		ret = pwrite(fd, linuxvm, size, data->offset);
+
+	if (ret != size) {
+		co_debug("co_os_transfer_file_block: %s error: %ld != %ld",
+			 dir == CO_MONITOR_TRANSFER_FROM_HOST ? "read" : "write",
+			 (long)ret, size);
+		return CO_RC(ERROR);
+	}
+
+	data->offset += size;
+	return CO_RC(OK);
+}
+
+/* Same as the module: write back and drop the pages of the request */
+static void co_os_file_block_uncache(co_monitor_file_block_dev_t *fdev,
+				     unsigned long long offset,
+				     unsigned long long size,
+				     bool_t read)
+{
+	int fd = fdev->sysdep->fd;
+
+	if (!fdev->direct || size == 0)
+		return;
+
+	if (!read)
+		sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+
+	posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+}
+
+static co_rc_t co_os_file_block_transfer(co_monitor_t *cmon,
+					 co_monitor_file_block_dev_t *fdev,
+					 unsigned long long offset,
+					 vm_ptr_t address,
+					 unsigned long size,
+					 bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+	co_rc_t rc;
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	rc = co_monitor_host_linuxvm_transfer(cmon, &data, co_os_transfer_file_block,
+					      address, size,
+					      read ? CO_MONITOR_TRANSFER_FROM_HOST :
+						     CO_MONITOR_TRANSFER_FROM_LINUX);
+	if (CO_OK(rc))
+		co_os_file_block_uncache(fdev, offset, size, read);
+
+	return rc;
+}
+
+static co_rc_t co_os_file_block_read(struct co_monitor *cmon,
+				     co_block_dev_t *dev,
+				     co_monitor_file_block_dev_t *fdev,
+				     co_block_request_t *request)
+{
+	return co_os_file_block_transfer(cmon, fdev, request->offset, request->address,
+					 (unsigned long)request->size, PTRUE);
+}
+
+static co_rc_t co_os_file_block_write(struct co_monitor *cmon,
+				      co_block_dev_t *dev,
+				      co_monitor_file_block_dev_t *fdev,
+				      co_block_request_t *request)
+{
+	return co_os_file_block_transfer(cmon, fdev, request->offset, request->address,
+					 (unsigned long)request->size, PFALSE);
+}
+
+static co_rc_t co_os_file_block_host_read_write(co_monitor_file_block_dev_t *fdev,
+						unsigned long long offset,
+						void *buffer,
+						unsigned long size,
+						bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	return co_os_transfer_file_block(NULL, &data, buffer, size,
+					 read ? CO_MONITOR_TRANSFER_FROM_HOST :
+					 CO_MONITOR_TRANSFER_FROM_LINUX);
+}
+
+static co_rc_t co_os_file_block_discard(co_monitor_file_block_dev_t *fdev,
+					unsigned long long offset,
+					unsigned long long size)
+{
+	if (fallocate(fdev->sysdep->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      offset, size)) {
+		co_debug("co_os_file_block_discard: punch hole error");
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_flush(co_monitor_file_block_dev_t *fdev)
+{
+	if (fdatasync(fdev->sysdep->fd)) {
+		co_debug("co_os_file_block_flush: fsync error");
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_iov_submit(int fd, co_os_file_block_iov_t *vec,
+					   off_t *offset, bool_t read)
+{
+	ssize_t ret;
+
+	if (read)
+		ret = preadv(fd, vec->iov, vec->count, *offset);
+	else
+		ret = pwritev(fd, vec->iov, vec->count, *offset);
+
+	if (ret != vec->size) {
+		co_debug("co_os_file_block_iov_submit: %s error: %d != %d",
+			 read ? "read" : "write", (int)ret, (int)vec->size);
+		return CO_RC(ERROR);
+	}
+
+	*offset += vec->size;
+	vec->count = 0;
+	vec->size = 0;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_vector(co_monitor_t *cmon,
+				       co_monitor_file_block_dev_t *fdev,
+				       unsigned long long offset,
+				       co_block_segment_t *segments,
+				       unsigned long nr_segments,
+				       bool_t read)
+{
+	co_os_file_block_iov_t vec;
+	off_t pos = offset;
+	unsigned char *page;
+	unsigned long i;
+	co_pfn_t pfn;
+	co_rc_t rc = CO_RC(OK);
+
+	vec.count = 0;
+	vec.size = 0;
+
+	for (i = 0; i < nr_segments && CO_OK(rc); i++) {
+		vm_ptr_t vaddr = segments[i].address;
+		unsigned long size = segments[i].size;
+
+		while (size > 0) {
+			unsigned long one_copy;
+			unsigned char *start;
+
+			one_copy = ((vaddr + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - vaddr;
+			if (one_copy > size)
+				one_copy = size;
+
+			rc = co_monitor_host_linuxvm_transfer_map(cmon, vaddr, one_copy, &start,
+								  &page, &pfn);
+			if (!CO_OK(rc))
+				break;
+
+			vec.iov[vec.count].iov_base = start;
+			vec.iov[vec.count].iov_len = one_copy;
+			vec.count++;
+			vec.size += one_copy;
+
+			if (vec.count == CO_OS_FILE_BLOCK_IOV_MAX) {
+				rc = co_os_file_block_iov_submit(fdev->sysdep->fd, &vec, &pos, read);
+				if (!CO_OK(rc))
+					break;
+			}
+
+			size -= one_copy;
+			vaddr += one_copy;
+		}
+	}
+
+	if (vec.count && CO_OK(rc))
+		rc = co_os_file_block_iov_submit(fdev->sysdep->fd, &vec, &pos, read);
+
+	if (CO_OK(rc))
+		co_os_file_block_uncache(fdev, offset, pos - offset, read);
+
+	return rc;
+}
+
+static co_rc_t co_os_file_block_readv(struct co_monitor *cmon,
+				      co_block_dev_t *dev,
+				      co_monitor_file_block_dev_t *fdev,
+				      co_block_request_t *request,
+				      co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(cmon, fdev, request->offset,
+				       segments, request->nr_segments, PTRUE);
+}
+
+static co_rc_t co_os_file_block_writev(struct co_monitor *cmon,
+				       co_block_dev_t *dev,
+				       co_monitor_file_block_dev_t *fdev,
+				       co_block_request_t *request,
+				       co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(cmon, fdev, request->offset,
+				       segments, request->nr_segments, PFALSE);
+}
+
+static void co_os_file_block_async_do(callback_context_t *context)
+{
+	co_rc_t rc;
+
+	if (context->segments)
+		rc = co_os_file_block_vector(context->monitor, context->fdev, context->offset,
+					     context->segments, context->nr_segments,
+					     context->read);
+	else
+		rc = co_os_file_block_transfer(context->monitor, context->fdev, context->offset,
+					       context->address, context->size, context->read);
+
+	if (CO_OK(rc))
+		context->msg.intr.uptodate = 1;
+	else
+		co_debug("cobd%d async %s failed size=%ld rc=%x",
+			 context->msg.linux_message.unit,
+			 context->read ? "read" : "write", context->size, (int)rc);
+
+	co_monitor_block_complete(context->monitor, context->dev, &context->msg.message);
+}
+
+static void *co_os_file_block_thread(void *arg)
+{
+	struct co_os_file_block_sysdep *sysdep = arg;
+	callback_context_t *context;
+
+	for (;;) {
+		pthread_mutex_lock(&sysdep->lock);
+		while (!sysdep->head && !sysdep->stop)
+			pthread_cond_wait(&sysdep->wait, &sysdep->lock);
+
+		/* Queue drained, leave if asked to */
+		context = sysdep->head;
+		if (!context) {
+			pthread_mutex_unlock(&sysdep->lock);
+			break;
+		}
+
+		sysdep->head = context->next;
+		if (!sysdep->head)
+			sysdep->tail = NULL;
+		pthread_mutex_unlock(&sysdep->lock);
+
+		co_os_file_block_async_do(context);
+	}
+
+	return NULL;
+}
+
+static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
+						 co_block_dev_t *dev,
+						 co_monitor_file_block_dev_t *fdev,
+						 co_block_request_t *request,
+						 co_block_segment_t *segments,
+						 bool_t read)
+{
+	struct co_os_file_block_sysdep *sysdep = fdev->sysdep;
+	callback_context_t *context;
+	unsigned long segments_size = 0;
+
+	/* The segment list is copied, fdev->segments is reused by the next request */
+	if (segments)
+		segments_size = request->nr_segments * sizeof(co_block_segment_t);
+
+	context = co_os_malloc(sizeof(callback_context_t) + segments_size);
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(context, 0, sizeof(callback_context_t));
+
+	if (segments) {
+		context->segments = (co_block_segment_t *)(context + 1);
+		context->nr_segments = request->nr_segments;
+		co_memcpy(context->segments, segments, segments_size);
+	}
+
+	context->monitor = monitor;
+	context->dev = dev;
+	context->fdev = fdev;
+	context->offset = request->offset;
+	context->address = request->address;
+	context->size = (unsigned long)request->size;
+	context->read = read;
+	context->msg.message.from = CO_MODULE_COBD0 + dev->unit;
+	context->msg.message.to = CO_MODULE_LINUX;
+	context->msg.message.priority = CO_PRIORITY_DISCARDABLE;
+	context->msg.message.type = CO_MESSAGE_TYPE_OTHER;
+	context->msg.message.size = sizeof(context->msg) - sizeof(context->msg.message);
+	context->msg.linux_message.device = CO_DEVICE_BLOCK;
+	context->msg.linux_message.unit = dev->unit;
+	context->msg.linux_message.size = sizeof(context->msg.intr);
+	context->msg.intr.irq_request = request->irq_request;
+	context->msg.intr.tag = request->tag;
+
+	/* Set before a worker can complete the request */
+	request->async = PTRUE;
+
+	pthread_mutex_lock(&sysdep->lock);
+	if (sysdep->tail)
+		sysdep->tail->next = context;
+	else
+		sysdep->head = context;
+	sysdep->tail = context;
+	pthread_cond_signal(&sysdep->wait);
+	pthread_mutex_unlock(&sysdep->lock);
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_async_read(struct co_monitor *cmon,
+					   co_block_dev_t *dev,
+					   co_monitor_file_block_dev_t *fdev,
+					   co_block_request_t *request)
+{
+	return co_os_file_block_async_read_write(cmon, dev, fdev, request, NULL, PTRUE);
+}
+
+static co_rc_t co_os_file_block_async_write(struct co_monitor *cmon,
+					    co_block_dev_t *dev,
+					    co_monitor_file_block_dev_t *fdev,
+					    co_block_request_t *request)
+{
+	return co_os_file_block_async_read_write(cmon, dev, fdev, request, NULL, PFALSE);
+}
+
+static co_rc_t co_os_file_block_async_readv(struct co_monitor *cmon,
+					    co_block_dev_t *dev,
+					    co_monitor_file_block_dev_t *fdev,
+					    co_block_request_t *request,
+					    co_block_segment_t *segments)
+{
+	return co_os_file_block_async_read_write(cmon, dev, fdev, request, segments, PTRUE);
+}
+
+static co_rc_t co_os_file_block_async_writev(struct co_monitor *cmon,
+					     co_block_dev_t *dev,
+					     co_monitor_file_block_dev_t *fdev,
+					     co_block_request_t *request,
+					     co_block_segment_t *segments)
+{
+	return co_os_file_block_async_read_write(cmon, dev, fdev, request, segments, PFALSE);
+}
+
+static co_rc_t co_os_transfer_file_block_mapped(struct co_monitor *cmon,
+						void *host_data, void *linuxvm,
+						unsigned long size,
+						co_monitor_transfer_dir_t dir)
+{
+	co_os_transfer_file_block_data_t *data = host_data;
+	struct co_os_file_block_sysdep *sysdep = data->fdev->sysdep;
+
+	if (data->offset > sysdep->map_size || size > sysdep->map_size - data->offset) {
+		co_debug("co_os_transfer_file_block_mapped: beyond the image: %lld",
+			 (long long)data->offset);
+		return CO_RC(ERROR);
+	}
+
+	if (dir == CO_MONITOR_TRANSFER_FROM_HOST)
+		co_memcpy(linuxvm, sysdep->map + data->offset, size);
+	else
+		co_memcpy(sysdep->map + data->offset, linuxvm, size);
+
+	data->offset += size;
+	return CO_RC(OK);
+}
+
+/* The module writes back the range, msync() is the same for a mapping */
+static co_rc_t co_os_file_block_mapped_sync(co_monitor_file_block_dev_t *fdev,
+					    unsigned long long offset,
+					    unsigned long long size)
+{
+	unsigned long long start = offset & CO_ARCH_PAGE_MASK;
+
+	if (!fdev->write_through || size == 0)
+		return CO_RC(OK);
+
+	if (msync(fdev->sysdep->map + start, offset + size - start, MS_SYNC)) {
+		co_debug("co_os_file_block_mapped_sync: msync error");
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_mapped_vector(co_monitor_t *cmon,
+					      co_monitor_file_block_dev_t *fdev,
+					      unsigned long long offset,
+					      co_block_segment_t *segments,
+					      unsigned long nr_segments,
+					      bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	for (i = 0; i < nr_segments && CO_OK(rc); i++)
+		rc = co_monitor_host_linuxvm_transfer(cmon, &data,
+						      co_os_transfer_file_block_mapped,
+						      segments[i].address, segments[i].size,
+						      read ? CO_MONITOR_TRANSFER_FROM_HOST :
+							     CO_MONITOR_TRANSFER_FROM_LINUX);
+
+	if (CO_OK(rc) && !read)
+		rc = co_os_file_block_mapped_sync(fdev, offset, data.offset - offset);
+
+	return rc;
+}
+
+static co_rc_t co_os_file_block_mapped_read(struct co_monitor *cmon,
+					    co_block_dev_t *dev,
+					    co_monitor_file_block_dev_t *fdev,
+					    co_block_request_t *request)
+{
+	co_block_segment_t segment;
+
+	segment.address = request->address;
+	segment.size = (unsigned long)request->size;
+
+	return co_os_file_block_mapped_vector(cmon, fdev, request->offset, &segment, 1, PTRUE);
+}
+
+static co_rc_t co_os_file_block_mapped_write(struct co_monitor *cmon,
+					     co_block_dev_t *dev,
+					     co_monitor_file_block_dev_t *fdev,
+					     co_block_request_t *request)
+{
+	co_block_segment_t segment;
+
+	segment.address = request->address;
+	segment.size = (unsigned long)request->size;
+
+	return co_os_file_block_mapped_vector(cmon, fdev, request->offset, &segment, 1, PFALSE);
+}
+
+static co_rc_t co_os_file_block_mapped_readv(struct co_monitor *cmon,
+					     co_block_dev_t *dev,
+					     co_monitor_file_block_dev_t *fdev,
+					     co_block_request_t *request,
+					     co_block_segment_t *segments)
+{
+	return co_os_file_block_mapped_vector(cmon, fdev, request->offset,
+					      segments, request->nr_segments, PTRUE);
+}
+
+static co_rc_t co_os_file_block_mapped_writev(struct co_monitor *cmon,
+					      co_block_dev_t *dev,
+					      co_monitor_file_block_dev_t *fdev,
+					      co_block_request_t *request,
+					      co_block_segment_t *segments)
+{
+	return co_os_file_block_mapped_vector(cmon, fdev, request->offset,
+					      segments, request->nr_segments, PFALSE);
+}
+
+static co_rc_t co_os_file_block_mapped_host_read_write(co_monitor_file_block_dev_t *fdev,
+						       unsigned long long offset,
+						       void *buffer,
+						       unsigned long size,
+						       bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+	co_rc_t rc;
+
+	data.offset = offset;
+	data.fdev = fdev;
+
+	rc = co_os_transfer_file_block_mapped(NULL, &data, buffer, size,
+					      read ? CO_MONITOR_TRANSFER_FROM_HOST :
+						     CO_MONITOR_TRANSFER_FROM_LINUX);
+	if (CO_OK(rc) && !read)
+		rc = co_os_file_block_mapped_sync(fdev, offset, size);
+
+	return rc;
+}
+
+static co_rc_t co_os_file_block_get_size(co_monitor_file_block_dev_t *fdev,
+					 unsigned long long *size)
+{
+	off_t end;
+	int fd;
+
+	fd = open(fdev->pathname, O_RDONLY);
+	if (fd < 0) {
+		co_debug("error opening file '%s'", fdev->pathname);
+		return CO_RC(ERROR);
+	}
+
+	end = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	if (end < 0)
+		return CO_RC(ERROR);
+
+	*size = end;
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_open(struct co_monitor *cmon, co_monitor_file_block_dev_t *fdev)
+{
+	struct co_os_file_block_sysdep *sysdep;
+	int fd;
+
+	co_debug("opening %s", fdev->pathname);
+
+	fd = open(fdev->pathname, (fdev->read_only ? O_RDONLY : O_RDWR) |
+		  (fdev->write_through ? O_SYNC : 0));
+	if (fd < 0)
+		return CO_RC(ERROR);
+
+	sysdep = co_os_malloc(sizeof(*sysdep));
+	if (!sysdep) {
+		close(fd);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+
+	co_memset(sysdep, 0, sizeof(*sysdep));
+	sysdep->fd = fd;
+	pthread_mutex_init(&sysdep->lock, NULL);
+	pthread_cond_init(&sysdep->wait, NULL);
+	fdev->sysdep = sysdep;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_close(co_monitor_file_block_dev_t *fdev)
+{
+	struct co_os_file_block_sysdep *sysdep = fdev->sysdep;
+	int i;
+
+	co_debug("closing %s", fdev->pathname);
+
+	/* The threads drain the queue before they exit */
+	pthread_mutex_lock(&sysdep->lock);
+	sysdep->stop = PTRUE;
+	pthread_cond_broadcast(&sysdep->wait);
+	pthread_mutex_unlock(&sysdep->lock);
+
+	for (i = 0; i < sysdep->nr_threads; i++)
+		pthread_join(sysdep->threads[i], NULL);
+
+	if (sysdep->map)
+		munmap(sysdep->map, sysdep->map_size);
+	close(sysdep->fd);
+	pthread_cond_destroy(&sysdep->wait);
+	pthread_mutex_destroy(&sysdep->lock);
+	co_os_free(sysdep);
+	fdev->sysdep = NULL;
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_async_open(struct co_monitor *cmon,
+					   co_monitor_file_block_dev_t *fdev)
+{
+	struct co_os_file_block_sysdep *sysdep;
+	co_rc_t rc;
+	int i;
+
+	rc = co_os_file_block_open(cmon, fdev);
+	if (!CO_OK(rc))
+		return rc;
+
+	sysdep = fdev->sysdep;
+	for (i = 0; i < CO_OS_FILE_BLOCK_THREADS; i++) {
+		if (pthread_create(&sysdep->threads[i], NULL, co_os_file_block_thread, sysdep)) {
+			co_os_file_block_close(fdev);
+			return CO_RC(OUT_OF_MEMORY);
+		}
+		sysdep->nr_threads++;
+	}
+
+	return rc;
+}
+
+static co_rc_t co_os_file_block_mapped_open(struct co_monitor *cmon,
+					    co_monitor_file_block_dev_t *fdev)
+{
+	struct co_os_file_block_sysdep *sysdep;
+	off_t end;
+	void *map;
+	co_rc_t rc;
+
+	rc = co_os_file_block_open(cmon, fdev);
+	if (!CO_OK(rc))
+		return rc;
+
+	sysdep = fdev->sysdep;
+	end = lseek(sysdep->fd, 0, SEEK_END);
+	if (end <= 0 || (unsigned long long)end != (size_t)end) {
+		co_debug("cobd%d: can't map %s", fdev->dev.unit, fdev->pathname);
+		co_os_file_block_close(fdev);
+		return CO_RC(ERROR);
+	}
+
+	map = mmap(NULL, end, PROT_READ | (fdev->read_only ? 0 : PROT_WRITE),
+		   MAP_SHARED, sysdep->fd, 0);
+	if (map == MAP_FAILED) {
+		co_debug("cobd%d: can't map %s", fdev->dev.unit, fdev->pathname);
+		co_os_file_block_close(fdev);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+
+	sysdep->map = map;
+	sysdep->map_size = end;
+
+	return CO_RC(OK);
+}
+
+co_monitor_file_block_operations_t co_os_file_block_async_operations = {
+	.open = co_os_file_block_async_open,
+	.close = co_os_file_block_close,
+	.read = co_os_file_block_async_read,
+	.write = co_os_file_block_async_write,
+	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_async_readv,
+	.writev = co_os_file_block_async_writev,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
+};
+
+co_monitor_file_block_operations_t co_os_file_block_default_operations = {
+	.open = co_os_file_block_open,
+	.close = co_os_file_block_close,
+	.read = co_os_file_block_read,
+	.write = co_os_file_block_write,
+	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_readv,
+	.writev = co_os_file_block_writev,
+	.host_read_write = co_os_file_block_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
+};
+
+co_monitor_file_block_operations_t co_os_file_block_mapped_operations = {
+	.open = co_os_file_block_mapped_open,
+	.close = co_os_file_block_close,
+	.read = co_os_file_block_mapped_read,
+	.write = co_os_file_block_mapped_write,
+	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_mapped_readv,
+	.writev = co_os_file_block_mapped_writev,
+	.host_read_write = co_os_file_block_mapped_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
+};
@@ -0,0 +1,152 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/*
+ * The memory of Linux, one host buffer seen at CO_ARCH_KERNEL_OFFSET.
+ * Transfers are still split at page boundaries, like kernel/transfer.c
+ * does for the real pseudo physical RAM.
+ */
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/kernel/transfer.h>
+#include <colinux/arch/mmu.h>
+
+#include "bench.h"
+
+static unsigned char *guest_memory;
+static unsigned long guest_size;
+
+co_rc_t co_bench_guest_alloc(unsigned long size, vm_ptr_t *out_address)
+{
+	size = (size + CO_ARCH_PAGE_SIZE - 1) & CO_ARCH_PAGE_MASK;
+
+	guest_memory = co_os_alloc_pages(size >> CO_ARCH_PAGE_SHIFT);
+	if (!guest_memory)
+		return CO_RC(OUT_OF_MEMORY);
+
+	guest_size = size;
+	*out_address = CO_ARCH_KERNEL_OFFSET;
+
+	return CO_RC(OK);
+}
+
+void co_bench_guest_free(void)
+{
+	co_os_free_pages(guest_memory, guest_size >> CO_ARCH_PAGE_SHIFT);
+	guest_memory = NULL;
+	guest_size = 0;
+}
+
+void *co_bench_guest_to_host(vm_ptr_t address)
+{
+	return guest_memory + (address - CO_ARCH_KERNEL_OFFSET);
+}
+
+static co_rc_t check_bounds(vm_ptr_t vaddr, unsigned long size)
+{
+	if (vaddr < CO_ARCH_KERNEL_OFFSET ||
+	    vaddr - CO_ARCH_KERNEL_OFFSET > guest_size ||
+	    size > guest_size - (vaddr - CO_ARCH_KERNEL_OFFSET)) {
+		co_debug_error("bench: transfer off bounds: %p (%ld)", (void *)vaddr, size);
+		return CO_RC(TRANSFER_OFF_BOUNDS);
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_monitor_host_linuxvm_transfer_map(co_monitor_t *cmon, vm_ptr_t vaddr,
+					     unsigned long size, unsigned char **start,
+					     unsigned char **page, co_pfn_t *ppfn)
+{
+	unsigned long one_copy;
+	co_rc_t rc;
+
+	rc = check_bounds(vaddr, size);
+	if (!CO_OK(rc))
+		return rc;
+
+	one_copy = ((vaddr + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - vaddr;
+	if (size <= 0 || size > one_copy)
+		return CO_RC(TRANSFER_OFF_BOUNDS);
+
+	*start = co_bench_guest_to_host(vaddr);
+	*page = co_bench_guest_to_host(vaddr & CO_ARCH_PAGE_MASK);
+	*ppfn = 0;
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_monitor_host_linuxvm_transfer(co_monitor_t *cmon, void *host_data,
+					 co_monitor_transfer_func_t host_func,
+					 vm_ptr_t vaddr, unsigned long size,
+					 co_monitor_transfer_dir_t dir)
+{
+	unsigned long one_copy;
+	co_rc_t rc;
+
+	rc = check_bounds(vaddr, size);
+	if (!CO_OK(rc))
+		return rc;
+
+	while (size > 0) {
+		one_copy = ((vaddr + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - vaddr;
+		if (one_copy > size)
+			one_copy = size;
+
+		rc = host_func(cmon, host_data, co_bench_guest_to_host(vaddr), one_copy, dir);
+		if (!CO_OK(rc))
+			return rc;
+
+		size -= one_copy;
+		vaddr += one_copy;
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t transfer_memcpy(co_monitor_t *cmon, void *host_data, void *linuxvm,
+			       unsigned long size, co_monitor_transfer_dir_t dir)
+{
+	unsigned char **host = (unsigned char **)host_data;
+
+	if (dir == CO_MONITOR_TRANSFER_FROM_HOST)
+		co_memcpy(linuxvm, *host, size);
+	else
+		co_memcpy(*host, linuxvm, size);
+
+	(*host) += size;
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_monitor_host_to_linuxvm(co_monitor_t *cmon, void *from,
+				   vm_ptr_t to, unsigned long size)
+{
+	return co_monitor_host_linuxvm_transfer(cmon, &from, transfer_memcpy, to, size,
+						CO_MONITOR_TRANSFER_FROM_HOST);
+}
+
+co_rc_t co_monitor_linuxvm_to_host(co_monitor_t *cmon, vm_ptr_t from,
+				   void *to, unsigned long size)
+{
+	return co_monitor_host_linuxvm_transfer(cmon, &to, transfer_memcpy, from, size,
+						CO_MONITOR_TRANSFER_FROM_LINUX);
+}
+
+/* Completions of asynchronous requests end up here instead of in Linux */
+co_rc_t co_monitor_message_from_user_free(co_monitor_t *monitor, co_message_t *message)
+{
+	co_block_intr_t *intr;
+
+	intr = (co_block_intr_t *)((co_linux_message_t *)message->data)->data;
+	co_bench_request_done(intr->tag, intr->uptodate);
+
+	co_os_free(message);
+	return CO_RC(OK);
+}
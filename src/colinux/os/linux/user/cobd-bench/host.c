@@ -0,0 +1,81 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/* Linux host: the kernel services the block code needs, in user space */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/alloc.h>
+#include <colinux/os/kernel/mutex.h>
+#include <colinux/arch/mmu.h>
+
+struct co_os_mutex {
+	pthread_mutex_t mutex;
+};
+
+co_rc_t co_os_mutex_create(co_os_mutex_t *mutex_out)
+{
+	co_os_mutex_t mutex;
+
+	mutex = co_os_malloc(sizeof(*mutex));
+	if (!mutex)
+		return CO_RC(OUT_OF_MEMORY);
+
+	pthread_mutex_init(&mutex->mutex, NULL);
+	*mutex_out = mutex;
+
+	return CO_RC(OK);
+}
+
+void co_os_mutex_destroy(co_os_mutex_t mutex)
+{
+	pthread_mutex_destroy(&mutex->mutex);
+	co_os_free(mutex);
+}
+
+void co_os_mutex_acquire(co_os_mutex_t mutex)
+{
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+void co_os_mutex_release(co_os_mutex_t mutex)
+{
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+void co_os_mutex_acquire_critical(co_os_mutex_t mutex)
+{
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+void co_os_mutex_release_critical(co_os_mutex_t mutex)
+{
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+void *co_os_alloc_pages(unsigned int pages)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, CO_ARCH_PAGE_SIZE, pages << CO_ARCH_PAGE_SHIFT))
+		return NULL;
+
+	return ptr;
+}
+
+void co_os_free_pages(void *ptr, unsigned int pages)
+{
+	free(ptr);
+}
+
+void co_os_unmap(struct co_manager *manager, void *ptr, co_pfn_t pfn)
+{
+	/* Guest memory is mapped all the time, see guest.c */
+}
@@ -0,0 +1,679 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/*
+ * Drives a cobd device the way Linux does, with fio style patterns, and
+ * reports what the block code of the host driver achieves. No module
+ * and no guest are needed, see bench.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/user/daemon.h>
+#include <colinux/user/config.h>
+#include <colinux/kernel/fileblock.h>
+#include <colinux/kernel/blockqos.h>
+#include <colinux/arch/mmu.h>
+
+#include "bench.h"
+
+COLINUX_DEFINE_MODULE("colinux-cobd-bench");
+
+#define BENCH_UNIT		0
+#define BENCH_MAX_BLOCK_SIZE	(4*1024*1024)
+
+enum {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_DIRS
+};
+
+typedef struct {
+	const char *name;
+	bool_t random;
+	int read_percent;	/* -1 takes it from -m */
+} bench_pattern_t;
+
+static bench_pattern_t patterns[] = {
+	{ "read",	PFALSE,	100 },
+	{ "write",	PFALSE,	0 },
+	{ "randread",	PTRUE,	100 },
+	{ "randwrite",	PTRUE,	0 },
+	{ "rw",		PFALSE,	-1 },
+	{ "randrw",	PTRUE,	-1 },
+};
+
+typedef struct {
+	bool_t busy;
+	int dir;
+	unsigned long long submit;
+	vm_ptr_t buffer;
+	vm_ptr_t segments;
+} bench_slot_t;
+
+typedef struct {
+	unsigned long *latencies;	/* in microseconds */
+	unsigned long count;
+	unsigned long allocated;
+	unsigned long long bytes;
+	unsigned long errors;
+} bench_stats_t;
+
+static struct {
+	/* Parameters */
+	bench_pattern_t *pattern;
+	int read_percent;
+	unsigned long block_size;
+	unsigned int depth;
+	unsigned long seconds;
+	unsigned long long requests;
+	unsigned long long region;
+	unsigned long flush_interval;
+	bool_t vectored;
+	bool_t async;
+	const char *delta;	/* snapshot halfway through, see -S */
+
+	co_monitor_t *cmon;
+	co_monitor_file_block_dev_t *fdev;
+	unsigned long nr_segments;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	bench_slot_t slots[CO_BLOCK_MAX_INFLIGHT];
+	unsigned int busy;
+	bench_stats_t stats[BENCH_DIRS];
+	unsigned long flushes;
+	unsigned long long flush_usecs;
+	unsigned long long snapshot_usecs;
+	co_rc_t snapshot_rc;
+	unsigned long long random;
+} bench;
+
+static unsigned long long now_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* xorshift64, cheap enough not to show up in the results */
+static unsigned long long next_random(void)
+{
+	bench.random ^= bench.random << 13;
+	bench.random ^= bench.random >> 7;
+	bench.random ^= bench.random << 17;
+	return bench.random;
+}
+
+static co_rc_t parse_size(const char *text, unsigned long long *size)
+{
+	char *end;
+
+	*size = strtoull(text, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': *size <<= 10; end++; break;
+	case 'm': case 'M': *size <<= 20; end++; break;
+	case 'g': case 'G': *size <<= 30; end++; break;
+	default: break;
+	}
+
+	if (end == text || *end)
+		return CO_RC(INVALID_PARAMETER);
+
+	return CO_RC(OK);
+}
+
+/* Caller holds bench.lock */
+static void account(bench_slot_t *slot, bool_t uptodate)
+{
+	bench_stats_t *stats = &bench.stats[slot->dir];
+	unsigned long *grown;
+
+	if (stats->count == stats->allocated) {
+		stats->allocated = stats->allocated ? stats->allocated * 2 : 65536;
+		grown = realloc(stats->latencies, stats->allocated * sizeof(*grown));
+		if (!grown) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		stats->latencies = grown;
+	}
+
+	stats->latencies[stats->count++] = (unsigned long)(now_usecs() - slot->submit);
+	stats->bytes += bench.block_size;
+	if (!uptodate)
+		stats->errors++;
+
+	slot->busy = PFALSE;
+	bench.busy--;
+	pthread_cond_signal(&bench.done);
+}
+
+void co_bench_request_done(unsigned long tag, bool_t uptodate)
+{
+	pthread_mutex_lock(&bench.lock);
+	if (tag < bench.depth && bench.slots[tag].busy)
+		account(&bench.slots[tag], uptodate);
+	pthread_mutex_unlock(&bench.lock);
+}
+
+static co_rc_t simple_request(co_block_request_type_t type, co_block_request_t *request)
+{
+	memset(request, 0, sizeof(*request));
+	request->type = type;
+
+	co_monitor_block_request(bench.cmon, BENCH_UNIT, request);
+	if (request->rc != CO_BLOCK_REQUEST_RETCODE_OK)
+		return CO_RC(ERROR);
+
+	return CO_RC(OK);
+}
+
+/*
+ * Wait for a completion. Requests held back by the I/O limits are passed
+ * on meanwhile, as the monitor does on its way back to Linux. Caller
+ * holds bench.lock.
+ */
+static void wait_done(void)
+{
+	struct timespec ts;
+
+	if (!bench.cmon->block_qos_queued) {
+		pthread_cond_wait(&bench.done, &bench.lock);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		ts.tv_sec++;
+	}
+	pthread_cond_timedwait(&bench.done, &bench.lock, &ts);
+
+	/* Completions of the dispatched requests take the lock */
+	pthread_mutex_unlock(&bench.lock);
+	co_block_qos_dispatch(bench.cmon);
+	pthread_mutex_lock(&bench.lock);
+}
+
+static void wait_idle(void)
+{
+	pthread_mutex_lock(&bench.lock);
+	while (bench.busy)
+		wait_done();
+	pthread_mutex_unlock(&bench.lock);
+}
+
+static void flush(void)
+{
+	co_block_request_t request;
+	unsigned long long start;
+
+	/* Linux drains the queue before a flush */
+	wait_idle();
+
+	start = now_usecs();
+	if (!CO_OK(simple_request(CO_BLOCK_FLUSH, &request)))
+		bench.stats[BENCH_WRITE].errors++;
+
+	bench.flush_usecs += now_usecs() - start;
+	bench.flushes++;
+}
+
+/*
+ * Freeze the image the way CO_MONITOR_IOCTL_BLOCK_SNAPSHOT does, while
+ * requests are in flight. The monitor would take it on its way back to
+ * Linux, between two requests.
+ */
+static void snapshot(void)
+{
+	co_monitor_ioctl_block_snapshot_t params;
+	unsigned long long start;
+	FILE *file;
+
+	/* The delta starts out empty */
+	file = fopen(bench.delta, "wb");
+	if (file)
+		fclose(file);
+
+	memset(&params, 0, sizeof(params));
+	params.unit = BENCH_UNIT;
+	snprintf(params.delta, sizeof(params.delta), "%s", bench.delta);
+
+	start = now_usecs();
+	bench.snapshot_rc = co_monitor_file_block_snapshot_ioctl(bench.cmon, &params);
+	if (CO_OK(bench.snapshot_rc))
+		co_monitor_file_block_snapshot_run(bench.cmon);
+	bench.snapshot_usecs = now_usecs() - start;
+}
+
+static unsigned long long next_offset(unsigned long long *sequential)
+{
+	unsigned long long offset;
+
+	if (bench.pattern->random)
+		return (next_random() % (bench.region / bench.block_size)) * bench.block_size;
+
+	offset = *sequential;
+	*sequential += bench.block_size;
+	if (*sequential + bench.block_size > bench.region)
+		*sequential = 0;
+
+	return offset;
+}
+
+static bench_slot_t *get_slot(unsigned long *tag)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&bench.lock);
+	while (bench.busy == bench.depth)
+		wait_done();
+
+	for (i = 0; i < bench.depth; i++)
+		if (!bench.slots[i].busy)
+			break;
+
+	bench.slots[i].busy = PTRUE;
+	bench.busy++;
+	pthread_mutex_unlock(&bench.lock);
+
+	*tag = i;
+	return &bench.slots[i];
+}
+
+static void submit(unsigned long long offset, int dir)
+{
+	co_block_request_t request;
+	bench_slot_t *slot;
+	unsigned long tag;
+
+	slot = get_slot(&tag);
+	slot->dir = dir;
+
+	memset(&request, 0, sizeof(request));
+	request.offset = offset;
+	request.size = bench.block_size;
+	request.tag = tag;
+
+	if (bench.vectored) {
+		request.type = dir == BENCH_READ ? CO_BLOCK_READV : CO_BLOCK_WRITEV;
+		request.address = slot->segments;
+		request.nr_segments = bench.nr_segments;
+	} else {
+		request.type = dir == BENCH_READ ? CO_BLOCK_READ : CO_BLOCK_WRITE;
+		request.address = slot->buffer;
+	}
+
+	slot->submit = now_usecs();
+	co_monitor_block_request(bench.cmon, BENCH_UNIT, &request);
+
+	/* Asynchronous ones are accounted by co_bench_request_done() */
+	if (request.rc != CO_BLOCK_REQUEST_RETCODE_OK || !request.async) {
+		pthread_mutex_lock(&bench.lock);
+		account(slot, request.rc == CO_BLOCK_REQUEST_RETCODE_OK);
+		pthread_mutex_unlock(&bench.lock);
+	}
+}
+
+static void run(void)
+{
+	unsigned long long sequential = 0, issued = 0, end, half;
+	unsigned long writes = 0;
+	bool_t snapshotted = !bench.delta;
+	int dir;
+
+	end = now_usecs() + bench.seconds * 1000000ULL;
+	half = end - bench.seconds * 500000ULL;
+
+	while (bench.requests ? issued < bench.requests : now_usecs() < end) {
+		if (!snapshotted && (bench.requests ? issued >= bench.requests / 2 : now_usecs() >= half)) {
+			snapshot();
+			snapshotted = PTRUE;
+		}
+
+
+		dir = (int)(next_random() % 100) < bench.read_percent ? BENCH_READ : BENCH_WRITE;
+
+		submit(next_offset(&sequential), dir);
+		issued++;
+
+		if (dir == BENCH_WRITE && bench.flush_interval &&
+		    ++writes % bench.flush_interval == 0)
+			flush();
+	}
+
+	wait_idle();
+}
+
+static co_rc_t setup_guest(void)
+{
+	unsigned long block_pages, slot_size, i, j;
+	co_block_segment_t *segments;
+	unsigned char *data;
+	vm_ptr_t address;
+	co_rc_t rc;
+
+	/* The data of each slot, followed by a page for its segment list */
+	block_pages = (bench.block_size + CO_ARCH_PAGE_SIZE - 1) >> CO_ARCH_PAGE_SHIFT;
+	slot_size = (block_pages + 1) << CO_ARCH_PAGE_SHIFT;
+
+	rc = co_bench_guest_alloc(slot_size * bench.depth, &address);
+	if (!CO_OK(rc))
+		return rc;
+
+	bench.nr_segments = block_pages;
+
+	for (i = 0; i < bench.depth; i++) {
+		bench.slots[i].buffer = address + i * slot_size;
+		bench.slots[i].segments = bench.slots[i].buffer + (block_pages << CO_ARCH_PAGE_SHIFT);
+
+		/* Data that sparse devices can not drop */
+		data = co_bench_guest_to_host(bench.slots[i].buffer);
+		for (j = 0; j < bench.block_size; j++)
+			data[j] = (unsigned char)(next_random() | 1);
+
+		segments = co_bench_guest_to_host(bench.slots[i].segments);
+		for (j = 0; j < block_pages; j++) {
+			segments[j].address = bench.slots[i].buffer + (j << CO_ARCH_PAGE_SHIFT);
+			segments[j].size = CO_ARCH_PAGE_SIZE;
+		}
+		segments[block_pages - 1].size = bench.block_size -
+			((block_pages - 1) << CO_ARCH_PAGE_SHIFT);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t setup_device(const char *spec)
+{
+	co_block_dev_desc_t *conf;
+	co_rc_t rc;
+
+	bench.cmon = co_os_malloc(sizeof(co_monitor_t));
+	bench.fdev = co_os_malloc(sizeof(co_monitor_file_block_dev_t));
+	if (!bench.cmon || !bench.fdev)
+		return CO_RC(OUT_OF_MEMORY);
+
+	memset(bench.cmon, 0, sizeof(co_monitor_t));
+	bench.cmon->config.cobd_async_enable = bench.async;
+	co_os_get_timestamp_freq(&bench.cmon->timestamp, &bench.cmon->timestamp_freq);
+
+	conf = &bench.cmon->config.block_devs[BENCH_UNIT];
+	conf->enabled = PTRUE;
+
+	rc = co_parse_cobd_device(conf, BENCH_UNIT, spec);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_monitor_file_block_init(bench.cmon, bench.fdev, conf);
+	if (!CO_OK(rc))
+		return rc;
+
+	co_monitor_block_register_device(bench.cmon, BENCH_UNIT, &bench.fdev->dev);
+
+	return CO_RC(OK);
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report_dir(const char *name, bench_stats_t *stats, double seconds)
+{
+	unsigned long long total = 0;
+	unsigned long i;
+
+	if (stats->count == 0)
+		return;
+
+	qsort(stats->latencies, stats->count, sizeof(stats->latencies[0]), compare_ulong);
+	for (i = 0; i < stats->count; i++)
+		total += stats->latencies[i];
+
+	printf("  %-6s %10lu requests %10.1f IOPS %9.2f MB/s\n", name, stats->count,
+	       stats->count / seconds, stats->bytes / seconds / (1024 * 1024));
+	printf("         latency us: avg %llu, p50 %lu, p99 %lu, max %lu\n",
+	       total / stats->count, stats->latencies[(stats->count - 1) / 2],
+	       stats->latencies[(stats->count - 1) * 99 / 100],
+	       stats->latencies[stats->count - 1]);
+	if (stats->errors)
+		printf("         %lu errors\n", stats->errors);
+}
+
+static void report(const char *spec, double seconds)
+{
+	co_monitor_ioctl_get_block_stats_t params;
+	co_monitor_file_block_readahead_t *ra = &bench.fdev->readahead;
+
+	printf("cobd%d=%s: %s, %lu bytes, depth %u, %s%s, %.2f seconds\n", BENCH_UNIT, spec,
+	       bench.pattern->name, bench.block_size, bench.depth,
+	       bench.async ? "async" : "sync", bench.vectored ? ", vectored" : "", seconds);
+
+	report_dir("read", &bench.stats[BENCH_READ], seconds);
+	report_dir("write", &bench.stats[BENCH_WRITE], seconds);
+
+	if (bench.flushes)
+		printf("  flush  %10lu requests, avg %llu us\n", bench.flushes,
+		       bench.flush_usecs / bench.flushes);
+
+	co_monitor_file_block_get_stats(bench.fdev, &params);
+	if (params.cache.max_pages)
+		printf("  cache: %llu hits, %llu misses, %llu evictions, %lu of %lu pages\n",
+		       params.cache.hits, params.cache.misses, params.cache.evictions,
+		       params.cache.pages, params.cache.max_pages);
+
+	if (ra->buffer)
+		printf("  readahead: %llu reads, %llu hits\n", ra->reads, ra->hits);
+
+	if (bench.delta && CO_RC_GET_CODE(bench.snapshot_rc) == CO_RC_NOT_SUPPORTED)
+		printf("  snapshot: not with the async or mmap backends\n");
+	else if (bench.delta)
+		printf("  snapshot: %s in %llu us, %s\n",
+		       bench.fdev->snapshot.state == CO_BLOCK_SNAPSHOT_DONE ? "taken" : "failed",
+		       bench.snapshot_usecs, bench.fdev->pathname);
+
+	if (bench.fdev->dev.qos.delayed)
+		printf("  qos: %llu requests delayed\n", bench.fdev->dev.qos.delayed);
+}
+
+static void syntax(void)
+{
+	printf("Cooperative Linux block device benchmark\n");
+	printf("syntax:\n\n");
+	printf("    colinux-cobd-bench [options] <image>[,<cobd options>]\n\n");
+	printf("      -p <pattern>     read, write, randread (default), randwrite, rw, randrw\n");
+	printf("      -m <percent>     reads of rw and randrw (default 50)\n");
+	printf("      -b <size>        block size (default 4K)\n");
+	printf("      -q <depth>       requests in flight, up to %d (default 1)\n",
+	       CO_BLOCK_MAX_INFLIGHT);
+	printf("      -a               asynchronous backend, implied by -q above 1\n");
+	printf("      -v               vectored requests, one segment per page\n");
+	printf("      -f <writes>      flush after every so many writes\n");
+	printf("      -s <size>        size of the region used (default the whole image)\n");
+	printf("      -t <seconds>     run time (default 10)\n");
+	printf("      -n <requests>    number of requests, instead of -t\n");
+	printf("      -S <delta>       snapshot halfway through, writes go to <delta> after,\n"
+	       "                       not with -a or mmap\n");
+	printf("\n");
+	printf("    cobd options are those of the cobdX= parameter of colinux-daemon.\n");
+	printf("    <image> may be an NBD export, nbd://<address>[:<port>][/<name>].\n");
+	printf("    Patterns with writes overwrite the image.\n");
+}
+
+static co_rc_t parse_args(int argc, char *argv[])
+{
+	unsigned long long size;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:m:b:q:avf:s:t:n:S:")) != -1) {
+		switch (c) {
+		case 'p':
+			for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+				if (strcmp(optarg, patterns[i].name) == 0)
+					bench.pattern = &patterns[i];
+			if (!bench.pattern)
+				return CO_RC(INVALID_PARAMETER);
+			break;
+		case 'm':
+			bench.read_percent = atoi(optarg);
+			if (bench.read_percent < 0 || bench.read_percent > 100)
+				return CO_RC(INVALID_PARAMETER);
+			break;
+		case 'b':
+			if (!CO_OK(parse_size(optarg, &size)) || size == 0 ||
+			    size > BENCH_MAX_BLOCK_SIZE)
+				return CO_RC(INVALID_PARAMETER);
+			bench.block_size = (unsigned long)size;
+			break;
+		case 'q':
+			bench.depth = atoi(optarg);
+			if (bench.depth < 1 || bench.depth > CO_BLOCK_MAX_INFLIGHT)
+				return CO_RC(INVALID_PARAMETER);
+			break;
+		case 'a':
+			bench.async = PTRUE;
+			break;
+		case 'v':
+			bench.vectored = PTRUE;
+			break;
+		case 'f':
+			bench.flush_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			if (!CO_OK(parse_size(optarg, &bench.region)))
+				return CO_RC(INVALID_PARAMETER);
+			break;
+		case 't':
+			bench.seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			bench.requests = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			bench.delta = optarg;
+			break;
+		default:
+			return CO_RC(INVALID_PARAMETER);
+		}
+	}
+
+	if (optind + 1 != argc)
+		return CO_RC(INVALID_PARAMETER);
+
+	if (bench.pattern->read_percent >= 0)
+		bench.read_percent = bench.pattern->read_percent;
+
+	if (bench.depth > 1)
+		bench.async = PTRUE;
+
+	if (bench.vectored &&
+	    bench.block_size > CO_BLOCK_MAX_SEGMENTS * CO_ARCH_PAGE_SIZE) {
+		fprintf(stderr, "vectored requests are up to %d bytes\n",
+			CO_BLOCK_MAX_SEGMENTS * CO_ARCH_PAGE_SIZE);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t bench_main(int argc, char *argv[])
+{
+	co_block_request_t request;
+	unsigned long long start;
+	const char *spec;
+	co_rc_t rc;
+
+	bench.pattern = NULL;
+	bench.read_percent = 50;
+	bench.block_size = 4096;
+	bench.depth = 1;
+	bench.seconds = 10;
+	bench.random = 0x9e3779b97f4a7c15ULL;
+
+	rc = parse_args(argc, argv);
+	if (!bench.pattern)
+		bench.pattern = &patterns[2];
+	if (!CO_OK(rc)) {
+		syntax();
+		return rc;
+	}
+	spec = argv[optind];
+
+	pthread_mutex_init(&bench.lock, NULL);
+	pthread_cond_init(&bench.done, NULL);
+
+	rc = setup_device(spec);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot set up cobd%d=%s\n", BENCH_UNIT, spec);
+		return rc;
+	}
+
+	rc = simple_request(CO_BLOCK_STAT, &request);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot stat %s\n", bench.fdev->pathname);
+		goto out;
+	}
+
+	if (bench.region == 0 || bench.region > request.disk_size)
+		bench.region = request.disk_size;
+	if (bench.region < bench.block_size) {
+		fprintf(stderr, "%s is smaller than a block\n", bench.fdev->pathname);
+		rc = CO_RC(INVALID_PARAMETER);
+		goto out;
+	}
+
+	rc = setup_guest();
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = simple_request(CO_BLOCK_OPEN, &request);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot open %s\n", bench.fdev->pathname);
+		goto out_guest;
+	}
+
+	start = now_usecs();
+	run();
+	report(spec, (now_usecs() - start) / 1000000.0);
+
+	simple_request(CO_BLOCK_CLOSE, &request);
+
+out_guest:
+	co_bench_guest_free();
+out:
+	co_monitor_block_unregister_device(bench.cmon, BENCH_UNIT);
+	co_monitor_file_block_shutdown(bench.fdev);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	co_rc_t rc;
+
+	rc = bench_main(argc, argv);
+
+	if (!CO_OK(rc))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+/*
+ * Connections of the NBD client of kernel/nbdblock.c, on top of BSD
+ * sockets, with a POSIX thread as the receiver.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <colinux/common/libc.h>
+#include <colinux/os/alloc.h>
+#include <colinux/os/kernel/nbd.h>
+
+struct co_os_nbd {
+	int sock;
+	pthread_t receiver;
+	void (*func)(void *data);
+	void *data;
+	pthread_mutex_t lock;
+	pthread_cond_t control;
+	bool_t control_done;
+};
+
+static co_rc_t co_os_nbd_io(int sock, void *buffer, unsigned long size, bool_t out)
+{
+	ssize_t ret;
+
+	while (size) {
+		if (out)
+			ret = send(sock, buffer, size, MSG_NOSIGNAL);
+		else
+			ret = recv(sock, buffer, size, MSG_WAITALL | MSG_NOSIGNAL);
+
+		if (ret <= 0)
+			return CO_RC(BROKEN_PIPE);
+
+		buffer = (unsigned char *)buffer + ret;
+		size -= ret;
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_nbd_send(void *conn, void *buffer, unsigned long size)
+{
+	return co_os_nbd_io(((co_os_nbd_t)conn)->sock, buffer, size, PTRUE);
+}
+
+co_rc_t co_os_nbd_recv(void *conn, void *buffer, unsigned long size)
+{
+	return co_os_nbd_io(((co_os_nbd_t)conn)->sock, buffer, size, PFALSE);
+}
+
+co_rc_t co_os_nbd_connect(co_nbd_uri_t *uri, co_os_nbd_t *nbd_out)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	struct sockaddr *addr;
+	socklen_t addrlen;
+	co_os_nbd_t nbd;
+	int sock, one = 1;
+
+	if (uri->unix_socket) {
+		co_memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		co_memcpy(sun.sun_path, uri->socket_path, sizeof(sun.sun_path) - 1);
+		addr = (struct sockaddr *)&sun;
+		addrlen = sizeof(sun);
+		sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	} else {
+		co_memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(uri->port);
+		co_memcpy(&sin.sin_addr.s_addr, uri->addr, sizeof(uri->addr));
+		addr = (struct sockaddr *)&sin;
+		addrlen = sizeof(sin);
+		sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	}
+	if (sock < 0)
+		return CO_RC(ERROR);
+
+	if (connect(sock, addr, addrlen) < 0) {
+		co_debug_error("nbd: connect failed (errno %d)", errno);
+		close(sock);
+		return CO_RC(ERROR);
+	}
+
+	/* Headers go out one by one, don't let them wait for more */
+	if (!uri->unix_socket)
+		setsockopt(sock, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	nbd = co_os_malloc(sizeof(*nbd));
+	if (!nbd) {
+		close(sock);
+		return CO_RC(OUT_OF_MEMORY);
+	}
+
+	co_memset(nbd, 0, sizeof(*nbd));
+	nbd->sock = sock;
+	pthread_mutex_init(&nbd->lock, NULL);
+	pthread_cond_init(&nbd->control, NULL);
+
+	*nbd_out = nbd;
+	return CO_RC(OK);
+}
+
+void co_os_nbd_shutdown(co_os_nbd_t nbd)
+{
+	shutdown(nbd->sock, SHUT_RDWR);
+}
+
+void co_os_nbd_close(co_os_nbd_t nbd)
+{
+	close(nbd->sock);
+	pthread_cond_destroy(&nbd->control);
+	pthread_mutex_destroy(&nbd->lock);
+	co_os_free(nbd);
+}
+
+static void *co_os_nbd_receiver(void *arg)
+{
+	co_os_nbd_t nbd = arg;
+
+	nbd->func(nbd->data);
+	return NULL;
+}
+
+co_rc_t co_os_nbd_receiver_start(co_os_nbd_t nbd, void (*func)(void *data),
+				 void *data, int unit)
+{
+	nbd->func = func;
+	nbd->data = data;
+
+	if (pthread_create(&nbd->receiver, NULL, co_os_nbd_receiver, nbd))
+		return CO_RC(OUT_OF_MEMORY);
+
+	return CO_RC(OK);
+}
+
+void co_os_nbd_receiver_stop(co_os_nbd_t nbd)
+{
+	pthread_join(nbd->receiver, NULL);
+}
+
+void co_os_nbd_control_reset(co_os_nbd_t nbd)
+{
+	pthread_mutex_lock(&nbd->lock);
+	nbd->control_done = PFALSE;
+	pthread_mutex_unlock(&nbd->lock);
+}
+
+void co_os_nbd_control_wait(co_os_nbd_t nbd)
+{
+	pthread_mutex_lock(&nbd->lock);
+	while (!nbd->control_done)
+		pthread_cond_wait(&nbd->control, &nbd->lock);
+	pthread_mutex_unlock(&nbd->lock);
+}
+
+void co_os_nbd_control_done(co_os_nbd_t nbd)
+{
+	pthread_mutex_lock(&nbd->lock);
+	nbd->control_done = PTRUE;
+	pthread_cond_signal(&nbd->control);
+	pthread_mutex_unlock(&nbd->lock);
+}
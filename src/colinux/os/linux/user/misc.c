@@ -93,14 +93,23 @@ void co_terminal_print_color(co_terminal_color_t color, const char *format, ...)
 	va_end(ap);
 }
 
+/* Microseconds, like the timestamps of the host module */
 void co_os_get_timestamp(co_timestamp_t *dts)
 {
 	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
 
-	dts->high = tv.tv_sec;
-        dts->low = tv.tv_usec;
+	dts->quad = tv.tv_sec;
+	dts->quad *= 1000000;
+	dts->quad += tv.tv_usec;
+}
+
+void co_os_get_timestamp_freq(co_timestamp_t *dts, co_timestamp_t *freq)
+{
+	co_os_get_timestamp(dts);
+	if (freq)
+		freq->quad = 1000000;
 }
 
 int co_udp_socket_connect(const char *addr, unsigned short int port)
@@ -18,6 +18,7 @@ targets['executables'] = Target(
     Input('colinux-ndis-net-daemon.exe'),
     Input('colinux-slirp-net-daemon.exe'),
     Input('colinux-serial-daemon.exe'),
+    Input('colinux-cobd-tool.exe'),
     Input('linux.sys'),
     ] + optional_targets(),
     tool = Empty(),
@@ -112,6 +113,16 @@ targets['colinux-serial-daemon.exe'] = Target(
     mono_options = generate_options('gcc'),
 )
 
+targets['colinux-cobd-tool.exe'] = Target(
+    inputs = [
+        Input('../user/daemon/res/colinux-cobd-tool.res'),
+        Input('../user/cobd-tool/build.o'),
+        Input('../../../user/cobd-tool/build.o'),
+    ] + user_dep,
+    tool = Compiler(),
+    mono_options = generate_options('gcc'),
+)
+
 targets['colinux-console-fltk.exe'] = Target(
     inputs = [
         Input('../user/daemon/res/colinux-fltk.res'),
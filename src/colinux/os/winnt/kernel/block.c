@@ -14,19 +14,48 @@
 
 #include <colinux/common/libc.h>
 #include <colinux/os/alloc.h>
+#include <colinux/os/kernel/nbd.h>
 #include <colinux/kernel/transfer.h>
 #include <colinux/kernel/fileblock.h>
 #include <colinux/kernel/monitor.h>
+#include <colinux/arch/mmu.h>
 
 #include "fileio.h"
 
+#ifndef FSCTL_SET_SPARSE
+#define FSCTL_SET_SPARSE	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 49, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#endif
+#ifndef FSCTL_SET_ZERO_DATA
+#define FSCTL_SET_ZERO_DATA	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 50, METHOD_BUFFERED, FILE_WRITE_DATA)
+#endif
+
+typedef struct {
+	LARGE_INTEGER FileOffset;
+	LARGE_INTEGER BeyondFinalZero;
+} zero_data_information_t;
+
 typedef struct {
-	struct {
-		co_message_t message;
-		co_linux_message_t linux_message;
-		co_block_intr_t intr;
-	} msg; /* Must stay as the first field */
+	co_message_t message;
+	co_linux_message_t linux_message;
+	co_block_intr_t intr;
+} block_message_t;
+
+/*
+ * Completion shared by all pieces of an asynchronous READV/WRITEV,
+ * posted to Linux when the last piece is done.
+ */
+typedef struct {
+	block_message_t msg; /* Must stay as the first field */
 	co_monitor_t *monitor;
+	co_block_dev_t *dev;
+	LONG pending;
+} vector_context_t;
+
+typedef struct {
+	block_message_t msg; /* Must stay as the first field */
+	co_monitor_t *monitor;
+	co_block_dev_t *dev;
+	vector_context_t *vector; /* NULL for single requests */
 	co_pfn_t pfn;
 	unsigned char *page;
 	unsigned char *start;
@@ -110,6 +139,95 @@ co_rc_t co_os_file_block_read_write(co_monitor_t *monitor,
 	return rc;
 }
 
+static co_rc_t co_os_file_block_host_read_write(co_monitor_file_block_dev_t *fdev,
+						unsigned long long offset,
+						void *buffer,
+						unsigned long size,
+						bool_t read)
+{
+	co_os_transfer_file_block_data_t data;
+
+	data.offset.QuadPart = offset;
+	data.file_handle = (HANDLE)(fdev->sysdep);
+
+	return transfer_file_block(NULL, &data, buffer, size,
+				   read ? CO_MONITOR_TRANSFER_FROM_HOST :
+				   CO_MONITOR_TRANSFER_FROM_LINUX);
+}
+
+/*
+ * Handles of asynchronous devices are not synchronous, the request is
+ * waited for with an event of its own.
+ */
+static NTSTATUS fs_control(HANDLE handle, ULONG code, PVOID input, ULONG input_size)
+{
+	IO_STATUS_BLOCK isb;
+	HANDLE event;
+	NTSTATUS status;
+
+	status = ZwCreateEvent(&event, EVENT_ALL_ACCESS, NULL, NotificationEvent, FALSE);
+	if (status != STATUS_SUCCESS)
+		return status;
+
+	status = ZwFsControlFile(handle, event, NULL, NULL, &isb, code,
+				 input, input_size, NULL, 0);
+	if (status == STATUS_PENDING) {
+		ZwWaitForSingleObject(event, FALSE, NULL);
+		status = isb.Status;
+	}
+
+	ZwClose(event);
+	return status;
+}
+
+static co_rc_t co_os_file_block_discard(co_monitor_file_block_dev_t *fdev,
+					unsigned long long offset,
+					unsigned long long size)
+{
+	HANDLE handle = (HANDLE)(fdev->sysdep);
+	zero_data_information_t zero;
+	NTSTATUS status;
+
+	/* Without the sparse flag NTFS writes the zeros, so set it first */
+	status = fs_control(handle, FSCTL_SET_SPARSE, NULL, 0);
+	if (status != STATUS_SUCCESS) {
+		co_debug("set sparse status %X", (int)status);
+		return CO_RC(ERROR);
+	}
+
+	zero.FileOffset.QuadPart = offset;
+	zero.BeyondFinalZero.QuadPart = offset + size;
+
+	status = fs_control(handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero));
+	if (status != STATUS_SUCCESS) {
+		co_debug("set zero data status %X", (int)status);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_flush(co_monitor_file_block_dev_t *fdev)
+{
+	HANDLE handle = (HANDLE)(fdev->sysdep);
+	IO_STATUS_BLOCK isb;
+	NTSTATUS status;
+
+	status = ZwFlushBuffersFile(handle, &isb);
+	if (status == STATUS_PENDING) {
+		/* Linux drained its queue first, nothing else completes meanwhile */
+		ZwWaitForSingleObject(handle, FALSE, NULL);
+		status = isb.Status;
+	}
+
+	if (status != STATUS_SUCCESS) {
+		co_debug("flush status %X", (int)status);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
 static void CALLBACK transfer_file_block_callback(callback_context_t *context, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved)
 {
 	co_debug_lvl(filesystem, 10, "cobd%d callback size=%ld info=%ld status=%X",
@@ -125,7 +243,33 @@ static void CALLBACK transfer_file_block_callback(callback_context_t *context, P
 			    (int)IoStatusBlock->Status);
 
 	co_monitor_host_linuxvm_transfer_unmap(context->monitor, context->page, context->pfn);
-	co_monitor_message_from_user_free(context->monitor, &context->msg.message);
+
+	if (context->vector) {
+		vector_context_t *vector = context->vector;
+
+		if (!context->msg.intr.uptodate)
+			vector->msg.intr.uptodate = 0;
+		co_os_free(context);
+		if (InterlockedDecrement(&vector->pending) == 0)
+			co_monitor_block_complete(vector->monitor, vector->dev, &vector->msg.message);
+		return;
+	}
+
+	co_monitor_block_complete(context->monitor, context->dev, &context->msg.message);
+}
+
+static void init_block_message(block_message_t *msg, int unit, co_block_request_t *request)
+{
+	msg->message.from = CO_MODULE_COBD0 + unit;
+	msg->message.to = CO_MODULE_LINUX;
+	msg->message.priority = CO_PRIORITY_DISCARDABLE;
+	msg->message.type = CO_MESSAGE_TYPE_OTHER;
+	msg->message.size = sizeof (*msg) - sizeof (msg->message);
+	msg->linux_message.device = CO_DEVICE_BLOCK;
+	msg->linux_message.unit = unit;
+	msg->linux_message.size = sizeof (msg->intr);
+	msg->intr.irq_request = request->irq_request;
+	msg->intr.tag = request->tag;
 }
 
 static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
@@ -134,8 +278,9 @@ static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
 				    vm_ptr_t address,
 				    unsigned long size,
 				    bool_t read,
-				    int unit,
-				    void *irq_request)
+				    co_block_dev_t *dev,
+				    co_block_request_t *request,
+				    vector_context_t *vector)
 {
 	co_rc_t rc;
 	NTSTATUS status;
@@ -147,17 +292,11 @@ static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
 	co_memset(context, 0, sizeof(callback_context_t));
 
 	context->monitor = monitor;
+	context->dev = dev;
+	context->vector = vector;
 	context->offset.QuadPart = offset;
 	context->size = size;
-	context->msg.message.from = CO_MODULE_COBD0 + unit;
-	context->msg.message.to = CO_MODULE_LINUX;
-	context->msg.message.priority = CO_PRIORITY_DISCARDABLE;
-	context->msg.message.type = CO_MESSAGE_TYPE_OTHER;
-	context->msg.message.size = sizeof (context->msg) - sizeof (context->msg.message);
-	context->msg.linux_message.device = CO_DEVICE_BLOCK;
-	context->msg.linux_message.unit = unit;
-	context->msg.linux_message.size = sizeof (context->msg.intr);
-	context->msg.intr.irq_request = irq_request;
+	init_block_message(&context->msg, dev->unit, request);
 
 	// map linux kernal memory into host memory
 	rc = co_monitor_host_linuxvm_transfer_map(
@@ -169,6 +308,9 @@ static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
 		&context->pfn);
 
 	if (CO_OK(rc)) {
+		if (vector)
+			InterlockedIncrement(&vector->pending);
+
 		if (read) {
 			status = ZwReadFile(file_handle,
 				    NULL,
@@ -179,7 +321,7 @@ static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
 				    size,
 				    &context->offset,
 				    NULL);
-			co_debug_lvl(filesystem, 10, "cobd%d read status %X", unit, (int)status);
+			co_debug_lvl(filesystem, 10, "cobd%d read status %X", dev->unit, (int)status);
 		} else {
 			status = ZwWriteFile(file_handle,
 				     NULL,
@@ -190,12 +332,15 @@ static co_rc_t co_os_file_block_async_read_write(co_monitor_t *monitor,
 				     size,
 				     &context->offset,
 				     NULL);
-			co_debug_lvl(filesystem, 10, "cobd%d write status %X", unit, (int)status);
+			co_debug_lvl(filesystem, 10, "cobd%d write status %X", dev->unit, (int)status);
 		}
 
 		if (status == STATUS_PENDING || status == STATUS_SUCCESS)
 			return CO_RC(OK);
 
+		if (vector)
+			InterlockedDecrement(&vector->pending);
+
 		rc = co_status_convert(status);
 		co_debug("block io failed: %p %lx (reason: %x)", context->start, size, (int)status);
 		co_monitor_host_linuxvm_transfer_unmap(monitor, context->page, context->pfn);
@@ -211,8 +356,7 @@ static co_rc_t co_os_file_block_async_read(co_monitor_t *linuxvm, co_block_dev_t
 	request->async = PTRUE;
 	return co_os_file_block_async_read_write(linuxvm, (HANDLE)(fdev->sysdep),
 						request->offset, request->address,
-						request->size, PTRUE, dev->unit,
-						request->irq_request);
+						request->size, PTRUE, dev, request, NULL);
 }
 
 static co_rc_t co_os_file_block_async_write(co_monitor_t *linuxvm, co_block_dev_t *dev,
@@ -221,8 +365,7 @@ static co_rc_t co_os_file_block_async_write(co_monitor_t *linuxvm, co_block_dev_
 	request->async = PTRUE;
 	return co_os_file_block_async_read_write(linuxvm, (HANDLE)(fdev->sysdep),
 						request->offset, request->address,
-						request->size, PFALSE, dev->unit,
-						request->irq_request);
+						request->size, PFALSE, dev, request, NULL);
 }
 
 static co_rc_t co_os_file_block_read(co_monitor_t *linuxvm, co_block_dev_t *dev,
@@ -241,6 +384,114 @@ static co_rc_t co_os_file_block_write(co_monitor_t *linuxvm, co_block_dev_t *dev
 					   request->size, PFALSE);
 }
 
+static co_rc_t co_os_file_block_vector(co_monitor_t *linuxvm, co_monitor_file_block_dev_t *fdev,
+				       co_block_request_t *request, co_block_segment_t *segments,
+				       bool_t read)
+{
+	unsigned long long offset = request->offset;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	for (i = 0; i < request->nr_segments; i++) {
+		rc = co_os_file_block_read_write(linuxvm, (HANDLE)(fdev->sysdep),
+						 offset, segments[i].address,
+						 segments[i].size, read);
+		if (!CO_OK(rc))
+			break;
+
+		offset += segments[i].size;
+	}
+
+	return rc;
+}
+
+/*
+ * An asynchronous vector is issued page by page. 'pending' holds an extra
+ * reference until everything is queued, so the completion can't be posted
+ * early by a fast callback.
+ */
+static co_rc_t co_os_file_block_async_vector(co_monitor_t *linuxvm, co_block_dev_t *dev,
+					     co_monitor_file_block_dev_t *fdev,
+					     co_block_request_t *request, co_block_segment_t *segments,
+					     bool_t read)
+{
+	unsigned long long offset = request->offset;
+	vector_context_t *vector;
+	unsigned long i;
+	co_rc_t rc = CO_RC(OK);
+
+	vector = co_os_malloc(sizeof (vector_context_t));
+	if (!vector)
+		return CO_RC(OUT_OF_MEMORY);
+	co_memset(vector, 0, sizeof(vector_context_t));
+
+	vector->monitor = linuxvm;
+	vector->dev = dev;
+	vector->pending = 1;
+	init_block_message(&vector->msg, dev->unit, request);
+	vector->msg.intr.uptodate = 1;
+
+	for (i = 0; i < request->nr_segments && CO_OK(rc); i++) {
+		vm_ptr_t address = segments[i].address;
+		unsigned long size = segments[i].size;
+
+		while (size > 0) {
+			unsigned long one_copy;
+
+			one_copy = ((address + CO_ARCH_PAGE_SIZE) & CO_ARCH_PAGE_MASK) - address;
+			if (one_copy > size)
+				one_copy = size;
+
+			rc = co_os_file_block_async_read_write(linuxvm, (HANDLE)(fdev->sysdep),
+							       offset, address, one_copy, read,
+							       dev, request, vector);
+			if (!CO_OK(rc)) {
+				vector->msg.intr.uptodate = 0;
+				break;
+			}
+
+			offset += one_copy;
+			address += one_copy;
+			size -= one_copy;
+		}
+	}
+
+	/* Failures are reported through the completion message, the tag too is freed there */
+	request->async = PTRUE;
+	if (InterlockedDecrement(&vector->pending) == 0)
+		co_monitor_block_complete(linuxvm, dev, &vector->msg.message);
+
+	return CO_RC(OK);
+}
+
+static co_rc_t co_os_file_block_async_readv(co_monitor_t *linuxvm, co_block_dev_t *dev,
+			       co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			       co_block_segment_t *segments)
+{
+	return co_os_file_block_async_vector(linuxvm, dev, fdev, request, segments, PTRUE);
+}
+
+static co_rc_t co_os_file_block_async_writev(co_monitor_t *linuxvm, co_block_dev_t *dev,
+			       co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			       co_block_segment_t *segments)
+{
+	return co_os_file_block_async_vector(linuxvm, dev, fdev, request, segments, PFALSE);
+}
+
+static co_rc_t co_os_file_block_readv(co_monitor_t *linuxvm, co_block_dev_t *dev,
+			       co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			       co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(linuxvm, fdev, request, segments, PTRUE);
+}
+
+static co_rc_t co_os_file_block_writev(co_monitor_t *linuxvm, co_block_dev_t *dev,
+			       co_monitor_file_block_dev_t *fdev, co_block_request_t *request,
+			       co_block_segment_t *segments)
+{
+	return co_os_file_block_vector(linuxvm, fdev, request, segments, PFALSE);
+}
+
 static bool_t probe_area(HANDLE handle, LARGE_INTEGER offset, char *test_buffer, unsigned long size)
 {
 	IO_STATUS_BLOCK isb;
@@ -416,15 +667,60 @@ static co_rc_t co_os_file_block_get_size(co_monitor_file_block_dev_t *fdev, unsi
 	return rc;
 }
 
+static unsigned long open_options(co_monitor_file_block_dev_t *fdev)
+{
+	unsigned long options = 0;
+
+	if (fdev->write_through)
+		options |= FILE_WRITE_THROUGH;
+	if (fdev->direct)
+		options |= FILE_NO_INTERMEDIATE_BUFFERING;
+
+	return options;
+}
+
+/*
+ * Unbuffered transfers must be aligned to the sectors of the host disk,
+ * and Linux only aligns to 512 bytes. On disks with larger sectors the
+ * device keeps using the file cache.
+ */
+static bool_t direct_possible(co_monitor_file_block_dev_t *fdev)
+{
+	FILE_FS_FULL_SIZE_INFORMATION fsi;
+	IO_STATUS_BLOCK isb;
+	NTSTATUS status;
+
+	status = ZwQueryVolumeInformationFile((HANDLE)(fdev->sysdep), &isb, &fsi,
+					      sizeof(fsi), FileFsFullSizeInformation);
+	if (!NT_SUCCESS(status) || fsi.BytesPerSector <= 512)
+		return PTRUE;
+
+	co_debug_error("cobd%d: %lu byte sectors, using the host cache",
+		       fdev->dev.unit, fsi.BytesPerSector);
+	co_os_file_close((HANDLE)(fdev->sysdep));
+	fdev->sysdep = NULL;
+	fdev->direct = PFALSE;
+
+	return PFALSE;
+}
+
 static co_rc_t co_os_file_block_open(co_monitor_t *linuxvm, co_monitor_file_block_dev_t *fdev)
 {
 	HANDLE *FileHandle = (HANDLE *)&fdev->sysdep;
 	co_rc_t rc;
 
+	if (fdev->read_only)
+		return co_os_file_open(fdev->pathname, FileHandle, FILE_READ_DATA);
+
 	/* Sync open */
-	rc = co_os_file_open(fdev->pathname, FileHandle, FILE_READ_DATA | FILE_WRITE_DATA);
-	if (CO_OK(rc))
+	rc = co_os_file_create(fdev->pathname, FileHandle,
+			       FILE_READ_DATA | FILE_WRITE_DATA | SYNCHRONIZE, 0, FILE_OPEN,
+			       FILE_SYNCHRONOUS_IO_NONALERT | open_options(fdev));
+	if (CO_OK(rc)) {
+		if (fdev->direct && !direct_possible(fdev))
+			return co_os_file_block_open(linuxvm, fdev);
 		return CO_RC(OK);
+	}
 
 	if (CO_RC_GET_CODE(rc) == CO_RC_ACCESS_DENIED) {
 		co_rc_t rc2;
@@ -443,9 +739,13 @@ static co_rc_t co_os_file_block_async_open(co_monitor_t *linuxvm, co_monitor_fil
 	co_rc_t rc;
 
 	/* Async open */
-	rc = co_os_file_create(fdev->pathname, FileHandle, FILE_READ_DATA | FILE_WRITE_DATA, 0, FILE_OPEN, 0);
-	if (CO_OK(rc))
+	rc = co_os_file_create(fdev->pathname, FileHandle, FILE_READ_DATA | FILE_WRITE_DATA, 0, FILE_OPEN,
+			       open_options(fdev));
+	if (CO_OK(rc)) {
+		if (fdev->direct && !direct_possible(fdev))
+			return co_os_file_block_async_open(linuxvm, fdev);
 		return CO_RC(OK);
+	}
 
 	if (CO_RC_GET_CODE(rc) == CO_RC_ACCESS_DENIED) {
 		co_rc_t rc2;
@@ -477,6 +777,10 @@ co_monitor_file_block_operations_t co_os_file_block_async_operations = {
 	.read = co_os_file_block_async_read,
 	.write = co_os_file_block_async_write,
 	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_async_readv,
+	.writev = co_os_file_block_async_writev,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
 };
 
 co_monitor_file_block_operations_t co_os_file_block_default_operations = {
@@ -485,4 +789,78 @@ co_monitor_file_block_operations_t co_os_file_block_default_operations = {
 	.read = co_os_file_block_read,
 	.write = co_os_file_block_write,
 	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_readv,
+	.writev = co_os_file_block_writev,
+	.host_read_write = co_os_file_block_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
+};
+
+/*
+ * Reads and writes of cached handles are already copies from and to the
+ * views of the file the cache manager keeps mapped (fast I/O), so mapped
+ * devices use the synchronous operations.
+ */
+co_monitor_file_block_operations_t co_os_file_block_mapped_operations = {
+	.open = co_os_file_block_open,
+	.close = co_os_file_block_close,
+	.read = co_os_file_block_read,
+	.write = co_os_file_block_write,
+	.get_size = co_os_file_block_get_size,
+	.readv = co_os_file_block_readv,
+	.writev = co_os_file_block_writev,
+	.host_read_write = co_os_file_block_host_read_write,
+	.discard = co_os_file_block_discard,
+	.flush = co_os_file_block_flush,
 };
+
+/*
+ * The driver has no socket interface of its own (TDI would be needed on
+ * the hosts coLinux supports), so NBD exports can't be opened yet. The
+ * client of kernel/nbdblock.c never gets past co_os_nbd_connect().
+ */
+co_rc_t co_os_nbd_connect(co_nbd_uri_t *uri, co_os_nbd_t *nbd_out)
+{
+	co_debug_error("nbd: NBD exports are not supported on this host");
+	return CO_RC(ERROR);
+}
+
+void co_os_nbd_close(co_os_nbd_t nbd)
+{
+}
+
+co_rc_t co_os_nbd_send(void *conn, void *buffer, unsigned long size)
+{
+	return CO_RC(BROKEN_PIPE);
+}
+
+co_rc_t co_os_nbd_recv(void *conn, void *buffer, unsigned long size)
+{
+	return CO_RC(BROKEN_PIPE);
+}
+
+void co_os_nbd_shutdown(co_os_nbd_t nbd)
+{
+}
+
+co_rc_t co_os_nbd_receiver_start(co_os_nbd_t nbd, void (*func)(void *data),
+				 void *data, int unit)
+{
+	return CO_RC(ERROR);
+}
+
+void co_os_nbd_receiver_stop(co_os_nbd_t nbd)
+{
+}
+
+void co_os_nbd_control_reset(co_os_nbd_t nbd)
+{
+}
+
+void co_os_nbd_control_wait(co_os_nbd_t nbd)
+{
+}
+
+void co_os_nbd_control_done(co_os_nbd_t nbd)
+{
+}
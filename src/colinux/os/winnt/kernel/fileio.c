@@ -70,9 +70,9 @@ co_rc_t co_status_convert(NTSTATUS status)
 	}
 }
 
-co_rc_t co_os_file_create(char *pathname, PHANDLE FileHandle, unsigned long open_flags,
-			  unsigned long file_attribute, unsigned long create_disposition,
-			  unsigned long options)
+static co_rc_t file_create_shared(char *pathname, PHANDLE FileHandle, unsigned long open_flags,
+				  unsigned long file_attribute, unsigned long create_disposition,
+				  unsigned long options, unsigned long share_access)
 {
 	NTSTATUS status;
 	OBJECT_ATTRIBUTES ObjectAttributes;
@@ -96,8 +96,7 @@ co_rc_t co_os_file_create(char *pathname, PHANDLE FileHandle, unsigned long open
 			      &IoStatusBlock,
 			      NULL,
 			      file_attribute,
-			      (open_flags == (FILE_LIST_DIRECTORY | SYNCHRONIZE)) ?
-				 FILE_SHARE_DIRECTORY : 0,
+			      share_access,
 			      create_disposition,
 			      options,
 			      NULL,
@@ -111,6 +110,18 @@ co_rc_t co_os_file_create(char *pathname, PHANDLE FileHandle, unsigned long open
 	return co_status_convert(status);
 }
 
+co_rc_t co_os_file_create(char *pathname, PHANDLE FileHandle, unsigned long open_flags,
+			  unsigned long file_attribute, unsigned long create_disposition,
+			  unsigned long options)
+{
+	return file_create_shared(pathname, FileHandle, open_flags, file_attribute,
+				  create_disposition, options,
+				  (open_flags == (FILE_LIST_DIRECTORY | SYNCHRONIZE)) ?
+				     FILE_SHARE_DIRECTORY :
+				  (open_flags & (FILE_WRITE_DATA | FILE_APPEND_DATA)) ?
+				     0 : FILE_SHARE_READ);
+}
+
 co_rc_t co_os_file_open(char *pathname, PHANDLE FileHandle, unsigned long open_flags)
 {
 	return co_os_file_create(pathname, FileHandle, open_flags | SYNCHRONIZE, 0, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT);
@@ -177,27 +188,42 @@ co_rc_t co_os_set_file_information(char *filename,
 	return co_status_convert(status);
 }
 
-co_rc_t co_os_file_read_write(co_monitor_t *linuxvm, char *filename,
-			      unsigned long long offset, unsigned long size,
-			      vm_ptr_t src_buffer, bool_t read)
+/*
+ * Handles of the cofs cache stay open between requests. They share
+ * everything, so only openers that deny sharing themselves are kept
+ * out of the file meanwhile.
+ */
+co_rc_t co_os_file_handle_open(char *filename, bool_t write, void **handle)
 {
+	HANDLE file_handle;
 	co_rc_t rc;
-	HANDLE handle;
 
-	rc = co_os_file_open(filename, &handle, read ? FILE_READ_DATA : FILE_WRITE_DATA);
+	rc = file_create_shared(filename, &file_handle,
+				FILE_READ_DATA | (write ? FILE_WRITE_DATA : 0) | SYNCHRONIZE,
+				0, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE);
 	if (!CO_OK(rc))
 		return rc;
 
-	rc = co_os_file_block_read_write(linuxvm,
-					 handle,
-					 offset,
-					 src_buffer,
-					 size,
-					 read);
+	*handle = (void *)file_handle;
+	return CO_RC(OK);
+}
 
-	co_os_file_close(handle);
+void co_os_file_handle_close(void *handle)
+{
+	co_os_file_close((HANDLE)handle);
+}
 
-	return rc;
+co_rc_t co_os_file_handle_read_write(co_monitor_t *linuxvm, void *handle,
+				     unsigned long long offset, unsigned long size,
+				     vm_ptr_t src_buffer, bool_t read)
+{
+	return co_os_file_block_read_write(linuxvm,
+					   (HANDLE)handle,
+					   offset,
+					   src_buffer,
+					   size,
+					   read);
 }
 
 static void change_file_mode_func(void *data, VOID *buffer, ULONG len)
@@ -281,6 +307,36 @@ co_rc_t co_os_file_set_attr(char *filename, unsigned long valid, struct fuse_att
 	return rc;
 }
 
+#define FUSE_S_IR (FUSE_S_IRUSR | FUSE_S_IRGRP | FUSE_S_IROTH)
+#define FUSE_S_IW (FUSE_S_IWUSR | FUSE_S_IWGRP | FUSE_S_IWOTH)
+#define FUSE_S_IX (FUSE_S_IXUSR | FUSE_S_IXGRP | FUSE_S_IXOTH)
+
+static void file_info_to_attr(LARGE_INTEGER LastAccessTime,
+			      LARGE_INTEGER LastWriteTime,
+			      LARGE_INTEGER ChangeTime,
+			      LARGE_INTEGER EndOfFile,
+			      ULONG FileAttributes,
+			      struct fuse_attr *attr)
+{
+	attr->atime = windows_time_to_unix_time(LastAccessTime);
+	attr->mtime = windows_time_to_unix_time(LastWriteTime);
+	attr->ctime = windows_time_to_unix_time(ChangeTime);
+
+	if (FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		attr->mode = FUSE_S_IFDIR
+			   | ((FileAttributes & FILE_ATTRIBUTE_HIDDEN)   ? 0 : FUSE_S_IR)
+			   | ((FileAttributes & FILE_ATTRIBUTE_READONLY) ? 0 : FUSE_S_IW)
+			   | ((FileAttributes & FILE_ATTRIBUTE_SYSTEM)   ? 0 : FUSE_S_IX);
+	else
+		attr->mode = FUSE_S_IFREG
+			   | ((FileAttributes & FILE_ATTRIBUTE_HIDDEN)   ? 0 : FUSE_S_IR)
+			   | ((FileAttributes & FILE_ATTRIBUTE_READONLY) ? 0 : FUSE_S_IW)
+			   | ((FileAttributes & FILE_ATTRIBUTE_SYSTEM)   ? FUSE_S_IX : 0);
+
+	attr->size = EndOfFile.QuadPart;
+	attr->blocks = (EndOfFile.QuadPart + ((1<<10)-1)) >> 10;
+}
+
 co_rc_t co_os_file_get_attr(char *fullname, struct fuse_attr *attr)
 {
 	char * dirname;
@@ -407,27 +463,8 @@ co_rc_t co_os_file_get_attr(char *fullname, struct fuse_attr *attr)
 		FileAttributes = entry_buffer.entry.FileAttributes;
 	}
 
-	attr->atime = windows_time_to_unix_time(LastAccessTime);
-	attr->mtime = windows_time_to_unix_time(LastWriteTime);
-	attr->ctime = windows_time_to_unix_time(ChangeTime);
-
-	#define FUSE_S_IR (FUSE_S_IRUSR | FUSE_S_IRGRP | FUSE_S_IROTH)
-	#define FUSE_S_IW (FUSE_S_IWUSR | FUSE_S_IWGRP | FUSE_S_IWOTH)
-	#define FUSE_S_IX (FUSE_S_IXUSR | FUSE_S_IXGRP | FUSE_S_IXOTH)
-
-	if (FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-		attr->mode = FUSE_S_IFDIR
-			   | ((FileAttributes & FILE_ATTRIBUTE_HIDDEN)   ? 0 : FUSE_S_IR)
-			   | ((FileAttributes & FILE_ATTRIBUTE_READONLY) ? 0 : FUSE_S_IW)
-			   | ((FileAttributes & FILE_ATTRIBUTE_SYSTEM)   ? 0 : FUSE_S_IX);
-	else
-		attr->mode = FUSE_S_IFREG
-			   | ((FileAttributes & FILE_ATTRIBUTE_HIDDEN)   ? 0 : FUSE_S_IR)
-			   | ((FileAttributes & FILE_ATTRIBUTE_READONLY) ? 0 : FUSE_S_IW)
-			   | ((FileAttributes & FILE_ATTRIBUTE_SYSTEM)   ? FUSE_S_IX : 0);
-
-	attr->size = EndOfFile.QuadPart;
-	attr->blocks = (EndOfFile.QuadPart + ((1<<10)-1)) >> 10;
+	file_info_to_attr(LastAccessTime, LastWriteTime, ChangeTime,
+			  EndOfFile, FileAttributes, attr);
 
 	rc = CO_RC(OK);
 
@@ -684,6 +721,14 @@ co_rc_t co_os_file_getdir(char *dirname, co_filesystem_dir_names_t *names)
 			else
 				new_name->type = FUSE_DT_REG;
 
+			/* The listing has all there is, spares a query per name */
+			co_memset(&new_name->attr, 0, sizeof(new_name->attr));
+			new_name->attr.nlink = 1;
+			file_info_to_attr(entry->LastAccessTime, entry->LastWriteTime,
+					  entry->ChangeTime, entry->EndOfFile,
+					  entry->FileAttributes, &new_name->attr);
+			new_name->has_attr = PTRUE;
+
 			rc = co_utf8_wcstombs(new_name->name, entry->FileName, filename_utf8_length + 1);
 			if (!CO_OK(rc)) {
 				co_os_free(new_name);
@@ -12,6 +12,7 @@
 #define __CO_WINNT_KERNEL_FILEIO_H__
 
 #include <colinux/kernel/monitor.h>
+#include <colinux/kernel/filesystem.h>
 
 #include "ddk.h"
 
@@ -37,4 +38,24 @@ extern co_rc_t co_os_file_block_read_write(co_monitor_t *monitor,
 
 extern co_rc_t co_os_file_close(PHANDLE FileHandle);
 
+/*
+ * Host pathnames of cofs inodes, and the operations on them that
+ * back the co_os_fs_* calls.
+ */
+extern co_rc_t co_os_fs_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
+				      char **out_name, int need_len);
+extern int co_os_fs_add_last_component(co_pathname_t *dirname);
+extern co_rc_t co_os_fs_dir_inode_to_path(co_filesystem_t *fs, co_inode_t *dir,
+					  char **out_name, char *name);
+
+extern co_rc_t co_os_file_handle_open(char *filename, bool_t write, void **handle);
+extern co_rc_t co_os_file_set_attr(char *filename, unsigned long valid, struct fuse_attr *attr);
+extern co_rc_t co_os_file_get_attr(char *filename, struct fuse_attr *attr);
+extern co_rc_t co_os_file_unlink(char *filename);
+extern co_rc_t co_os_file_rmdir(char *filename);
+extern co_rc_t co_os_file_mkdir(char *dirname);
+extern co_rc_t co_os_file_rename(char *filename, char *dest_filename);
+extern co_rc_t co_os_file_mknod(co_filesystem_t *filesystem, char *filename, unsigned long mode);
+extern co_rc_t co_os_file_getdir(char *dirname, co_filesystem_dir_names_t *names);
+
 #endif
@@ -3,6 +3,8 @@
 #include <colinux/os/alloc.h>
 #include <colinux/os/kernel/filesystem.h>
 
+#include "fileio.h"
+
 co_rc_t co_os_fs_inode_to_path(co_filesystem_t *fs, co_inode_t *dir, char **out_name, int add)
 {
 	co_inode_t *dir_scan = dir;
@@ -107,3 +109,510 @@ co_rc_t co_os_fs_dir_join_unix_path(co_pathname_t *dirname, const char *addition
 
 	return CO_RC(OK);
 }
+
+/*
+ * Windows has no use for handles on directories, every call builds
+ * the full pathname from the inode up.
+ */
+co_rc_t co_os_fs_get_attr(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			  struct fuse_attr *attr)
+{
+	char *filename;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &filename, name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_get_attr(filename, attr);
+	co_os_free(filename);
+
+	return rc;
+}
+
+/* The pathname of the directory, the names are appended to a copy */
+co_rc_t co_os_fs_dir_hold(co_filesystem_t *fs, co_inode_t *dir, void **ref)
+{
+	return co_os_fs_inode_to_path(fs, dir, (char **)ref, 0);
+}
+
+co_rc_t co_os_fs_dir_get_attr(void *ref, char *name, struct fuse_attr *attr)
+{
+	char *dirname = ref, *filename;
+	int len, name_len;
+	co_rc_t rc;
+
+	if (!*name)
+		return co_os_file_get_attr(dirname, attr);
+
+	len = co_strlen(dirname);
+	name_len = co_strlen(name);
+	filename = co_os_malloc(len + name_len + 2);
+	if (!filename)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memcpy(filename, dirname, len);
+	if (len > 0  &&  dirname[len-1] != '\\')
+		filename[len++] = '\\';
+	co_memcpy(&filename[len], name, name_len + 1);
+
+	rc = co_os_file_get_attr(filename, attr);
+	co_os_free(filename);
+
+	return rc;
+}
+
+void co_os_fs_dir_unhold(void *ref)
+{
+	co_os_free(ref);
+}
+
+co_rc_t co_os_fs_set_attr(co_filesystem_t *fs, co_inode_t *inode, unsigned long valid,
+			  struct fuse_attr *attr)
+{
+	char *filename;
+	co_rc_t rc;
+
+	rc = co_os_fs_inode_to_path(fs, inode, &filename, 0);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_set_attr(filename, valid, attr);
+	co_os_free(filename);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_getdir(co_filesystem_t *fs, co_inode_t *dir,
+			co_filesystem_dir_names_t *names)
+{
+	char *dirname;
+	co_rc_t rc;
+
+	rc = co_os_fs_inode_to_path(fs, dir, &dirname, 1);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_getdir(dirname, names);
+	co_os_free(dirname);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_mknod(co_filesystem_t *fs, co_inode_t *dir, char *name,
+		       unsigned long mode)
+{
+	char *filename;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &filename, name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_mknod(fs, filename, mode);
+	co_os_free(filename);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_mkdir(co_filesystem_t *fs, co_inode_t *dir, char *name,
+		       unsigned long mode)
+{
+	char *dirname;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &dirname, name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_mkdir(dirname);
+	co_os_free(dirname);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_unlink(co_filesystem_t *fs, co_inode_t *dir, char *name)
+{
+	char *filename;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &filename, name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_unlink(filename);
+	co_os_free(filename);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_rmdir(co_filesystem_t *fs, co_inode_t *dir, char *name)
+{
+	char *dirname;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &dirname, name);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_rmdir(dirname);
+	co_os_free(dirname);
+
+	return rc;
+}
+
+co_rc_t co_os_fs_rename(co_filesystem_t *fs, co_inode_t *dir, char *name,
+			co_inode_t *new_dir, char *new_name)
+{
+	char *old_dirname = NULL, *new_dirname = NULL;
+	co_rc_t rc;
+
+	rc = co_os_fs_dir_inode_to_path(fs, dir, &old_dirname, name);
+	if (CO_OK(rc)) {
+		rc = co_os_fs_dir_inode_to_path(fs, new_dir, &new_dirname, new_name);
+		if (CO_OK(rc)) {
+			rc = co_os_file_rename(old_dirname, new_dirname);
+			co_os_free(new_dirname);
+		}
+		co_os_free(old_dirname);
+	}
+
+	return rc;
+}
+
+co_rc_t co_os_fs_open(co_filesystem_t *fs, co_inode_t *inode, bool_t write, void **handle)
+{
+	char *filename;
+	co_rc_t rc;
+
+	rc = co_os_fs_inode_to_path(fs, inode, &filename, 0);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_os_file_handle_open(filename, write, handle);
+	co_os_free(filename);
+
+	return rc;
+}
+
+void co_os_fs_inode_release(co_filesystem_t *fs, co_inode_t *inode)
+{
+}
+
+/*
+ * A watched directory has a handle of its own, with a change notification
+ * pending on it. Its APC comes on the thread that asked for it, the
+ * monitor's or the worker's, and asks for the next one. Once the watch
+ * is dropped it only frees the context.
+ */
+typedef struct {
+	HANDLE handle;
+	IO_STATUS_BLOCK isb;
+	co_filesystem_t *fs;
+	co_fs_watch_t *watch;		/* NULL once dropped */
+	bool_t pending;
+	ULONG buffer[16];		/* the names that changed are not used */
+} watch_context_t;
+
+#define WATCH_FILTER	(FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | \
+			 FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | \
+			 FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION)
+
+static void CALLBACK watch_callback(watch_context_t *context, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved);
+
+static NTSTATUS watch_arm(watch_context_t *context)
+{
+	NTSTATUS status;
+
+	status = ZwNotifyChangeDirectoryFile(context->handle, NULL,
+					     (PIO_APC_ROUTINE) watch_callback, context,
+					     &context->isb, context->buffer, sizeof(context->buffer),
+					     WATCH_FILTER, FALSE);
+	context->pending = NT_SUCCESS(status);
+
+	return status;
+}
+
+static void CALLBACK watch_callback(watch_context_t *context, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved)
+{
+	co_filesystem_t *fs = context->fs;
+	NTSTATUS status = IoStatusBlock->Status;
+
+	/* co_os_fs_unwatch() may run on the other thread, the mutex keeps it out */
+	co_os_mutex_acquire(fs->watch_mutex);
+	context->pending = PFALSE;
+	if (!context->watch) {
+		co_os_mutex_release(fs->watch_mutex);
+		co_os_free(context);
+		return;
+	}
+
+	/* STATUS_NOTIFY_ENUM_DIR, too many changes for the buffer, is one too */
+	if (NT_SUCCESS(status))
+		status = watch_arm(context);
+	if (!NT_SUCCESS(status))
+		co_debug_lvl(filesystem, 5, "watch of dir %d ends, status %x",
+			     context->watch->number, (int)status);
+	co_monitor_file_system_changed(fs, context->watch, !NT_SUCCESS(status));
+	co_os_mutex_release(fs->watch_mutex);
+}
+
+co_rc_t co_os_fs_watch(co_filesystem_t *fs, co_fs_watch_t *watch)
+{
+	watch_context_t *context;
+	NTSTATUS status;
+	char *dirname;
+	co_rc_t rc;
+
+	context = co_os_malloc(sizeof(*context));
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(context, 0, sizeof(*context));
+	context->fs = fs;
+	context->watch = watch;
+
+	rc = co_os_fs_inode_to_path(fs, watch->dir, &dirname, 0);
+	if (!CO_OK(rc))
+		goto out_free;
+
+	/* Not synchronous, the notification completes with an APC */
+	rc = co_os_file_create(dirname, &context->handle, FILE_LIST_DIRECTORY | SYNCHRONIZE,
+			       0, FILE_OPEN, FILE_DIRECTORY_FILE);
+	co_os_free(dirname);
+	if (!CO_OK(rc))
+		goto out_free;
+
+	co_os_mutex_acquire(fs->watch_mutex);
+	status = watch_arm(context);
+	co_os_mutex_release(fs->watch_mutex);
+
+	if (!NT_SUCCESS(status)) {
+		ZwClose(context->handle);
+		rc = co_status_convert(status);
+		goto out_free;
+	}
+
+	watch->sysdep = context;
+	return CO_RC(OK);
+
+out_free:
+	co_os_free(context);
+	return rc;
+}
+
+void co_os_fs_unwatch(co_filesystem_t *fs, co_fs_watch_t *watch)
+{
+	watch_context_t *context = watch->sysdep;
+
+	/*
+	 * The APC comes on the thread that armed the watch, the monitor's or
+	 * the worker's. On this one the mutex holds it off, on the other one
+	 * it takes the mutex before it looks at the context. Whoever comes
+	 * last frees it.
+	 */
+	co_os_mutex_acquire(fs->watch_mutex);
+	context->watch = NULL;
+	ZwClose(context->handle);
+	if (!context->pending)
+		co_os_free(context);
+	co_os_mutex_release(fs->watch_mutex);
+
+	watch->sysdep = NULL;
+}
+
+/*
+ * The meta data store is a section of the file, mapped like the handles
+ * into the daemon's process, where all cofs requests come from. Changes
+ * of the view are the file's pages already, nothing to report per
+ * change.
+ */
+typedef struct {
+	HANDLE handle;
+	HANDLE section;
+	PVOID base;
+	SIZE_T size;
+} meta_context_t;
+
+co_rc_t co_os_fs_meta_map(co_filesystem_t *fs, char *pathname, unsigned long *size, void **map)
+{
+	FILE_STANDARD_INFORMATION info;
+	LARGE_INTEGER maximum;
+	IO_STATUS_BLOCK isb;
+	meta_context_t *context;
+	NTSTATUS status;
+	co_rc_t rc;
+
+	context = co_os_malloc(sizeof(*context));
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+
+	co_memset(context, 0, sizeof(*context));
+
+	rc = co_os_file_create(pathname, &context->handle,
+			       FILE_READ_DATA | FILE_WRITE_DATA | SYNCHRONIZE, FILE_ATTRIBUTE_HIDDEN,
+			       FILE_OPEN_IF, FILE_SYNCHRONOUS_IO_NONALERT);
+	if (!CO_OK(rc))
+		goto out_free;
+
+	status = ZwQueryInformationFile(context->handle, &isb, &info, sizeof(info),
+					FileStandardInformation);
+	if (!NT_SUCCESS(status))
+		goto out_close;
+
+	/* The section extends the file, with zeros */
+	maximum.QuadPart = *size;
+	if (info.EndOfFile.QuadPart > maximum.QuadPart)
+		maximum = info.EndOfFile;
+
+	if (maximum.QuadPart > CO_FS_META_MAX_SIZE) {
+		status = STATUS_INVALID_PARAMETER;
+		goto out_close;
+	}
+
+	status = ZwCreateSection(&context->section, SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+				 NULL, &maximum, PAGE_READWRITE, SEC_COMMIT, context->handle);
+	if (!NT_SUCCESS(status))
+		goto out_close;
+
+	status = ZwMapViewOfSection(context->section, NtCurrentProcess(), &context->base, 0, 0,
+				    NULL, &context->size, ViewUnmap, 0, PAGE_READWRITE);
+	if (!NT_SUCCESS(status)) {
+		ZwClose(context->section);
+		goto out_close;
+	}
+
+	fs->meta.sysdep = context;
+	*size = maximum.LowPart;
+	*map = context->base;
+	return CO_RC(OK);
+
+out_close:
+	co_debug_lvl(filesystem, 5, "error %x mapping '%s'", (int)status, pathname);
+	ZwClose(context->handle);
+	rc = co_status_convert(status);
+out_free:
+	co_os_free(context);
+	return rc;
+}
+
+void co_os_fs_meta_dirty(co_filesystem_t *fs, unsigned long offset, unsigned long size)
+{
+}
+
+co_rc_t co_os_fs_meta_flush(co_filesystem_t *fs)
+{
+	meta_context_t *context = fs->meta.sysdep;
+	IO_STATUS_BLOCK isb;
+	PVOID base = context->base;
+	SIZE_T size = context->size;
+	NTSTATUS status;
+
+	status = ZwFlushVirtualMemory(NtCurrentProcess(), &base, &size, &isb);
+	if (NT_SUCCESS(status))
+		status = ZwFlushBuffersFile(context->handle, &isb);
+
+	return co_status_convert(status);
+}
+
+void co_os_fs_meta_unmap(co_filesystem_t *fs)
+{
+	meta_context_t *context = fs->meta.sysdep;
+
+	ZwUnmapViewOfSection(NtCurrentProcess(), context->base);
+	ZwClose(context->section);
+	ZwClose(context->handle);
+	co_os_free(context);
+
+	fs->meta.sysdep = NULL;
+}
+
+/*
+ * The worker of an asynchronous device is a system thread in the daemon's
+ * process, where the host files and the meta data store are open. The
+ * semaphore counts the queued jobs.
+ */
+typedef struct {
+	HANDLE thread;
+	KSPIN_LOCK lock;
+	KSEMAPHORE semaphore;
+	co_list_t queue;
+} async_context_t;
+
+static VOID async_thread(PVOID arg)
+{
+	co_filesystem_t *fs = arg;
+	async_context_t *context = fs->async_sysdep;
+	co_fs_job_t *job;
+	KIRQL irql;
+
+	for (;;) {
+		KeWaitForSingleObject(&context->semaphore, Executive, KernelMode, FALSE, NULL);
+
+		KeAcquireSpinLock(&context->lock, &irql);
+		if (co_list_empty(&context->queue)) {
+			/* Queue drained, the count was co_os_fs_async_stop()'s */
+			KeReleaseSpinLock(&context->lock, irql);
+			break;
+		}
+		co_list_entry_assign(context->queue.next, job, node);
+		co_list_del(&job->node);
+		KeReleaseSpinLock(&context->lock, irql);
+
+		co_monitor_file_system_job(fs, job);
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+co_rc_t co_os_fs_async_start(co_filesystem_t *fs)
+{
+	async_context_t *context;
+	OBJECT_ATTRIBUTES attr;
+	NTSTATUS status;
+
+	context = co_os_malloc(sizeof(*context));
+	if (!context)
+		return CO_RC(OUT_OF_MEMORY);
+
+	KeInitializeSpinLock(&context->lock);
+	KeInitializeSemaphore(&context->semaphore, 0, MAXLONG);
+	co_list_init(&context->queue);
+	fs->async_sysdep = context;
+
+	InitializeObjectAttributes(&attr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = PsCreateSystemThread(&context->thread, THREAD_ALL_ACCESS, &attr,
+				      NtCurrentProcess(), NULL, async_thread, fs);
+	if (!NT_SUCCESS(status)) {
+		co_os_free(context);
+		fs->async_sysdep = NULL;
+		return co_status_convert(status);
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_os_fs_queue(co_filesystem_t *fs, co_fs_job_t *job)
+{
+	async_context_t *context = fs->async_sysdep;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&context->lock, &irql);
+	co_list_add_tail(&job->node, &context->queue);
+	KeReleaseSpinLock(&context->lock, irql);
+	KeReleaseSemaphore(&context->semaphore, 0, 1, FALSE);
+
+	return CO_RC(OK);
+}
+
+void co_os_fs_async_stop(co_filesystem_t *fs)
+{
+	async_context_t *context = fs->async_sysdep;
+
+	/* One count more than there are jobs, the thread runs them first */
+	KeReleaseSemaphore(&context->semaphore, 0, 1, FALSE);
+	ZwWaitForSingleObject(context->thread, FALSE, NULL);
+	ZwClose(context->thread);
+	co_os_free(context);
+	fs->async_sysdep = NULL;
+}
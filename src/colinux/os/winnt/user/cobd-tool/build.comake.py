@@ -0,0 +1,5 @@
+targets['build.o'] = Target(
+    inputs=[
+    Input('main.o'),
+    ],
+)
@@ -0,0 +1,24 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#include <colinux/user/daemon.h>
+#include <colinux/user/cobd-tool/main.h>
+
+COLINUX_DEFINE_MODULE("colinux-cobd-tool");
+
+int main(int argc, char *argv[])
+{
+	co_rc_t rc;
+
+	rc = co_cobd_tool_main(argc, argv);
+
+	if (!CO_OK(rc))
+		return -1;
+
+	return 0;
+}
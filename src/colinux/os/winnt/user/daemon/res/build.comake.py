@@ -105,6 +105,20 @@ targets['colinux-serial.res'] = Target(
     )
 )
 
+targets['colinux-cobd-tool.res'] = Target(
+    tool = Script(script_cmdline),
+    inputs = [
+       Input('colinux.rc'),
+       Input('resources_def.inc'),
+    ],
+    options = Options(
+        appenders = dict(
+            exe_name_option = "-cobd-tool",
+            text_name_option = " Block device tool",
+        )
+    )
+)
+
 targets['colinux-fltk.res'] = Target(
     tool = Script(script_cmdline),
     inputs = [
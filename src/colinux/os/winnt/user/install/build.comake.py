@@ -16,6 +16,7 @@ targets['coLinux.exe'] = Target(
        Input('premaid/colinux-console-fltk.exe'),
        Input('premaid/colinux-console-nt.exe'),
        Input('premaid/colinux-daemon.exe'),
+       Input('premaid/colinux-cobd-tool.exe'),
        Input('premaid/colinux-net-daemon.exe'),
        Input('premaid/colinux-slirp-net-daemon.exe'),
        Input('premaid/linux.sys'),
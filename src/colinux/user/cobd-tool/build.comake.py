@@ -0,0 +1,3 @@
+targets['build.o'] = Target(
+    inputs=input_list(".c", ".o"),
+)
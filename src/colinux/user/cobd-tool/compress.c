@@ -0,0 +1,194 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <colinux/common/common.h>
+#include <colinux/common/lz4.h>
+#include <colinux/common/zblock.h>
+
+#include "main.h"
+
+/*
+ * Write a compressed image (common/zblock.h) of a raw one. The input is
+ * read sequentially, so it can also be a pipe.
+ */
+
+static co_rc_t write_all(FILE *file, const void *buffer, unsigned long size)
+{
+	if (fwrite(buffer, 1, size, file) != size) {
+		perror("write");
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t compress_image(FILE *in, FILE *out, unsigned long chunk_shift)
+{
+	unsigned long chunk_size = 1UL << chunk_shift;
+	unsigned long long *index = NULL;
+	unsigned long index_entries = 0;
+	unsigned char *input, *output;
+	co_zblock_header_t header;
+	unsigned long size, stored;
+	unsigned long long offset;
+	void *work;
+	co_rc_t rc;
+
+	input = malloc(chunk_size);
+	output = malloc(chunk_size);
+	work = malloc(CO_LZ4_WORK_SIZE);
+	if (!input || !output || !work) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CO_ZBLOCK_MAGIC;
+	header.version = CO_ZBLOCK_VERSION;
+	header.method = CO_ZBLOCK_METHOD_LZ4;
+	header.chunk_shift = chunk_shift;
+
+	/* The header is rewritten at the end */
+	rc = write_all(out, &header, sizeof(header));
+	if (!CO_OK(rc))
+		goto out;
+	offset = sizeof(header);
+
+	while ((size = fread(input, 1, chunk_size, in)) > 0) {
+		if (header.chunks + 2 > index_entries) {
+			unsigned long long *bigger;
+
+			index_entries = index_entries ? index_entries * 2 : 1024;
+			bigger = realloc(index, index_entries * sizeof(*index));
+			if (!bigger) {
+				rc = CO_RC(OUT_OF_MEMORY);
+				goto out;
+			}
+			index = bigger;
+		}
+
+		index[header.chunks++] = offset;
+
+		/* Only smaller chunks are stored compressed */
+		stored = co_lz4_compress(input, size, output, size - 1, work);
+		if (stored)
+			rc = write_all(out, output, stored);
+		else {
+			stored = size;
+			rc = write_all(out, input, size);
+		}
+		if (!CO_OK(rc))
+			goto out;
+
+		offset += stored;
+		header.size += size;
+
+		if (size < chunk_size)
+			break;
+	}
+
+	if (ferror(in)) {
+		perror("read");
+		rc = CO_RC(ERROR);
+		goto out;
+	}
+
+	if (header.chunks == 0) {
+		fprintf(stderr, "empty image\n");
+		rc = CO_RC(INVALID_PARAMETER);
+		goto out;
+	}
+
+	index[header.chunks] = offset;
+	header.index_offset = offset;
+
+	rc = write_all(out, index, (header.chunks + 1) * sizeof(*index));
+	if (!CO_OK(rc))
+		goto out;
+
+	if (fseek(out, 0, SEEK_SET) != 0) {
+		perror("seek");
+		rc = CO_RC(ERROR);
+		goto out;
+	}
+
+	rc = write_all(out, &header, sizeof(header));
+	if (!CO_OK(rc))
+		goto out;
+
+	printf("%llu bytes in %lu chunks, compressed to %llu bytes (%llu%%)\n",
+	       header.size, header.chunks, offset,
+	       offset * 100 / header.size);
+
+out:
+	free(index);
+	free(work);
+	free(output);
+	free(input);
+	return rc;
+}
+
+co_rc_t co_cobd_tool_compress(int argc, char *argv[])
+{
+	unsigned long chunk_shift = CO_ZBLOCK_DEFAULT_CHUNK_SHIFT;
+	FILE *in, *out;
+	co_rc_t rc;
+
+	if (argc == 5 && strcmp(argv[1], "-c") == 0) {
+		unsigned long chunk_kb = strtoul(argv[2], NULL, 10);
+
+		for (chunk_shift = CO_ZBLOCK_MIN_CHUNK_SHIFT;
+		     chunk_shift < CO_ZBLOCK_MAX_CHUNK_SHIFT; chunk_shift++)
+			if ((1UL << chunk_shift) >= chunk_kb * 1024)
+				break;
+
+		if ((1UL << chunk_shift) != chunk_kb * 1024) {
+			fprintf(stderr, "chunk size must be a power of two from %d to %d KB\n",
+				1 << (CO_ZBLOCK_MIN_CHUNK_SHIFT - 10),
+				1 << (CO_ZBLOCK_MAX_CHUNK_SHIFT - 10));
+			return CO_RC(INVALID_PARAMETER);
+		}
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: compress [-c <chunk size in KB>] <image> <compressed image>\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return CO_RC(ERROR);
+	}
+
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		perror(argv[2]);
+		fclose(in);
+		return CO_RC(ERROR);
+	}
+
+	rc = compress_image(in, out, chunk_shift);
+
+	fclose(in);
+	if (fclose(out) != 0 && CO_OK(rc)) {
+		perror(argv[2]);
+		rc = CO_RC(ERROR);
+	}
+
+	return rc;
+}
@@ -0,0 +1,70 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <colinux/common/common.h>
+
+#include "main.h"
+
+/*
+ * Helpers for cobd images, and for tracing, limiting and snapshotting
+ * the cobd devices of a running instance.
+ */
+
+typedef struct {
+	const char *name;
+	co_rc_t (*func)(int argc, char *argv[]);
+	const char *usage;
+} co_cobd_tool_command_t;
+
+static co_cobd_tool_command_t commands[] = {
+	{ "compress", co_cobd_tool_compress,
+	  "compress [-c <chunk size in KB>] <image> <compressed image>" },
+	{ "trace", co_cobd_tool_trace,
+	  "trace -i <instance> [-t <seconds>] [-o <trace file>]" },
+	{ "report", co_cobd_tool_report,
+	  "report <trace file>" },
+	{ "replay", co_cobd_tool_replay,
+	  "replay [-w] [-u <unit>] <trace file> <image>" },
+	{ "qos", co_cobd_tool_qos,
+	  "qos -i <instance> -u <unit> [-r <iops>] [-b <bandwidth>] [-B <burst ms>]" },
+	{ "snapshot", co_cobd_tool_snapshot,
+	  "snapshot -i <instance> -u <unit> <delta>" },
+	{ "export", co_cobd_tool_export,
+	  "export <image or overlay> <flat image>" },
+};
+
+static void syntax(void)
+{
+	unsigned int i;
+
+	printf("Cooperative Linux block device tool\n");
+	printf("syntax:\n\n");
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		printf("    colinux-cobd-tool %s\n", commands[i].usage);
+	printf("\n");
+}
+
+co_rc_t co_cobd_tool_main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	if (argc < 2) {
+		syntax();
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		if (strcmp(argv[1], commands[i].name) == 0)
+			return commands[i].func(argc - 1, argv + 1);
+
+	syntax();
+	return CO_RC(INVALID_PARAMETER);
+}
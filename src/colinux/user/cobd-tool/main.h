@@ -0,0 +1,23 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#ifndef __COLINUX_USER_COBD_TOOL_MAIN_H__
+#define __COLINUX_USER_COBD_TOOL_MAIN_H__
+
+extern co_rc_t co_cobd_tool_main(int argc, char *argv[]);
+
+/* Commands, argv[0] is the command name */
+extern co_rc_t co_cobd_tool_compress(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_trace(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_report(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_replay(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_qos(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_snapshot(int argc, char *argv[]);
+extern co_rc_t co_cobd_tool_export(int argc, char *argv[]);
+
+#endif
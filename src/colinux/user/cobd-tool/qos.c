@@ -0,0 +1,144 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <colinux/common/common.h>
+#include <colinux/user/monitor.h>
+#include <colinux/user/reactor.h>
+
+#include "main.h"
+
+/*
+ * Show or change the I/O limits of a cobd device of a running instance,
+ * the same ones as the iops=, bps= and burst= options of cobdX.
+ */
+
+#define QOS_IOPS	0x1
+#define QOS_KBPS	0x2
+#define QOS_BURST	0x4
+
+static co_rc_t monitor_receive(co_reactor_user_t user, unsigned char *buffer,
+			       unsigned long size)
+{
+	/* Nothing is routed to us, no modules are attached */
+	return CO_RC(OK);
+}
+
+/* Bandwidth in KB per second, megabytes unless a K, M or G follows */
+static co_rc_t parse_kbps(const char *text, unsigned long *kbps)
+{
+	char *end;
+
+	*kbps = strtoul(text, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': end++; break;
+	case 'g': case 'G': *kbps <<= 10; /* fall through */
+	case 'm': case 'M': end++; /* fall through */
+	case '\0': *kbps <<= 10; break;
+	default: break;
+	}
+
+	if (end == text || *end)
+		return CO_RC(INVALID_PARAMETER);
+
+	return CO_RC(OK);
+}
+
+static void print_limit(const char *name, unsigned long value, const char *unit)
+{
+	if (value)
+		printf("  %-6s %lu%s\n", name, value, unit);
+	else
+		printf("  %-6s unlimited\n", name);
+}
+
+co_rc_t co_cobd_tool_qos(int argc, char *argv[])
+{
+	co_monitor_ioctl_block_qos_t params;
+	co_block_qos_t qos = { 0, 0, 0 };
+	unsigned int given = 0;
+	co_user_monitor_t *umon;
+	co_reactor_t reactor;
+	co_id_t id = CO_INVALID_ID;
+	co_rc_t rc = CO_RC(OK);
+	int unit = -1;
+	int i;
+
+	for (i = 1; i + 1 < argc && CO_OK(rc); i += 2) {
+		if (strcmp(argv[i], "-i") == 0) {
+			id = atoi(argv[i + 1]);
+		} else if (strcmp(argv[i], "-u") == 0) {
+			unit = atoi(argv[i + 1]);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			qos.iops = strtoul(argv[i + 1], NULL, 10);
+			given |= QOS_IOPS;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			rc = parse_kbps(argv[i + 1], &qos.kbps);
+			given |= QOS_KBPS;
+		} else if (strcmp(argv[i], "-B") == 0) {
+			qos.burst = strtoul(argv[i + 1], NULL, 10);
+			given |= QOS_BURST;
+		} else {
+			break;
+		}
+	}
+
+	if (!CO_OK(rc) || i != argc || id == CO_INVALID_ID ||
+	    unit < 0 || unit >= CO_MODULE_MAX_COBD ||
+	    qos.burst > CO_BLOCK_QOS_BURST_MAX) {
+		fprintf(stderr, "usage: qos -i <instance> -u <unit> [-r <iops>] "
+			"[-b <bandwidth>] [-B <burst ms>]\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	memset(&params, 0, sizeof(params));
+	params.unit = unit;
+
+	rc = co_reactor_create(&reactor);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_user_monitor_open(reactor, monitor_receive, id, NULL, 0, &umon);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot open instance %d, rc %x\n", (int)id, (unsigned int)rc);
+		goto out_reactor;
+	}
+
+	/* Limits not given stay as they are */
+	rc = co_user_monitor_block_qos(umon, &params);
+	if (CO_OK(rc) && given) {
+		if (given & QOS_IOPS)
+			params.qos.iops = qos.iops;
+		if (given & QOS_KBPS)
+			params.qos.kbps = qos.kbps;
+		if (given & QOS_BURST)
+			params.qos.burst = qos.burst;
+		params.set = PTRUE;
+		rc = co_user_monitor_block_qos(umon, &params);
+	}
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cobd%d: cannot access the limits, rc %x\n", unit, (unsigned int)rc);
+		goto out_monitor;
+	}
+
+	printf("cobd%d:\n", unit);
+	print_limit("iops", params.qos.iops, "");
+	print_limit("bps", params.qos.kbps, " KB/s");
+	printf("  %-6s %lu ms\n", "burst",
+	       params.qos.burst ? params.qos.burst : CO_BLOCK_QOS_BURST_DEFAULT);
+	printf("  %lu requests waiting, %llu delayed so far\n", params.queued, params.delayed);
+
+out_monitor:
+	co_user_monitor_close(umon);
+out_reactor:
+	co_reactor_destroy(reactor);
+	return rc;
+}
@@ -0,0 +1,198 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define fseeko fseeko64
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <colinux/common/common.h>
+
+#include "main.h"
+#include "trace.h"
+
+/*
+ * Re-drive the requests of one unit of a trace against an image, one at
+ * a time and as fast as possible, and report the latencies seen here.
+ * Writes store zeroes and are only replayed with -w, use a copy of the
+ * image for that. Discards are skipped.
+ */
+
+static unsigned long long replay_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+static unsigned long long replay_clock_freq(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	return freq.QuadPart;
+#else
+	return 1000000ULL;
+#endif
+}
+
+static int replay_sync(FILE *image)
+{
+	if (fflush(image) != 0)
+		return -1;
+#ifdef _WIN32
+	return _commit(_fileno(image));
+#else
+	return fsync(fileno(image));
+#endif
+}
+
+static int replay_event(FILE *image, co_block_trace_event_t *event,
+			unsigned char **buffer, unsigned long *buffer_size)
+{
+	unsigned char *grown;
+
+	if (event->type == CO_BLOCK_FLUSH)
+		return replay_sync(image);
+
+	if (event->size > *buffer_size) {
+		grown = realloc(*buffer, event->size);
+		if (!grown)
+			return -1;
+
+		memset(grown, 0, event->size);
+		*buffer = grown;
+		*buffer_size = event->size;
+	}
+
+	if (fseeko(image, event->offset, SEEK_SET) != 0)
+		return -1;
+
+	if (event->type == CO_BLOCK_READ || event->type == CO_BLOCK_READV)
+		return fread(*buffer, 1, event->size, image) == event->size ? 0 : -1;
+
+	memset(*buffer, 0, event->size);
+	return fwrite(*buffer, 1, event->size, image) == event->size ? 0 : -1;
+}
+
+static co_rc_t replay(co_cobd_trace_t *trace, unsigned int unit, FILE *image,
+		      bool_t writes, co_cobd_trace_t *result)
+{
+	co_block_trace_event_t event;
+	unsigned long buffer_size = 0, skipped = 0, i;
+	unsigned char *buffer = NULL;
+	co_rc_t rc = CO_RC(OK);
+
+	result->freq = replay_clock_freq();
+
+	for (i = 0; i < trace->count && CO_OK(rc); i++) {
+		event = trace->events[i];
+		if (event.unit != unit)
+			continue;
+
+		switch (event.type) {
+		case CO_BLOCK_READ:
+		case CO_BLOCK_READV:
+		case CO_BLOCK_FLUSH:
+			break;
+		case CO_BLOCK_WRITE:
+		case CO_BLOCK_WRITEV:
+			if (writes)
+				break;
+			/* fall through */
+		default:
+			skipped++;
+			continue;
+		}
+
+		event.submit = replay_clock();
+		event.error = replay_event(image, &event, &buffer, &buffer_size) != 0;
+		event.complete = replay_clock();
+
+		rc = co_cobd_trace_append(result, &event, 1);
+	}
+
+	free(buffer);
+
+	if (skipped)
+		printf("%lu requests skipped\n", skipped);
+
+	return rc;
+}
+
+co_rc_t co_cobd_tool_replay(int argc, char *argv[])
+{
+	co_cobd_trace_t trace, result;
+	bool_t writes = PFALSE;
+	int unit = -1;
+	FILE *image;
+	co_rc_t rc;
+
+	for (argc--, argv++; argc > 2; argc--, argv++) {
+		if (strcmp(argv[0], "-w") == 0) {
+			writes = PTRUE;
+		} else if (strcmp(argv[0], "-u") == 0 && argc > 3) {
+			unit = atoi(argv[1]);
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
+	}
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: replay [-w] [-u <unit>] <trace file> <image>\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	rc = co_cobd_trace_load(&trace, argv[0]);
+	if (!CO_OK(rc))
+		return rc;
+
+	if (unit < 0 && trace.count > 0)
+		unit = trace.events[0].unit;
+
+	image = fopen(argv[1], writes ? "r+b" : "rb");
+	if (!image) {
+		perror(argv[1]);
+		co_cobd_trace_free(&trace);
+		return CO_RC(ERROR);
+	}
+
+	printf("replaying cobd%d of %s on %s\n", unit, argv[0], argv[1]);
+
+	memset(&result, 0, sizeof(result));
+	rc = replay(&trace, unit, image, writes, &result);
+	if (CO_OK(rc))
+		co_cobd_trace_report(&result);
+
+	fclose(image);
+	co_cobd_trace_free(&result);
+	co_cobd_trace_free(&trace);
+
+	return rc;
+}
@@ -0,0 +1,353 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <colinux/common/common.h>
+#include <colinux/common/cow.h>
+#include <colinux/user/monitor.h>
+#include <colinux/user/reactor.h>
+#include <colinux/os/user/cobdpath.h>
+
+#include "main.h"
+
+/*
+ * Snapshots of the cobd devices of a running instance, and flat copies
+ * of them. A snapshot freezes the current image and stacks an empty
+ * overlay on it, see common/cow.h. The frozen image never changes again,
+ * so it can be exported while the instance keeps writing to the overlay.
+ */
+
+#define SNAPSHOT_POLL_MSECS	10
+#define EXPORT_CLUSTER_SIZE	(1UL << CO_COW_CLUSTER_SHIFT)
+#define EXPORT_L2_ENTRIES	1024	/* a page of cluster numbers, as in kernel/cowblock.c */
+
+static co_rc_t monitor_receive(co_reactor_user_t user, unsigned char *buffer,
+			       unsigned long size)
+{
+	/* Nothing is routed to us, no modules are attached */
+	return CO_RC(OK);
+}
+
+/* The delta has to be empty, or the monitor would take it for an old overlay */
+static co_rc_t create_delta(const char *pathname)
+{
+	FILE *file;
+	off_t size;
+
+	file = fopen(pathname, "ab");
+	if (!file) {
+		perror(pathname);
+		return CO_RC(ERROR);
+	}
+
+	fseeko(file, 0, SEEK_END);
+	size = ftello(file);
+	fclose(file);
+
+	if (size != 0) {
+		fprintf(stderr, "%s: not empty\n", pathname);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	return CO_RC(OK);
+}
+
+co_rc_t co_cobd_tool_snapshot(int argc, char *argv[])
+{
+	co_monitor_ioctl_block_snapshot_t params;
+	co_user_monitor_t *umon;
+	co_reactor_t reactor;
+	co_id_t id = CO_INVALID_ID;
+	co_rc_t rc;
+	int unit = -1;
+	int i;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-i") == 0)
+			id = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-u") == 0)
+			unit = atoi(argv[i + 1]);
+		else
+			break;
+	}
+
+	if (i + 1 != argc || id == CO_INVALID_ID || unit < 0 || unit >= CO_MODULE_MAX_COBD ||
+	    strlen(argv[i]) >= sizeof(params.delta)) {
+		fprintf(stderr, "usage: snapshot -i <instance> -u <unit> <delta>\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	rc = create_delta(argv[i]);
+	if (!CO_OK(rc))
+		return rc;
+
+	memset(&params, 0, sizeof(params));
+	params.unit = unit;
+	strcpy(params.delta, argv[i]);
+	rc = co_canonize_cobd_path(&params.delta);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_reactor_create(&reactor);
+	if (!CO_OK(rc))
+		return rc;
+
+	rc = co_user_monitor_open(reactor, monitor_receive, id, NULL, 0, &umon);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot open instance %d, rc %x\n", (int)id, (unsigned int)rc);
+		goto out_reactor;
+	}
+
+	rc = co_user_monitor_block_snapshot(umon, &params);
+	if (CO_RC_GET_CODE(rc) == CO_RC_NOT_SUPPORTED) {
+		fprintf(stderr, "cobd%d: no snapshots with setcobd=async or mmap\n", unit);
+		goto out_monitor;
+	}
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cobd%d: cannot take a snapshot, rc %x\n", unit, (unsigned int)rc);
+		goto out_monitor;
+	}
+
+	/* The monitor takes it between two requests of Linux */
+	params.query = PTRUE;
+	while (CO_OK(rc) && params.state == CO_BLOCK_SNAPSHOT_PENDING) {
+		co_reactor_select(reactor, SNAPSHOT_POLL_MSECS);
+		rc = co_user_monitor_block_snapshot(umon, &params);
+	}
+
+	if (!CO_OK(rc) || params.state != CO_BLOCK_SNAPSHOT_DONE) {
+		fprintf(stderr, "cobd%d: snapshot failed, the image is unchanged\n", unit);
+		if (CO_OK(rc))
+			rc = CO_RC(ERROR);
+		goto out_monitor;
+	}
+
+	printf("cobd%d: frozen %s, writes go to %s\n", unit, params.snapshot, argv[i]);
+
+out_monitor:
+	co_user_monitor_close(umon);
+out_reactor:
+	co_reactor_destroy(reactor);
+	return rc;
+}
+
+/* An image of the chain, the top one first */
+typedef struct {
+	FILE *file;
+	bool_t overlay;
+	co_cow_header_t header;
+	unsigned long *l1;
+	unsigned long l2_index;		/* of the L2 table in 'l2', ~0 if none */
+	unsigned long l2[EXPORT_L2_ENTRIES];
+} export_layer_t;
+
+/* The host driver's form of a Windows path is "\??\C:\...", the Win32 one "\\?\C:\..." */
+static void host_to_user_path(co_pathname_t pathname)
+{
+	if (strncmp(pathname, "\\??\\", 4) == 0)
+		pathname[1] = '\\';
+}
+
+static co_rc_t read_at(FILE *file, unsigned long long offset, void *buffer, unsigned long size)
+{
+	unsigned long got;
+
+	if (fseeko(file, offset, SEEK_SET) != 0)
+		return CO_RC(ERROR);
+
+	/* Plain images may end short of the last cluster */
+	got = fread(buffer, 1, size, file);
+	if (got < size) {
+		if (ferror(file))
+			return CO_RC(ERROR);
+		memset((char *)buffer + got, 0, size - got);
+	}
+
+	return CO_RC(OK);
+}
+
+static co_rc_t open_layer(export_layer_t *layer, co_pathname_t pathname)
+{
+	unsigned long l1_size;
+
+	host_to_user_path(pathname);
+	layer->file = fopen(pathname, "rb");
+	if (!layer->file) {
+		perror(pathname);
+		return CO_RC(ERROR);
+	}
+
+	layer->l2_index = ~0UL;
+	if (fread(&layer->header, sizeof(layer->header), 1, layer->file) != 1 ||
+	    layer->header.magic != CO_COW_MAGIC) {
+		fseeko(layer->file, 0, SEEK_END);
+		layer->header.size = ftello(layer->file);
+		return CO_RC(OK);
+	}
+
+	if (layer->header.version < 2 || layer->header.version > CO_COW_VERSION ||
+	    layer->header.cluster_shift != CO_COW_CLUSTER_SHIFT) {
+		fprintf(stderr, "%s: overlay of an unknown base image\n", pathname);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	l1_size = layer->header.l1_entries * sizeof(unsigned long);
+	layer->l1 = malloc(l1_size);
+	if (!layer->l1)
+		return CO_RC(OUT_OF_MEMORY);
+
+	layer->overlay = PTRUE;
+	return read_at(layer->file, layer->header.l1_offset, layer->l1, l1_size);
+}
+
+/* Overlay cluster holding 'cluster' of the disk, 0 if it is further down */
+static co_rc_t lookup(export_layer_t *layer, unsigned long cluster, unsigned long *out_cluster)
+{
+	unsigned long l1_index = cluster / EXPORT_L2_ENTRIES;
+	co_rc_t rc;
+
+	*out_cluster = 0;
+	if (!layer->l1[l1_index])
+		return CO_RC(OK);
+
+	if (layer->l2_index != l1_index) {
+		rc = read_at(layer->file, (unsigned long long)layer->l1[l1_index] << CO_COW_CLUSTER_SHIFT,
+			     layer->l2, sizeof(layer->l2));
+		if (!CO_OK(rc))
+			return rc;
+		layer->l2_index = l1_index;
+	}
+
+	*out_cluster = layer->l2[cluster % EXPORT_L2_ENTRIES];
+	return CO_RC(OK);
+}
+
+static co_rc_t read_cluster(export_layer_t *layers, int count, unsigned long cluster,
+			    unsigned char *buffer)
+{
+	unsigned long data_cluster;
+	int i;
+	co_rc_t rc;
+
+	for (i = 0; i < count - 1; i++) {
+		rc = lookup(&layers[i], cluster, &data_cluster);
+		if (!CO_OK(rc))
+			return rc;
+
+		if (data_cluster)
+			return read_at(layers[i].file,
+				       (unsigned long long)data_cluster << CO_COW_CLUSTER_SHIFT,
+				       buffer, EXPORT_CLUSTER_SIZE);
+	}
+
+	return read_at(layers[i].file, (unsigned long long)cluster << CO_COW_CLUSTER_SHIFT,
+		       buffer, EXPORT_CLUSTER_SIZE);
+}
+
+co_rc_t co_cobd_tool_export(int argc, char *argv[])
+{
+	export_layer_t *layers;
+	co_pathname_t pathname;
+	unsigned long long size, offset;
+	unsigned long cluster, length;
+	unsigned char *buffer;
+	FILE *out = NULL;
+	int count = 0, i;
+	co_rc_t rc;
+
+	if (argc != 3 || strlen(argv[1]) >= sizeof(pathname)) {
+		fprintf(stderr, "usage: export <image or overlay> <flat image>\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	layers = calloc(CO_COW_MAX_DEPTH + 1, sizeof(*layers));
+	buffer = malloc(EXPORT_CLUSTER_SIZE);
+	if (!layers || !buffer) {
+		rc = CO_RC(OUT_OF_MEMORY);
+		goto out;
+	}
+
+	/* Down the chain of bases, until a plain image */
+	strcpy(pathname, argv[1]);
+	do {
+		if (count > CO_COW_MAX_DEPTH) {
+			fprintf(stderr, "%s: more than %d overlays\n", argv[1], CO_COW_MAX_DEPTH);
+			rc = CO_RC(INVALID_PARAMETER);
+			goto out;
+		}
+
+		rc = open_layer(&layers[count++], pathname);
+		if (!CO_OK(rc))
+			goto out;
+
+		memcpy(pathname, layers[count - 1].header.base_pathname, sizeof(pathname));
+	} while (layers[count - 1].overlay);
+
+	size = layers[0].header.size;
+	for (i = 1; i < count; i++) {
+		if (layers[i].header.size != size) {
+			fprintf(stderr, "%s: base image changed size\n", argv[1]);
+			rc = CO_RC(INVALID_PARAMETER);
+			goto out;
+		}
+	}
+
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		perror(argv[2]);
+		rc = CO_RC(ERROR);
+		goto out;
+	}
+
+	for (offset = 0; offset < size; offset += length) {
+		cluster = (unsigned long)(offset >> CO_COW_CLUSTER_SHIFT);
+		length = EXPORT_CLUSTER_SIZE;
+		if (offset + length > size)
+			length = (unsigned long)(size - offset);
+
+		rc = read_cluster(layers, count, cluster, buffer);
+		if (!CO_OK(rc)) {
+			fprintf(stderr, "%s: read error\n", argv[1]);
+			goto out;
+		}
+
+		if (fwrite(buffer, 1, length, out) != length) {
+			perror(argv[2]);
+			rc = CO_RC(ERROR);
+			goto out;
+		}
+	}
+
+	if (fclose(out) != 0) {
+		perror(argv[2]);
+		rc = CO_RC(ERROR);
+	}
+	out = NULL;
+
+	if (CO_OK(rc))
+		printf("%s: %llu bytes from %d image(s)\n", argv[2], size, count);
+
+out:
+	if (out)
+		fclose(out);
+	if (layers) {
+		for (i = 0; i < count; i++) {
+			if (layers[i].file)
+				fclose(layers[i].file);
+			free(layers[i].l1);
+		}
+		free(layers);
+	}
+	free(buffer);
+	return rc;
+}
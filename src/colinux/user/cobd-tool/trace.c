@@ -0,0 +1,464 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <colinux/common/common.h>
+#include <colinux/user/monitor.h>
+#include <colinux/user/reactor.h>
+
+#include "main.h"
+#include "trace.h"
+
+/*
+ * Capture the cobd requests of a running instance from the trace ring
+ * of the monitor, and report IOPS and latency per unit.
+ */
+
+#define TRACE_POLL_MSECS	100
+#define TRACE_HISTOGRAM_BUCKETS	24	/* up to 16s, in powers of two */
+
+enum {
+	TRACE_OP_READ,
+	TRACE_OP_WRITE,
+	TRACE_OP_DISCARD,
+	TRACE_OP_FLUSH,
+	TRACE_OPS
+};
+
+static const char *op_names[TRACE_OPS] = {
+	"read", "write", "discard", "flush",
+};
+
+co_rc_t co_cobd_trace_append(co_cobd_trace_t *trace, co_block_trace_event_t *events,
+			     unsigned long count)
+{
+	co_block_trace_event_t *grown;
+	unsigned long allocated;
+
+	if (trace->count + count > trace->allocated) {
+		allocated = trace->allocated ? trace->allocated * 2 : CO_BLOCK_TRACE_EVENTS;
+		while (allocated < trace->count + count)
+			allocated *= 2;
+
+		grown = realloc(trace->events, allocated * sizeof(*grown));
+		if (!grown)
+			return CO_RC(OUT_OF_MEMORY);
+
+		trace->events = grown;
+		trace->allocated = allocated;
+	}
+
+	memcpy(&trace->events[trace->count], events, count * sizeof(*events));
+	trace->count += count;
+
+	return CO_RC(OK);
+}
+
+void co_cobd_trace_free(co_cobd_trace_t *trace)
+{
+	free(trace->events);
+	memset(trace, 0, sizeof(*trace));
+}
+
+co_rc_t co_cobd_trace_load(co_cobd_trace_t *trace, const char *filename)
+{
+	co_cobd_trace_header_t header;
+	co_block_trace_event_t events[256];
+	unsigned long long left;
+	unsigned long count;
+	co_rc_t rc = CO_RC(OK);
+	FILE *file;
+
+	memset(trace, 0, sizeof(*trace));
+
+	file = fopen(filename, "rb");
+	if (!file) {
+		perror(filename);
+		return CO_RC(ERROR);
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    header.magic != CO_COBD_TRACE_MAGIC ||
+	    header.version != CO_COBD_TRACE_VERSION ||
+	    header.freq == 0) {
+		fprintf(stderr, "%s: not a cobd trace\n", filename);
+		fclose(file);
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	trace->freq = header.freq;
+	trace->lost = header.lost;
+
+	for (left = header.count; left > 0 && CO_OK(rc); left -= count) {
+		count = sizeof(events) / sizeof(events[0]);
+		if (count > left)
+			count = (unsigned long)left;
+
+		if (fread(events, sizeof(events[0]), count, file) != count) {
+			fprintf(stderr, "%s: truncated trace\n", filename);
+			rc = CO_RC(ERROR);
+			break;
+		}
+
+		rc = co_cobd_trace_append(trace, events, count);
+	}
+
+	fclose(file);
+
+	if (!CO_OK(rc))
+		co_cobd_trace_free(trace);
+
+	return rc;
+}
+
+static co_rc_t trace_save(co_cobd_trace_t *trace, const char *filename)
+{
+	co_cobd_trace_header_t header;
+	FILE *file;
+
+	file = fopen(filename, "wb");
+	if (!file) {
+		perror(filename);
+		return CO_RC(ERROR);
+	}
+
+	header.magic = CO_COBD_TRACE_MAGIC;
+	header.version = CO_COBD_TRACE_VERSION;
+	header.freq = trace->freq;
+	header.count = trace->count;
+	header.lost = trace->lost;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(trace->events, sizeof(trace->events[0]), trace->count, file) != trace->count) {
+		perror(filename);
+		fclose(file);
+		return CO_RC(ERROR);
+	}
+
+	if (fclose(file) != 0) {
+		perror(filename);
+		return CO_RC(ERROR);
+	}
+
+	return CO_RC(OK);
+}
+
+/* Report */
+
+static int event_op(co_block_trace_event_t *event)
+{
+	switch (event->type) {
+	case CO_BLOCK_READ:
+	case CO_BLOCK_READV:
+		return TRACE_OP_READ;
+	case CO_BLOCK_WRITE:
+	case CO_BLOCK_WRITEV:
+		return TRACE_OP_WRITE;
+	case CO_BLOCK_DISCARD:
+		return TRACE_OP_DISCARD;
+	case CO_BLOCK_FLUSH:
+		return TRACE_OP_FLUSH;
+	default:
+		break;
+	}
+
+	return -1;
+}
+
+static unsigned long long event_usecs(co_cobd_trace_t *trace, co_block_trace_event_t *event)
+{
+	return (event->complete - event->submit) * 1000000ULL / trace->freq;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long percentile(unsigned long long *sorted, unsigned long count,
+				     unsigned int percent)
+{
+	return sorted[(count - 1) * percent / 100];
+}
+
+static void report_unit(co_cobd_trace_t *trace, unsigned int unit, double seconds,
+			unsigned long long *latencies)
+{
+	unsigned long histogram[TRACE_HISTOGRAM_BUCKETS];
+	unsigned long long bytes, total;
+	unsigned long count, errors, all = 0, peak = 0, i;
+	co_block_trace_event_t *event;
+	int op, bucket;
+
+	memset(histogram, 0, sizeof(histogram));
+
+	printf("cobd%u:\n", unit);
+	printf("    %-8s %8s %9s %9s %9s %9s %9s %9s %6s\n", "op", "count", "IOPS", "MB/s",
+	       "avg us", "p50 us", "p99 us", "max us", "errors");
+
+	for (op = 0; op < TRACE_OPS; op++) {
+		count = errors = 0;
+		bytes = total = 0;
+
+		for (i = 0; i < trace->count; i++) {
+			event = &trace->events[i];
+			if (event->unit != unit || event_op(event) != op)
+				continue;
+
+			latencies[count] = event_usecs(trace, event);
+			total += latencies[count];
+			bytes += event->size;
+			errors += event->error;
+
+			for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS - 1; bucket++)
+				if (latencies[count] < (2ULL << bucket))
+					break;
+			histogram[bucket]++;
+
+			count++;
+		}
+
+		if (count == 0)
+			continue;
+
+		qsort(latencies, count, sizeof(latencies[0]), compare_ull);
+
+		printf("    %-8s %8lu %9.1f %9.2f %9llu %9llu %9llu %9llu %6lu\n",
+		       op_names[op], count, count / seconds,
+		       bytes / seconds / (1024 * 1024), total / count,
+		       percentile(latencies, count, 50), percentile(latencies, count, 99),
+		       latencies[count - 1], errors);
+
+		all += count;
+	}
+
+	for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++)
+		if (histogram[bucket] > peak)
+			peak = histogram[bucket];
+
+	printf("    latency histogram:\n");
+	for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+		if (histogram[bucket] == 0)
+			continue;
+
+		printf("    < %7llu us %8lu %5.1f%% ", 2ULL << bucket, histogram[bucket],
+		       histogram[bucket] * 100.0 / all);
+		for (i = 0; i < histogram[bucket] * 40 / peak; i++)
+			putchar('#');
+		putchar('\n');
+	}
+	printf("\n");
+}
+
+void co_cobd_trace_report(co_cobd_trace_t *trace)
+{
+	unsigned long long first = ~0ULL, last = 0;
+	unsigned long long *latencies;
+	unsigned long i, units = 0;
+	unsigned int unit;
+	double seconds;
+
+	printf("%lu requests", trace->count);
+	if (trace->lost)
+		printf(", %llu lost", trace->lost);
+	printf("\n");
+
+	if (trace->count == 0 || trace->freq == 0)
+		return;
+
+	for (i = 0; i < trace->count; i++) {
+		if (trace->events[i].submit < first)
+			first = trace->events[i].submit;
+		if (trace->events[i].complete > last)
+			last = trace->events[i].complete;
+		if (trace->events[i].unit < CO_MODULE_MAX_COBD)
+			units |= 1UL << trace->events[i].unit;
+	}
+
+	seconds = (double)(last - first) / trace->freq;
+	if (seconds <= 0)
+		seconds = 1.0 / trace->freq;
+	printf("over %.3f seconds\n\n", seconds);
+
+	latencies = malloc(trace->count * sizeof(*latencies));
+	if (!latencies) {
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+
+	for (unit = 0; unit < CO_MODULE_MAX_COBD; unit++)
+		if (units & (1UL << unit))
+			report_unit(trace, unit, seconds, latencies);
+
+	free(latencies);
+}
+
+/* Capture */
+
+static co_rc_t monitor_receive(co_reactor_user_t user, unsigned char *buffer,
+			       unsigned long size)
+{
+	/* Nothing is routed to us, no modules are attached */
+	return CO_RC(OK);
+}
+
+static co_rc_t trace_ioctl(co_user_monitor_t *umon, co_monitor_ioctl_block_trace_t *params,
+			   co_block_trace_op_t op, unsigned long size)
+{
+	co_rc_t rc;
+
+	params->op = op;
+	rc = co_user_monitor_block_trace(umon, params, size);
+	if (!CO_OK(rc))
+		fprintf(stderr, "block trace failed, rc %x\n", (unsigned int)rc);
+
+	return rc;
+}
+
+static co_rc_t trace_drain(co_user_monitor_t *umon, co_monitor_ioctl_block_trace_t *params,
+			   unsigned long size, co_cobd_trace_t *trace)
+{
+	co_rc_t rc;
+
+	do {
+		rc = trace_ioctl(umon, params, CO_BLOCK_TRACE_READ, size);
+		if (!CO_OK(rc))
+			return rc;
+
+		trace->freq = params->freq;
+		trace->lost += params->lost;
+
+		rc = co_cobd_trace_append(trace, params->events, params->count);
+		if (!CO_OK(rc))
+			return rc;
+	} while (params->count == CO_BLOCK_TRACE_READ_MAX);
+
+	return CO_RC(OK);
+}
+
+static co_rc_t trace_capture(co_id_t id, unsigned long seconds, co_cobd_trace_t *trace)
+{
+	co_monitor_ioctl_block_trace_t *params;
+	co_user_monitor_t *umon;
+	co_reactor_t reactor;
+	unsigned long size;
+	time_t end;
+	co_rc_t rc;
+
+	size = sizeof(*params) + CO_BLOCK_TRACE_READ_MAX * sizeof(co_block_trace_event_t);
+	params = malloc(size);
+	if (!params)
+		return CO_RC(OUT_OF_MEMORY);
+	memset(params, 0, sizeof(*params));
+
+	rc = co_reactor_create(&reactor);
+	if (!CO_OK(rc))
+		goto out;
+
+	rc = co_user_monitor_open(reactor, monitor_receive, id, NULL, 0, &umon);
+	if (!CO_OK(rc)) {
+		fprintf(stderr, "cannot open instance %d, rc %x\n", (int)id, (unsigned int)rc);
+		goto out_reactor;
+	}
+
+	rc = trace_ioctl(umon, params, CO_BLOCK_TRACE_START, sizeof(*params));
+	if (!CO_OK(rc))
+		goto out_monitor;
+
+	printf("tracing instance %d for %lu seconds\n", (int)id, seconds);
+
+	end = time(NULL) + seconds;
+	while (time(NULL) < end) {
+		co_reactor_select(reactor, TRACE_POLL_MSECS);
+
+		rc = trace_drain(umon, params, size, trace);
+		if (!CO_OK(rc))
+			break;
+	}
+
+	trace_ioctl(umon, params, CO_BLOCK_TRACE_STOP, sizeof(*params));
+
+	/* Requests in flight complete shortly after the stop */
+	if (CO_OK(rc)) {
+		co_reactor_select(reactor, TRACE_POLL_MSECS);
+		rc = trace_drain(umon, params, size, trace);
+	}
+
+out_monitor:
+	co_user_monitor_close(umon);
+out_reactor:
+	co_reactor_destroy(reactor);
+out:
+	free(params);
+	return rc;
+}
+
+co_rc_t co_cobd_tool_trace(int argc, char *argv[])
+{
+	co_cobd_trace_t trace;
+	const char *output = NULL;
+	unsigned long seconds = 10;
+	co_id_t id = CO_INVALID_ID;
+	co_rc_t rc;
+	int i;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-i") == 0)
+			id = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-t") == 0)
+			seconds = strtoul(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "-o") == 0)
+			output = argv[i + 1];
+		else
+			break;
+	}
+
+	if (i != argc || id == CO_INVALID_ID || seconds == 0) {
+		fprintf(stderr, "usage: trace -i <instance> [-t <seconds>] [-o <trace file>]\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	memset(&trace, 0, sizeof(trace));
+
+	rc = trace_capture(id, seconds, &trace);
+	if (CO_OK(rc) && output)
+		rc = trace_save(&trace, output);
+
+	if (CO_OK(rc))
+		co_cobd_trace_report(&trace);
+
+	co_cobd_trace_free(&trace);
+	return rc;
+}
+
+co_rc_t co_cobd_tool_report(int argc, char *argv[])
+{
+	co_cobd_trace_t trace;
+	co_rc_t rc;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: report <trace file>\n");
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	rc = co_cobd_trace_load(&trace, argv[1]);
+	if (!CO_OK(rc))
+		return rc;
+
+	co_cobd_trace_report(&trace);
+	co_cobd_trace_free(&trace);
+
+	return CO_RC(OK);
+}
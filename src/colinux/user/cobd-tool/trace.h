@@ -0,0 +1,47 @@
+/*
+ * This source code is a part of coLinux source package.
+ *
+ * The code is licensed under the GPL. See the COPYING file at
+ * the root directory.
+ *
+ */
+
+#ifndef __COLINUX_USER_COBD_TOOL_TRACE_H__
+#define __COLINUX_USER_COBD_TOOL_TRACE_H__
+
+#include <stdio.h>
+
+#include <colinux/common/common.h>
+#include <colinux/common/ioctl.h>
+
+/*
+ * A trace file is this header followed by 'count' events, as returned
+ * by CO_MONITOR_IOCTL_BLOCK_TRACE. Time stamps count 'freq' per second.
+ */
+
+#define CO_COBD_TRACE_MAGIC	0x54424f43	/* "COBT" */
+#define CO_COBD_TRACE_VERSION	1
+
+typedef struct {
+	unsigned long		magic;
+	unsigned long		version;
+	unsigned long long	freq;
+	unsigned long long	count;
+	unsigned long long	lost;
+} PACKED_STRUCT co_cobd_trace_header_t;
+
+typedef struct {
+	unsigned long long	freq;
+	unsigned long long	lost;
+	unsigned long		count;
+	unsigned long		allocated;
+	co_block_trace_event_t	*events;
+} co_cobd_trace_t;
+
+extern co_rc_t co_cobd_trace_append(co_cobd_trace_t *trace, co_block_trace_event_t *events,
+				    unsigned long count);
+extern co_rc_t co_cobd_trace_load(co_cobd_trace_t *trace, const char *filename);
+extern void co_cobd_trace_free(co_cobd_trace_t *trace);
+extern void co_cobd_trace_report(co_cobd_trace_t *trace);
+
+#endif
@@ -13,6 +13,9 @@
 
 #include <colinux/common/libc.h>
 #include <colinux/common/config.h>
+#include <colinux/common/zblock.h>
+#include <colinux/common/cow.h>
+#include <colinux/common/nbd.h>
 #include <colinux/common/console.h>
 #include <colinux/user/cmdline.h>
 #include <colinux/os/user/file.h>
@@ -97,6 +100,273 @@ static co_rc_t check_cobd_file(co_pathname_t pathname, char* name, int index)
 #endif
 }
 
+static void split_comma_separated(const char* source, comma_buffer_t* array);
+
+/*
+ * Parses a size with an optional K, M or G suffix, megabytes if there
+ * is none.
+ */
+static co_rc_t parse_size_kb(const char *text, unsigned long *size_kb)
+{
+	unsigned long value;
+	char *end;
+
+	value = strtoul(text, &end, 10);
+	if (end == text)
+		return CO_RC(INVALID_PARAMETER);
+
+	switch (*end) {
+	case 'k': case 'K':
+		end++;
+		break;
+	case 'g': case 'G':
+		value <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		end++;
+		/* fall through */
+	case '\0':
+		value <<= 10;
+		break;
+	default:
+		return CO_RC(INVALID_PARAMETER);
+	}
+
+	if (*end != '\0')
+		return CO_RC(INVALID_PARAMETER);
+
+	*size_kb = value;
+	return CO_RC(OK);
+}
+
+#define CO_COBD_MAX_OPTIONS	12
+
+/*
+ * Options follow the image path, comma separated:
+ *   cobd0=rootfs.img,cache=64M
+ */
+static co_rc_t parse_cobd_options(co_block_dev_desc_t *cobd, int index, const char *options)
+{
+	char option[CO_COBD_MAX_OPTIONS][sizeof(co_pathname_t) + 8];
+	comma_buffer_t array[CO_COBD_MAX_OPTIONS + 1];
+	char *value, *end;
+	co_rc_t rc;
+	int i;
+
+	for (i = 0; i < CO_COBD_MAX_OPTIONS; i++) {
+		array[i].size = sizeof(option[i]);
+		array[i].buffer = option[i];
+	}
+	array[i].size = 0;
+	array[i].buffer = NULL;
+
+	split_comma_separated(options, array);
+
+	for (i = 0; i < CO_COBD_MAX_OPTIONS; i++) {
+		if (!*option[i])
+			continue;
+
+		value = strchr(option[i], '=');
+		if (value)
+			*value++ = '\0';
+		else
+			value = "";
+
+		if (strcmp(option[i], "cache") == 0) {
+			rc = parse_size_kb(value, &cobd->cache_size);
+			if (!CO_OK(rc)) {
+				co_terminal_print("cobd%d: invalid cache size '%s'\n", index, value);
+				return rc;
+			}
+			co_debug_info("cobd%d: %lu KB read cache", index, cobd->cache_size);
+		} else if (strcmp(option[i], "readahead") == 0) {
+			rc = parse_size_kb(value, &cobd->readahead);
+			if (!CO_OK(rc)) {
+				co_terminal_print("cobd%d: invalid readahead size '%s'\n", index, value);
+				return rc;
+			}
+			co_debug_info("cobd%d: %lu KB readahead", index, cobd->readahead);
+		} else if (strcmp(option[i], "cow") == 0 && *value) {
+			co_snprintf(cobd->base_pathname, sizeof(cobd->base_pathname), "%s", value);
+		} else if (strcmp(option[i], "cache_mode") == 0) {
+			if (strcmp(value, "writeback") == 0)
+				cobd->cache_mode = CO_BLOCK_DEV_CACHE_WRITEBACK;
+			else if (strcmp(value, "writethrough") == 0)
+				cobd->cache_mode = CO_BLOCK_DEV_CACHE_WRITETHROUGH;
+			else if (strcmp(value, "unsafe") == 0)
+				cobd->cache_mode = CO_BLOCK_DEV_CACHE_UNSAFE;
+			else {
+				co_terminal_print("cobd%d: invalid cache mode '%s'\n", index, value);
+				return CO_RC(INVALID_PARAMETER);
+			}
+			co_debug_info("cobd%d: %s cache", index, value);
+		} else if (strcmp(option[i], "direct") == 0 && !*value) {
+			cobd->direct = PTRUE;
+			co_debug_info("cobd%d: bypassing the host cache", index);
+		} else if (strcmp(option[i], "sparse") == 0 && !*value) {
+			cobd->sparse = PTRUE;
+			co_debug_info("cobd%d: zero writes free storage", index);
+		} else if (strcmp(option[i], "iops") == 0) {
+			cobd->qos.iops = strtoul(value, &end, 10);
+			if (end == value || *end) {
+				co_terminal_print("cobd%d: invalid iops '%s'\n", index, value);
+				return CO_RC(INVALID_PARAMETER);
+			}
+			co_debug_info("cobd%d: %lu requests per second", index, cobd->qos.iops);
+		} else if (strcmp(option[i], "bps") == 0) {
+			rc = parse_size_kb(value, &cobd->qos.kbps);
+			if (!CO_OK(rc)) {
+				co_terminal_print("cobd%d: invalid bandwidth '%s'\n", index, value);
+				return rc;
+			}
+			co_debug_info("cobd%d: %lu KB per second", index, cobd->qos.kbps);
+		} else if (strcmp(option[i], "burst") == 0) {
+			cobd->qos.burst = strtoul(value, &end, 10);
+			if (end == value || *end || cobd->qos.burst > CO_BLOCK_QOS_BURST_MAX) {
+				co_terminal_print("cobd%d: invalid burst '%s'\n", index, value);
+				return CO_RC(INVALID_PARAMETER);
+			}
+			co_debug_info("cobd%d: %lu ms burst", index, cobd->qos.burst);
+		} else if (strcmp(option[i], "mmap") == 0 && !*value) {
+			cobd->mapped = PTRUE;
+			co_debug_info("cobd%d: copying from the mapped image", index);
+		} else {
+			co_terminal_print("cobd%d: unknown option '%s'\n", index, option[i]);
+			return CO_RC(INVALID_PARAMETER);
+		}
+	}
+
+	return CO_RC(OK);
+}
+
+/*
+ * A missing copy-on-write overlay is created empty, the monitor formats
+ * it when the device is opened.
+ */
+static co_rc_t create_cobd_overlay(co_block_dev_desc_t *cobd, int index)
+{
+	char *buf;
+	unsigned long size;
+	co_rc_t rc;
+
+	co_remove_quotation_marks(cobd->pathname);
+
+	rc = co_os_file_load(cobd->pathname, &buf, &size, 1);
+	if (CO_OK(rc)) {
+		co_os_file_free(buf);
+		return rc;
+	}
+
+	co_terminal_print("cobd%d: creating overlay %s\n", index, cobd->pathname);
+	rc = co_os_file_write(cobd->pathname, "", 0);
+	if (!CO_OK(rc))
+		co_terminal_print("cobd%d: can't create overlay %s\n", index, cobd->pathname);
+
+	return rc;
+}
+
+static void detect_cobd_format(co_block_dev_desc_t *cobd, int index)
+{
+	co_zblock_header_t *header;
+	co_cow_header_t *cow;
+	unsigned long size;
+	char *buf;
+
+	if (is_device(cobd->pathname))
+		return;
+
+	co_remove_quotation_marks(cobd->pathname);
+
+	if (!CO_OK(co_os_file_load(cobd->pathname, &buf, &size, sizeof(*cow))))
+		return;
+
+	header = (co_zblock_header_t *)buf;
+	cow = (co_cow_header_t *)buf;
+	if (size >= sizeof(*header) && header->magic == CO_ZBLOCK_MAGIC) {
+		cobd->format = CO_BLOCK_DEV_FORMAT_COMPRESSED;
+		co_debug_info("cobd%d: compressed image, read-only", index);
+	} else if (size == sizeof(*cow) && cow->magic == CO_COW_MAGIC &&
+		   cow->version >= 2 && cow->base_pathname[0]) {
+		/* A snapshot delta, or an overlay that knows its base */
+		co_memcpy(cobd->base_pathname, cow->base_pathname, sizeof(co_pathname_t));
+		cobd->base_pathname[sizeof(co_pathname_t) - 1] = '\0';
+		co_debug_info("cobd%d: overlay of %s", index, cobd->base_pathname);
+	}
+
+	co_os_file_free(buf);
+}
+
+/*
+ * Fill in a cobd device from "<path>[,<options>]", the value of a
+ * cobdX= parameter. The path may be an NBD export, see common/nbd.h.
+ */
+co_rc_t co_parse_cobd_device(co_block_dev_desc_t *cobd, int index, const char *param)
+{
+	const char *options;
+	bool_t quotation_marks = PFALSE;
+	co_rc_t rc;
+
+	/* Options start at the first comma outside of quotation marks */
+	for (options = param; *options; options++) {
+		if (*options == '"')
+			quotation_marks = !quotation_marks;
+		else if (*options == ',' && !quotation_marks)
+			break;
+	}
+
+	co_snprintf(cobd->pathname, sizeof(cobd->pathname), "%.*s",
+		    (int)(options - param), param);
+
+	if (*options) {
+		rc = parse_cobd_options(cobd, index, options + 1);
+		if (!CO_OK(rc))
+			return rc;
+	}
+
+	if (co_nbd_is_uri(cobd->pathname)) {
+		co_nbd_uri_t uri;
+
+		if (cobd->base_pathname[0] || cobd->mapped || cobd->direct) {
+			co_terminal_print("cobd%d: cow, mmap and direct need an image file\n", index);
+			return CO_RC(INVALID_PARAMETER);
+		}
+
+		rc = co_nbd_parse_uri(cobd->pathname, &uri);
+		if (!CO_OK(rc)) {
+			co_terminal_print("cobd%d: invalid NBD export '%s'\n", index, cobd->pathname);
+			return rc;
+		}
+
+		cobd->format = CO_BLOCK_DEV_FORMAT_NBD;
+		co_debug_info("mapping cobd%d to NBD export %s", index, cobd->pathname);
+		return CO_RC(OK);
+	}
+
+	if (cobd->base_pathname[0]) {
+		rc = check_cobd_file(cobd->base_pathname, "cobd", index);
+		if (!CO_OK(rc))
+			return rc;
+
+		rc = create_cobd_overlay(cobd, index);
+		if (!CO_OK(rc))
+			return rc;
+
+		co_canonize_cobd_path(&cobd->base_pathname);
+		co_debug_info("cobd%d: base image %s", index, cobd->base_pathname);
+	} else {
+		rc = check_cobd_file(cobd->pathname, "cobd", index);
+		if (!CO_OK(rc))
+			return rc;
+
+		detect_cobd_format(cobd, index);
+	}
+
+	co_canonize_cobd_path(&cobd->pathname);
+	co_debug_info("mapping cobd%d to %s", index, cobd->pathname);
+
+	return CO_RC(OK);
+}
+
 static co_rc_t parse_args_config_cobd(co_command_line_params_t cmdline, co_config_t* conf)
 {
 	bool_t	     exists;
@@ -145,15 +415,9 @@ static co_rc_t parse_args_config_cobd(co_command_line_params_t cmdline, co_confi
 		}
 		cobd->enabled = PTRUE;
 
-		co_snprintf(cobd->pathname, sizeof(cobd->pathname), "%s", param);
-
-		rc = check_cobd_file(cobd->pathname, "cobd", index);
+		rc = co_parse_cobd_device(cobd, index, param);
 		if (!CO_OK(rc))
 			return rc;
-
-		co_canonize_cobd_path(&cobd->pathname);
-		co_debug_info("mapping cobd%d to %s", index, cobd->pathname);
-
 	} while (1);
 
 	return CO_RC(OK);
@@ -822,9 +1086,27 @@ static co_rc_t parse_args_config_cofs(co_command_line_params_t cmdline, co_confi
 {
 	bool_t       exists;
 	char*	     param;
+	char	     buf[16];
 	co_rc_t      rc;
 	unsigned int index;
 
+	rc = co_cmdline_get_next_equality(cmdline, "setcofs", 0, NULL, 0,
+					  buf, sizeof(buf), &exists);
+	if (!CO_OK(rc))
+		return rc;
+
+	if (exists) {
+		if (strcmp(buf, "async") == 0) {
+			conf->cofs_async_enable = PTRUE;
+		} else if (strcmp(buf, "sync") == 0) {
+			conf->cofs_async_enable = PFALSE;
+		} else {
+			co_terminal_print("error: setcofs option only allowed"
+			                  " 'async' or 'sync'\n");
+			return CO_RC(INVALID_PARAMETER);
+		}
+	}
+
 	do {
 		rc = co_cmdline_get_next_equality_int_prefix(cmdline,
 							     "cofs",
@@ -17,5 +17,6 @@
 #include "macaddress.h"
 
 extern co_rc_t co_parse_config_args(co_command_line_params_t cmdline, co_start_parameters_t *start_parameters);
+extern co_rc_t co_parse_cobd_device(co_block_dev_desc_t *cobd, int index, const char *param);
 
 #endif
@@ -150,8 +150,9 @@ static void parse_tlv(const co_debug_tlv_t *tlv, const char *block)
 		switch (ptlv->type) {
 		case CO_DEBUG_TYPE_TIMESTAMP: {
 			co_timestamp_t *ts = (typeof(ts))(ptlv->value);
-			fprintf(output_file, " timestamp=\"%08u.%-10u\"",
-				(unsigned int)ts->high, (unsigned int)ts->low);
+			/* One 64-bit count, microseconds on Linux hosts */
+			fprintf(output_file, " timestamp=\"%llu\"",
+				(unsigned long long)ts->quad);
 			break;
 		}
 		case CO_DEBUG_TYPE_MODULE: {
@@ -244,6 +244,39 @@ co_rc_t co_user_monitor_status(co_user_monitor_t *umon,
 					     &params->pc, sizeof(*params));
 }
 
+co_rc_t co_user_monitor_get_block_stats(co_user_monitor_t *umon,
+				       co_monitor_ioctl_get_block_stats_t *params)
+{
+	return co_manager_io_monitor_unisize(umon->handle,
+					     CO_MONITOR_IOCTL_GET_BLOCK_STATS,
+					     &params->pc, sizeof(*params));
+}
+
+co_rc_t co_user_monitor_block_trace(co_user_monitor_t *umon,
+				    co_monitor_ioctl_block_trace_t *params,
+				    unsigned long size)
+{
+	return co_manager_io_monitor(umon->handle,
+				     CO_MONITOR_IOCTL_BLOCK_TRACE,
+				     &params->pc, sizeof(*params), size);
+}
+
+co_rc_t co_user_monitor_block_qos(co_user_monitor_t *umon,
+				  co_monitor_ioctl_block_qos_t *params)
+{
+	return co_manager_io_monitor_unisize(umon->handle,
+					     CO_MONITOR_IOCTL_BLOCK_QOS,
+					     &params->pc, sizeof(*params));
+}
+
+co_rc_t co_user_monitor_block_snapshot(co_user_monitor_t *umon,
+				       co_monitor_ioctl_block_snapshot_t *params)
+{
+	return co_manager_io_monitor_unisize(umon->handle,
+					     CO_MONITOR_IOCTL_BLOCK_SNAPSHOT,
+					     &params->pc, sizeof(*params));
+}
+
 co_rc_t co_user_monitor_conet_bind_adapter(co_user_monitor_t *umon,
 				co_monitor_ioctl_conet_bind_adapter_t *params)
 {
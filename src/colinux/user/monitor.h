@@ -53,6 +53,15 @@ extern co_rc_t co_user_monitor_get_state(co_user_monitor_t*		 umon,
 extern co_rc_t co_user_monitor_reset(co_user_monitor_t *umon);
 extern co_rc_t co_user_monitor_status(co_user_monitor_t *umon,
 				      co_monitor_ioctl_status_t *status);
+extern co_rc_t co_user_monitor_get_block_stats(co_user_monitor_t *umon,
+					      co_monitor_ioctl_get_block_stats_t *params);
+extern co_rc_t co_user_monitor_block_trace(co_user_monitor_t *umon,
+					   co_monitor_ioctl_block_trace_t *params,
+					   unsigned long size);
+extern co_rc_t co_user_monitor_block_qos(co_user_monitor_t *umon,
+					 co_monitor_ioctl_block_qos_t *params);
+extern co_rc_t co_user_monitor_block_snapshot(co_user_monitor_t *umon,
+					      co_monitor_ioctl_block_snapshot_t *params);
 
 extern co_rc_t co_user_monitor_message_send(co_user_monitor_t *umon,  co_message_t *message);
 